@@ -0,0 +1,30 @@
+// Handled - Request capture format, shared with handled-replay
+// Copyright (c) 2024 Chema Hernández Gil / AGPL-3.0 license
+// https://github.com/chema/handle-handler
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// LIBC ONLY, SO handled-replay BUILDS ON A LOAD GENERATOR WITHOUT THE DAEMON'S LIBRARIES
+
+// REQUEST CAPTURE ('capture_file' OPTION), REPLAYED BY handled-replay. THE FILE STARTS WITH CAPTURE_MAGIC, THEN HOLDS
+// ONE RECORD PER REQUEST: ARRIVAL (8 BYTES, MICROSECONDS SINCE THE EPOCH), BODY SIZE (4, FROM Content-Length), HOST
+// LENGTH (2), URL LENGTH (2) AND METHOD (1), THEN THE HOST AND THE URL, UNTERMINATED. INTEGERS IN HOST BYTE ORDER.
+#define CAPTURE_MAGIC					"HDCAP01\n"
+#define CAPTURE_MAGIC_SIZE				8
+#define CAPTURE_RECORD_HEADER			17
+#define CAPTURE_HOST_MAX				255		// Longer hosts and URLs are cut
+#define CAPTURE_URL_MAX					2048
+#define CAPTURE_BUFFER_SIZE				65536	// Records buffered per process before a write
+#define CAPTURE_FLUSH_INTERVAL			1000	// Milliseconds a record may wait for more before the write
+
+// METHODS IN A CAPTURE RECORD
+typedef enum {
+  CAPTURE_GET = 0,
+  CAPTURE_POST = 1,
+  CAPTURE_HEAD = 2,
+  CAPTURE_OTHER = 3,
+  CAPTURE_METHOD_COUNT = 4
+} captureMethod;
+
+#endif // CAPTURE_H
@@ -6,11 +6,42 @@
 #include <sqlite3.h>
 #include <curl/curl.h>
 #include <ctype.h>
+#include <zlib.h>
+
+#include "capture.h"
+
+#ifdef HANDLED_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#ifdef HANDLED_TLS
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+#endif
+
+// USDT PROBES FOR bpftrace, perf AND SYSTEMTAP (use make USDT=1, requires systemtap-sdt-dev). EACH ONE IS A NOP
+// UNTIL A TRACER ATTACHES. WITHOUT USDT=1 THE ARGUMENTS ARE NOT EVEN EVALUATED. SEE examples/bpftrace.
+#ifdef HANDLED_USDT
+#include <sys/sdt.h>
+#define HANDLED_PROBE1(name, a)				DTRACE_PROBE1(handled, name, a)
+#define HANDLED_PROBE2(name, a, b)			DTRACE_PROBE2(handled, name, a, b)
+#define HANDLED_PROBE3(name, a, b, c)		DTRACE_PROBE3(handled, name, a, b, c)
+#define HANDLED_PROBE4(name, a, b, c, d)	DTRACE_PROBE4(handled, name, a, b, c, d)
+#else
+#define HANDLED_PROBE1(name, a)				do {} while (0)
+#define HANDLED_PROBE2(name, a, b)			do {} while (0)
+#define HANDLED_PROBE3(name, a, b, c)		do {} while (0)
+#define HANDLED_PROBE4(name, a, b, c, d)	do {} while (0)
+#endif
 
 #ifndef PORT
 #define PORT 8123  		// Default port for production
 #endif
 
+#ifndef ADMIN_PORT
+#define ADMIN_PORT (PORT + 1)	// Local-only admin listener (metrics, replication), bound to 127.0.0.1
+#endif
+
 #define POSTBUFFERSIZE  1024
 
 #define URL_WELL_KNOWN_ATPROTO 			"/.well-known/atproto-did"
@@ -19,10 +50,166 @@
 #define DATA_MAX_SIZE		256
 
 #define MAX_SIZE_DID_PLC	32    // Explicit max from https://web.plc.directory/spec/v0.1/did-plc
-#define MAXDIDSIZE			256   // Implied desired max from https://atproto.com/specs/did (UNUSED)
+#define DID_PLC_PREFIX		"did:plc:"
+#define DID_PLC_PACKED_SIZE	15    // The 24 base32 characters after the prefix, decoded
+#define MAXDIDSIZE			256   // Implied desired max from https://atproto.com/specs/did, caps the 'did' form field
 
 #define CONTENT_TEXT		"text/plain"
 #define CONTENT_HTML		"text/html"
+#define CONTENT_METRICS		"text/plain; version=0.0.4"
+#define CONTENT_JSON		"application/json"
+#define CONTENT_CSV			"text/csv"
+#define CONTENT_JSONL		"application/jsonl"
+
+// RUNTIME CONFIGURATION (handled.conf IN THE BASE DIRECTORY, OR key=value ARGUMENTS)
+#define CONFIG_FILENAME			"handled.conf"
+#define CONFIG_LINE_MAX			512
+#define CONFIG_VALUE_MAX		256
+
+// NATIVE HTTPS LISTENER (BUILD WITH make TLS=1)
+#define DEFAULT_TLS_PORT			8443
+#define DEFAULT_TLS_CERTIFICATE		"fullchain.pem"		// Wildcard certificate chain, relative to the base directory
+#define DEFAULT_TLS_KEY				"privkey.pem"
+#define DEFAULT_TLS_PRIORITIES		"NORMAL:-VERS-SSL3.0:-VERS-TLS1.0:-VERS-TLS1.1"	// TLS 1.2 and 1.3, like the NGINX example
+#define TLS_MAX_CHAIN_LENGTH		8
+#define TLS_RELOAD_CHECK_INTERVAL	30		// Seconds between certificate file change checks
+
+// PREFORK WORKERS SHARING THE LISTENING PORTS WITH SO_REUSEPORT
+#define MAX_WORKERS					64
+#define WORKER_MIN_UPTIME			5		// Seconds, workers crashing sooner are restarted with a delay
+#define WORKER_RESTART_DELAY		1		// Seconds
+#define DAEMON_MAX_OPTIONS			16		// MHD options collected for MHD_OPTION_ARRAY
+
+// LIFECYCLE: SIGTERM/SIGINT DRAIN AND STOP, SIGHUP RELOADS THE TLS CERTIFICATE, SIGUSR2 RE-EXECUTES A SUCCESSOR
+// THAT INHERITS THE LISTENING SOCKETS (SAME PROTOCOL AS SYSTEMD SOCKET ACTIVATION) AND SENDS SIGUSR1 WHEN READY.
+#define DEFAULT_DRAIN_TIMEOUT		30		// Seconds to let in-flight requests finish after the listeners close
+#define SD_LISTEN_FDS_START			3		// First inherited socket, as defined by systemd
+#define ENV_LISTEN_FDS				"LISTEN_FDS"
+#define ENV_LISTEN_PID				"LISTEN_PID"
+#define ENV_LISTEN_FDNAMES			"LISTEN_FDNAMES"
+#define ENV_NOTIFY_SOCKET			"NOTIFY_SOCKET"
+#define ENV_PREDECESSOR_PID			"HANDLED_PREDECESSOR_PID"
+#define LISTEN_NAME_HTTP			"http"
+#define LISTEN_NAME_TLS				"https"
+#define PREWARM_BUFFER_SIZE			65536
+
+// ADMISSION CONTROL AND LOAD SHEDDING (LIMITS APPLY PER LISTENER AND PROCESS)
+#define DEFAULT_MAX_CONNECTIONS			1024
+#define DEFAULT_MAX_CONNECTIONS_PER_IP	0		// 0 disables it. Keep it off behind a reverse proxy, every client is 127.0.0.1
+#define DEFAULT_IDLE_TIMEOUT			15		// Seconds without traffic before a connection is closed
+#define DEFAULT_REQUEST_TIMEOUT			30		// Seconds a request may take to arrive in full (slow POST bodies), 0 disables it
+#define DEFAULT_CONNECTION_MEMORY		32768	// Bytes MHD may buffer per connection
+#define DEFAULT_SHED_REGISTRATIONS		64		// Requests in flight before registration traffic is answered with a 503
+#define DEFAULT_SHED_WELL_KNOWN			512		// Requests in flight before well-known lookups are answered with a 503
+#define SHED_RETRY_AFTER				"5"		// Seconds, sent in Retry-After with every shed request
+#define BLOCKLIST_MAX_ENTRIES			4096
+
+// RATE LIMITING OF REGISTRATIONS (POST /result), TOKEN BUCKETS SHARED BY ALL WORKERS
+#define RATE_LIMIT_SHARDS			64		// Lock stripes
+#define RATE_LIMIT_SHARD_SLOTS		256		// Buckets per shard and key type
+#define RATE_LIMIT_PROBE			8		// Slots searched for a key before the stalest one is replaced
+#define DEFAULT_RATE_ADDRESS		10		// Registrations per minute per client address, 0 disables it
+#define DEFAULT_BURST_ADDRESS		5
+#define DEFAULT_RATE_LABEL			6		// Registration attempts per minute per label, 0 disables it
+#define DEFAULT_BURST_LABEL			3
+#define RATE_LIMIT_RETRY_AFTER		"60"	// Seconds, sent in Retry-After with every 429
+#define HEADER_FORWARDED_FOR		"X-Forwarded-For"
+#define CLIENT_ADDRESS_MAX			64
+
+// REQUEST LANES: WELL-KNOWN AND PAGE GETS STAY ON THE MHD I/O THREADS, REGISTRATIONS RUN ON THEIR OWN POOL
+#define DEFAULT_IO_THREADS				1		// MHD thread pool per listener and process
+#define DEFAULT_REGISTRATION_THREADS	4		// 0 runs registrations on the I/O threads
+#define DEFAULT_REGISTRATION_QUEUE		64		// Registrations waiting for a thread before new ones get a 503
+#define MAX_IO_THREADS					64
+#define MAX_REGISTRATION_THREADS		64
+#define LATENCY_BUCKET_COUNT			8		// Request latency histogram buckets, see latencyBucketBounds
+
+// REQUEST DEADLINES, PROPAGATED INTO THE RESOLVER AND SQLITE (MILLISECONDS, 0 DISABLES ONE)
+#define DEFAULT_DEADLINE_WELL_KNOWN		500
+#define DEFAULT_DEADLINE_PAGE			2000
+#define DEFAULT_DEADLINE_REGISTRATION	15000	// Includes the wait for a registration thread
+#define RESOLVER_CONNECT_TIMEOUT		3000	// Cap on connecting to a resolver, within the deadline
+#define RESOLVER_TIMEOUT				10000	// Resolver timeout without a deadline (command line)
+#define DATABASE_BUSY_TIMEOUT			5000	// Wait for a locked database without a deadline
+#define DATABASE_PROGRESS_STEPS			1000	// SQLite VM steps between deadline checks
+
+// REQUEST STAGE TIMING, AND TRACES OF SLOW REQUESTS ('trace_file' OPTION)
+#define DEFAULT_TRACE_THRESHOLD			1000	// Milliseconds a request may take before it is traced
+#define TRACE_MAX_PER_SECOND			20		// Traces written per second and process, the rest are dropped
+#define REQUEST_SPAN_MAX				12		// Stage spans kept per request, later ones extend the last
+
+// ADMIN LISTENER ROUTES
+#define URL_ADMIN_METRICS	"/metrics"
+#define URL_ADMIN_REPLICATION	"/replication"	// ?after=N, change log entries after sequence N
+#define URL_ADMIN_HANDLES	"/handles"		// ?did=..., handles holding the DIDs
+#define REVERSE_LOOKUP_MAX	256				// DIDs in one /handles request
+#define URL_ADMIN_LOOKUP	"/lookup"		// POST, handles or labels to DIDs in bulk
+#define ADMIN_AUTH_SCHEME	"Bearer "
+#define LOOKUP_MAX_BODY		(64 * 1024 * 1024)	// Bytes of names in one /lookup request
+#define LOOKUP_BLOCK_SIZE	65536			// Response chunk size and first upload buffer
+#define URL_ADMIN_EXPORT	"/export"		// ?format=csv|jsonl, every user, streamed
+#define EXPORT_PAGE_ROWS	500				// Rows per read transaction of an export
+#define EXPORT_BLOCK_SIZE	65536			// Export response chunk size
+
+// REPLICATION FROM THE CHANGE LOG ('handled replica')
+#define HEADER_REPLICATION_SEQUENCE		"X-Handled-Sequence"	// Latest change log sequence on the primary
+#define REPLICATION_BATCH				1000	// Change log entries per response
+#define DEFAULT_REPLICA_INTERVAL		1000	// Milliseconds between polls once caught up
+#define DEFAULT_CHANGE_LOG_DAYS			30		// Days before superseded and delete entries are pruned, 0 keeps them all
+#define CHANGE_LOG_PRUNE_INTERVAL		3600	// Seconds between pruning passes
+#define CHANGE_LOG_TOO_OLD				-2		// '*head' when 'after' is older than the pruned part of the log
+#define HANDLE_INDEX_INITIAL			1024	// Slots in the in-memory handle index, a power of two
+#define HANDLE_INDEX_RESERVE			((size_t)64 << 30)	// Address space for each of the index's two generations
+#define RESERVED_LIST_RESERVE			((size_t)4 << 30)	// The same for the compiled reserved list
+#define SHARED_RESERVE_MINIMUM			((size_t)64 << 20)	// Halved down to this while the kernel refuses
+
+// SHARDED USER DATABASE ('shards' OPTION, 'handled reshard')
+#define MAX_SHARDS						256
+
+// ONLINE BACKUPS ('handled backup' AND backup_interval)
+#define DEFAULT_BACKUP_DIRECTORY		"backups"	// Relative to the base directory unless absolute
+#define DEFAULT_BACKUP_KEEP				7		// Newest backups kept, older ones are removed
+#define DEFAULT_BACKUP_PAGES			100		// Database pages copied per step
+#define DEFAULT_BACKUP_SLEEP			10		// Milliseconds between steps, when writers get in
+#define BACKUP_MAX_RESTARTS				4		// Restarts (a write to the source) before the rest is copied in one step
+#define BACKUP_NAME_FORMAT				"%Y%m%dT%H%M%SZ"	// UTC start time, so names sort by age
+#define BACKUP_NAME_LENGTH				16
+#define BACKUP_PARTIAL_SUFFIX			".partial"	// A backup being built
+#define BACKUP_MANIFEST					"MANIFEST"	// crc32 bytes file, one line per copied file
+
+// AUTHORITATIVE DNS FOR _atproto TXT RECORDS ('dns' OPTION), UDP AND TCP ON ONE THREAD PER PROCESS
+#define DEFAULT_DNS_PORT				8053	// 53 needs root or CAP_NET_BIND_SERVICE
+#define DEFAULT_DNS_ADDRESS				"0.0.0.0"
+#define DEFAULT_DNS_TTL					300		// Seconds, TXT answers
+#define DNS_NEGATIVE_TTL				60		// Seconds, SOA TTL and minimum, how long NXDOMAIN and NODATA are cached
+#define DNS_SOA_REFRESH					3600
+#define DNS_SOA_RETRY					600
+#define DNS_SOA_EXPIRE					604800
+#define DNS_HOSTMASTER					"hostmaster"	// SOA mailbox, under the domain
+#define DNS_ATPROTO_LABEL				"_atproto"
+#define DNS_TXT_PREFIX					"did="
+#define DNS_MAX_MESSAGE					512		// Queries and answers, no EDNS
+#define DNS_MAX_NAME					255
+#define DNS_HEADER_SIZE					12
+#define DNS_UDP_BATCH					64		// Datagrams read and answered per system call
+#define DNS_TCP_MAX_CONNECTIONS			64		// Per process, more are closed at once
+#define DNS_TCP_IDLE_TIMEOUT			5		// Seconds
+
+// WELL-KNOWN FILES FOR NGINX ('static_root' OPTION, 'handled materialize')
+#define STATIC_SEQUENCE_FILENAME		".handled-sequence"	// Change log sequence the files reflect
+#define STATIC_TEMPORARY_SUFFIX			".tmp"	// Files being written, renamed into place when complete
+#define STATIC_LOCK_FILENAME			".handled-lock"	// flock held while a file is brought in line with the database
+
+// RESPONSE COMPRESSION
+#define ENCODING_NAME_GZIP		"gzip"
+#define ENCODING_NAME_BROTLI	"br"
+
+#define COMPRESSION_MIN_SIZE				512		// Template output smaller than this goes out uncompressed
+#define COMPRESSION_MAX_RATIO				0.9		// Skip on the fly compression of templates that shrink less than 10%
+#define COMPRESSION_GZIP_LEVEL_STATIC		9		// Static pages are compressed once at load, so spend the CPU
+#define COMPRESSION_GZIP_LEVEL_DYNAMIC		5
+#define COMPRESSION_BROTLI_QUALITY_STATIC	11
+#define COMPRESSION_BROTLI_QUALITY_DYNAMIC	4
 
 
 // DEFINE THE REGULAR EXPRESSION PATTERNS FOR DATA VALIDATION
@@ -81,6 +268,7 @@
 #define ERROR_DATABASE "Error: Database operation failed."
 #define ERROR_DUPLICATE_DATA "Error: Duplicate record found, unable to process."
 #define ERROR_REQUEST_FAILED "Error: Request failed."
+#define ERROR_REPLICA_READ_ONLY "Error: Registrations are not accepted on this server."
 
 #define ERROR_INVALID_DID_ENTERED "The bsky.social handle or DID you entered appears to be invalid. Please double-check it and try again. If the issue persists, ensure the handle is active and properly set up."
 
@@ -90,6 +278,102 @@ enum connectionType {
   POST
 } ;
 
+// CONTENT ENCODINGS, IN INCREASING ORDER OF PREFERENCE
+typedef enum {
+  ENCODING_IDENTITY = 0,
+  ENCODING_GZIP = 1,
+  ENCODING_BROTLI = 2,
+  ENCODING_COUNT = 3
+} contentEncoding;
+
+// TRAFFIC CLASSES, SHED IN THIS ORDER WHEN OVERLOADED
+typedef enum {
+  TRAFFIC_REGISTRATION = 0,
+  TRAFFIC_WELL_KNOWN = 1,
+  TRAFFIC_CLASS_COUNT = 2
+} trafficClass;
+
+// RATE LIMITER KEY TYPES, EACH WITH ITS OWN BUCKETS
+typedef enum {
+  RATE_KEY_ADDRESS = 0,
+  RATE_KEY_LABEL = 1,
+  RATE_KEY_COUNT = 2
+} rateLimitKey;
+
+// REQUEST LANES, EACH WITH ITS OWN LATENCY HISTOGRAM
+typedef enum {
+  LANE_IO = 0,
+  LANE_REGISTRATION = 1,
+  LANE_COUNT = 2
+} requestLane;
+
+// PROGRESS OF A POST /result REQUEST
+typedef enum {
+  REGISTRATION_RECEIVING = 0,		// Body still arriving
+  REGISTRATION_QUEUED = 1,			// Connection suspended, waiting for or running on a lane thread
+  REGISTRATION_DONE = 2				// Result ready to be sent
+} registrationState;
+
+// WHERE A REQUEST RAN OUT OF TIME
+typedef enum {
+  DEADLINE_STAGE_QUEUE = 0,			// Waiting for a registration thread
+  DEADLINE_STAGE_RESOLVE = 1,		// DID lookup over HTTPS
+  DEADLINE_STAGE_DATABASE = 2,		// SQLite, locked or slow
+  DEADLINE_STAGE_COUNT = 3
+} deadlineStage;
+
+// WHERE A REQUEST SPENDS ITS TIME, IN THE ORDER A REGISTRATION GOES THROUGH THEM
+typedef enum {
+  REQUEST_STAGE_RECEIVE = 0,		// Headers and body, through the post processor
+  REQUEST_STAGE_QUEUE = 1,			// Waiting for a registration thread, then for MHD to resume the connection
+  REQUEST_STAGE_EXTRACT = 2,		// Looking for a DID in the form field (extractDid)
+  REQUEST_STAGE_RESOLVE = 3,		// Resolving a handle over HTTPS (getWellKnownDID)
+  REQUEST_STAGE_STORE = 4,			// Inserting the record (addNewRecord)
+  REQUEST_STAGE_LOOKUP = 5,			// Well-known and page lookups in the databases or the index
+  REQUEST_STAGE_RENDER = 6,			// Filling and compressing the result template
+  REQUEST_STAGE_SEND = 7,			// From queueing the response until MHD is done with it
+  REQUEST_STAGE_COUNT = 8
+} requestStage;
+
+// WHAT A REQUEST TURNED OUT TO BE, FOR THE ALLOCATION PROFILE (make ALLOCPROF=1)
+typedef enum {
+  REQUEST_ROUTE_WELL_KNOWN = 0,		// GET /.well-known/atproto-did
+  REQUEST_ROUTE_LANDING = 1,		// GET / on a handle: register, reserved or active page
+  REQUEST_ROUTE_RESULT = 2,			// POST /result
+  REQUEST_ROUTE_ERROR = 3,			// Everything else: 404s, error pages, rejected requests
+  REQUEST_ROUTE_COUNT = 4
+} requestRoute;
+
+// DNS RESPONSE CODES, AS SENT, COUNTED PER CODE
+typedef enum {
+  DNS_RCODE_NOERROR = 0,
+  DNS_RCODE_FORMERR = 1,
+  DNS_RCODE_SERVFAIL = 2,
+  DNS_RCODE_NXDOMAIN = 3,
+  DNS_RCODE_NOTIMP = 4,
+  DNS_RCODE_REFUSED = 5,
+  DNS_RCODE_COUNT = 6
+} dnsResponseCode;
+
+// DNS TRANSPORTS
+typedef enum {
+  DNS_TRANSPORT_UDP = 0,
+  DNS_TRANSPORT_TCP = 1,
+  DNS_TRANSPORT_COUNT = 2
+} dnsTransport;
+
+// USER EXPORT FORMATS ('handled export' AND /export)
+typedef enum {
+  EXPORT_CSV = 0,					// Header row, then RFC 4180 quoting
+  EXPORT_JSONL = 1					// One JSON object per line
+} exportFormat;
+
+// CONFIGURATION OPTION VALUE TYPES
+typedef enum {
+  CONFIG_INTEGER,
+  CONFIG_STRING
+} configOptionType;
+
 // NOT USED YET
 typedef enum {
   NOT_LOCKED = 0,
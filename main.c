@@ -6,14 +6,39 @@
 
 #include <sys/types.h>
 
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <dirent.h>
-
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #include "handled.h"
 
@@ -34,10 +59,182 @@ const char *domainName = NULL;
 const char *baseDirectory = NULL;
 const char *filterDatabaseGlobal = NULL;
 const char *principalDatabaseGlobal = NULL;
+const char *shardIndexDatabaseGlobal = NULL;		// Sharded store only: DID and label uniqueness, change log
+char **shardDatabasesGlobal = NULL;
+int shardCountGlobal = 0;							// 0 while users are kept in principalDatabaseGlobal
 
 #define RESERVED_HANDLES_FILENAME "reserved.txt"
 #define FILTER_DB_FILENAME "filtered-handles.db"
 #define PRINCIPAL_DB_FILENAME "active-user-handles.db"
+#define SHARD_DB_FILENAME "active-user-handles-%03d.db"
+#define SHARD_INDEX_DB_FILENAME "active-user-index.db"
+#define RESHARD_SUFFIX ".reshard"
+#define RESHARD_COMMIT_FILENAME "reshard-commit"		// Target layout of a reshard whose files are all built
+
+// RUNTIME CONFIGURATION, DEFAULTS FROM handled.h
+struct configStruct {
+	int port;
+	int adminPort;								// Loopback only
+	int tlsEnabled;								// Serve HTTPS natively, without the NGINX hop
+	int tlsPort;
+	char tlsCertificate[CONFIG_VALUE_MAX];		// Relative to the base directory unless absolute
+	char tlsKey[CONFIG_VALUE_MAX];
+	char tlsPriorities[CONFIG_VALUE_MAX];
+	int workers;								// Prefork worker processes, 0 serves from this process
+	int drainTimeout;							// Seconds in-flight requests get to finish on stop or upgrade
+	int maxConnections;
+	int maxConnectionsPerIp;					// 0 disables the per-IP limit
+	int idleTimeout;
+	int requestTimeout;
+	int connectionMemory;
+	int shedRegistrations;
+	int shedWellKnown;
+	char blocklist[CONFIG_VALUE_MAX];			// Addresses and networks refused at accept, empty for none
+	int rateAddress;							// Registrations per minute per client address, 0 disables it
+	int burstAddress;
+	int rateLabel;								// Registration attempts per minute per label, 0 disables it
+	int burstLabel;
+	int trustForwardedFor;						// Take the client address from X-Forwarded-For on loopback connections
+	int ioThreads;
+	int registrationThreads;					// 0 runs registrations on the I/O threads
+	int registrationQueue;
+	int deadlineWellKnown;						// Milliseconds per route, 0 disables the deadline
+	int deadlinePage;
+	int deadlineRegistration;
+	char replicaSource[CONFIG_VALUE_MAX];		// Admin listener of the primary, for 'handled replica'
+	int replicaInterval;
+	int changeLogDays;							// Days superseded and delete entries stay in the change log, 0 for ever
+	int shards;									// User database files, 0 or 1 for a single one
+	char adminToken[CONFIG_VALUE_MAX];			// Bearer token for admin batch routes, empty turns them off
+	int backupInterval;							// Seconds between backups taken by the daemon, 0 for none
+	char backupDirectory[CONFIG_VALUE_MAX];
+	int backupKeep;
+	int backupPages;
+	int backupSleep;
+	int dnsEnabled;								// Answer _atproto TXT queries from the handle index
+	int dnsPort;
+	char dnsAddress[CONFIG_VALUE_MAX];
+	int dnsTtl;
+	char dnsNameserver[CONFIG_VALUE_MAX];		// SOA and NS name, empty for the domain itself
+	char staticRoot[CONFIG_VALUE_MAX];			// Web root for well-known files served by NGINX, empty for none
+	char traceFile[CONFIG_VALUE_MAX];			// Chrome trace events of slow requests, empty for none
+	int traceThreshold;							// Milliseconds
+	char captureFile[CONFIG_VALUE_MAX];			// Binary log of incoming requests for handled-replay, empty for none
+};
+
+struct configStruct configGlobal = {
+	.port = PORT,
+	.adminPort = ADMIN_PORT,
+	.tlsEnabled = FALSE,
+	.tlsPort = DEFAULT_TLS_PORT,
+	.tlsCertificate = DEFAULT_TLS_CERTIFICATE,
+	.tlsKey = DEFAULT_TLS_KEY,
+	.tlsPriorities = DEFAULT_TLS_PRIORITIES,
+	.workers = 0,
+	.drainTimeout = DEFAULT_DRAIN_TIMEOUT,
+	.maxConnections = DEFAULT_MAX_CONNECTIONS,
+	.maxConnectionsPerIp = DEFAULT_MAX_CONNECTIONS_PER_IP,
+	.idleTimeout = DEFAULT_IDLE_TIMEOUT,
+	.requestTimeout = DEFAULT_REQUEST_TIMEOUT,
+	.connectionMemory = DEFAULT_CONNECTION_MEMORY,
+	.shedRegistrations = DEFAULT_SHED_REGISTRATIONS,
+	.shedWellKnown = DEFAULT_SHED_WELL_KNOWN,
+	.blocklist = "",
+	.rateAddress = DEFAULT_RATE_ADDRESS,
+	.burstAddress = DEFAULT_BURST_ADDRESS,
+	.rateLabel = DEFAULT_RATE_LABEL,
+	.burstLabel = DEFAULT_BURST_LABEL,
+	.trustForwardedFor = FALSE,
+	.ioThreads = DEFAULT_IO_THREADS,
+	.registrationThreads = DEFAULT_REGISTRATION_THREADS,
+	.registrationQueue = DEFAULT_REGISTRATION_QUEUE,
+	.deadlineWellKnown = DEFAULT_DEADLINE_WELL_KNOWN,
+	.deadlinePage = DEFAULT_DEADLINE_PAGE,
+	.deadlineRegistration = DEFAULT_DEADLINE_REGISTRATION,
+	.replicaSource = "",
+	.replicaInterval = DEFAULT_REPLICA_INTERVAL,
+	.changeLogDays = DEFAULT_CHANGE_LOG_DAYS,
+	.shards = 0,
+	.adminToken = "",
+	.backupInterval = 0,
+	.backupDirectory = DEFAULT_BACKUP_DIRECTORY,
+	.backupKeep = DEFAULT_BACKUP_KEEP,
+	.backupPages = DEFAULT_BACKUP_PAGES,
+	.backupSleep = DEFAULT_BACKUP_SLEEP,
+	.dnsEnabled = FALSE,
+	.dnsPort = DEFAULT_DNS_PORT,
+	.dnsAddress = DEFAULT_DNS_ADDRESS,
+	.dnsTtl = DEFAULT_DNS_TTL,
+	.dnsNameserver = "",
+	.staticRoot = "",
+	.traceFile = "",
+	.traceThreshold = DEFAULT_TRACE_THRESHOLD,
+	.captureFile = "",
+};
+
+// SET BY 'handled replica': SERVE WELL-KNOWN LOOKUPS FROM THE INDEX FED BY THE PRIMARY'S CHANGE LOG
+static int replicaMode = FALSE;
+
+// KEYS ACCEPTED IN handled.conf AND AS key=value ARGUMENTS
+struct configOptionStruct {
+	const char *key;
+	configOptionType type;
+	size_t offset;				// Offset of the field in configStruct
+	long minimum;				// Range for CONFIG_INTEGER
+	long maximum;
+};
+
+static const struct configOptionStruct configOptions[] = {
+	{ "port",				CONFIG_INTEGER,	offsetof(struct configStruct, port),			1, 65535 },
+	{ "admin_port",			CONFIG_INTEGER,	offsetof(struct configStruct, adminPort),		1, 65535 },
+	{ "tls",				CONFIG_INTEGER,	offsetof(struct configStruct, tlsEnabled),		0, 1 },
+	{ "tls_port",			CONFIG_INTEGER,	offsetof(struct configStruct, tlsPort),			1, 65535 },
+	{ "tls_certificate",	CONFIG_STRING,	offsetof(struct configStruct, tlsCertificate),	0, 0 },
+	{ "tls_key",			CONFIG_STRING,	offsetof(struct configStruct, tlsKey),			0, 0 },
+	{ "tls_priorities",		CONFIG_STRING,	offsetof(struct configStruct, tlsPriorities),	0, 0 },
+	{ "workers",			CONFIG_INTEGER,	offsetof(struct configStruct, workers),			0, MAX_WORKERS },
+	{ "drain_timeout",		CONFIG_INTEGER,	offsetof(struct configStruct, drainTimeout),	0, 600 },
+	{ "max_connections",	CONFIG_INTEGER,	offsetof(struct configStruct, maxConnections),	1, 65536 },
+	{ "max_connections_per_ip",	CONFIG_INTEGER,	offsetof(struct configStruct, maxConnectionsPerIp),	0, 65536 },
+	{ "idle_timeout",		CONFIG_INTEGER,	offsetof(struct configStruct, idleTimeout),		0, 3600 },
+	{ "request_timeout",	CONFIG_INTEGER,	offsetof(struct configStruct, requestTimeout),	0, 3600 },
+	{ "connection_memory",	CONFIG_INTEGER,	offsetof(struct configStruct, connectionMemory),	4096, 1048576 },
+	{ "shed_registrations",	CONFIG_INTEGER,	offsetof(struct configStruct, shedRegistrations),	1, 65536 },
+	{ "shed_well_known",	CONFIG_INTEGER,	offsetof(struct configStruct, shedWellKnown),	1, 65536 },
+	{ "blocklist",			CONFIG_STRING,	offsetof(struct configStruct, blocklist),		0, 0 },
+	{ "rate_address",		CONFIG_INTEGER,	offsetof(struct configStruct, rateAddress),		0, 100000 },
+	{ "burst_address",		CONFIG_INTEGER,	offsetof(struct configStruct, burstAddress),	1, 100000 },
+	{ "rate_label",			CONFIG_INTEGER,	offsetof(struct configStruct, rateLabel),		0, 100000 },
+	{ "burst_label",		CONFIG_INTEGER,	offsetof(struct configStruct, burstLabel),		1, 100000 },
+	{ "trust_forwarded_for",	CONFIG_INTEGER,	offsetof(struct configStruct, trustForwardedFor),	0, 1 },
+	{ "io_threads",			CONFIG_INTEGER,	offsetof(struct configStruct, ioThreads),		1, MAX_IO_THREADS },
+	{ "registration_threads",	CONFIG_INTEGER,	offsetof(struct configStruct, registrationThreads),	0, MAX_REGISTRATION_THREADS },
+	{ "registration_queue",	CONFIG_INTEGER,	offsetof(struct configStruct, registrationQueue),	1, 65536 },
+	{ "deadline_well_known",	CONFIG_INTEGER,	offsetof(struct configStruct, deadlineWellKnown),	0, 600000 },
+	{ "deadline_page",		CONFIG_INTEGER,	offsetof(struct configStruct, deadlinePage),	0, 600000 },
+	{ "deadline_registration",	CONFIG_INTEGER,	offsetof(struct configStruct, deadlineRegistration),	0, 600000 },
+	{ "replica_source",		CONFIG_STRING,	offsetof(struct configStruct, replicaSource),	0, 0 },
+	{ "replica_interval",	CONFIG_INTEGER,	offsetof(struct configStruct, replicaInterval),	50, 600000 },
+	{ "change_log_days",	CONFIG_INTEGER,	offsetof(struct configStruct, changeLogDays),	0, 36500 },
+	{ "shards",				CONFIG_INTEGER,	offsetof(struct configStruct, shards),			0, MAX_SHARDS },
+	{ "admin_token",		CONFIG_STRING,	offsetof(struct configStruct, adminToken),		0, 0 },
+	{ "backup_interval",	CONFIG_INTEGER,	offsetof(struct configStruct, backupInterval),	0, 604800 },
+	{ "backup_directory",	CONFIG_STRING,	offsetof(struct configStruct, backupDirectory),	0, 0 },
+	{ "backup_keep",		CONFIG_INTEGER,	offsetof(struct configStruct, backupKeep),		1, 1000 },
+	{ "backup_pages",		CONFIG_INTEGER,	offsetof(struct configStruct, backupPages),		1, 1000000 },
+	{ "backup_sleep",		CONFIG_INTEGER,	offsetof(struct configStruct, backupSleep),		0, 10000 },
+	{ "dns",				CONFIG_INTEGER,	offsetof(struct configStruct, dnsEnabled),		0, 1 },
+	{ "dns_port",			CONFIG_INTEGER,	offsetof(struct configStruct, dnsPort),			1, 65535 },
+	{ "dns_address",		CONFIG_STRING,	offsetof(struct configStruct, dnsAddress),		0, 0 },
+	{ "dns_ttl",			CONFIG_INTEGER,	offsetof(struct configStruct, dnsTtl),			0, 86400 },
+	{ "dns_nameserver",		CONFIG_STRING,	offsetof(struct configStruct, dnsNameserver),	0, 0 },
+	{ "static_root",		CONFIG_STRING,	offsetof(struct configStruct, staticRoot),		0, 0 },
+	{ "trace_file",			CONFIG_STRING,	offsetof(struct configStruct, traceFile),		0, 0 },
+	{ "trace_threshold",	CONFIG_INTEGER,	offsetof(struct configStruct, traceThreshold),	0, 600000 },
+	{ "capture_file",		CONFIG_STRING,	offsetof(struct configStruct, captureFile),		0, 0 },
+};
+
+#define CONFIG_OPTION_COUNT (sizeof(configOptions) / sizeof(configOptions[0]))
 
 #define PLACEHOLDER_ERROR "{{ ERROR }}"
 #define PLACEHOLDER_TOKEN "{{ TOKEN }}"
@@ -49,6 +246,12 @@ regex_t regexLabel;
 regex_t regexFullHandle;
 regex_t regexDidPLC;
 
+// ALLOCATIONS AND THE BYTES ASKED FOR, SEE ALLOCATION PROFILE
+struct allocCountStruct {
+	unsigned long long count;
+	unsigned long long bytes;
+};
+
 struct connectionInfoStruct
 {
 	enum connectionType connectiontype; // NOT USED YET
@@ -63,6 +266,31 @@ struct connectionInfoStruct
 	// USER DETAILS WE NEED TO TRACK, CONSIDER REMOVING SOME
 	const char *did;
 	const char *email;
+
+	// ADMISSION CONTROL
+	trafficClass traffic;
+	requestLane lane;
+	long long started;					// Microseconds, CLOCK_MONOTONIC
+	long long deadline;					// Same clock, 0 for none
+	int timedOut;						// The registration ran out of time on its lane thread
+
+	// REGISTRATION LANE (POST /result)
+	struct MHD_Connection *connection;
+	registrationState state;
+	const char *didInput;				// Raw 'did' form field, resolved off the I/O threads
+	newRecordResult *record;			// Set by processRegistration
+
+	// STAGE TIMING: CONSECUTIVE SPANS FROM 'started', EACH ENDING WHERE THE NEXT BEGINS (stageMark)
+	requestStage spanStage[REQUEST_SPAN_MAX];
+	long long spanEnd[REQUEST_SPAN_MAX];	// Same clock as 'started'
+	int spanCount;
+	requestRoute route;
+
+	#ifdef HANDLED_ALLOCPROF
+	// ALLOCATION PROFILE: WHAT THIS REQUEST ALLOCATED SINCE THE LAST MARK, AND IN EACH STAGE
+	struct allocCountStruct allocPending;
+	struct allocCountStruct allocStages[REQUEST_STAGE_COUNT];
+	#endif
 	
 	// HTTP RESPONSE BODY WE WILL RETURN, NULL IF NOT YET KNOWN.
 	// const char *answerstring;
@@ -77,6 +305,116 @@ struct curlResponse {
     size_t size;
 };
 
+// Growable text buffer used to render admin responses
+struct textBuffer {
+	char *data;
+	size_t length;
+	size_t capacity;
+};
+
+// ONE CHANGE LOG ENTRY AS STREAMED TO REPLICAS. THE STRINGS POINT INTO THE RESPONSE BODY.
+struct changeEntryStruct {
+	long long sequence;
+	int put;							// FALSE for a delete
+	const char *handle;
+	const char *did;
+	const char *label;
+	const char *domain;
+	int locked;
+};
+
+// PRE-RENDERED STATIC PAGE, WITH EVERY CONTENT ENCODING WORTH SENDING
+struct staticPageStruct {
+	const char *filename;							// Relative path, e.g., STATIC_REGISTER
+	const char *contentType;
+	unsigned int statusCode;
+	int isTemplate;									// Templates are filled and compressed per request
+	int compressTemplate;							// Template compresses well enough to do it on the fly
+	char *body[ENCODING_COUNT];						// NULL if the encoding is unavailable or not smaller
+	size_t bodySize[ENCODING_COUNT];
+	struct MHD_Response *response[ENCODING_COUNT];	// Reused for every request, static pages only
+};
+
+// ***************************************************************************
+// BEGIN METRICS *************************************************************
+// ***************************************************************************
+
+// GAUGES A PROCESS RAISES AND LOWERS ITSELF. EACH WORKER KEEPS ITS OWN SLOT, SUMMED FOR /metrics, SO THE SUPERVISOR
+// CAN ZERO THE SLOT OF A WORKER THAT DIED WITH REQUESTS IN FLIGHT.
+struct workerGaugeStruct {
+	atomic_ullong requestsInFlight;
+	atomic_ullong laneInFlight[LANE_COUNT];			// Requests being served per lane
+	atomic_ullong laneQueued;						// Registrations waiting for a lane thread
+};
+
+// RUNNING COUNTERS, EXPORTED IN PROMETHEUS TEXT FORMAT BY THE ADMIN LISTENER.
+// LIVES IN A SHARED MAPPING SO PREFORK WORKERS ADD TO THE SAME TOTALS.
+struct metricsStruct {
+	atomic_ullong encodedResponses[ENCODING_COUNT];	// Static and template responses sent per encoding
+	atomic_ullong dynamicCompressions;				// Template responses compressed on the fly
+	atomic_ullong compressionInputBytes;			// Uncompressed size of every compressed response
+	atomic_ullong compressionOutputBytes;			// Bytes actually sent for those responses
+	atomic_ullong workerRestarts;					// Prefork workers restarted after exiting unexpectedly
+	atomic_ullong shedResponses[TRAFFIC_CLASS_COUNT];	// Requests answered with the prebuilt 503
+	atomic_ullong connectionsBlocked;				// Connections refused by the blocklist
+	atomic_ullong requestTimeouts;					// Requests closed for arriving slower than request_timeout
+	struct workerGaugeStruct workerGauges[MAX_WORKERS];	// By worker index, slot 0 without prefork
+	atomic_ullong rateLimited[RATE_KEY_COUNT];		// Registrations answered with 429, by the bucket that ran out
+	atomic_ullong rateStripesRecovered;				// Rate limit stripes reset after their holder died
+	atomic_ullong laneRejected;						// Registrations answered with 503 because the lane queue was full
+	atomic_ullong latencyBuckets[LANE_COUNT][LATENCY_BUCKET_COUNT];	// Request latency histogram, not cumulative
+	atomic_ullong latencyMicroseconds[LANE_COUNT];	// Sum of request latencies
+	atomic_ullong latencyCount[LANE_COUNT];
+	atomic_ullong deadlineExceeded[DEADLINE_STAGE_COUNT];	// Requests that ran out of time, by stage
+	atomic_ullong resolutionsFetched;				// Outbound DID lookups made for registrations
+	atomic_ullong resolutionsCoalesced;				// Lookups saved by sharing one already in flight
+	atomic_llong replicaApplied;					// Replica: last change log sequence applied
+	atomic_llong replicaPrimary;					// Replica: latest sequence the primary reported
+	atomic_llong replicaSynced;						// Replica: CLOCK_MONOTONIC microseconds it was last caught up
+	atomic_ullong replicaEntries;					// Replica: change log entries applied
+	atomic_ullong replicaErrors;					// Replica: failed polls and applies
+	atomic_ullong replicaResyncs;					// Replica: restarts from sequence 0 after falling behind the pruned log
+	atomic_ullong replicationSkipped;				// Malformed change log entries passed over by a follower
+	atomic_ullong changeLogPruned;					// Change log entries removed by retention
+	atomic_ullong shardQuarantined;					// Shard edits set aside for conflicting with another shard
+	atomic_ullong indexRecords;					// Gauge, handles in the in-memory index
+	atomic_ullong indexBytes;						// Gauge, memory the index holds
+	atomic_ullong indexSkipped;						// Users left out of the index: not a did:plc, or the handle is too long
+	atomic_ullong backups;							// Backups taken and verified
+	atomic_ullong backupFailures;
+	atomic_ullong backupMicroseconds;				// Duration of the last good backup
+	atomic_ullong backupPages;						// Pages copied by the last good backup
+	atomic_llong backupCompleted;					// Unix time the last good backup finished
+	atomic_ullong dnsQueries[DNS_TRANSPORT_COUNT];	// DNS messages received, answered or not
+	atomic_ullong dnsResponses[DNS_RCODE_COUNT];	// DNS responses sent, by response code
+	atomic_ullong staticFilesWritten;				// Well-known files written under static_root
+	atomic_ullong staticFilesRemoved;
+	atomic_ullong staticFileErrors;
+	atomic_llong staticSequence;					// Change log sequence the well-known files reflect
+	atomic_ullong stageBuckets[REQUEST_STAGE_COUNT][LATENCY_BUCKET_COUNT];	// Time requests spent in each stage, not cumulative
+	atomic_ullong stageMicroseconds[REQUEST_STAGE_COUNT];
+	atomic_ullong stageCount[REQUEST_STAGE_COUNT];
+	atomic_ullong tracesWritten;					// Slow requests appended to trace_file
+	atomic_ullong tracesDropped;					// Slow requests over TRACE_MAX_PER_SECOND or not written
+	atomic_ullong capturedRequests;					// Requests logged to capture_file
+	atomic_ullong captureErrors;					// Requests lost with a failed write
+	atomic_ullong allocRequests[REQUEST_ROUTE_COUNT];	// Requests profiled per route (make ALLOCPROF=1)
+	atomic_ullong allocCount[REQUEST_ROUTE_COUNT][REQUEST_STAGE_COUNT];	// Allocations they made, by stage
+	atomic_ullong allocBytes[REQUEST_ROUTE_COUNT][REQUEST_STAGE_COUNT];
+};
+
+static struct metricsStruct metricsFallback;		// Used until initializeMetrics() maps the shared copy
+struct metricsStruct *metricsGlobal = &metricsFallback;
+
+#define METRIC_ADD(field, value)	atomic_fetch_add_explicit(&metricsGlobal->field, (value), memory_order_relaxed)
+#define METRIC_SUB(field, value)	atomic_fetch_sub_explicit(&metricsGlobal->field, (value), memory_order_relaxed)
+#define METRIC_GET(field)			atomic_load_explicit(&metricsGlobal->field, memory_order_relaxed)
+#define METRIC_SET(field, value)	atomic_store_explicit(&metricsGlobal->field, (value), memory_order_relaxed)
+
+static int workerSlot = 0;							// This process's workerGauges slot, its worker index
+#define GAUGE_ADD(field, value)		METRIC_ADD(workerGauges[workerSlot].field, value)
+#define GAUGE_SUB(field, value)		METRIC_SUB(workerGauges[workerSlot].field, value)
+
 // ***************************************************************************
 // BEGIN HARD CODED HTML CODE ************************************************
 // ***************************************************************************
@@ -98,6 +436,68 @@ int usageDaemon (void)
     printf("init {basedir}                      Creates restricted handle database (~/.handled is suggested)\n");
     printf("update {basedir}                    Updates restricted handle database\n");
     printf("httpd {basedir} {domain name}       Starts HTTPD daemon for given domain name\n");
+    printf("      [key=value ...]               Options, overriding {basedir}/" CONFIG_FILENAME "\n");
+    printf("reshard {basedir} {N}               Moves the user database to N files, with the daemon stopped\n");
+    printf("export {basedir} {file} [csv|jsonl] Writes every user but their token to file, the daemon may be running\n");
+    printf("backup {basedir} [key=value ...]    Takes a verified backup of the databases, the daemon may be running\n");
+    printf("backup {basedir} verify             Checks every backup against its manifest\n");
+    printf("materialize {basedir}               Writes the well-known file of every user under static_root,\n");
+    printf("      [key=value ...]               the daemon may be running\n");
+    printf("replica {basedir} {domain name}     Serves well-known lookups from a copy of a primary's users,\n");
+    printf("      [key=value ...]               kept current from its change log (read only)\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("\n");
+    printf("port=%-5d                          HTTP listener port\n", PORT);
+    printf("admin_port=%-5d                    Loopback listener for metrics and the change log\n", ADMIN_PORT);
+    printf("tls=0|1                             Serve HTTPS natively (build with make TLS=1)\n");
+    printf("tls_port=%-5d                      HTTPS listener port\n", DEFAULT_TLS_PORT);
+    printf("tls_certificate=" DEFAULT_TLS_CERTIFICATE "        Wildcard certificate chain, relative to {basedir}\n");
+    printf("tls_key=" DEFAULT_TLS_KEY "                 Private key, relative to {basedir}\n");
+    printf("tls_priorities={gnutls priorities}  Defaults to TLS 1.2 and 1.3\n");
+    printf("workers=N                           Fork N worker processes sharing the ports (SO_REUSEPORT)\n");
+    printf("max_connections=%-5d               Open connections per listener\n", DEFAULT_MAX_CONNECTIONS);
+    printf("max_connections_per_ip=N            Per client address, 0 (default) disables it behind a proxy\n");
+    printf("idle_timeout=%-3d                     Seconds before an idle connection is closed\n", DEFAULT_IDLE_TIMEOUT);
+    printf("request_timeout=%-3d                  Seconds a request body may take to arrive\n", DEFAULT_REQUEST_TIMEOUT);
+    printf("connection_memory=%-6d            Bytes buffered per connection\n", DEFAULT_CONNECTION_MEMORY);
+    printf("shed_registrations=%-5d            Requests in flight before registrations get a 503\n", DEFAULT_SHED_REGISTRATIONS);
+    printf("shed_well_known=%-5d               Requests in flight before well-known lookups get a 503\n", DEFAULT_SHED_WELL_KNOWN);
+    printf("blocklist={file}                    Addresses or CIDR networks to refuse, relative to {basedir}\n");
+    printf("rate_address=%-3d                     Registrations per minute per client address, 0 disables it\n", DEFAULT_RATE_ADDRESS);
+    printf("burst_address=%-3d                    Registrations a client address may send at once\n", DEFAULT_BURST_ADDRESS);
+    printf("rate_label=%-3d                       Registration attempts per minute per handle label, 0 disables it\n", DEFAULT_RATE_LABEL);
+    printf("burst_label=%-3d                      Attempts a label may receive at once\n", DEFAULT_BURST_LABEL);
+    printf("trust_forwarded_for=0|1             Take the client address from X-Forwarded-For on loopback connections\n");
+    printf("io_threads=%-3d                       MHD threads per listener for well-known and page requests\n", DEFAULT_IO_THREADS);
+    printf("registration_threads=%-3d             Threads resolving and storing registrations, 0 uses the I/O threads\n", DEFAULT_REGISTRATION_THREADS);
+    printf("registration_queue=%-5d             Registrations waiting for a thread before new ones get a 503\n", DEFAULT_REGISTRATION_QUEUE);
+    printf("deadline_well_known=%-5d           Milliseconds a well-known lookup may take, 0 disables it\n", DEFAULT_DEADLINE_WELL_KNOWN);
+    printf("deadline_page=%-5d                 Milliseconds a page request may take\n", DEFAULT_DEADLINE_PAGE);
+    printf("deadline_registration=%-5d         Milliseconds a registration may take, lookups included\n", DEFAULT_DEADLINE_REGISTRATION);
+    printf("drain_timeout=%-3d                    Seconds to finish open requests on stop or upgrade\n", DEFAULT_DRAIN_TIMEOUT);
+    printf("shards=N                            User database files, split by handle hash (see reshard)\n");
+    printf("replica_source={url}                Primary's admin listener (replica), defaults to http://127.0.0.1:%d\n", ADMIN_PORT);
+    printf("replica_interval=%-5d              Milliseconds between change log polls once caught up (and index updates)\n", DEFAULT_REPLICA_INTERVAL);
+    printf("change_log_days=%-3d                  Days before superseded and delete change log entries are pruned, 0 keeps all\n", DEFAULT_CHANGE_LOG_DAYS);
+    printf("admin_token={token}                 Bearer token for /lookup and /export on the admin listener, unset turns them off\n");
+    printf("backup_interval=N                   Seconds between backups taken by the daemon, 0 (default) for none\n");
+    printf("backup_directory=" DEFAULT_BACKUP_DIRECTORY "            Where backups go, relative to {basedir}\n");
+    printf("backup_keep=%-3d                     Newest backups kept, older ones are removed\n", DEFAULT_BACKUP_KEEP);
+    printf("backup_pages=%-5d                  Database pages copied per backup step\n", DEFAULT_BACKUP_PAGES);
+    printf("backup_sleep=%-5d                  Milliseconds between backup steps, for writers to get in\n", DEFAULT_BACKUP_SLEEP);
+    printf("dns=0|1                             Answer _atproto TXT queries over UDP and TCP from the handle index\n");
+    printf("dns_port=%-5d                      DNS listener port\n", DEFAULT_DNS_PORT);
+    printf("dns_address=" DEFAULT_DNS_ADDRESS "                 DNS listener address, IPv4 or IPv6\n");
+    printf("dns_ttl=%-5d                       Seconds resolvers may cache a TXT answer\n", DEFAULT_DNS_TTL);
+    printf("dns_nameserver={name}               Name in the SOA and NS records, defaults to the domain name\n");
+    printf("static_root={directory}             Keep a well-known file per handle here for NGINX, relative to {basedir}\n");
+    printf("trace_file={file}                   Append requests slower than trace_threshold as Chrome trace events\n");
+    printf("trace_threshold=%-5d               Milliseconds a request may take before it is traced\n", DEFAULT_TRACE_THRESHOLD);
+    printf("capture_file={file}                 Log the method, host, URL and body size of every request for handled-replay\n");
+    printf("\n");
+    printf("Signals: SIGTERM drains and stops, SIGHUP reloads the TLS certificate and the reserved list,\n");
+    printf("SIGUSR2 starts a successor that takes over the listening sockets without dropping connections.\n");
 
 	closelog();
 
@@ -135,6 +535,131 @@ static enum MHD_Result logMHDError(const char *errorMessage) {
     return MHD_NO;                                   // RETURN ERROR CODE
 }
 
+// MICROSECONDS ON THE MONOTONIC CLOCK, FOR DURATIONS
+static long long monotonicMicroseconds (void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+// ***************************************************************************
+// BEGIN REQUEST DEADLINES ***************************************************
+// ***************************************************************************
+
+// DEADLINE OF THE REQUEST THE CURRENT THREAD IS WORKING ON. THE RESOLVER AND DATABASE HELPERS READ IT,
+// SO THEIR SIGNATURES STAY THE SAME FOR THE COMMAND LINE PATHS, WHICH RUN WITHOUT A DEADLINE.
+struct requestDeadlineStruct {
+	long long deadline;			// Microseconds, CLOCK_MONOTONIC. 0 for none.
+	int exceeded;
+};
+
+static _Thread_local struct requestDeadlineStruct requestDeadline = {0, FALSE};
+
+static const char *deadlineStageNames[DEADLINE_STAGE_COUNT] = { "queue", "resolve", "database" };
+
+// PREBUILT 503 FOR REQUESTS THAT RAN OUT OF TIME
+static struct MHD_Response *deadlineResponse = NULL;
+static const char deadlinePage[] = "<html><head><title>Timeout</title></head><body>The request took too long. Please try again in a few seconds.</body></html>";
+
+// START WORKING ON A REQUEST WITH THE GIVEN DEADLINE (0 FOR NONE)
+static void deadlineBegin (long long deadline)
+{
+	requestDeadline.deadline = deadline;
+	requestDeadline.exceeded = FALSE;
+}
+
+// MILLISECONDS LEFT FOR THE CURRENT REQUEST, -1 IF IT HAS NO DEADLINE, 0 IF IT RAN OUT
+static long deadlineRemainingMs (void)
+{
+	if (requestDeadline.deadline == 0) return -1;
+
+	long long remaining = (requestDeadline.deadline - monotonicMicroseconds()) / 1000;
+	return remaining > 0 ? (long)remaining : 0;
+}
+
+// THE CURRENT REQUEST RAN OUT OF TIME IN 'stage'. COUNTED ONCE PER REQUEST.
+static void deadlineExpire (deadlineStage stage)
+{
+	if (requestDeadline.exceeded) return;
+	requestDeadline.exceeded = TRUE;
+	METRIC_ADD(deadlineExceeded[stage], 1);
+}
+
+// TRUE IF THE CURRENT REQUEST RAN OUT OF TIME
+static int deadlineExceeded (void)
+{
+	return requestDeadline.exceeded;
+}
+
+// DEADLINE FOR A NEW REQUEST, BY ROUTE
+static long long requestDeadlineFor (const char *url, const char *method, long long started)
+{
+	int milliseconds = configGlobal.deadlinePage;
+	if (0 == strcasecmp(url, URL_WELL_KNOWN_ATPROTO)) milliseconds = configGlobal.deadlineWellKnown;
+	else if (0 == strcasecmp(method, MHD_HTTP_METHOD_POST)) milliseconds = configGlobal.deadlineRegistration;
+
+	return milliseconds > 0 ? started + milliseconds * 1000LL : 0;
+}
+
+// BUILD THE SHARED TIMEOUT RESPONSE. RETURNS 0 ON SUCCESS.
+int buildDeadlineResponse (void)
+{
+	deadlineResponse = MHD_create_response_from_buffer(sizeof(deadlinePage) - 1, (void *)deadlinePage, MHD_RESPMEM_PERSISTENT);
+	if (!deadlineResponse) return 1;
+
+	MHD_add_response_header(deadlineResponse, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_HTML);
+	MHD_add_response_header(deadlineResponse, MHD_HTTP_HEADER_RETRY_AFTER, SHED_RETRY_AFTER);
+	MHD_add_response_header(deadlineResponse, MHD_HTTP_HEADER_CACHE_CONTROL, "no-store");
+	return 0;
+}
+
+// FREE THE TIMEOUT RESPONSE (AFTER THE DAEMONS STOPPED)
+void freeDeadlineResponse (void)
+{
+	if (deadlineResponse) MHD_destroy_response(deadlineResponse);
+	deadlineResponse = NULL;
+}
+
+// QUEUE THE PREBUILT TIMEOUT RESPONSE
+static enum MHD_Result sendDeadlineResponse (struct MHD_Connection *connection)
+{
+	if (!deadlineResponse) return MHD_NO;
+	return MHD_queue_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE, deadlineResponse);
+}
+
+// SQLITE BUSY HANDLER: RETRY A LOCKED DATABASE WITH A GROWING PAUSE UNTIL THE DEADLINE,
+// OR FOR DATABASE_BUSY_TIMEOUT WITHOUT ONE. RETURNING 0 MAKES THE CALL FAIL WITH SQLITE_BUSY.
+static int databaseBusyHandler (void *unused, int attempts)
+{
+	(void) unused;
+
+	long remaining = deadlineRemainingMs();
+	long pause = attempts < 5 ? 1L << attempts : 25;	// 1, 2, 4, 8, 16, THEN 25 ms
+	if (remaining < 0) remaining = DATABASE_BUSY_TIMEOUT - (long)attempts * 25;
+
+	if (remaining <= 0) {
+		if (requestDeadline.deadline != 0) deadlineExpire(DEADLINE_STAGE_DATABASE);
+		return 0;
+	}
+
+	if (pause > remaining) pause = remaining;
+	struct timespec delay = {0, pause * 1000000L};
+	nanosleep(&delay, NULL);
+	return 1;
+}
+
+// SQLITE PROGRESS HANDLER: INTERRUPT A STATEMENT THAT RUNS PAST THE DEADLINE
+static int databaseProgressHandler (void *unused)
+{
+	(void) unused;
+
+	if (deadlineRemainingMs() != 0) return 0;
+	deadlineExpire(DEADLINE_STAGE_DATABASE);
+	return 1;
+}
+
 
 // ***************************************************************************
 // BEGIN "SECURITY" **********************************************************
@@ -219,15 +744,30 @@ const char *getWellKnownDID (const char *handle)
         return NULL;
     }
 
+	// BOUND THE LOOKUP BY WHAT IS LEFT OF THE REQUEST DEADLINE
+	long timeout = deadlineRemainingMs();
+	if (timeout == 0) {
+		deadlineExpire(DEADLINE_STAGE_RESOLVE);
+		curl_easy_cleanup(curl);
+		return NULL;
+	}
+	if (timeout < 0) timeout = RESOLVER_TIMEOUT;
+
    // SET CURL OPTIONS
 	curl_easy_setopt(curl, CURLOPT_URL, url);                  			// URL TO FETCH
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, timeout < RESOLVER_CONNECT_TIMEOUT ? timeout : RESOLVER_CONNECT_TIMEOUT);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);						// TIMEOUTS WITHOUT SIGALRM, REQUIRED WITH THREADS
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlReceiveData );	// CALLBACK FUNCTION TO STORE DATA
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);      			// PASS THE RESPONSE STRUCT
 
 	// PERFORM THE FILE TRANSFER
+	HANDLED_PROBE1(resolve_start, handle);
 	res = curl_easy_perform(curl);
+	HANDLED_PROBE2(resolve_done, handle, (int)res);
     if (res != CURLE_OK) {
         fprintf(stderr, "CURL: Error from libcurl: %s\n", curl_easy_strerror(res));
+		if (res == CURLE_OPERATION_TIMEDOUT && deadlineRemainingMs() == 0) deadlineExpire(DEADLINE_STAGE_RESOLVE);
         if (response.data) free(response.data);
         curl_easy_cleanup(curl);
         return NULL;
@@ -356,6 +896,13 @@ const char *buildAbsolutePath (const char *baseDirectory, const char *relativePa
     return absolutePath;
 }
 
+// RESOLVE A CONFIGURED FILE NAME AGAINST THE BASE DIRECTORY, UNLESS ABSOLUTE. CALLER MUST FREE.
+char *configFilePath (const char *fileName)
+{
+	if (fileName[0] == '/') return strdup(fileName);
+	return (char *)buildAbsolutePath(baseDirectory, fileName);
+}
+
 // CONSTRUCT GLOBAL PATH FILE NAMES, TO FREE AT END
 int buildAbsoluteDatabasePaths ()
 {
@@ -372,6 +919,50 @@ int buildAbsoluteDatabasePaths ()
 	return 0; // Success
 }
 
+// PATH OF ONE SHARD OF THE USER DATABASE, WITH A SUFFIX WHILE IT IS BEING BUILT. CALLER MUST FREE.
+char *shardDatabasePath (int shard, const char *suffix)
+{
+	char fileName[64];
+	snprintf(fileName, sizeof(fileName), SHARD_DB_FILENAME "%s", shard, suffix);
+	return (char *)buildAbsolutePath(baseDirectory, fileName);
+}
+
+void freeShardDatabasePaths ()
+{
+	for (int i = 0; shardDatabasesGlobal && i < shardCountGlobal; i++) free(shardDatabasesGlobal[i]);
+	free(shardDatabasesGlobal);
+	free((char *)shardIndexDatabaseGlobal);
+	shardDatabasesGlobal = NULL;
+	shardIndexDatabaseGlobal = NULL;
+	shardCountGlobal = 0;
+}
+
+// SPLIT THE USER DATABASE INTO 'shards' FILES, OR KEEP ONE FILE FOR 0 AND 1. RETURNS 0 ON SUCCESS.
+int buildShardDatabasePaths (int shards)
+{
+	freeShardDatabasePaths ();
+	if (shards <= 1) return 0;
+
+	shardDatabasesGlobal = calloc(shards, sizeof(char *));
+	shardIndexDatabaseGlobal = buildAbsolutePath( baseDirectory, SHARD_INDEX_DB_FILENAME );
+	if (!shardDatabasesGlobal || !shardIndexDatabaseGlobal) {
+		free(shardDatabasesGlobal);
+		shardDatabasesGlobal = NULL;
+		return logErrorAndExit ("Error: Memory allocation failure (DB Path)");
+	}
+
+	shardCountGlobal = shards;
+	for (int i = 0; i < shards; i++) {
+		shardDatabasesGlobal[i] = shardDatabasePath(i, "");
+		if (!shardDatabasesGlobal[i]) {
+			freeShardDatabasePaths ();
+			return logErrorAndExit ("Error: Memory allocation failure (DB Path)");
+		}
+	}
+
+	return 0;
+}
+
 // VALIDATE BASE DIRECTORY EXISTS
 static int confirmBaseDirectory(const char *path) {
     if (!path || path[0] != '/') {
@@ -401,6 +992,120 @@ void freeGlobalPaths() {
         free((char *)filterDatabaseGlobal);
         filterDatabaseGlobal = NULL;
     }
+
+	freeShardDatabasePaths ();
+}
+
+// *********************************
+// ********* CONFIGURATION *********
+// *********************************
+
+// TRIM LEADING AND TRAILING WHITESPACE IN PLACE
+static char *trimWhitespace (char *text)
+{
+	while (isspace((unsigned char)*text)) text++;
+
+	char *end = text + strlen(text);
+	while (end > text && isspace((unsigned char)end[-1])) end--;
+	*end = '\0';
+
+	return text;
+}
+
+// APPLY A SINGLE CONFIGURATION OPTION. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+int applyConfigOption (const char *key, const char *value)
+{
+	for (size_t i = 0; i < CONFIG_OPTION_COUNT; i++) {
+		const struct configOptionStruct *option = &configOptions[i];
+		if (strcmp(option->key, key) != 0) continue;
+
+		void *field = (char *)&configGlobal + option->offset;
+
+		if (option->type == CONFIG_INTEGER) {
+			char *end;
+			long number = strtol(value, &end, 10);
+			if (end == value || *end != '\0' || number < option->minimum || number > option->maximum) {
+				fprintf(stderr, "ERROR: Invalid value '%s' for option '%s' (%ld to %ld)\n", value, key, option->minimum, option->maximum);
+				return 1;
+			}
+			*(int *)field = (int)number;
+			return 0;
+		}
+
+		if ((size_t)snprintf((char *)field, CONFIG_VALUE_MAX, "%s", value) >= CONFIG_VALUE_MAX) {
+			fprintf(stderr, "ERROR: Value for option '%s' is too long\n", key);
+			return 1;
+		}
+		return 0;
+	}
+
+	fprintf(stderr, "ERROR: Unknown configuration option '%s'\n", key);
+	return 1;
+}
+
+// SPLIT A 'key=value' STRING (MODIFIED IN PLACE) AND APPLY IT
+static int applyConfigAssignment (char *assignment)
+{
+	char *separator = strchr(assignment, '=');
+	if (!separator) {
+		fprintf(stderr, "ERROR: Expected key=value, found '%s'\n", assignment);
+		return 1;
+	}
+
+	*separator = '\0';
+	return applyConfigOption(trimWhitespace(assignment), trimWhitespace(separator + 1));
+}
+
+// LOAD handled.conf FROM THE BASE DIRECTORY, IF PRESENT. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+int loadConfigFile ()
+{
+	const char *configFile = buildAbsolutePath(baseDirectory, CONFIG_FILENAME);
+	if (!configFile) return logErrorAndExit("Memory allocation failure (config path)");
+
+	FILE *file = fopen(configFile, "r");
+	if (!file) {
+		// THE CONFIGURATION FILE IS OPTIONAL
+		free((char *)configFile);
+		return 0;
+	}
+
+	char line[CONFIG_LINE_MAX];
+	int lineNumber = 0;
+	int failed = 0;
+
+	while (fgets(line, sizeof(line), file)) {
+		lineNumber++;
+		line[strcspn(line, "\n")] = '\0';
+
+		char *content = trimWhitespace(line);
+		// Skip empty lines and lines that start with '#', which are comments
+		if (content[0] == '\0' || content[0] == '#') continue;
+
+		if (applyConfigAssignment(content) != 0) {
+			fprintf(stderr, "ERROR: %s line %d\n", configFile, lineNumber);
+			failed = 1;
+		}
+	}
+
+	fclose(file);
+	free((char *)configFile);
+	return failed;
+}
+
+// APPLY key=value COMMAND LINE ARGUMENTS, WHICH OVERRIDE handled.conf
+int applyConfigArguments (int argc, char *argv[], int first)
+{
+	char assignment[CONFIG_LINE_MAX];
+
+	for (int i = first; i < argc; i++) {
+		// WORK ON A COPY, SO THE PROCESS TITLE (AND WHAT ps SHOWS) STAYS INTACT
+		if ((size_t)snprintf(assignment, sizeof(assignment), "%s", argv[i]) >= sizeof(assignment)) {
+			fprintf(stderr, "ERROR: Argument too long: '%s'\n", argv[i]);
+			return 1;
+		}
+		if (applyConfigAssignment(assignment) != 0) return 1;
+	}
+	return 0;
 }
 
 // HELPER FUNCTION TO REPLACE PLACEHOLDER_ERROR TEXT IN A STRING
@@ -447,107 +1152,566 @@ char* replacePlaceholder(const char *html, const char* placeholder, const char *
 }
 
 // ***************************************************************************
-// BEGIN REGEX AND VALIDATORS ************************************************
+// BEGIN SHARED MAPPINGS *****************************************************
 // ***************************************************************************
 
-// HELPER FUNCTION TO HANDLE REGEX COMPILATION ERRORS
-int handleRegexError(int ret, regex_t *regex, const char *patternName) {
-    size_t errorBufferSize = regerror(ret, regex, NULL, 0); // Get required buffer size
-    char *errorMessage = malloc(errorBufferSize);  // Dynamically allocate memory
-	
-    if (!errorMessage) {
-        return logErrorAndExit ("Memory allocation error for regex error message buffer");
-    }
-
-    regerror(ret, regex, errorMessage, errorBufferSize);  // Populate the error message
-    fprintf(stderr, "Regex compilation error for %s pattern: %s\n", patternName, errorMessage);
-	syslog(LOG_ERR, "Regex compilation error for %s pattern: %s", patternName, errorMessage);
-    free(errorMessage);  // Free allocated memory
-    return 1;
+// ANONYMOUS SHARED MAPPING, INHERITED BY PREFORK WORKERS. RETURNS NULL ON FAILURE.
+void *sharedMappingCreate (size_t size)
+{
+	void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED) {
+		perror("Failed to create shared mapping");
+		return NULL;
+	}
+	return mapping;
 }
 
-// FUNCTION TO COMPILE THE PRINCIPAL REGEXES
-int compileGlobalRegex( ) {
-    int ret;
+// TWO VERSIONS OF A STRUCTURE IN ONE SHARED MAPPING, MADE BEFORE ANY FORK: A CONTROL PAGE, THEN TWO HALVES. ONE
+// PROCESS WRITES, THE OTHERS MAP IT READ ONLY. THE WRITER BUILDS THE NEXT VERSION IN THE HALF NOBODY READS AND
+// PUBLISHES IT BY BUMPING THE GENERATION, THEN GIVES THE OLD HALF'S PAGES BACK. SMALL CHANGES TO THE CURRENT
+// VERSION ARE MADE IN PLACE WHILE THE SEQUENCE IS ODD. A READER NOTES THE SEQUENCE, READS AND READS AGAIN IF THE
+// SEQUENCE MOVED, SO IT NEVER LOCKS OUT THE WRITER. THE HALVES ARE ONLY RESERVED: PAGES COST MEMORY ONCE WRITTEN.
+struct sharedControlStruct {
+	atomic_ullong generation;					// The current version is in half (generation & 1)
+	atomic_ullong sequence;						// Odd while the writer changes the current version
+	atomic_int stale;							// The writer died inside a change
+};
 
-	// Compile DID PLC regex
-	ret = regcomp(&regexDid, VALID_PATTERN_DID_PLC, REG_EXTENDED | REG_ICASE );
-    if ( ret != 0 ) return handleRegexError(ret, &regexDid, "DID");
+struct sharedVersionsStruct {
+	struct sharedControlStruct *control;		// NULL until created
+	unsigned char *halves;
+	size_t halfSize;
+};
 
-	// Compile handle regex
-	ret = regcomp(&regexHandle, VALID_PATTERN_HANDLE, REG_EXTENDED | REG_ICASE );
-    if ( ret != 0 ) return handleRegexError(ret, &regexHandle, "Handle");
-	
-	// Compile label regex
-	ret = regcomp(&regexLabel, VALID_PATTERN_LABEL, REG_EXTENDED | REG_ICASE );
-    if ( ret != 0 ) return handleRegexError(ret, &regexLabel, "Label");	
-	
-	// Compile FULL HANDLE regex
-	ret = regcomp(&regexFullHandle, VALID_PATTERN_FULL_HANDLE, REG_EXTENDED | REG_ICASE );
-    if ( ret != 0 ) return handleRegexError(ret, &regexFullHandle, "Full Handle");	
-	
-	// Compile DID PLC regex
-	ret = regcomp(&regexDidPLC, DID_PLC_SPEC_PATTERN, REG_EXTENDED | REG_ICASE );
-    if ( ret != 0 ) return handleRegexError(ret, &regexDidPLC, "DID PLC Regex");		
-	
-    return 0;  // Success
+// RESERVE TWO HALVES OF 'halfSize' BYTES, HALVED WHILE THE KERNEL REFUSES, DOWN TO SHARED_RESERVE_MINIMUM.
+// RETURNS 0 ON SUCCESS.
+int sharedVersionsCreate (struct sharedVersionsStruct *versions, size_t halfSize)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	for (; halfSize >= SHARED_RESERVE_MINIMUM; halfSize /= 2) {
+		void *mapping = mmap(NULL, page + 2 * halfSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mapping == MAP_FAILED) continue;
+		versions->control = mapping;
+		versions->halves = (unsigned char *)mapping + page;
+		versions->halfSize = halfSize;
+		return 0;
+	}
+	perror("Failed to reserve shared mapping");
+	return 1;
 }
 
-// FUNCTION TO FREE GLOBAL REGEXES (CALLED WHEN PROGRAM EXITS)
-void freeGlobalRegexes() {
-	// FREE COMPILED REGEXS
-    regfree(&regexDid);   // Free DID regex
-    regfree(&regexHandle); // Free handle regex
-    regfree(&regexLabel); // Free label regex
-	regfree(&regexFullHandle); // Free handle regex
-	regfree(&regexDidPLC); // Free handle regex	
+void sharedVersionsFree (struct sharedVersionsStruct *versions)
+{
+	if (versions->control) munmap(versions->control, (size_t)sysconf(_SC_PAGESIZE) + 2 * versions->halfSize);
+	memset(versions, 0, sizeof(*versions));
 }
 
-
-// VALIDATOR FOR IDENTIFIER
-int validateDid(const char *did) {  // RETURNS KEY_VALID = 0 for successful validation
-	if (did == NULL) return KEY_INVALID;
-	
-    if (regexec(&regexDid, did, 0, NULL, 0) != 0) {
-		return KEY_INVALID;
+// THIS PROCESS ONLY READS FROM NOW ON (A PREFORK WORKER THAT IS NOT THE WRITER)
+void sharedVersionsProtect (struct sharedVersionsStruct *versions)
+{
+	if (versions->control && mprotect(versions->control, (size_t)sysconf(_SC_PAGESIZE) + 2 * versions->halfSize, PROT_READ) != 0) {
+		perror("Failed to map shared versions read only");
 	}
-	
-    return KEY_VALID;
 }
 
+static unsigned char *sharedVersionsHalf (const struct sharedVersionsStruct *versions, unsigned long long generation)
+{
+	return versions->halves + (generation & 1) * versions->halfSize;
+}
 
-// VALIDATOR FOR HANDLE
-int validateHandle(const char *did) {  // RETURNS KEY_VALID = 0 for successful validation
-	if (did == NULL) return KEY_INVALID;
-	
-    if (regexec(&regexHandle, did, 0, NULL, 0) != 0) {
-		return KEY_INVALID;
-	}
-	
-    return KEY_VALID;
+// THE HALF THE NEXT VERSION IS BUILT IN (WRITER)
+static unsigned char *sharedVersionsNext (const struct sharedVersionsStruct *versions)
+{
+	return sharedVersionsHalf(versions, atomic_load_explicit(&versions->control->generation, memory_order_relaxed) + 1);
 }
 
-// VALIDATOR FOR LABEL
-int validateLabel(const char *label) {  // RETURNS KEY_VALID = 0 for successful validation
-	if (label == NULL) return KEY_INVALID;
-	
-    if (regexec(&regexLabel, label, 0, NULL, 0) != 0) {
-		return KEY_INVALID;
-	}
-	
-    return KEY_VALID;
+// MAKE THE VERSION BUILT IN THE NEXT HALF CURRENT AND RELEASE THE PAGES OF THE ONE IT REPLACES (WRITER). A READER
+// STILL IN THE OLD HALF SEES THE SEQUENCE MOVE, AND ZEROES WHERE ITS PAGES WERE.
+static void sharedVersionsPublish (struct sharedVersionsStruct *versions)
+{
+	struct sharedControlStruct *control = versions->control;
+	unsigned long long previous = atomic_load_explicit(&control->generation, memory_order_relaxed);
+
+	atomic_store_explicit(&control->generation, previous + 1, memory_order_release);
+	atomic_fetch_add_explicit(&control->sequence, 2, memory_order_release);
+	if (madvise(sharedVersionsHalf(versions, previous), versions->halfSize, MADV_REMOVE) != 0) perror("Failed to release the previous version");
 }
 
-// EXTRACT THE FIRST DID FROM A GIVEN STRING
-void extractDid (const char *input, char *output, size_t output_size) {
-    regmatch_t match[1]; // Array to hold match result
+// BRACKET A CHANGE TO THE CURRENT VERSION IN PLACE (WRITER)
+static void sharedVersionsWriteBegin (struct sharedVersionsStruct *versions)
+{
+	atomic_fetch_add_explicit(&versions->control->sequence, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
 
-    // Execute the regex on the input string using global regexDidPLC
-    if (regexec(&regexDidPLC, input, 1, match, 0) == 0) {
-        // Match found, extract the substring
-        size_t start = match[0].rm_so; // Start of match
-        size_t end = match[0].rm_eo;   // End of match
-        size_t match_length = end - start;
+static void sharedVersionsWriteEnd (struct sharedVersionsStruct *versions)
+{
+	atomic_fetch_add_explicit(&versions->control->sequence, 1, memory_order_release);
+}
+
+// START A READ: WAIT OUT A CHANGE UNDER WAY, PUT THE CURRENT HALF IN '*half' AND RETURN THE SEQUENCE TO CHECK
+static unsigned long long sharedVersionsReadBegin (const struct sharedVersionsStruct *versions, unsigned char **half)
+{
+	unsigned long long sequence;
+	while ((sequence = atomic_load_explicit(&versions->control->sequence, memory_order_acquire)) & 1) sched_yield();
+	*half = sharedVersionsHalf(versions, atomic_load_explicit(&versions->control->generation, memory_order_acquire));
+	return sequence;
+}
+
+// TRUE IF NOTHING CHANGED SINCE THE READ BEGAN, SO WHAT IT FOUND STANDS
+static int sharedVersionsReadValid (const struct sharedVersionsStruct *versions, unsigned long long sequence)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&versions->control->sequence, memory_order_relaxed) == sequence;
+}
+
+// MOVE THE METRICS INTO A SHARED MAPPING (CALL BEFORE FORKING WORKERS)
+int initializeMetrics ()
+{
+	struct metricsStruct *shared = sharedMappingCreate(sizeof(struct metricsStruct));
+	if (!shared) return 1;
+
+	memcpy(shared, metricsGlobal, sizeof(struct metricsStruct));
+	metricsGlobal = shared;
+	return 0;
+}
+
+// ZERO THE GAUGES OF A WORKER THAT EXITED, SO ITS REQUESTS NO LONGER COUNT AS IN FLIGHT (SUPERVISOR, AFTER REAPING IT)
+void clearWorkerGauges (int slot)
+{
+	struct workerGaugeStruct *gauges = &metricsGlobal->workerGauges[slot];
+
+	atomic_store(&gauges->requestsInFlight, 0);
+	for (int lane = 0; lane < LANE_COUNT; lane++) atomic_store(&gauges->laneInFlight[lane], 0);
+	atomic_store(&gauges->laneQueued, 0);
+}
+
+// ADD UP THE GAUGES OF EVERY WORKER SLOT
+static void sumWorkerGauges (unsigned long long *inFlight, unsigned long long *laneInFlight, unsigned long long *laneQueued)
+{
+	*inFlight = *laneQueued = 0;
+	for (int lane = 0; lane < LANE_COUNT; lane++) laneInFlight[lane] = 0;
+
+	for (int slot = 0; slot < MAX_WORKERS; slot++) {
+		const struct workerGaugeStruct *gauges = &metricsGlobal->workerGauges[slot];
+		*inFlight += atomic_load_explicit(&gauges->requestsInFlight, memory_order_relaxed);
+		for (int lane = 0; lane < LANE_COUNT; lane++) laneInFlight[lane] += atomic_load_explicit(&gauges->laneInFlight[lane], memory_order_relaxed);
+		*laneQueued += atomic_load_explicit(&gauges->laneQueued, memory_order_relaxed);
+	}
+}
+
+// RELEASE THE SHARED METRICS (CALLED WHEN PROGRAM EXITS)
+void freeMetrics ()
+{
+	if (metricsGlobal == &metricsFallback) return;
+	munmap(metricsGlobal, sizeof(struct metricsStruct));
+	metricsGlobal = &metricsFallback;
+}
+
+// ***************************************************************************
+// BEGIN TEXT BUFFER *********************************************************
+// ***************************************************************************
+
+// APPEND FORMATTED TEXT TO A GROWABLE BUFFER. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+int textBufferAppend (struct textBuffer *buffer, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	int needed = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if (needed < 0) return 1;
+
+	if (buffer->length + (size_t)needed + 1 > buffer->capacity) {
+		size_t newCapacity = buffer->capacity ? buffer->capacity * 2 : 1024;
+		while (newCapacity < buffer->length + (size_t)needed + 1) newCapacity *= 2;
+
+		char *newData = realloc(buffer->data, newCapacity);
+		if (!newData) {
+			fprintf(stderr, "ERROR: Memory allocation failed (textBufferAppend)\n");
+			return 1;
+		}
+		buffer->data = newData;
+		buffer->capacity = newCapacity;
+	}
+
+	va_start(args, format);
+	vsnprintf(buffer->data + buffer->length, buffer->capacity - buffer->length, format, args);
+	va_end(args);
+	buffer->length += (size_t)needed;
+
+	return 0;
+}
+
+// APPEND 'text' AS A QUOTED JSON STRING. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+int textBufferAppendJson (struct textBuffer *buffer, const char *text)
+{
+	int failed = textBufferAppend(buffer, "\"");
+
+	for (const unsigned char *c = (const unsigned char *)text; *c && !failed; c++) {
+		if (*c == '"' || *c == '\\') failed |= textBufferAppend(buffer, "\\%c", *c);
+		else if (*c < 0x20) failed |= textBufferAppend(buffer, "\\u%04x", *c);
+		else failed |= textBufferAppend(buffer, "%c", *c);
+	}
+
+	return failed | textBufferAppend(buffer, "\"");
+}
+
+// ***************************************************************************
+// BEGIN COMPRESSION AND STATIC PAGE CACHE ***********************************
+// ***************************************************************************
+
+// EVERY PAGE SERVED FROM DISK, LOADED AND COMPRESSED ONCE AT STARTUP
+static struct staticPageStruct staticPages[] = {
+	{ .filename = STATIC_REGISTER, .contentType = CONTENT_HTML, .statusCode = MHD_HTTP_OK },
+	{ .filename = STATIC_ACTIVE, .contentType = CONTENT_HTML, .statusCode = MHD_HTTP_OK },
+	{ .filename = STATIC_RESERVED, .contentType = CONTENT_HTML, .statusCode = MHD_HTTP_OK },
+	{ .filename = STATIC_NOTFOUND, .contentType = CONTENT_HTML, .statusCode = MHD_HTTP_NOT_FOUND },
+	{ .filename = STATIC_ERROR, .contentType = CONTENT_HTML, .statusCode = MHD_HTTP_OK, .isTemplate = TRUE },
+	{ .filename = STATIC_SUCCESS, .contentType = CONTENT_HTML, .statusCode = MHD_HTTP_OK, .isTemplate = TRUE },
+};
+
+#define STATIC_PAGE_COUNT (sizeof(staticPages) / sizeof(staticPages[0]))
+
+static const char *encodingNames[ENCODING_COUNT] = { "identity", ENCODING_NAME_GZIP, ENCODING_NAME_BROTLI };
+
+// GZIP A BUFFER. RETURNS A BUFFER THE CALLER MUST FREE, OR NULL ON FAILURE.
+char *compressGzip (const char *input, size_t inputSize, int level, size_t *outputSize)
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+
+	// 15 WINDOW BITS + 16 SELECTS THE GZIP WRAPPER INSTEAD OF THE ZLIB ONE
+	if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		fprintf(stderr, "ERROR: Unable to initialize gzip stream\n");
+		return NULL;
+	}
+
+	uLong bound = deflateBound(&stream, inputSize);
+	char *output = malloc(bound);
+	if (!output) {
+		deflateEnd(&stream);
+		return NULL;
+	}
+
+	stream.next_in = (Bytef *)input;
+	stream.avail_in = inputSize;
+	stream.next_out = (Bytef *)output;
+	stream.avail_out = bound;
+
+	int rc = deflate(&stream, Z_FINISH);
+	*outputSize = stream.total_out;
+	deflateEnd(&stream);
+
+	if (rc != Z_STREAM_END) {
+		fprintf(stderr, "ERROR: Gzip compression failed (%d)\n", rc);
+		free(output);
+		return NULL;
+	}
+
+	return output;
+}
+
+#ifdef HANDLED_BROTLI
+// BROTLI COMPRESS A BUFFER. RETURNS A BUFFER THE CALLER MUST FREE, OR NULL ON FAILURE.
+char *compressBrotli (const char *input, size_t inputSize, int quality, size_t *outputSize)
+{
+	size_t bound = BrotliEncoderMaxCompressedSize(inputSize);
+	if (bound == 0) return NULL;
+
+	char *output = malloc(bound);
+	if (!output) return NULL;
+
+	*outputSize = bound;
+	if (!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, inputSize,
+								(const uint8_t *)input, outputSize, (uint8_t *)output)) {
+		fprintf(stderr, "ERROR: Brotli compression failed\n");
+		free(output);
+		return NULL;
+	}
+
+	return output;
+}
+#endif
+
+// COMPRESS WITH THE GIVEN ENCODING, 'atLoad' PICKS THE SLOW BUT SMALLEST SETTINGS. CALLER MUST FREE.
+char *compressBuffer (contentEncoding encoding, const char *input, size_t inputSize, int atLoad, size_t *outputSize)
+{
+	switch (encoding) {
+		case ENCODING_GZIP:
+			return compressGzip(input, inputSize, atLoad ? COMPRESSION_GZIP_LEVEL_STATIC : COMPRESSION_GZIP_LEVEL_DYNAMIC, outputSize);
+		#ifdef HANDLED_BROTLI
+		case ENCODING_BROTLI:
+			return compressBrotli(input, inputSize, atLoad ? COMPRESSION_BROTLI_QUALITY_STATIC : COMPRESSION_BROTLI_QUALITY_DYNAMIC, outputSize);
+		#endif
+		default:
+			return NULL;
+	}
+}
+
+// PARSE 'Accept-Encoding' INTO A BITMASK OF ACCEPTED ENCODINGS (IDENTITY IS ALWAYS ACCEPTED)
+unsigned int acceptedEncodings (struct MHD_Connection *connection)
+{
+	unsigned int accepted = 1u << ENCODING_IDENTITY;
+	unsigned int rejected = 0;
+	int wildcard = FALSE;
+
+	const char *header = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+	if (!header) return accepted;
+
+	const char *cursor = header;
+	while (*cursor) {
+		// SKIP SEPARATORS AND FIND THE CODING NAME
+		while (*cursor == ' ' || *cursor == '\t' || *cursor == ',') cursor++;
+		if (!*cursor) break;
+
+		const char *name = cursor;
+		while (*cursor && *cursor != ',' && *cursor != ';' && *cursor != ' ' && *cursor != '\t') cursor++;
+		size_t nameLength = cursor - name;
+
+		// OPTIONAL QUALITY VALUE, 'q=0' MEANS NOT ACCEPTABLE
+		double quality = 1.0;
+		const char *end = strchr(cursor, ',');
+		if (!end) end = cursor + strlen(cursor);
+		const char *q = strstr(cursor, "q=");
+		if (q && q < end) quality = strtod(q + 2, NULL);
+		cursor = end;
+
+		unsigned int bit = 0;
+		if (nameLength == 4 && strncasecmp(name, ENCODING_NAME_GZIP, 4) == 0) bit = 1u << ENCODING_GZIP;
+		else if (nameLength == 2 && strncasecmp(name, ENCODING_NAME_BROTLI, 2) == 0) bit = 1u << ENCODING_BROTLI;
+		else if (nameLength == 1 && name[0] == '*') {
+			wildcard = quality > 0.0;
+			continue;
+		}
+
+		if (quality > 0.0) accepted |= bit;
+		else rejected |= bit;
+	}
+
+	if (wildcard) accepted |= ((1u << ENCODING_COUNT) - 1) & ~rejected;
+	return accepted & ~rejected;
+}
+
+// PICK THE MOST PREFERRED ENCODING THE CLIENT ACCEPTS AND THE PAGE HAS
+static contentEncoding selectEncoding (unsigned int accepted, const struct staticPageStruct *page)
+{
+	for (int encoding = ENCODING_COUNT - 1; encoding > ENCODING_IDENTITY; encoding--) {
+		if ((accepted & (1u << encoding)) && page->body[encoding]) return (contentEncoding)encoding;
+	}
+	return ENCODING_IDENTITY;
+}
+
+// FIND A CACHED PAGE BY ITS RELATIVE FILE NAME, NULL IF IT IS NOT CACHED
+static struct staticPageStruct *findStaticPage (const char *filename)
+{
+	for (size_t i = 0; i < STATIC_PAGE_COUNT; i++) {
+		if (strcmp(staticPages[i].filename, filename) == 0 && staticPages[i].body[ENCODING_IDENTITY]) return &staticPages[i];
+	}
+	return NULL;
+}
+
+// BUILD A REUSABLE RESPONSE FOR ONE ENCODING OF A STATIC PAGE
+static struct MHD_Response *buildStaticResponse (struct staticPageStruct *page, contentEncoding encoding, int hasVariants)
+{
+	struct MHD_Response *response = MHD_create_response_from_buffer(page->bodySize[encoding], page->body[encoding], MHD_RESPMEM_PERSISTENT);
+	if (!response) return NULL;
+
+	if (page->contentType) MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, page->contentType);
+	if (encoding != ENCODING_IDENTITY) MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING, encodingNames[encoding]);
+	if (hasVariants) MHD_add_response_header(response, MHD_HTTP_HEADER_VARY, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+
+	return response;
+}
+
+// LOAD EVERY STATIC PAGE AND BUILD ITS COMPRESSED VARIANTS. PAGES THAT FAIL TO LOAD ARE READ FROM DISK PER REQUEST.
+int loadStaticPageCache ()
+{
+	for (size_t i = 0; i < STATIC_PAGE_COUNT; i++) {
+		struct staticPageStruct *page = &staticPages[i];
+
+		page->body[ENCODING_IDENTITY] = readFile(page->filename);
+		if (!page->body[ENCODING_IDENTITY]) {
+			fprintf(stderr, "WARNING: Unable to cache '%s', it will be read on every request\n", page->filename);
+			syslog(LOG_WARNING, "Unable to cache '%s', it will be read on every request", page->filename);
+			continue;
+		}
+		page->bodySize[ENCODING_IDENTITY] = strlen(page->body[ENCODING_IDENTITY]);
+
+		// TEMPLATES ONLY KEEP THE RAW TEXT, BUT MEASURE HOW WELL THEY COMPRESS TO DECIDE ON THE FLY COMPRESSION
+		if (page->isTemplate) {
+			size_t compressedSize;
+			char *compressed = compressBuffer(ENCODING_GZIP, page->body[ENCODING_IDENTITY], page->bodySize[ENCODING_IDENTITY], FALSE, &compressedSize);
+			if (compressed) {
+				page->compressTemplate = compressedSize <= page->bodySize[ENCODING_IDENTITY] * COMPRESSION_MAX_RATIO;
+				free(compressed);
+			}
+			#ifdef VERBOSE_FLAG
+			printf("CACHE: Template '%s' loaded (%zu bytes, compress on the fly: %s)\n", page->filename,
+					page->bodySize[ENCODING_IDENTITY], page->compressTemplate ? "yes" : "no");
+			#endif
+			continue;
+		}
+
+		// KEEP A COMPRESSED VARIANT ONLY IF IT IS ACTUALLY SMALLER
+		for (int encoding = ENCODING_GZIP; encoding < ENCODING_COUNT; encoding++) {
+			size_t compressedSize;
+			char *compressed = compressBuffer((contentEncoding)encoding, page->body[ENCODING_IDENTITY], page->bodySize[ENCODING_IDENTITY], TRUE, &compressedSize);
+			if (!compressed) continue;
+			if (compressedSize >= page->bodySize[ENCODING_IDENTITY]) {
+				free(compressed);
+				continue;
+			}
+			page->body[encoding] = compressed;
+			page->bodySize[encoding] = compressedSize;
+		}
+	}
+
+	// BUILD THE REUSABLE RESPONSES. THE BODIES ARE NEVER WRITTEN AGAIN, SO PREFORK WORKERS KEEP SHARING THE PAGES
+	// THEY INHERIT COPY-ON-WRITE
+	for (size_t i = 0; i < STATIC_PAGE_COUNT; i++) {
+		struct staticPageStruct *page = &staticPages[i];
+		if (page->isTemplate || !page->body[ENCODING_IDENTITY]) continue;
+
+		int hasVariants = page->body[ENCODING_GZIP] || page->body[ENCODING_BROTLI];
+		for (int encoding = ENCODING_IDENTITY; encoding < ENCODING_COUNT; encoding++) {
+			if (!page->body[encoding]) continue;
+			page->response[encoding] = buildStaticResponse(page, (contentEncoding)encoding, hasVariants);
+			if (!page->response[encoding]) return logErrorAndExit("Unable to build static page response");
+		}
+
+		printf("CACHE: '%s' loaded (%zu bytes, gzip %zu, br %zu)\n", page->filename, page->bodySize[ENCODING_IDENTITY],
+				page->bodySize[ENCODING_GZIP], page->bodySize[ENCODING_BROTLI]);
+	}
+
+	return 0;
+}
+
+// FREE THE STATIC PAGE CACHE (CALLED WHEN PROGRAM EXITS)
+void freeStaticPageCache ()
+{
+	for (size_t i = 0; i < STATIC_PAGE_COUNT; i++) {
+		for (int encoding = ENCODING_IDENTITY; encoding < ENCODING_COUNT; encoding++) {
+			if (staticPages[i].response[encoding]) MHD_destroy_response(staticPages[i].response[encoding]);
+			free(staticPages[i].body[encoding]);
+			staticPages[i].response[encoding] = NULL;
+			staticPages[i].body[encoding] = NULL;
+			staticPages[i].bodySize[encoding] = 0;
+		}
+	}
+}
+
+// COUNT A RESPONSE AND ITS COMPRESSION SAVINGS
+static void countEncodedResponse (contentEncoding encoding, size_t identitySize, size_t sentSize)
+{
+	METRIC_ADD(encodedResponses[encoding], 1);
+	if (encoding == ENCODING_IDENTITY) return;
+	METRIC_ADD(compressionInputBytes, identitySize);
+	METRIC_ADD(compressionOutputBytes, sentSize);
+}
+
+// ***************************************************************************
+// BEGIN REGEX AND VALIDATORS ************************************************
+// ***************************************************************************
+
+// HELPER FUNCTION TO HANDLE REGEX COMPILATION ERRORS
+int handleRegexError(int ret, regex_t *regex, const char *patternName) {
+    size_t errorBufferSize = regerror(ret, regex, NULL, 0); // Get required buffer size
+    char *errorMessage = malloc(errorBufferSize);  // Dynamically allocate memory
+	
+    if (!errorMessage) {
+        return logErrorAndExit ("Memory allocation error for regex error message buffer");
+    }
+
+    regerror(ret, regex, errorMessage, errorBufferSize);  // Populate the error message
+    fprintf(stderr, "Regex compilation error for %s pattern: %s\n", patternName, errorMessage);
+	syslog(LOG_ERR, "Regex compilation error for %s pattern: %s", patternName, errorMessage);
+    free(errorMessage);  // Free allocated memory
+    return 1;
+}
+
+// FUNCTION TO COMPILE THE PRINCIPAL REGEXES
+int compileGlobalRegex( ) {
+    int ret;
+
+	// Compile DID PLC regex
+	ret = regcomp(&regexDid, VALID_PATTERN_DID_PLC, REG_EXTENDED | REG_ICASE );
+    if ( ret != 0 ) return handleRegexError(ret, &regexDid, "DID");
+
+	// Compile handle regex
+	ret = regcomp(&regexHandle, VALID_PATTERN_HANDLE, REG_EXTENDED | REG_ICASE );
+    if ( ret != 0 ) return handleRegexError(ret, &regexHandle, "Handle");
+	
+	// Compile label regex
+	ret = regcomp(&regexLabel, VALID_PATTERN_LABEL, REG_EXTENDED | REG_ICASE );
+    if ( ret != 0 ) return handleRegexError(ret, &regexLabel, "Label");	
+	
+	// Compile FULL HANDLE regex
+	ret = regcomp(&regexFullHandle, VALID_PATTERN_FULL_HANDLE, REG_EXTENDED | REG_ICASE );
+    if ( ret != 0 ) return handleRegexError(ret, &regexFullHandle, "Full Handle");	
+	
+	// Compile DID PLC regex
+	ret = regcomp(&regexDidPLC, DID_PLC_SPEC_PATTERN, REG_EXTENDED | REG_ICASE );
+    if ( ret != 0 ) return handleRegexError(ret, &regexDidPLC, "DID PLC Regex");		
+	
+    return 0;  // Success
+}
+
+// FUNCTION TO FREE GLOBAL REGEXES (CALLED WHEN PROGRAM EXITS)
+void freeGlobalRegexes() {
+	// FREE COMPILED REGEXS
+    regfree(&regexDid);   // Free DID regex
+    regfree(&regexHandle); // Free handle regex
+    regfree(&regexLabel); // Free label regex
+	regfree(&regexFullHandle); // Free handle regex
+	regfree(&regexDidPLC); // Free handle regex	
+}
+
+
+// VALIDATOR FOR IDENTIFIER
+int validateDid(const char *did) {  // RETURNS KEY_VALID = 0 for successful validation
+	if (did == NULL) return KEY_INVALID;
+	
+    if (regexec(&regexDid, did, 0, NULL, 0) != 0) {
+		return KEY_INVALID;
+	}
+	
+    return KEY_VALID;
+}
+
+
+// VALIDATOR FOR HANDLE
+int validateHandle(const char *did) {  // RETURNS KEY_VALID = 0 for successful validation
+	if (did == NULL) return KEY_INVALID;
+	
+    if (regexec(&regexHandle, did, 0, NULL, 0) != 0) {
+		return KEY_INVALID;
+	}
+	
+    return KEY_VALID;
+}
+
+// VALIDATOR FOR LABEL
+int validateLabel(const char *label) {  // RETURNS KEY_VALID = 0 for successful validation
+	if (label == NULL) return KEY_INVALID;
+	
+    if (regexec(&regexLabel, label, 0, NULL, 0) != 0) {
+		return KEY_INVALID;
+	}
+	
+    return KEY_VALID;
+}
+
+// EXTRACT THE FIRST DID FROM A GIVEN STRING
+void extractDid (const char *input, char *output, size_t output_size) {
+    regmatch_t match[1]; // Array to hold match result
+
+    // Execute the regex on the input string using global regexDidPLC
+    if (regexec(&regexDidPLC, input, 1, match, 0) == 0) {
+        // Match found, extract the substring
+        size_t start = match[0].rm_so; // Start of match
+        size_t end = match[0].rm_eo;   // End of match
+        size_t match_length = end - start;
 
         if (match_length < output_size) {
             strncpy(output, input + start, match_length);
@@ -563,21 +1727,43 @@ void extractDid (const char *input, char *output, size_t output_size) {
 }
 
 
-// REMOVE DOMAIN NAME FROM THE HOSTNAME
+// NORMALIZE A HOST HEADER: LOWERCASE, PORT REMOVED. MATCHES WHAT NGINX DOES WITH '~^(?<handle>.+)\.DOMAIN\.TLD$'.
+// RETURNS NULL UNLESS THE HOST IS THE DOMAIN ITSELF OR ONE OF ITS SUBDOMAINS. CALLER MUST FREE THE RETURNED POINTER.
+char* normalizeHost(const char *hostHeader) {
+    if (!hostHeader || !domainName) return NULL;
+
+    // DROP THE PORT, IF ANY
+    size_t hostLength = strcspn(hostHeader, ":");
+    size_t domainLength = strlen(domainName);
+    if (hostLength == 0 || hostLength < domainLength) return NULL;
+
+    // THE HOST MUST END WITH THE DOMAIN NAME, PRECEDED BY A '.' UNLESS IT IS THE DOMAIN ITSELF
+    const char *suffix = hostHeader + hostLength - domainLength;
+    if (strncasecmp(suffix, domainName, domainLength) != 0) return NULL;
+    if (hostLength > domainLength && (hostLength == domainLength + 1 || suffix[-1] != '.')) return NULL;
+
+    char *host = malloc(hostLength + 1);
+    if (!host) return NULL;
+
+    for (size_t i = 0; i < hostLength; i++) host[i] = (char)tolower((unsigned char)hostHeader[i]);
+    host[hostLength] = '\0';
+
+    return host; // CALLER MUST FREE
+}
+
+// REMOVE DOMAIN NAME FROM A NORMALIZED HOSTNAME (SEE normalizeHost)
 // CALLER MUST FREE THE RETURNED POINTER
 char* removeDomainName(const char *host) {
     // ENSURE HOST AND DOMAINNAME ARE VALID
     if (!host || !domainName) return NULL;
 
-    // Find the domain name in the host
-    const char *domainStart = strcasestr(host, domainName);
-    if (!domainStart) return NULL; // Domain not found
-
     size_t hostLength = strlen(host);
     size_t domainLength = strlen(domainName);
 
-    // Validate structure: must have at least one label + '.' before the domain
-    if (hostLength <= domainLength + 1 || *(domainStart - 1) != '.') return NULL;
+    // Validate structure: must have at least one label + '.' before the domain, and end with the domain
+    if (hostLength <= domainLength + 1) return NULL;
+    const char *domainStart = host + hostLength - domainLength;
+    if (strcasecmp(domainStart, domainName) != 0 || *(domainStart - 1) != '.') return NULL;
 
     // Calculate the label length (excluding '.' and domain name)
     size_t labelLength = domainStart - host - 1;
@@ -609,6 +1795,10 @@ sqlite3 *databaseOpen(const char *dbFile) {
         if (db) sqlite3_close(db); // Ensure cleanup in case of partial initialization
         return NULL;
     }
+
+	// WAIT FOR LOCKS AND RUN STATEMENTS ONLY WITHIN THE REQUEST DEADLINE
+	sqlite3_busy_handler(db, databaseBusyHandler, NULL);
+	if (deadlineRemainingMs() >= 0) sqlite3_progress_handler(db, DATABASE_PROGRESS_STEPS, databaseProgressHandler, NULL);
 	
     return db;
 }
@@ -617,10 +1807,10 @@ sqlite3 *databaseOpen(const char *dbFile) {
 sqlite3_stmt *databasePrepareStatement (sqlite3 *db, const char *sql) {
 	sqlite3_stmt *stmt;
 	
+	// THE CALLER OWNS 'db' AND CLOSES IT, ON FAILURE TOO
 	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
 		fprintf(stderr, "Query SQL preparation error: %s\n", sqlite3_errmsg(db));
         sqlite3_finalize(stmt);
-		sqlite3_close(db);
         return NULL;
     }
 	
@@ -676,840 +1866,7467 @@ int databaseGenericSingularQuery (const char *dbPath, const char *sql, const cha
 }
 
 
-// ***************************************************************************
-// BEGIN HANDLED SPECIFIC DATABASE FUNCTIONS ********************************
-// ***************************************************************************
+// *********************************************
+// ********* HANDLE INDEX **********************
+// *********************************************
 
+// HANDLE TO DID MAP IN MEMORY, BOTH WAYS, SIZED FOR TENS OF MILLIONS OF USERS. A REPLICA SERVES WELL-KNOWN LOOKUPS
+// FROM IT, THE PRIMARY ANSWERS REVERSE LOOKUPS AND CATCHES DUPLICATE REGISTRATIONS WITH IT. RECORDS ARE COLUMNS:
+// A DID:PLC IS KEPT AS ITS 15 DECODED BASE32 BYTES, A HANDLE AS ITS LABEL (THE DOMAIN SUFFIX STRIPPED), PREFIXED
+// BY ITS LENGTH, IN ONE STRING ARENA. TWO HASH TABLES, BY HANDLE AND BY DID, HOLD RECORD NUMBERS WITH LINEAR
+// PROBING. A REMOVED RECORD IS DEAD UNTIL THE NEXT REBUILD COMPACTS THE COLUMNS. UNDER 64 BYTES A RECORD WITH
+// SLACK, SEE /metrics. EVERY PROCESS MAPS THE SAME COPY (SEE sharedVersionsCreate): ONE PROCESS, THE ONLY ONE OR
+// PREFORK WORKER 0, FOLLOWS THE CHANGE LOG INTO IT, THE OTHER WORKERS ONLY READ. READERS CHECK EVERY RECORD
+// NUMBER AND OFFSET AGAINST THE GENERATION'S CAPACITIES, SO A READ RACING THE WRITER GETS A WRONG ANSWER, WHICH
+// THE SEQUENCE CHECK THROWS AWAY, NEVER A FAULT.
+#define INDEX_SLOT_EMPTY		0				// Slots hold record number + 1
+#define INDEX_SLOT_DELETED		UINT32_MAX
+#define INDEX_RECORD_DEAD		UINT32_MAX		// In place of a label offset
+#define INDEX_KEY_FULL			0x80			// Length byte flag, a handle outside our domain kept whole
+#define INDEX_FLAG_LOCKED		0x01
+
+// ONE GENERATION OF THE INDEX FILLS ONE HALF OF handleIndexVersions: THIS HEADER, THEN THE TWO TABLES, THE LABEL
+// OFFSETS, THE DIDS, THE FLAGS AND THE ARENA. THE CAPACITIES ARE FIXED FOR A GENERATION, A REBUILD STARTS THE NEXT.
+struct handleIndexHeaderStruct {
+	size_t slotCapacity;						// A power of two
+	size_t recordCapacity;
+	size_t arenaCapacity;
+	size_t slotsUsed;							// Records and tombstones
+	size_t didSlotsUsed;
+	size_t records;								// Live and dead
+	size_t live;
+	size_t arenaLength;
+	long long sequence;							// Change log sequence the index reflects
+};
 
-// INITIALIZE DATABASE, RETURNS DATABASE_SUCCESS 0 IF SUCESSFUL, DATABASE_ERROR 1 IF IT FAILED.
-int initializeUserDatabase( ) {
-	char *err_msg = 0;
-    int rc;
-	
-    sqlite3 *db = databaseOpen(principalDatabaseGlobal);
-    if (!db) {
-        return DATABASE_ERROR;
-    }
+// A GENERATION AS THIS PROCESS SEES IT
+struct handleIndexStruct {
+	struct handleIndexHeaderStruct *header;
+	uint32_t *slots;							// By handle
+	uint32_t *didSlots;							// By DID, the same capacity
+	uint32_t *labels;							// Arena offset of each record's label
+	uint8_t (*dids)[DID_PLC_PACKED_SIZE];
+	uint8_t *flags;
+	unsigned char *arena;						// Length byte, then the key
+	size_t slotCapacity;						// Copied from the header, which a reader must not trust
+	size_t recordCapacity;
+	size_t arenaCapacity;
+};
 
-	// SQL COMMENTARY: ADDITIONAL INDEXING IS UNNECESSARY SINCE 'did' COLUMN IS UNIQUE
-	// VIEW THE INDEX LIST USING: PRAGMA index_list(did_plc_users);
-    char *sqlCreateTable = "CREATE TABLE IF NOT EXISTS did_plc_users ("
-                "handle TEXT PRIMARY KEY, "				// HOST / HANDLE, e.g., 'myhandle.baysky.social'
-				"did TEXT NOT NULL UNIQUE, "
-				"label TEXT NOT NULL UNIQUE, "			// LABEL, e.g., 'myhandle'
-				"domain TEXT NOT NULL, "				// DOMAIN NAME, e.g., 'baysky.social'
-                "token TEXT NOT NULL, "
-				"email TEXT, "
-				"locked BOOLEAN DEFAULT 0, "
-				"notes TEXT,"
-				"creation_time TIMESTAMP DEFAULT CURRENT_TIMESTAMP);";
-
-    rc = sqlite3_exec(db, sqlCreateTable, 0, 0, &err_msg);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "ERROR: Principal User Table creation failed: %s\n", err_msg);
+static struct sharedVersionsStruct handleIndexVersions;
+static struct handleIndexStruct handleIndex;	// The writer's view of the current generation
+static pthread_mutex_t handleIndexWriteLock = PTHREAD_MUTEX_INITIALIZER;
+static int handleIndexLoaded = FALSE;
+static int handleIndexWriter = TRUE;			// The only process, or prefork worker 0
+
+// 'did:plc:' AND 24 BASE32 CHARACTERS (RFC 4648, a-z2-7) TO 15 BYTES. RETURNS 0 ON SUCCESS.
+static int packDidPlc (const char *did, uint8_t *packed)
+{
+	size_t prefixLength = strlen(DID_PLC_PREFIX);
+	if (strncasecmp(did, DID_PLC_PREFIX, prefixLength) != 0 || strlen(did) != MAX_SIZE_DID_PLC) return 1;
+
+	uint32_t buffer = 0;
+	int bits = 0;
+	size_t out = 0;
+	for (const char *c = did + prefixLength; *c; c++) {
+		int value;
+		char lower = (char)tolower((unsigned char)*c);
+		if (lower >= 'a' && lower <= 'z') value = lower - 'a';
+		else if (lower >= '2' && lower <= '7') value = lower - '2' + 26;
+		else return 1;
+
+		buffer = (buffer << 5) | (uint32_t)value;
+		bits += 5;
+		if (bits >= 8) {
+			bits -= 8;
+			packed[out++] = (uint8_t)(buffer >> bits);
+		}
+	}
+	return 0;
+}
+
+// THE REVERSE OF packDidPlc. 'did' HOLDS MAX_SIZE_DID_PLC + 1 BYTES.
+static void unpackDidPlc (const uint8_t *packed, char *did)
+{
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz234567";
+	size_t prefixLength = strlen(DID_PLC_PREFIX);
+	memcpy(did, DID_PLC_PREFIX, prefixLength);
+
+	uint32_t buffer = 0;
+	int bits = 0;
+	char *out = did + prefixLength;
+	for (size_t i = 0; i < DID_PLC_PACKED_SIZE; i++) {
+		buffer = (buffer << 8) | packed[i];
+		bits += 8;
+		while (bits >= 5) {
+			bits -= 5;
+			*out++ = alphabet[(buffer >> bits) & 31];
+		}
+	}
+	*out = '\0';
+}
+
+// THE KEY OF A HANDLE IS ITS LABEL WHEN IT IS UNDER OUR DOMAIN, OTHERWISE THE WHOLE HANDLE FLAGGED INDEX_KEY_FULL.
+// SETS '*header' TO THE LENGTH BYTE AND RETURNS THE KEY LENGTH, OR 0 WHEN IT DOES NOT FIT THE LENGTH BYTE.
+static size_t handleIndexKey (const char *handle, unsigned char *header)
+{
+	size_t length = strlen(handle);
+	size_t domainLength = domainName ? strlen(domainName) : 0;
+
+	if (domainLength > 0 && length > domainLength + 1 && handle[length - domainLength - 1] == '.' &&
+		strcasecmp(handle + length - domainLength, domainName) == 0) {
+		length -= domainLength + 1;
+		*header = (unsigned char)length;
+	} else *header = (unsigned char)(length | INDEX_KEY_FULL);
+
+	return length < INDEX_KEY_FULL ? length : 0;
+}
+
+static uint64_t handleIndexHash (unsigned char header, const void *key, size_t length)
+{
+	const unsigned char *bytes = key;
+	uint64_t hash = (14695981039346656037ULL ^ header) * 1099511628211ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// PLACE A GENERATION WITH THESE CAPACITIES IN 'half'. RETURNS 0 ON SUCCESS, 1 IF IT DOES NOT FIT THE HALF.
+static int handleIndexMap (unsigned char *half, size_t slotCapacity, size_t recordCapacity, size_t arenaCapacity, struct handleIndexStruct *index)
+{
+	size_t room = handleIndexVersions.halfSize;
+	size_t offset = sizeof(struct handleIndexHeaderStruct);
+	if (slotCapacity > room || recordCapacity > room || arenaCapacity > room) return 1;
+	size_t slotBytes = slotCapacity * sizeof(uint32_t);
+	size_t recordBytes = recordCapacity * sizeof(uint32_t);
+	if (offset + 2 * slotBytes + recordBytes + recordCapacity * (DID_PLC_PACKED_SIZE + sizeof(uint8_t)) + arenaCapacity > room) return 1;
+
+	index->header = (struct handleIndexHeaderStruct *)half;
+	index->slots = (uint32_t *)(half + offset);
+	index->didSlots = (uint32_t *)(half + offset + slotBytes);
+	index->labels = (uint32_t *)(half + offset + 2 * slotBytes);
+	index->dids = (uint8_t (*)[DID_PLC_PACKED_SIZE])(half + offset + 2 * slotBytes + recordBytes);
+	index->flags = half + offset + 2 * slotBytes + recordBytes + recordCapacity * DID_PLC_PACKED_SIZE;
+	index->arena = index->flags + recordCapacity;
+	index->slotCapacity = slotCapacity;
+	index->recordCapacity = recordCapacity;
+	index->arenaCapacity = arenaCapacity;
+	return 0;
+}
+
+// VIEW THE GENERATION IN 'half' AS ITS HEADER DESCRIBES IT, OR AS EMPTY IF THE HEADER DOES NOT DESCRIBE ONE THAT FITS
+static void handleIndexView (unsigned char *half, struct handleIndexStruct *index)
+{
+	const struct handleIndexHeaderStruct *header = (const struct handleIndexHeaderStruct *)half;
+	size_t slotCapacity = header->slotCapacity;
+
+	if ((slotCapacity & (slotCapacity - 1)) != 0 ||
+		handleIndexMap(half, slotCapacity, header->recordCapacity, header->arenaCapacity, index) != 0) handleIndexMap(half, 0, 0, 0, index);
+}
+
+// LENGTH BYTE AND KEY OF A RECORD, THEIR SIZE IN '*size'. NULL IF THEY DO NOT LIE IN THE ARENA: A DEAD RECORD, OR A
+// READ RACING A REBUILD.
+static const unsigned char *handleIndexLabel (const struct handleIndexStruct *index, uint32_t record, size_t *size)
+{
+	size_t offset = index->labels[record];
+	if (offset >= index->arenaCapacity) return NULL;
+
+	*size = 1 + (size_t)(index->arena[offset] & ~INDEX_KEY_FULL);
+	return offset + *size <= index->arenaCapacity ? index->arena + offset : NULL;
+}
+
+// SLOT HOLDING THE KEY, OR THE EMPTY SLOT ENDING ITS PROBE. '*tombstone' GETS THE FIRST TOMBSTONE ON THE WAY, IF ANY.
+// RECORDS OUT OF RANGE ARE PASSED OVER AND THE PROBE GIVES UP AFTER ONE ROUND WITH SIZE_MAX, SO A READ RACING THE
+// WRITER STAYS IN BOUNDS. THE WRITER'S OWN TABLES, UNDER 70% FULL, ALWAYS END IT ON A SLOT.
+static size_t handleIndexProbe (const struct handleIndexStruct *index, unsigned char header, const char *key, size_t *tombstone)
+{
+	size_t length = header & ~INDEX_KEY_FULL;
+	size_t mask = index->slotCapacity - 1;
+	size_t slot = (size_t)handleIndexHash(header, key, length) & mask;
+	if (tombstone) *tombstone = SIZE_MAX;
+
+	for (size_t probed = 0; probed < index->slotCapacity; probed++, slot = (slot + 1) & mask) {
+		uint32_t value = index->slots[slot];
+		if (value == INDEX_SLOT_EMPTY) return slot;
+		if (value == INDEX_SLOT_DELETED) {
+			if (tombstone && *tombstone == SIZE_MAX) *tombstone = slot;
+			continue;
+		}
+		size_t size;
+		const unsigned char *stored = value <= index->recordCapacity ? handleIndexLabel(index, value - 1, &size) : NULL;
+		if (stored && size == 1 + length && stored[0] == header && memcmp(stored + 1, key, length) == 0) return slot;
+	}
+	return SIZE_MAX;
+}
+
+// THE SAME, IN THE TABLE BY DID
+static size_t handleIndexProbeDid (const struct handleIndexStruct *index, const uint8_t *packed, size_t *tombstone)
+{
+	size_t mask = index->slotCapacity - 1;
+	size_t slot = (size_t)handleIndexHash(0, packed, DID_PLC_PACKED_SIZE) & mask;
+	if (tombstone) *tombstone = SIZE_MAX;
+
+	for (size_t probed = 0; probed < index->slotCapacity; probed++, slot = (slot + 1) & mask) {
+		uint32_t value = index->didSlots[slot];
+		if (value == INDEX_SLOT_EMPTY) return slot;
+		if (value == INDEX_SLOT_DELETED) {
+			if (tombstone && *tombstone == SIZE_MAX) *tombstone = slot;
+			continue;
+		}
+		if (value <= index->recordCapacity && memcmp(index->dids[value - 1], packed, DID_PLC_PACKED_SIZE) == 0) return slot;
+	}
+	return SIZE_MAX;
+}
+
+// RECORD NUMBER + 1 HOLDING A KEY, OR INDEX_SLOT_EMPTY
+static uint32_t handleIndexSeek (const struct handleIndexStruct *index, unsigned char header, const char *key)
+{
+	size_t slot = handleIndexProbe(index, header, key, NULL);
+	return slot == SIZE_MAX ? INDEX_SLOT_EMPTY : index->slots[slot];
+}
+
+static uint32_t handleIndexSeekDid (const struct handleIndexStruct *index, const uint8_t *packed)
+{
+	size_t slot = handleIndexProbeDid(index, packed, NULL);
+	return slot == SIZE_MAX ? INDEX_SLOT_EMPTY : index->didSlots[slot];
+}
+
+// BUILD THE NEXT GENERATION WITH THESE CAPACITIES AND PUBLISH IT. IT KEEPS THE LIVE RECORDS THAT BOTH TABLES OF THE
+// CURRENT ONE POINT AT, WHICH IS ALL OF THEM UNLESS A WRITER DIED INSIDE A CHANGE. READERS USE THE CURRENT ONE
+// MEANWHILE. CALLED WITH THE WRITE LOCK HELD. RETURNS 0 ON SUCCESS, 1 IF IT DOES NOT FIT.
+static int handleIndexRebuild (size_t slotCapacity, size_t recordCapacity, size_t arenaCapacity)
+{
+	struct handleIndexStruct next;
+	if (handleIndexMap(sharedVersionsNext(&handleIndexVersions), slotCapacity, recordCapacity, arenaCapacity, &next) != 0) {
+		fprintf(stderr, "INDEX: %zu slots, %zu records and %zu label bytes do not fit the %zu bytes reserved\n",
+			slotCapacity, recordCapacity, arenaCapacity, handleIndexVersions.halfSize);
+		return 1;
+	}
+
+	struct handleIndexHeaderStruct *header = next.header;
+	memset(header, 0, sizeof(*header));
+	memset(next.slots, 0, 2 * slotCapacity * sizeof(uint32_t));
+	header->slotCapacity = slotCapacity;
+	header->recordCapacity = recordCapacity;
+	header->arenaCapacity = arenaCapacity;
+	header->sequence = handleIndex.header->sequence;
+
+	size_t records = handleIndex.header->records < handleIndex.recordCapacity ? handleIndex.header->records : handleIndex.recordCapacity;
+	size_t kept = 0;
+	for (size_t i = 0; i < records; i++) {
+		size_t labelSize;
+		const unsigned char *stored = handleIndexLabel(&handleIndex, (uint32_t)i, &labelSize);
+		if (!stored || handleIndexSeek(&handleIndex, stored[0], (const char *)stored + 1) != i + 1 ||
+			handleIndexSeekDid(&handleIndex, handleIndex.dids[i]) != i + 1) continue;
+		if (kept == recordCapacity || header->arenaLength + labelSize > arenaCapacity) return 1;
+
+		memcpy(next.arena + header->arenaLength, stored, labelSize);
+		memcpy(next.dids[kept], handleIndex.dids[i], DID_PLC_PACKED_SIZE);
+		next.flags[kept] = handleIndex.flags[i];
+		next.labels[kept] = (uint32_t)header->arenaLength;
+		header->arenaLength += labelSize;
+		next.slots[handleIndexProbe(&next, stored[0], (const char *)stored + 1, NULL)] = (uint32_t)kept + 1;
+		next.didSlots[handleIndexProbeDid(&next, next.dids[kept], NULL)] = (uint32_t)kept + 1;
+		kept++;
+	}
+	header->records = header->live = header->slotsUsed = header->didSlotsUsed = kept;
+
+	handleIndex = next;
+	sharedVersionsPublish(&handleIndexVersions);
+	return 0;
+}
+
+// MAKE ROOM FOR 'records' LIVE RECORDS AND 'arenaBytes' MORE LABEL BYTES. A GENERATION SHORT OF EITHER, OR WITH A
+// TABLE OVER 70% IN USE, IS REBUILT INTO THE NEXT ONE, TABLES AT MOST 50% LIVE. CALLED WITH THE WRITE LOCK HELD.
+static int handleIndexReserve (size_t records, size_t arenaBytes)
+{
+	const struct handleIndexHeaderStruct *header = handleIndex.header;
+	size_t recordCapacity = handleIndex.recordCapacity;
+	size_t arenaCapacity = handleIndex.arenaCapacity;
+	size_t slotCapacity = handleIndex.slotCapacity;
+	int rebuild = FALSE;
+
+	if (records > recordCapacity) {
+		if (recordCapacity == 0) recordCapacity = HANDLE_INDEX_INITIAL;
+		while (recordCapacity < records) recordCapacity *= 2;
+		rebuild = TRUE;
+	}
+
+	if (header->arenaLength + arenaBytes > arenaCapacity) {
+		if (arenaCapacity == 0) arenaCapacity = HANDLE_INDEX_INITIAL * 16;
+		while (arenaCapacity < header->arenaLength + arenaBytes) arenaCapacity *= 2;
+		if (arenaCapacity > UINT32_MAX) return 1;
+		rebuild = TRUE;
+	}
+
+	size_t used = header->slotsUsed > header->didSlotsUsed ? header->slotsUsed : header->didSlotsUsed;
+	if ((used + 1) * 10 >= slotCapacity * 7 || records * 10 >= slotCapacity * 7) {
+		if (slotCapacity == 0) slotCapacity = HANDLE_INDEX_INITIAL;
+		while ((records > header->live ? records : header->live + 1) * 10 >= slotCapacity * 5) slotCapacity *= 2;
+		rebuild = TRUE;
+	}
+
+	return rebuild ? handleIndexRebuild(slotCapacity, recordCapacity, arenaCapacity) : 0;
+}
+
+// REMOVE A LIVE RECORD FROM BOTH TABLES. CALLED WITH THE WRITE LOCK HELD, INSIDE A CHANGE.
+static void handleIndexKill (uint32_t record)
+{
+	const unsigned char *stored = handleIndex.arena + handleIndex.labels[record];
+	handleIndex.slots[handleIndexProbe(&handleIndex, stored[0], (const char *)stored + 1, NULL)] = INDEX_SLOT_DELETED;
+	handleIndex.didSlots[handleIndexProbeDid(&handleIndex, handleIndex.dids[record], NULL)] = INDEX_SLOT_DELETED;
+	handleIndex.labels[record] = INDEX_RECORD_DEAD;
+	handleIndex.header->live--;
+}
+
+// SET OR, WITH A NULL 'did', REMOVE A HANDLE. LIKE THE DATABASE, A PUT REPLACES ANY RECORD HOLDING THE SAME
+// HANDLE OR DID. A USER THE INDEX CANNOT HOLD (NOT A did:plc, OR A HANDLE TOO LONG) IS LOGGED, COUNTED AND LEFT
+// OUT, AND ANY OLDER RECORD FOR ITS HANDLE REMOVED. CALLED WITH THE WRITE LOCK HELD. RETURNS 0 ON SUCCESS, 1 FOR
+// A SKIPPED USER AND -1 IF MEMORY RUNS OUT.
+static int handleIndexStore (const char *handle, const char *did, int locked)
+{
+	uint8_t packed[DID_PLC_PACKED_SIZE];
+	unsigned char header;
+	size_t length = handleIndexKey(handle, &header);
+	if (length == 0) {
+		fprintf(stderr, "INDEX: Unable to index '%s', too long\n", handle);
+		METRIC_ADD(indexSkipped, 1);
+		return 1;
+	}
+	int skipped = did && packDidPlc(did, packed) != 0;
+	if (skipped) {
+		fprintf(stderr, "INDEX: Unable to index '%s', '%s' is not a did:plc\n", handle, did);
+		METRIC_ADD(indexSkipped, 1);
+		did = NULL;
+	}
+
+	// GROW BEFORE LOOKING ANYTHING UP, A REBUILD RENUMBERS THE RECORDS
+	if (did && (handleIndexReserve(handleIndex.header->live + 1, 1 + length) != 0 ||
+				(handleIndex.header->records >= handleIndex.recordCapacity && handleIndexReserve(handleIndex.header->records + 1, 0) != 0))) return -1;
+	if (handleIndex.slotCapacity == 0) return skipped;
+
+	uint32_t current = handleIndexSeek(&handleIndex, header, handle);
+	if (!did) {
+		if (current != INDEX_SLOT_EMPTY) {
+			sharedVersionsWriteBegin(&handleIndexVersions);
+			handleIndexKill(current - 1);
+			sharedVersionsWriteEnd(&handleIndexVersions);
+		}
+		return skipped;
+	}
+
+	uint32_t holder = handleIndexSeekDid(&handleIndex, packed);
+	sharedVersionsWriteBegin(&handleIndexVersions);
+	if (holder != INDEX_SLOT_EMPTY && holder == current) {
+		handleIndex.flags[current - 1] = locked ? INDEX_FLAG_LOCKED : 0;
+		sharedVersionsWriteEnd(&handleIndexVersions);
+		return 0;
+	}
+	if (holder != INDEX_SLOT_EMPTY) handleIndexKill(holder - 1);
+	if (current != INDEX_SLOT_EMPTY) handleIndexKill(current - 1);
+
+	// APPEND A RECORD, IN THE FIRST TOMBSTONE ON EACH PROBE PATH OR THE EMPTY SLOT
+	struct handleIndexHeaderStruct *counts = handleIndex.header;
+	size_t record = counts->records++;
+	memcpy(handleIndex.dids[record], packed, DID_PLC_PACKED_SIZE);
+	handleIndex.flags[record] = locked ? INDEX_FLAG_LOCKED : 0;
+	handleIndex.labels[record] = (uint32_t)counts->arenaLength;
+	handleIndex.arena[counts->arenaLength] = header;
+	memcpy(handleIndex.arena + counts->arenaLength + 1, handle, length);
+	counts->arenaLength += 1 + length;
+
+	size_t tombstone;
+	size_t slot = handleIndexProbe(&handleIndex, header, handle, &tombstone);
+	if (tombstone != SIZE_MAX) slot = tombstone;
+	else counts->slotsUsed++;
+	handleIndex.slots[slot] = (uint32_t)record + 1;
+
+	slot = handleIndexProbeDid(&handleIndex, packed, &tombstone);
+	if (tombstone != SIZE_MAX) slot = tombstone;
+	else counts->didSlotsUsed++;
+	handleIndex.didSlots[slot] = (uint32_t)record + 1;
+
+	counts->live++;
+	sharedVersionsWriteEnd(&handleIndexVersions);
+	return 0;
+}
+
+// BYTES HELD BY THE CURRENT GENERATION. CALLED WITH THE WRITE LOCK HELD.
+static size_t handleIndexBytes (void)
+{
+	return handleIndex.slotCapacity * 2 * sizeof(uint32_t) + handleIndex.arenaCapacity +
+			handleIndex.recordCapacity * (DID_PLC_PACKED_SIZE + sizeof(uint32_t) + sizeof(uint8_t));
+}
+
+// PUBLISH THE SIZE OF THE INDEX. CALLED WITH THE WRITE LOCK HELD.
+static void handleIndexMeasure (void)
+{
+	METRIC_SET(indexRecords, handleIndex.header->live);
+	METRIC_SET(indexBytes, handleIndexBytes());
+}
+
+// START A READ OF THE CURRENT GENERATION, SEEN IN 'index'. RETURNS THE SEQUENCE TO CHECK WHEN DONE.
+static unsigned long long handleIndexReadBegin (struct handleIndexStruct *index)
+{
+	unsigned char *half;
+	unsigned long long sequence = sharedVersionsReadBegin(&handleIndexVersions, &half);
+	handleIndexView(half, index);
+	return sequence;
+}
+
+// DID FOR A HANDLE INTO 'did' (MAX_SIZE_DID_PLC + 1 BYTES). RETURNS TRUE IF FOUND.
+static int handleIndexFind (const char *handle, char *did)
+{
+	struct handleIndexStruct index;
+	uint8_t packed[DID_PLC_PACKED_SIZE];
+	unsigned long long sequence;
+	uint32_t value;
+	unsigned char header;
+	size_t length = handleIndexKey(handle, &header);
+	if (!handleIndexLoaded || length == 0) return FALSE;
+
+	do {
+		sequence = handleIndexReadBegin(&index);
+		value = handleIndexSeek(&index, header, handle);
+		if (value != INDEX_SLOT_EMPTY) memcpy(packed, index.dids[value - 1], DID_PLC_PACKED_SIZE);
+	} while (!sharedVersionsReadValid(&handleIndexVersions, sequence));
+	if (value == INDEX_SLOT_EMPTY) return FALSE;
+
+	unpackDidPlc(packed, did);
+	return TRUE;
+}
+
+// DID FOR A HANDLE FROM THE INDEX, OR NULL. CALLER MUST FREE.
+static char *handleIndexLookup (const char *handle)
+{
+	char did[MAX_SIZE_DID_PLC + 1];
+	return handleIndexFind(handle, did) ? strdup(did) : NULL;
+}
+
+// HANDLE HOLDING A DID, COPIED INTO 'handle' ('size' BYTES), AND ITS LOCK STATUS. RETURNS TRUE IF FOUND.
+static int handleIndexReverseLookup (const char *did, char *handle, size_t size, int *locked)
+{
+	struct handleIndexStruct index;
+	uint8_t packed[DID_PLC_PACKED_SIZE];
+	unsigned char stored[1 + INDEX_KEY_FULL];
+	size_t labelSize = 0;
+	uint8_t flags = 0;
+	unsigned long long sequence;
+	if (!handleIndexLoaded || packDidPlc(did, packed) != 0) return FALSE;
+
+	do {
+		sequence = handleIndexReadBegin(&index);
+		uint32_t value = handleIndexSeekDid(&index, packed);
+		const unsigned char *label = value != INDEX_SLOT_EMPTY ? handleIndexLabel(&index, value - 1, &labelSize) : NULL;
+		if (label) {
+			memcpy(stored, label, labelSize);
+			flags = index.flags[value - 1];
+		} else labelSize = 0;
+	} while (!sharedVersionsReadValid(&handleIndexVersions, sequence));
+	if (labelSize == 0) return FALSE;
+
+	int length = (int)labelSize - 1;
+	int written = (stored[0] & INDEX_KEY_FULL) ? snprintf(handle, size, "%.*s", length, (const char *)stored + 1)
+											   : snprintf(handle, size, "%.*s.%s", length, (const char *)stored + 1, domainName);
+	*locked = (flags & INDEX_FLAG_LOCKED) != 0;
+	return written > 0 && (size_t)written < size;
+}
+
+// TRUE IF THE LOADED INDEX ALREADY HOLDS THE HANDLE OR THE DID. IT MAY BE UP TO replica_interval BEHIND
+// REGISTRATIONS OUTSIDE THE WRITER AND EDITS MADE WITH THE sqlite3 SHELL.
+static int handleIndexClaimed (const char *handle, const char *did)
+{
+	struct handleIndexStruct index;
+	uint8_t packed[DID_PLC_PACKED_SIZE];
+	unsigned long long sequence;
+	unsigned char header;
+	size_t length = handleIndexKey(handle, &header);
+	int claimed;
+	if (!handleIndexLoaded) return FALSE;
+
+	int packedDid = packDidPlc(did, packed) == 0;
+	do {
+		sequence = handleIndexReadBegin(&index);
+		claimed = (length > 0 && handleIndexSeek(&index, header, handle) != INDEX_SLOT_EMPTY) ||
+					(packedDid && handleIndexSeekDid(&index, packed) != INDEX_SLOT_EMPTY);
+	} while (!sharedVersionsReadValid(&handleIndexVersions, sequence));
+
+	return claimed;
+}
+
+// APPLY CHANGE LOG ENTRIES ALREADY COMMITTED TO THE DATABASE. ONLY THE WRITER CHANGES THE INDEX, IN THE OTHER
+// WORKERS ITS FOLLOWER BRINGS THEM IN. RETURNS 1 ONLY IF MEMORY RAN OUT.
+static int handleIndexApply (const struct changeEntryStruct *entries, size_t count)
+{
+	int failed = 0;
+	if (!handleIndexLoaded || !handleIndexWriter) return 0;
+
+	pthread_mutex_lock(&handleIndexWriteLock);
+	for (size_t i = 0; i < count; i++) failed |= handleIndexStore(entries[i].handle, entries[i].put ? entries[i].did : NULL, entries[i].locked) < 0;
+	handleIndexMeasure();
+	pthread_mutex_unlock(&handleIndexWriteLock);
+
+	return failed;
+}
+
+// RECORD HOW FAR THE INDEX FOLLOWED THE CHANGE LOG, WHERE A WRITER TAKING OVER FROM THIS ONE STARTS
+static void handleIndexFollowed (long long sequence)
+{
+	if (!handleIndexLoaded || !handleIndexWriter) return;
+
+	pthread_mutex_lock(&handleIndexWriteLock);
+	handleIndex.header->sequence = sequence;
+	pthread_mutex_unlock(&handleIndexWriteLock);
+}
+
+// ADD ONE FILE'S USERS TO THE INDEX, SKIPPING ANY IT CANNOT HOLD. RETURNS 0 ON SUCCESS, 1 IF THE FILE CANNOT BE READ
+// OR MEMORY RUNS OUT.
+static int handleIndexLoadFile (const char *path)
+{
+	sqlite3 *db = databaseOpen(path);
+	if (!db) return 1;
+
+	sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT handle, did, locked FROM did_plc_users;");
+	if (!stmt) {
+		sqlite3_close(db);
+		return 1;
+	}
+
+	int failed = 0;
+	int rc;
+	pthread_mutex_lock(&handleIndexWriteLock);
+	while (!failed && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		failed |= handleIndexStore((const char *)sqlite3_column_text(stmt, 0), (const char *)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2)) < 0;
+	}
+	pthread_mutex_unlock(&handleIndexWriteLock);
+	if (!failed && rc != SQLITE_DONE) {
+		fprintf(stderr, "ERROR: Loading the handle index failed: %s\n", sqlite3_errmsg(db));
+		failed = 1;
+	}
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return failed;
+}
+
+// FILL THE INDEX FROM THE USER DATABASE AT START, BEFORE ANY FORK, SIZED FROM A COUNT FIRST. 'sequence' IS THE
+// CHANGE LOG POSITION, READ BEFORE THE USERS, SO THE ENTRIES AFTER IT (APPLIED BY THE FOLLOWER) COVER EVERY LATER
+// CHANGE. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+int loadHandleIndex (long long sequence)
+{
+	if (sequence < 0) return 1;
+	if (sharedVersionsCreate(&handleIndexVersions, HANDLE_INDEX_RESERVE) != 0) return 1;
+	handleIndexView(sharedVersionsHalf(&handleIndexVersions, 0), &handleIndex);
+
+	int files = shardCountGlobal > 0 ? shardCountGlobal : 1;
+	size_t records = 0, labelBytes = 0;
+	for (int i = 0; i < files; i++) {
+		sqlite3 *db = databaseOpen(shardCountGlobal > 0 ? shardDatabasesGlobal[i] : principalDatabaseGlobal);
+		if (!db) return 1;
+		sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT COUNT(*), IFNULL(SUM(LENGTH(label)), 0) FROM did_plc_users;");
+		if (!stmt) {
+			sqlite3_close(db);
+			return 1;
+		}
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			records += (size_t)sqlite3_column_int64(stmt, 0);
+			labelBytes += (size_t)sqlite3_column_int64(stmt, 1);
+		}
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
+	}
+
+	pthread_mutex_lock(&handleIndexWriteLock);
+	handleIndex.header->sequence = sequence;
+	int failed = handleIndexReserve(records, records + labelBytes);
+	pthread_mutex_unlock(&handleIndexWriteLock);
+	for (int i = 0; i < files && !failed; i++) failed |= handleIndexLoadFile(shardCountGlobal > 0 ? shardDatabasesGlobal[i] : principalDatabaseGlobal);
+
+	pthread_mutex_lock(&handleIndexWriteLock);
+	handleIndexMeasure();
+	size_t live = handleIndex.header->live;
+	size_t bytes = handleIndexBytes();
+	pthread_mutex_unlock(&handleIndexWriteLock);
+
+	handleIndexLoaded = !failed;
+	printf("Handle index loaded: %zu handles in %zu bytes (%.1f bytes per handle).\n", live, bytes, live ? (double)bytes / (double)live : 0.0);
+	return failed;
+}
+
+// PREFORK WORKER 0 BECOMES THE WRITER. IT PICKS UP THE CURRENT GENERATION, WHICH AN EARLIER WORKER 0 MAY HAVE
+// REPLACED SINCE THE FORK, AND REBUILDS IT IF THAT WORKER DIED INSIDE A CHANGE. ITS FOLLOWER THEN REAPPLIES THE
+// LOG FROM THE LAST POSITION RECORDED. RETURNS 0 ON SUCCESS, 1 IF THE REBUILD FAILED.
+int handleIndexTakeOver (void)
+{
+	int failed = 0;
+	if (!handleIndexLoaded) return 0;
+
+	struct sharedControlStruct *control = handleIndexVersions.control;
+	pthread_mutex_lock(&handleIndexWriteLock);
+	handleIndexView(sharedVersionsHalf(&handleIndexVersions, atomic_load(&control->generation)), &handleIndex);
+	if (atomic_load(&control->stale)) {
+		failed = handleIndexRebuild(handleIndex.slotCapacity, handleIndex.recordCapacity, handleIndex.arenaCapacity);
+		if (!failed) {
+			atomic_store(&control->stale, FALSE);
+			handleIndexMeasure();
+			syslog(LOG_WARNING, "Handle index rebuilt, the previous writer died inside a change");
+		}
+	}
+	pthread_mutex_unlock(&handleIndexWriteLock);
+
+	return failed;
+}
+
+// THE SUPERVISOR REAPED WORKER 0. IF IT DIED INSIDE A CHANGE, END THE CHANGE SO READERS STOP WAITING AND LEAVE THE
+// INDEX FOR THE NEXT WORKER 0 TO REBUILD.
+void handleIndexWriterExited (void)
+{
+	struct sharedControlStruct *control = handleIndexVersions.control;
+	if (!handleIndexLoaded || (atomic_load(&control->sequence) & 1) == 0) return;
+
+	atomic_store(&control->stale, TRUE);
+	atomic_fetch_add(&control->sequence, 1);
+}
+
+void freeHandleIndex (void)
+{
+	sharedVersionsFree(&handleIndexVersions);
+	memset(&handleIndex, 0, sizeof(handleIndex));
+	handleIndexLoaded = FALSE;
+}
+
+
+// ***************************************************************************
+// BEGIN HANDLED SPECIFIC DATABASE FUNCTIONS ********************************
+// ***************************************************************************
+
+
+// SQL COMMENTARY: ADDITIONAL INDEXING IS UNNECESSARY SINCE 'did' COLUMN IS UNIQUE
+// VIEW THE INDEX LIST USING: PRAGMA index_list(did_plc_users);
+#define SQL_CREATE_USER_TABLE	"CREATE TABLE IF NOT EXISTS did_plc_users (" \
+				"handle TEXT PRIMARY KEY, "				/* HOST / HANDLE, e.g., 'myhandle.baysky.social' */ \
+				"did TEXT NOT NULL UNIQUE, " \
+				"label TEXT NOT NULL UNIQUE, "			/* LABEL, e.g., 'myhandle' */ \
+				"domain TEXT NOT NULL, "				/* DOMAIN NAME, e.g., 'baysky.social' */ \
+				"token TEXT NOT NULL, " \
+				"email TEXT, " \
+				"locked BOOLEAN DEFAULT 0, " \
+				"notes TEXT," \
+				"creation_time TIMESTAMP DEFAULT CURRENT_TIMESTAMP);"
+
+// THE CHANGE LOG REPLICAS FOLLOW. replication_state HOLDS A REPLICA'S POSITION.
+#define SQL_CREATE_CHANGE_LOG	"CREATE TABLE IF NOT EXISTS did_plc_changes (" \
+				"sequence INTEGER PRIMARY KEY AUTOINCREMENT, " \
+				"operation TEXT NOT NULL, "				/* 'put' OR 'delete' */ \
+				"handle TEXT NOT NULL, " \
+				"did TEXT NOT NULL, " \
+				"label TEXT NOT NULL, " \
+				"domain TEXT NOT NULL, " \
+				"locked BOOLEAN NOT NULL DEFAULT 0, " \
+				"change_time TIMESTAMP DEFAULT CURRENT_TIMESTAMP);" \
+				"CREATE INDEX IF NOT EXISTS did_plc_changes_handle ON did_plc_changes (handle, sequence);" \
+				"CREATE TABLE IF NOT EXISTS change_log_state (id INTEGER PRIMARY KEY CHECK (id = 1), pruned INTEGER NOT NULL);" \
+				"CREATE TABLE IF NOT EXISTS replication_state (id INTEGER PRIMARY KEY CHECK (id = 1), sequence INTEGER NOT NULL);"
+
+// IN A SINGLE FILE, EVERY CHANGE TO did_plc_users IS APPENDED TO did_plc_changes BY TRIGGERS, SO EDITS MADE WITH
+// THE sqlite3 SHELL ARE REPLICATED TOO. AN UPDATE, LOCKING INCLUDED, IS LOGGED AS A DELETE OF THE OLD ROW AND A
+// PUT OF THE NEW.
+// THE FIRST TIME, THE LOG IS SEEDED WITH THE EXISTING USERS.
+#define SQL_LOG_USER_CHANGES	"INSERT INTO did_plc_changes (operation, handle, did, label, domain, locked) " \
+				"SELECT 'put', handle, did, label, domain, IFNULL(locked, 0) FROM did_plc_users " \
+				"WHERE NOT EXISTS (SELECT 1 FROM did_plc_changes) ORDER BY creation_time;" \
+				"CREATE TRIGGER IF NOT EXISTS did_plc_users_insert AFTER INSERT ON did_plc_users BEGIN " \
+				"INSERT INTO did_plc_changes (operation, handle, did, label, domain, locked) VALUES ('put', NEW.handle, NEW.did, NEW.label, NEW.domain, IFNULL(NEW.locked, 0)); END;" \
+				"CREATE TRIGGER IF NOT EXISTS did_plc_users_update AFTER UPDATE OF handle, did, label, domain, locked ON did_plc_users BEGIN " \
+				"INSERT INTO did_plc_changes (operation, handle, did, label, domain, locked) VALUES ('delete', OLD.handle, OLD.did, OLD.label, OLD.domain, IFNULL(OLD.locked, 0)); " \
+				"INSERT INTO did_plc_changes (operation, handle, did, label, domain, locked) VALUES ('put', NEW.handle, NEW.did, NEW.label, NEW.domain, IFNULL(NEW.locked, 0)); END;" \
+				"CREATE TRIGGER IF NOT EXISTS did_plc_users_delete AFTER DELETE ON did_plc_users BEGIN " \
+				"INSERT INTO did_plc_changes (operation, handle, did, label, domain, locked) VALUES ('delete', OLD.handle, OLD.did, OLD.label, OLD.domain, IFNULL(OLD.locked, 0)); END;"
+
+// IN A SHARD THE SAME TRIGGERS APPEND TO did_plc_pending, AS A TRIGGER CANNOT WRITE TO ANOTHER FILE.
+// moveShardChange THEN LOGS THE USERS EACH ROW NAMES TO THE SHARD INDEX'S CHANGE LOG AND KEEPS did_plc_index IN STEP.
+// A ROW THAT CONFLICTS WITH ANOTHER SHARD IS SET ASIDE IN did_plc_quarantine.
+#define SQL_CREATE_SHARD_PENDING	"CREATE TABLE IF NOT EXISTS did_plc_pending (" \
+				"sequence INTEGER PRIMARY KEY AUTOINCREMENT, " \
+				"operation TEXT NOT NULL, " \
+				"handle TEXT NOT NULL, " \
+				"did TEXT NOT NULL, " \
+				"label TEXT NOT NULL, " \
+				"domain TEXT NOT NULL, " \
+				"locked BOOLEAN NOT NULL DEFAULT 0, " \
+				"change_time TIMESTAMP DEFAULT CURRENT_TIMESTAMP);" \
+				"CREATE TABLE IF NOT EXISTS did_plc_quarantine (" \
+				"sequence INTEGER PRIMARY KEY, " \
+				"operation TEXT NOT NULL, " \
+				"handle TEXT NOT NULL, " \
+				"did TEXT NOT NULL, " \
+				"label TEXT NOT NULL, " \
+				"domain TEXT NOT NULL, " \
+				"locked BOOLEAN NOT NULL DEFAULT 0, " \
+				"change_time TIMESTAMP, " \
+				"quarantine_time TIMESTAMP DEFAULT CURRENT_TIMESTAMP);" \
+				"CREATE TRIGGER IF NOT EXISTS did_plc_users_insert AFTER INSERT ON did_plc_users BEGIN " \
+				"INSERT INTO did_plc_pending (operation, handle, did, label, domain, locked) VALUES ('put', NEW.handle, NEW.did, NEW.label, NEW.domain, IFNULL(NEW.locked, 0)); END;" \
+				"CREATE TRIGGER IF NOT EXISTS did_plc_users_update AFTER UPDATE OF handle, did, label, domain, locked ON did_plc_users BEGIN " \
+				"INSERT INTO did_plc_pending (operation, handle, did, label, domain, locked) VALUES ('delete', OLD.handle, OLD.did, OLD.label, OLD.domain, IFNULL(OLD.locked, 0)); " \
+				"INSERT INTO did_plc_pending (operation, handle, did, label, domain, locked) VALUES ('put', NEW.handle, NEW.did, NEW.label, NEW.domain, IFNULL(NEW.locked, 0)); END;" \
+				"CREATE TRIGGER IF NOT EXISTS did_plc_users_delete AFTER DELETE ON did_plc_users BEGIN " \
+				"INSERT INTO did_plc_pending (operation, handle, did, label, domain, locked) VALUES ('delete', OLD.handle, OLD.did, OLD.label, OLD.domain, IFNULL(OLD.locked, 0)); END;"
+
+// A SHARDED STORE KEEPS DIDS, LABELS AND HANDLES UNIQUE ACROSS SHARDS IN ONE SMALL INDEX, WITH THE CHANGE LOG
+// AND THE NUMBER OF SHARDS THE USERS ARE SPREAD OVER
+#define SQL_CREATE_SHARD_INDEX	"CREATE TABLE IF NOT EXISTS did_plc_index (" \
+				"did TEXT PRIMARY KEY, " \
+				"label TEXT NOT NULL UNIQUE, " \
+				"handle TEXT NOT NULL UNIQUE, " \
+				"shard INTEGER NOT NULL) WITHOUT ROWID;" \
+				"CREATE TABLE IF NOT EXISTS shard_layout (id INTEGER PRIMARY KEY CHECK (id = 1), shards INTEGER NOT NULL);" \
+				SQL_CREATE_CHANGE_LOG
+
+
+// STABLE SHARD OF A HANDLE: FNV-1a OF THE LOWERCASE HANDLE, SPREAD WITH A JUMP CONSISTENT HASH
+// (LAMPING AND VEACH), SO GROWING FROM N TO N+1 SHARDS ONLY MOVES ABOUT 1/(N+1) OF THE USERS
+int shardForHandle (const char *handle, int shards)
+{
+	uint64_t key = 14695981039346656037ULL;
+	for (const unsigned char *c = (const unsigned char *)handle; *c; c++) {
+		key ^= (uint64_t)tolower(*c);
+		key *= 1099511628211ULL;
+	}
+
+	int64_t bucket = -1, next = 0;
+	while (next < shards) {
+		bucket = next;
+		key = key * 2862933555777941757ULL + 1;
+		next = (int64_t)((double)(bucket + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+	}
+	return (int)bucket;
+}
+
+// THE FILE HOLDING A HANDLE'S RECORD
+const char *userDatabaseFor (const char *handle)
+{
+	if (shardCountGlobal == 0) return principalDatabaseGlobal;
+	return shardDatabasesGlobal[shardForHandle(handle, shardCountGlobal)];
+}
+
+// FLUSH A DIRECTORY, SO THE FILES AND RENAMES IN IT SURVIVE A CRASH
+static void syncDirectory (const char *path)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) return;
+	fsync(fd);
+	close(fd);
+}
+
+// SWITCH TO A RESHARDED LAYOUT WHOSE FILES ARE ALL BUILT UNDER RESHARD_SUFFIX NAMES. reshard-commit, NAMING THE
+// TARGET, IS WRITTEN AND FLUSHED FIRST: IT IS THE COMMIT POINT. THE RENAMES AND REMOVALS AFTER IT ARE REPEATED FROM
+// THE START IF THEY ARE CUT SHORT, SO A CRASH LEAVES EITHER THE OLD LAYOUT WHOLE OR A SWITCH THAT FINISHES ON THE
+// NEXT RUN. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+static int reshardFinishSwitch (int targetShards)
+{
+	int failed = 0;
+	int targetCount = targetShards ? targetShards : 1;
+	for (int i = 0; i < targetCount && !failed; i++) {
+		char *target = targetShards ? shardDatabasePath(i, "") : (char *)buildAbsolutePath(baseDirectory, PRINCIPAL_DB_FILENAME);
+		char *temporary = targetShards ? shardDatabasePath(i, RESHARD_SUFFIX) : (char *)buildAbsolutePath(baseDirectory, PRINCIPAL_DB_FILENAME RESHARD_SUFFIX);
+		failed = !target || !temporary || (rename(temporary, target) != 0 && errno != ENOENT);
+		if (failed) perror("Unable to rename a new user database file into place");
+		free(target);
+		free(temporary);
+	}
+
+	char *indexTarget = (char *)buildAbsolutePath(baseDirectory, SHARD_INDEX_DB_FILENAME);
+	char *indexTemporary = (char *)buildAbsolutePath(baseDirectory, SHARD_INDEX_DB_FILENAME RESHARD_SUFFIX);
+	char *principal = (char *)buildAbsolutePath(baseDirectory, PRINCIPAL_DB_FILENAME);
+	failed |= !indexTarget || !indexTemporary || !principal;
+	if (!failed && targetShards) {
+		failed = rename(indexTemporary, indexTarget) != 0 && errno != ENOENT;
+		if (failed) perror("Unable to rename the new shard index into place");
+	}
+
+	// REMOVE WHAT THE OLD LAYOUT LEAVES BEHIND
+	if (!failed) {
+		if (targetShards) unlink(principal);
+		else unlink(indexTarget);
+		for (int i = targetShards; i < MAX_SHARDS; i++) {
+			char *old = shardDatabasePath(i, "");
+			if (old) unlink(old);
+			free(old);
+		}
+		syncDirectory(baseDirectory);
+	}
+	free(indexTarget);
+	free(indexTemporary);
+	free(principal);
+	if (failed) return 1;
+
+	char *commit = (char *)buildAbsolutePath(baseDirectory, RESHARD_COMMIT_FILENAME);
+	if (commit) unlink(commit);
+	free(commit);
+	syncDirectory(baseDirectory);
+	return 0;
+}
+
+// FINISH A RESHARD CUT SHORT AFTER ITS COMMIT POINT. RETURNS 0 ON SUCCESS OR WHEN THERE IS NONE, 1 ON FAILURE.
+static int reshardRecover (void)
+{
+	char *commit = (char *)buildAbsolutePath(baseDirectory, RESHARD_COMMIT_FILENAME);
+	if (!commit) return 1;
+	FILE *file = fopen(commit, "r");
+	free(commit);
+	if (!file) return 0;
+
+	int targetShards = -1;
+	if (fscanf(file, "%d", &targetShards) != 1 || targetShards < 0 || targetShards > MAX_SHARDS) targetShards = -1;
+	fclose(file);
+	if (targetShards < 0) {
+		fprintf(stderr, "ERROR: '" RESHARD_COMMIT_FILENAME "' in the base directory is damaged\n");
+		return 1;
+	}
+
+	printf("Finishing an interrupted reshard to %d file(s).\n", targetShards ? targetShards : 1);
+	syslog(LOG_WARNING, "Finishing an interrupted reshard to %d files", targetShards ? targetShards : 1);
+	return reshardFinishSwitch(targetShards);
+}
+
+// THE FILE HOLDING THE CHANGE LOG
+const char *changeLogDatabase (void)
+{
+	return shardCountGlobal ? shardIndexDatabaseGlobal : principalDatabaseGlobal;
+}
+
+// NUMBER OF SHARDS THE USERS ARE SPREAD OVER ON DISK, 0 FOR A SINGLE FILE, -1 ON FAILURE. A RESHARD CUT SHORT
+// AFTER ITS COMMIT POINT IS FINISHED FIRST.
+int storedShardLayout (void)
+{
+	if (reshardRecover() != 0) return -1;
+
+	char *indexPath = (char *)buildAbsolutePath( baseDirectory, SHARD_INDEX_DB_FILENAME );
+	if (!indexPath) return -1;
+	if (access(indexPath, F_OK) != 0) {
+		free(indexPath);
+		return 0;
+	}
+
+	int shards = -1;
+	sqlite3 *db = databaseOpen(indexPath);
+	free(indexPath);
+	if (!db) return -1;
+
+	sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT shards FROM shard_layout WHERE id = 1;");
+	if (!stmt) {
+		sqlite3_close(db);
+		return -1;
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW) shards = sqlite3_column_int(stmt, 0);
+	else fprintf(stderr, "ERROR: The shard index has no layout\n");
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return shards;
+}
+
+// A CHANGE LOG CREATED BEFORE IT CARRIED LOCKING GETS THE locked COLUMN, AND THE TRIGGERS THAT DO NOT FILL IT ARE
+// DROPPED FOR SQL_LOG_USER_CHANGES TO CREATE AGAIN. RETURNS SQLITE_OK ON SUCCESS.
+static int upgradeChangeLog (sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM pragma_table_info('did_plc_changes') WHERE name = 'locked';", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Query SQL preparation error: %s\n", sqlite3_errmsg(db));
+		return SQLITE_ERROR;
+	}
+	int current = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) > 0;
+	sqlite3_finalize(stmt);
+	if (current) return SQLITE_OK;
+
+	printf("Upgrading the change log to carry locking.\n");
+	return sqlite3_exec(db, "ALTER TABLE did_plc_changes ADD COLUMN locked BOOLEAN NOT NULL DEFAULT 0;"
+							"DROP TRIGGER IF EXISTS did_plc_users_insert;"
+							"DROP TRIGGER IF EXISTS did_plc_users_update;"
+							"DROP TRIGGER IF EXISTS did_plc_users_delete;", 0, 0, NULL);
+}
+
+// CREATE EVERY SHARD AND THE SHARD INDEX. RETURNS DATABASE_SUCCESS OR DATABASE_ERROR.
+static int initializeShardedDatabase (void)
+{
+	char *err_msg = NULL;
+	char sql[128];
+
+	for (int i = 0; i < shardCountGlobal; i++) {
+		sqlite3 *db = databaseOpen(shardDatabasesGlobal[i]);
+		if (!db) return DATABASE_ERROR;
+		if (sqlite3_exec(db, SQL_CREATE_USER_TABLE SQL_CREATE_SHARD_PENDING, 0, 0, &err_msg) != SQLITE_OK) {
+			fprintf(stderr, "ERROR: Shard %d table creation failed: %s\n", i, err_msg);
+			sqlite3_free(err_msg);
+			sqlite3_close(db);
+			return DATABASE_ERROR;
+		}
+		sqlite3_close(db);
+	}
+
+	sqlite3 *db = databaseOpen(shardIndexDatabaseGlobal);
+	if (!db) return DATABASE_ERROR;
+	snprintf(sql, sizeof(sql), "INSERT OR IGNORE INTO shard_layout (id, shards) VALUES (1, %d);", shardCountGlobal);
+	if (sqlite3_exec(db, SQL_CREATE_SHARD_INDEX, 0, 0, &err_msg) != SQLITE_OK || sqlite3_exec(db, sql, 0, 0, &err_msg) != SQLITE_OK ||
+		upgradeChangeLog(db) != SQLITE_OK) {
+		fprintf(stderr, "ERROR: Shard index creation failed: %s\n", err_msg ? err_msg : sqlite3_errmsg(db));
 		sqlite3_free(err_msg);
-        sqlite3_close(db);
-        return DATABASE_ERROR;
-    }
+		sqlite3_close(db);
+		return DATABASE_ERROR;
+	}
+	sqlite3_close(db);
+
+	#ifdef VERBOSE_FLAG
+	printf("Principal user tables ready: %d shards and '%s'\n", shardCountGlobal, shardIndexDatabaseGlobal);
+	#endif
+
+	return DATABASE_SUCCESS;
+}
+
+// ATTACH THE SHARD INDEX TO A SHARD CONNECTION AS 'shardIndex'. ONE TRANSACTION THEN COVERS BOTH FILES, AND
+// SQLITE COMMITS THEM ATOMICALLY (ROLLBACK JOURNAL). RETURNS SQLITE_OK ON SUCCESS.
+static int attachShardIndex (sqlite3 *db)
+{
+	sqlite3_stmt *stmt = databasePrepareStatement(db, "ATTACH DATABASE ? AS shardIndex;");
+	if (!stmt) return SQLITE_ERROR;
+
+	int rc = databaseBindKey(stmt, 1, shardIndexDatabaseGlobal, db);
+	if (rc == SQLITE_OK && sqlite3_step(stmt) != SQLITE_DONE) {
+		fprintf(stderr, "ERROR: Unable to attach the shard index: %s\n", sqlite3_errmsg(db));
+		rc = SQLITE_ERROR;
+	}
+
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+// CLAIM A DID, LABEL AND HANDLE IN THE SHARD INDEX, INSIDE THE CALLER'S TRANSACTION. THE INSERT THAT FOLLOWS IS
+// LOGGED BY THE SHARD'S TRIGGER AND moveShardChange.
+// RETURNS SQLITE_DONE, SQLITE_CONSTRAINT IF ANOTHER SHARD HOLDS ONE OF THEM, OR AN ERROR.
+static int claimShardIndex (sqlite3 *db, const char *handle, const char *label, const char *did, int shard)
+{
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, "INSERT INTO shardIndex.did_plc_index (did, label, handle, shard) VALUES (LOWER(?), LOWER(?), LOWER(?), ?);", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Query SQL preparation error: %s\n", sqlite3_errmsg(db));
+		return SQLITE_ERROR;
+	}
+
+	sqlite3_bind_text(stmt, 1, did, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, label, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, handle, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 4, shard);
+
+	int rc = sqlite3_step(stmt);
+	if (rc != SQLITE_DONE && rc != SQLITE_CONSTRAINT) fprintf(stderr, "ERROR: Shard index update failed (%d): %s\n", rc, sqlite3_errmsg(db));
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+// LOG THE USERS ONE did_plc_pending ROW NAMES AS THEY ARE NOW: A DELETE FOR EACH INDEX ROW THAT NO LONGER MATCHES
+// A USER, THEN A PUT FOR EACH CURRENT USER, AND REBUILD THEIR did_plc_index ROWS. LOGGING THE END STATE RATHER THAN
+// EVERY STEP KEEPS AN EDIT THAT WAS REFUSED AND THEN UNDONE OUT OF THE LOG. RUNS INSIDE THE CALLER'S TRANSACTION, ON A
+// SHARD CONNECTION WITH THE INDEX ATTACHED. RETURNS SQLITE_OK, SQLITE_CONSTRAINT IF AN EDIT TOOK A DID, LABEL OR
+// HANDLE ANOTHER SHARD HOLDS (THE CALLER ROLLS BACK WHAT RAN), OR AN ERROR.
+static int moveShardChange (sqlite3 *db, int shard, long long sequence)
+{
+	char sql[3072];
+	char *err_msg = NULL;
+
+	snprintf(sql, sizeof(sql),
+			"CREATE TEMP TABLE IF NOT EXISTS shard_moving AS SELECT * FROM main.did_plc_pending WHERE 0;"
+			"DELETE FROM temp.shard_moving;"
+			"INSERT INTO temp.shard_moving SELECT * FROM main.did_plc_pending WHERE sequence = %lld;"
+			"INSERT INTO shardIndex.did_plc_changes (operation, handle, did, label, domain) "
+			"SELECT 'delete', i.handle, i.did, i.label, (SELECT LOWER(domain) FROM temp.shard_moving) "
+			"FROM shardIndex.did_plc_index i WHERE i.shard = %d AND (i.handle IN (SELECT LOWER(handle) FROM temp.shard_moving) "
+			"OR i.did IN (SELECT LOWER(did) FROM temp.shard_moving) OR i.label IN (SELECT LOWER(label) FROM temp.shard_moving)) "
+			"AND NOT EXISTS (SELECT 1 FROM main.did_plc_users u WHERE LOWER(u.handle) = i.handle AND LOWER(u.did) = i.did AND LOWER(u.label) = i.label) "
+			"ORDER BY i.handle;"
+			"DELETE FROM shardIndex.did_plc_index WHERE shard = %d AND (handle IN (SELECT LOWER(handle) FROM temp.shard_moving) "
+			"OR did IN (SELECT LOWER(did) FROM temp.shard_moving) OR label IN (SELECT LOWER(label) FROM temp.shard_moving));"
+			"CREATE TEMP TABLE IF NOT EXISTS shard_touched (handle TEXT PRIMARY KEY);"
+			"DELETE FROM temp.shard_touched;"
+			"INSERT OR IGNORE INTO temp.shard_touched SELECT handle FROM main.did_plc_users WHERE handle IN (SELECT handle FROM temp.shard_moving) "
+			"OR did IN (SELECT did FROM temp.shard_moving) OR label IN (SELECT label FROM temp.shard_moving);"
+			"INSERT INTO shardIndex.did_plc_index (did, label, handle, shard) SELECT LOWER(did), LOWER(label), LOWER(handle), %d "
+			"FROM main.did_plc_users WHERE handle IN temp.shard_touched;"
+			"INSERT INTO shardIndex.did_plc_changes (operation, handle, did, label, domain, locked) "
+			"SELECT 'put', LOWER(handle), LOWER(did), LOWER(label), LOWER(domain), IFNULL(locked, 0) FROM main.did_plc_users "
+			"WHERE handle IN temp.shard_touched ORDER BY LOWER(handle);"
+			"DELETE FROM main.did_plc_pending WHERE sequence = %lld;", sequence, shard, shard, shard, sequence);
+
+	int rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
+	if (rc != SQLITE_OK) fprintf(stderr, "ERROR: Moving shard %d change %lld to the change log failed: %s\n", shard, sequence, err_msg ? err_msg : sqlite3_errmsg(db));
+	sqlite3_free(err_msg);
+	return rc;
+}
+
+// MOVE A SHARD'S PENDING ROWS ONE AT A TIME, EACH IN ITS OWN TRANSACTION. A ROW THAT CONFLICTS WITH ANOTHER SHARD GOES
+// TO did_plc_quarantine FOR AN OPERATOR TO LOOK AT, SO THE ROWS AFTER IT STILL MOVE. RETURNS 0, OR 1 ON AN ERROR.
+static int drainShardPending (sqlite3 *db, int shard)
+{
+	if (attachShardIndex(db) != SQLITE_OK) return 1;
+
+	for (;;) {
+		if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, NULL) != SQLITE_OK) {
+			fprintf(stderr, "ERROR: Unable to collect shard %d changes: %s\n", shard, sqlite3_errmsg(db));
+			return 1;
+		}
+
+		sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT MIN(sequence) FROM main.did_plc_pending;");
+		if (!stmt) {
+			sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+			return 1;
+		}
+		int found = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL;
+		long long sequence = found ? sqlite3_column_int64(stmt, 0) : 0;
+		sqlite3_finalize(stmt);
+		if (!found) {
+			sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+			return 0;
+		}
+
+		int rc = sqlite3_exec(db, "SAVEPOINT shard_move;", 0, 0, NULL);
+		if (rc == SQLITE_OK) rc = moveShardChange(db, shard, sequence);
+		if (rc == SQLITE_CONSTRAINT) {
+			char quarantine[512];
+			snprintf(quarantine, sizeof(quarantine), "ROLLBACK TO shard_move;"
+						"INSERT INTO main.did_plc_quarantine (sequence, operation, handle, did, label, domain, locked, change_time) "
+						"SELECT sequence, operation, handle, did, label, domain, locked, change_time FROM main.did_plc_pending WHERE sequence = %lld;"
+						"DELETE FROM main.did_plc_pending WHERE sequence = %lld;", sequence, sequence);
+			rc = sqlite3_exec(db, quarantine, 0, 0, NULL);
+			if (rc == SQLITE_OK) {
+				fprintf(stderr, "ERROR: Shard %d change %lld conflicts with another shard, moved to did_plc_quarantine\n", shard, sequence);
+				syslog(LOG_WARNING, "Shard %d change %lld conflicts with another shard, quarantined", shard, sequence);
+				METRIC_ADD(shardQuarantined, 1);
+			}
+		}
+		if (rc != SQLITE_OK || sqlite3_exec(db, "RELEASE shard_move; COMMIT;", 0, 0, NULL) != SQLITE_OK) {
+			fprintf(stderr, "ERROR: Collecting shard %d change %lld failed: %s\n", shard, sequence, sqlite3_errmsg(db));
+			sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+			return 1;
+		}
+	}
+}
+
+// BRING EDITS MADE DIRECTLY TO THE SHARD FILES (THE sqlite3 SHELL) INTO THE CHANGE LOG. CALLED BEFORE THE LOG IS READ,
+// SO REPLICAS, THE HANDLE INDEX AND THE WELL-KNOWN FILES PICK THEM UP. A NO-OP FOR A SINGLE FILE, WHICH LOGS DIRECTLY.
+void collectShardChanges (void)
+{
+	for (int i = 0; i < shardCountGlobal; i++) {
+		sqlite3 *db = databaseOpen(shardDatabasesGlobal[i]);
+		if (!db) continue;
+
+		// MOST OF THE TIME THERE IS NOTHING TO MOVE, AND NO WRITE LOCK IS TAKEN
+		sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT EXISTS (SELECT 1 FROM did_plc_pending);");
+		if (!stmt) {
+			sqlite3_close(db);
+			continue;
+		}
+		int pending = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
+
+		if (pending) drainShardPending(db, i);
+		sqlite3_close(db);
+	}
+}
+
+
+// INITIALIZE DATABASE, RETURNS DATABASE_SUCCESS 0 IF SUCESSFUL, DATABASE_ERROR 1 IF IT FAILED.
+int initializeUserDatabase( ) {
+	char *err_msg = 0;
+    int rc;
+
+	// THE FILES ON DISK MUST MATCH THE CONFIGURED NUMBER OF SHARDS, 'handled reshard' MOVES BETWEEN THEM
+	int storedShards = storedShardLayout();
+	if (storedShards < 0) return DATABASE_ERROR;
+	if (storedShards != shardCountGlobal && (storedShards != 0 || access(principalDatabaseGlobal, F_OK) == 0)) {
+		fprintf(stderr, "ERROR: The user database has %d shards but shards=%d, run 'handled reshard' first\n", storedShards, shardCountGlobal);
+		return DATABASE_ERROR;
+	}
+	if (shardCountGlobal > 0) return initializeShardedDatabase();
+	
+    sqlite3 *db = databaseOpen(principalDatabaseGlobal);
+    if (!db) {
+        return DATABASE_ERROR;
+    }
+
+    rc = sqlite3_exec(db, SQL_CREATE_USER_TABLE, 0, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "ERROR: Principal User Table creation failed: %s\n", err_msg);
+		sqlite3_free(err_msg);
+        sqlite3_close(db);
+        return DATABASE_ERROR;
+    }
+
+    rc = sqlite3_exec(db, "BEGIN IMMEDIATE;" SQL_CREATE_CHANGE_LOG, 0, 0, &err_msg);
+    if (rc == SQLITE_OK) rc = upgradeChangeLog(db);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(db, SQL_LOG_USER_CHANGES "COMMIT;", 0, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "ERROR: Change log creation failed: %s\n", err_msg ? err_msg : sqlite3_errmsg(db));
+		sqlite3_free(err_msg);
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+        sqlite3_close(db);
+        return DATABASE_ERROR;
+    }
+
+	#ifdef VERBOSE_FLAG
+	printf("Principal user table ready: '%s'\n", principalDatabaseGlobal);
+	#endif
+
+    // CLOSE THE DATABASE
+	sqlite3_free(err_msg);
+    sqlite3_close(db);
+
+	return DATABASE_SUCCESS;
+}
+
+
+// NORMALIZE ONE LINE OF THE RESERVED LIST IN PLACE: TRIMMED AND IN LOWER CASE, AS LABELS ARE LOOKED UP.
+// RETURNS NULL FOR BLANK LINES AND '#' COMMENTS.
+static char *normalizeReservedWord (char *line)
+{
+	while (isspace((unsigned char)*line)) line++;
+	if (*line == '\0' || *line == '#') return NULL;
+
+	size_t length = strlen(line);
+	while (length > 0 && isspace((unsigned char)line[length - 1])) line[--length] = '\0';
+	for (char *c = line; *c; c++) *c = (char)tolower((unsigned char)*c);
+	return line;
+}
+
+static int compareReservedWords (const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// READ THE RESERVED LIST INTO ONE BUFFER, NORMALIZED, SORTED AND WITHOUT DUPLICATES. '*words' POINTS INTO '*text'.
+// RETURNS THE NUMBER OF WORDS, OR -1 ON FAILURE. THE CALLER FREES BOTH.
+static long loadReservedList (const char *path, char **text, char ***words, long *lines)
+{
+	*text = NULL;
+	*words = NULL;
+	*lines = 0;
+
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		perror("Failed to open file reserved word list");
+		return -1;
+	}
+	struct stat info;
+	if (fstat(fileno(file), &info) != 0 || !(*text = malloc((size_t)info.st_size + 1))) {
+		fclose(file);
+		return -1;
+	}
+	size_t size = fread(*text, 1, (size_t)info.st_size, file);
+	fclose(file);
+	(*text)[size] = '\0';
+
+	long count = 0, capacity = 0;
+	for (char *line = *text, *next; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next) *next++ = '\0';
+		(*lines)++;
+
+		char *word = normalizeReservedWord(line);
+		if (!word) continue;
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 4096;
+			char **grown = realloc(*words, (size_t)capacity * sizeof(char *));
+			if (!grown) return -1;
+			*words = grown;
+		}
+		(*words)[count++] = word;
+	}
+
+	if (count > 1) qsort(*words, (size_t)count, sizeof(char *), compareReservedWords);
+	long unique = 0;
+	for (long i = 0; i < count; i++) {
+		if (unique == 0 || strcmp((*words)[unique - 1], (*words)[i]) != 0) (*words)[unique++] = (*words)[i];
+	}
+	return unique;
+}
+
+// INITIALIZE/REBUILD FILTER DATABASE FROM THE RESERVED LIST, IN ONE TRANSACTION. THE LIST IS NORMALIZED, SORTED
+// AND DEDUPLICATED IN MEMORY, THEN MERGED WITH THE TABLE IN KEY ORDER, SO ONLY THE WORDS ADDED TO OR REMOVED FROM
+// THE LIST ARE WRITTEN. THE WORD IS THE PRIMARY KEY, SO labelReserved IS ONE INDEX LOOKUP. A RUNNING DAEMON SEES
+// THE OLD LIST OR THE NEW ONE.
+// RETURNS DATABASE_SUCCESS 0 IF SUCESSFUL, DATABASE_ERROR 1 IF IT FAILED.
+int initializeFilterDatabase( ) {
+	long long started = monotonicMicroseconds();
+
+	char *reservedHandleFile = (char *)buildAbsolutePath( baseDirectory, RESERVED_HANDLES_FILENAME );
+	if (!reservedHandleFile) {
+		fprintf(stderr, "Memory allocation failure (file name).\n");
+		return DATABASE_ERROR;
+	}
+
+	#ifdef VERBOSE_FLAG
+	printf("Loading database from reserved handle list: %s\n", reservedHandleFile);
+	#endif
+
+	char *text = NULL;
+	char **words = NULL;
+	long lines = 0;
+	long count = loadReservedList(reservedHandleFile, &text, &words, &lines);
+	free(reservedHandleFile);
+	if (count < 0) {
+		free(text);
+		free(words);
+		return DATABASE_ERROR;
+	}
+
+	sqlite3 *db = databaseOpen( filterDatabaseGlobal );
+	if (!db) {
+		free(text);
+		free(words);
+		return DATABASE_ERROR;
+	}
+
+	char *err_msg = NULL;
+	sqlite3_stmt *select = NULL;
+	sqlite3_stmt *insert = NULL;
+	sqlite3_stmt *delete = NULL;
+	struct textBuffer removedWords = {0};
+	int result = DATABASE_ERROR;
+	long added = 0, removed = 0;
+
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, &err_msg) != SQLITE_OK) goto cleanup;
+
+	// A TABLE FROM BEFORE THE WORD WAS ITS PRIMARY KEY IS REPLACED, ONCE
+	if (sqlite3_prepare_v2(db, "SELECT sql FROM sqlite_master WHERE name = 'reservedHandleTable';", -1, &select, NULL) != SQLITE_OK) goto cleanup;
+	int outdated = sqlite3_step(select) == SQLITE_ROW && !strstr((const char *)sqlite3_column_text(select, 0), "PRIMARY KEY");
+	sqlite3_finalize(select);
+	select = NULL;
+	if (outdated && sqlite3_exec(db, "DROP TABLE reservedHandleTable;", 0, 0, &err_msg) != SQLITE_OK) goto cleanup;
+	if (sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS reservedHandleTable (word TEXT NOT NULL PRIMARY KEY) WITHOUT ROWID;", 0, 0, &err_msg) != SQLITE_OK) goto cleanup;
+
+	if (sqlite3_prepare_v2(db, "SELECT word FROM reservedHandleTable ORDER BY word;", -1, &select, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "INSERT INTO reservedHandleTable (word) VALUES (?);", -1, &insert, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "DELETE FROM reservedHandleTable WHERE word = ?;", -1, &delete, NULL) != SQLITE_OK) goto cleanup;
+
+	// MERGE THE TABLE WITH THE LIST, BOTH IN strcmp ORDER (SQLITE'S BINARY COLLATION). WORDS ALREADY STORED ARE
+	// DROPPED FROM 'words', WHICH LEAVES THE NEW ONES, AND STORED WORDS NO LONGER LISTED ARE COLLECTED.
+	long next = 0, kept = 0;
+	int rc;
+	while ((rc = sqlite3_step(select)) == SQLITE_ROW) {
+		const char *stored = (const char *)sqlite3_column_text(select, 0);
+		int order = 1;
+		while (next < count && (order = strcmp(words[next], stored)) < 0) words[kept++] = words[next++];
+		if (next < count && order == 0) next++;
+		else if (textBufferAppend(&removedWords, "%s%c", stored, '\0') != 0) goto cleanup;
+	}
+	if (rc != SQLITE_DONE) goto cleanup;
+	while (next < count) words[kept++] = words[next++];
+	sqlite3_reset(select);
+
+	// THE WRITES COME AFTER THE READ, WHICH MUST NOT SEE THEM
+	for (size_t offset = 0; offset < removedWords.length; offset += strlen(removedWords.data + offset) + 1) {
+		sqlite3_bind_text(delete, 1, removedWords.data + offset, -1, SQLITE_STATIC);
+		rc = sqlite3_step(delete);
+		sqlite3_reset(delete);
+		if (rc != SQLITE_DONE) goto cleanup;
+		removed++;
+	}
+	for (long i = 0; i < kept; i++) {
+		sqlite3_bind_text(insert, 1, words[i], -1, SQLITE_STATIC);
+		rc = sqlite3_step(insert);
+		sqlite3_reset(insert);
+		if (rc != SQLITE_DONE) goto cleanup;
+		added++;
+	}
+
+	if (sqlite3_exec(db, "COMMIT;", 0, 0, &err_msg) != SQLITE_OK) goto cleanup;
+	result = DATABASE_SUCCESS;
+
+	printf("Reserved words: %ld unique from %ld lines, %ld added, %ld removed in %.3f s\n",
+		   count, lines, added, removed, (double)(monotonicMicroseconds() - started) / 1e6);
+
+	#ifdef VERBOSE_FLAG
+	printf("Reserved handle database is ready: %s\n", filterDatabaseGlobal);
+	#endif
+
+cleanup:
+	if (result != DATABASE_SUCCESS) {
+		fprintf(stderr, "Reserved Label Table Creation Failed: %s\n", err_msg ? err_msg : sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+	}
+	sqlite3_free(err_msg);
+	sqlite3_finalize(select);
+	sqlite3_finalize(insert);
+	sqlite3_finalize(delete);
+	sqlite3_close(db);
+	free(removedWords.data);
+	free(words);
+	free(text);
+	return result;
+}
+
+
+// *********************************************
+// ********* WELL-KNOWN FILES ******************
+// *********************************************
+
+// WITH static_root SET, EVERY HANDLE IS ALSO A FILE, <static_root>/<handle>/.well-known/atproto-did HOLDING ITS DID,
+// SO NGINX ANSWERS VERIFICATIONS WITH try_files AND NEVER PROXIES THEM. THE DATABASE STAYS THE SOURCE OF TRUTH: A
+// REGISTRATION WRITES ITS FILE AS SOON AS IT COMMITS, AND ONE PROCESS FOLLOWS THE CHANGE LOG INTO THE TREE FOR
+// EVERYTHING ELSE (SEE startStaticFiles). A FILE IS WRITTEN UNDER A TEMPORARY NAME AND RENAMED OVER THE OLD ONE, SO
+// NGINX READS THE OLD DID OR THE NEW ONE, NEVER PART OF ONE.
+static atomic_ulong staticTemporaryCounter = 0;		// Temporary names, unique per writer
+
+// REPLACE 'path' WITH A FILE HOLDING 'contents'. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+static int staticReplaceFile (const char *path, const char *contents)
+{
+	char temporary[PATH_MAX];
+	snprintf(temporary, sizeof(temporary), "%s.%d.%lu" STATIC_TEMPORARY_SUFFIX, path, (int)getpid(), atomic_fetch_add(&staticTemporaryCounter, 1));
+
+	int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return 1;
+	size_t length = strlen(contents);
+	int failed = write(fd, contents, length) != (ssize_t)length;
+	failed |= close(fd) != 0;
+	if (!failed && rename(temporary, path) == 0) return 0;
+
+	unlink(temporary);
+	return 1;
+}
+
+// WRITE THE FILE OF 'handle' HOLDING 'did' UNDER 'root', OR REMOVE IT (AND ITS DIRECTORIES) WHEN 'did' IS NULL.
+// RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+int materializeHandle (const char *root, const char *handle, const char *did)
+{
+	// THE HANDLE BECOMES A DIRECTORY NAME, SO ONLY A WELL FORMED ONE, LOWER CASED LIKE NGINX'S $host
+	char name[URL_MAX_SIZE];
+	size_t length = strlen(handle);
+	if (length >= sizeof(name) || regexec(&regexFullHandle, handle, 0, NULL, 0) != 0) {
+		fprintf(stderr, "STATIC: Not writing a file for handle '%s'\n", handle);
+		return 1;
+	}
+	for (size_t i = 0; i <= length; i++) name[i] = (char)tolower((unsigned char)handle[i]);
+
+	char path[PATH_MAX];
+	int failed = 0;
+	if (!did) {
+		snprintf(path, sizeof(path), "%s/%s" URL_WELL_KNOWN_ATPROTO, root, name);
+		failed = unlink(path) != 0 && errno != ENOENT;
+		snprintf(path, sizeof(path), "%s/%s/.well-known", root, name);
+		rmdir(path);
+		snprintf(path, sizeof(path), "%s/%s", root, name);
+		rmdir(path);
+		if (!failed) METRIC_ADD(staticFilesRemoved, 1);
+	} else {
+		snprintf(path, sizeof(path), "%s/%s", root, name);
+		failed = mkdir(path, 0755) != 0 && errno != EEXIST;
+		snprintf(path, sizeof(path), "%s/%s/.well-known", root, name);
+		failed = failed || (mkdir(path, 0755) != 0 && errno != EEXIST);
+		snprintf(path, sizeof(path), "%s/%s" URL_WELL_KNOWN_ATPROTO, root, name);
+		failed = failed || staticReplaceFile(path, did) != 0;
+		if (!failed) METRIC_ADD(staticFilesWritten, 1);
+	}
+
+	if (failed) {
+		fprintf(stderr, "STATIC: Updating '%s' failed: %s\n", path, strerror(errno));
+		METRIC_ADD(staticFileErrors, 1);
+	}
+	return failed;
+}
+
+// TAKE THE TREE LOCK, ACROSS PREFORK WORKERS. THE FOLLOWER HOLDS IT WHILE IT APPLIES A BATCH OF THE CHANGE LOG.
+// RETURNS THE DESCRIPTOR TO PASS TO staticUnlockTree, OR -1.
+static int staticLockTree (const char *root)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/" STATIC_LOCK_FILENAME, root);
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) return -1;
+
+	while (flock(fd, LOCK_EX) != 0) {
+		if (errno == EINTR) continue;
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void staticUnlockTree (int fd)
+{
+	if (fd < 0) return;
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+// BRING THE FILE OF 'handle' IN LINE WITH ITS ROW AS IT IS NOW IN 'db', UNDER THE TREE LOCK. A REGISTRATION WRITES ITS
+// FILE THIS WAY, AFTER IT COMMITS: IF THE FOLLOWER ALREADY APPLIED A LATER CHANGE (A DELETE FROM THE SHELL), THE ROW
+// SHOWS IT, AND AN OLD DID IS NOT WRITTEN BACK. A CHANGE COMMITTED AFTER THE READ IS LEFT TO THE FOLLOWER.
+// RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+static int materializeCurrentHandle (const char *root, sqlite3 *db, const char *handle)
+{
+	sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT did FROM did_plc_users WHERE handle = ?;");
+	if (!stmt) return 1;
+
+	int fd = staticLockTree(root);
+	if (fd < 0) {
+		fprintf(stderr, "STATIC: Unable to lock '%s': %s\n", root, strerror(errno));
+		sqlite3_finalize(stmt);
+		return 1;
+	}
+
+	int failed = 1;
+	if (databaseBindKey(stmt, 1, handle, db) == SQLITE_OK) {
+		int rc = sqlite3_step(stmt);
+		const char *did = rc == SQLITE_ROW ? (const char *)sqlite3_column_text(stmt, 0) : NULL;
+		if (rc == SQLITE_ROW && validateDid(did) == KEY_VALID) failed = materializeHandle(root, handle, did);
+		else if (rc == SQLITE_DONE) failed = materializeHandle(root, handle, NULL);
+		else if (rc != SQLITE_ROW) fprintf(stderr, "STATIC: Reading '%s' failed: %s\n", handle, sqlite3_errmsg(db));
+	}
+	staticUnlockTree(fd);
+
+	sqlite3_finalize(stmt);
+	return failed;
+}
+
+
+void freeNewRecordResult(newRecordResult *record) {
+    if (record) {
+        free(record->token);  // Free the token
+        free(record);         // Free the struct
+    }
+}
+
+
+// TRY ADDING A NEW REPORT. RETURNS newRecordResult (result and token IF SUCCESSFUL). CONSIDER MAKING TOKEN INTO A POINTER.
+// HANDLE IS HOST, LABEL IS SUBDOMAIN
+static newRecordResult *storeNewRecord (const char *handle, const char *label, const char *did, const char *email) {
+	newRecordResult *newRecord = malloc(sizeof(newRecordResult));
+	
+	if (!newRecord) {
+		fprintf(stderr, "ERROR: Memory allocation failed\n");
+		return NULL;  // Signal failure to allocate memory
+	}
+	
+	newRecord->result = RECORD_ERROR_DATABASE;  // Default error status
+	newRecord->token = NULL;                    // NULL to indicate no token yet
+
+	// ADD AN EMAIL DETAIL CHECKER HERE
+
+    if (!handle || !label || !did ) {
+        newRecord->result = RECORD_NULL_DATA;
+        return newRecord;
+    }	
+
+    if ( strlen(handle) == 0 || strlen(label) == 0 || strlen(did) == 0 ) {
+        newRecord->result = RECORD_EMPTY_DATA;
+        return newRecord;
+    }	
+	
+	// VALIDATION
+	
+	// ADD HANDLE (HOST) VALIDATION, UNTIL THEN ASSUME IT IS OK
+	
+	if ( validateHandle(label) == KEY_INVALID ) {
+		newRecord->result = RECORD_INVALID_LABEL;
+		return newRecord;
+	}
+
+	if ( validateDid(did) == KEY_INVALID ) {
+		newRecord->result = RECORD_INVALID_DID;
+		return newRecord;
+	}
+
+	// MOST DUPLICATES ARE KNOWN TO THE HANDLE INDEX, BEFORE ANY TOKEN OR DATABASE WORK. THE UNIQUE
+	// CONSTRAINTS STILL CATCH WHAT IT HAS NOT SEEN YET.
+	if ( handleIndexClaimed(handle, did) ) {
+		newRecord->result = RECORD_ERROR_DUPLICATE_DATA;
+		fprintf(stderr, "ERROR: Duplicate account found, unable to process: %s\n", handle);
+		return newRecord;
+	}
+	
+	// BASIC INFO VALID, CREATE TOKEN
+	char tempToken[TOKEN_LENGTH + 1]; // +1 for the null terminator
+	generateSecureToken(tempToken);
+
+    sqlite3 *db = databaseOpen(userDatabaseFor(handle));
+    if (!db) return newRecord;
+
+	// A SHARDED STORE CLAIMS THE DID, LABEL AND HANDLE IN THE SHARD INDEX FIRST, IN THE SAME TRANSACTION AS THE INSERT
+	int sharded = shardCountGlobal > 0;
+	int shard = sharded ? shardForHandle(handle, shardCountGlobal) : 0;
+	if (sharded) {
+		if (attachShardIndex(db) != SQLITE_OK || sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, NULL) != SQLITE_OK) {
+			fprintf(stderr, "ERROR: Unable to start sharded insert: %s\n", sqlite3_errmsg(db));
+			sqlite3_close(db);
+			return newRecord;
+		}
+
+		int claimed = claimShardIndex(db, handle, label, did, shard);
+		if (claimed != SQLITE_DONE) {
+			if (claimed == SQLITE_CONSTRAINT) {
+				newRecord->result = RECORD_ERROR_DUPLICATE_DATA;
+				fprintf(stderr, "ERROR: Duplicate account found, unable to process: %s\n", sqlite3_errmsg(db));
+			}
+			sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+			sqlite3_close(db);
+			return newRecord;
+		}
+	}
+
+    // SQL STATEMENT WITH PLACEHOLDERS FOR THE PARAMETERS
+	// ALL VALUES ARE NORMALIZED TO LOWERCASE EXCEPT FOR TOKEN
+    const char *insertUserRecordSql = 
+        "INSERT INTO did_plc_users (handle, did, label, domain, token, email) "
+        "VALUES (LOWER(?), LOWER(?), LOWER(?), LOWER(?), ?, ?);";
+
+	// PREPARE SQL STATEMENT
+    sqlite3_stmt *stmt = databasePrepareStatement (db, insertUserRecordSql);	
+	if (!stmt) {
+		if (sharded) sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+		sqlite3_close(db);
+		return newRecord;
+	}
+
+    // Bind parameters to the prepared statement using databaseBindKey
+    if (databaseBindKey(stmt, 1, handle, db) != SQLITE_OK || databaseBindKey(stmt, 2, did, db) != SQLITE_OK ||
+		databaseBindKey(stmt, 3, label, db) != SQLITE_OK || databaseBindKey(stmt, 4, domainName, db) != SQLITE_OK ||
+        databaseBindKey(stmt, 5, tempToken, db) != SQLITE_OK || databaseBindKey(stmt, 6, email, db) != SQLITE_OK)
+	{
+		fprintf(stderr, "ERROR: Unable to prepare SQL statement: %s\n", sqlite3_errmsg(db));
+		sqlite3_finalize(stmt);
+        sqlite3_close(db);
+		return newRecord;
+	}
+
+    // Execute the statement
+    int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+		if (rc == SQLITE_CONSTRAINT) {
+			newRecord->result = RECORD_ERROR_DUPLICATE_DATA;
+			fprintf(stderr, "ERROR: Duplicate account found, unable to process: %s\n", sqlite3_errmsg(db));
+		}
+        else fprintf(stderr, "ERROR: New record creation failed (%d): %s\n", rc, sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+		if (sharded) sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+        sqlite3_close(db);
+		return newRecord;
+    }
+
+	sqlite3_finalize(stmt);
+
+	// ONLY THE ROW THIS INSERT'S TRIGGER ADDED MOVES HERE, SHELL EDITS WAITING IN THE SHARD ARE LEFT TO THE COLLECTOR
+	long long pendingSequence = -1;
+	if (sharded) {
+		sqlite3_stmt *pendingStmt = databasePrepareStatement(db, "SELECT MAX(sequence) FROM main.did_plc_pending;");
+		pendingSequence = pendingStmt && sqlite3_step(pendingStmt) == SQLITE_ROW ? sqlite3_column_int64(pendingStmt, 0) : -1;
+		sqlite3_finalize(pendingStmt);
+	}
+	if (sharded && (pendingSequence < 0 || moveShardChange(db, shard, pendingSequence) != SQLITE_OK || sqlite3_exec(db, "COMMIT;", 0, 0, NULL) != SQLITE_OK)) {
+		fprintf(stderr, "ERROR: New record creation failed (commit): %s\n", sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+		sqlite3_close(db);
+		return newRecord;
+	}
+
+    // Dynamically allocate memory for the token
+    newRecord->token = strndup(tempToken, TOKEN_LENGTH + 1); // Ensure caller frees this memory
+    if (!newRecord->token) {
+        fprintf(stderr, "ERROR: Memory allocation for token failed\n");
+        free(newRecord);  // Clean up previously allocated memory
+        sqlite3_close(db);
+        return NULL;
+    }
+    newRecord->result = RECORD_VALID; // Ensure caller frees this memory
+	printf("New record created successfully: %s\n", handle);
+
+	// THE VALUES AS STORED (LOWER CASED BY THE INSERT), SO THE INDEX AND THE FILE MATCH THE ROW AND THE CHANGE LOG
+	char storedHandle[URL_MAX_SIZE], storedDid[MAXDIDSIZE + 1], storedLabel[URL_MAX_SIZE];
+	snprintf(storedHandle, sizeof(storedHandle), "%s", handle);
+	snprintf(storedDid, sizeof(storedDid), "%s", did);
+	snprintf(storedLabel, sizeof(storedLabel), "%s", label);
+	for (char *c = storedHandle; *c; c++) *c = (char)tolower((unsigned char)*c);
+	for (char *c = storedDid; *c; c++) *c = (char)tolower((unsigned char)*c);
+	for (char *c = storedLabel; *c; c++) *c = (char)tolower((unsigned char)*c);
+
+	// THE INDEX WRITER KNOWS ITS OWN REGISTRATION AT ONCE, THE CHANGE LOG FOLLOWER BRINGS IN THE REST
+	if (handleIndexLoaded) {
+		struct changeEntryStruct entry = {0, TRUE, storedHandle, storedDid, storedLabel, domainName, FALSE};
+		handleIndexApply(&entry, 1);
+	}
+
+	// AND ITS WELL-KNOWN FILE, SO NGINX ANSWERS FOR IT RIGHT AWAY, AS THE ROW IS BY THE TIME THE TREE LOCK IS HELD
+	if (configGlobal.staticRoot[0] != '\0') {
+		char *root = configFilePath(configGlobal.staticRoot);
+		if (root) materializeCurrentHandle(root, db, storedHandle);
+		free(root);
+	}
+
+    // Close the database
+    sqlite3_close(db);
+
+    return newRecord;
+}
+
+// SAME, BETWEEN THE record_start AND record_done PROBES
+newRecordResult *addNewRecord (const char *handle, const char *label, const char *did, const char *email) {
+	HANDLED_PROBE2(record_start, handle, did);
+	newRecordResult *newRecord = storeNewRecord(handle, label, did, email);
+	HANDLED_PROBE2(record_done, handle, newRecord ? (int)newRecord->result : (int)RECORD_ERROR_DATABASE);
+	return newRecord;
+}
+
+
+// QUERY PRINCIPAL DATABASE FOR EXISTENCE OF SPECIFIC 'handle' (FULL HOST NAME)
+int handleRegistered(const char *handle) {
+	const char *sql = "SELECT 1 FROM did_plc_users WHERE handle = ? LIMIT 1;";
+    return databaseGenericSingularQuery(userDatabaseFor(handle), sql, handle);
+}
+
+
+// *********************************************
+// ********* RESERVED TERMS ********************
+// *********************************************
+
+// A RESERVED LIST ENTRY IS A WORD, MATCHED EXACTLY, OR A PATTERN: 'word*' RESERVES EVERY LABEL STARTING WITH word,
+// '*word' EVERY LABEL ENDING WITH IT AND '*word*' EVERY LABEL CONTAINING IT. THE DAEMON COMPILES THE WHOLE LIST INTO
+// ONE AHO-CORASICK AUTOMATON, SO A LABEL IS CHECKED AGAINST ALL ENTRIES IN ONE PASS OVER ITS BYTES. THE LABEL IS
+// SCANNED BETWEEN TWO ANCHOR BYTES THAT NO LABEL CONTAINS: AN EXACT WORD IS COMPILED AS START, WORD, END, A PREFIX
+// KEEPS ONLY THE START ANCHOR AND A SUFFIX ONLY THE END ANCHOR. STATES ARE NUMBERED BREADTH FIRST, SO THE CHILDREN
+// OF A STATE ARE CONSECUTIVE AND SORTED BY BYTE, 12 BYTES A STATE. A BUILT AUTOMATON IS NEVER CHANGED: THE
+// SUPERVISOR, OR THE ONLY PROCESS, COMPILES IT INTO THE NEXT HALF OF reservedVersions AND PUBLISHES IT, AND EVERY
+// WORKER READS THAT ONE COPY. A READ RACING TWO RELOADS STAYS IN BOUNDS, AS EVERY STATE NUMBER IS CHECKED, AND IS
+// DONE AGAIN.
+#define RESERVED_ANCHOR_START	"\x02"
+#define RESERVED_ANCHOR_END		"\x03"
+#define RESERVED_ROOT			0				// State number of the root
+
+struct reservedStateStruct {
+	uint32_t firstChild;						// Children are consecutive states
+	uint32_t fail;								// Longest proper suffix of this state that is also a state
+	uint16_t children;
+	uint8_t byte;								// On the edge from the parent
+	uint8_t match;								// An entry ends here, or on the failure chain
+};
+
+struct reservedAutomatonStruct {
+	uint32_t stateCount;						// 0 until one is published
+	uint32_t root[256];							// Transitions from the root, RESERVED_ROOT if none
+	size_t entries;
+	struct reservedStateStruct states[];
+};
+
+static struct sharedVersionsStruct reservedVersions;
+
+// STATE AFTER 'byte'. A STATE OUT OF RANGE GOES BACK TO THE ROOT, AND A FAILURE LINK ONLY TO A LOWER STATE (A
+// SHALLOWER ONE, EARLIER BREADTH FIRST), SO EVEN A TORN READ STAYS IN BOUNDS AND ENDS.
+static uint32_t reservedAutomatonNext (const struct reservedAutomatonStruct *automaton, uint32_t stateCount, uint32_t state, unsigned char byte)
+{
+	for (;;) {
+		if (state == RESERVED_ROOT) return automaton->root[byte] < stateCount ? automaton->root[byte] : RESERVED_ROOT;
+
+		const struct reservedStateStruct *current = &automaton->states[state];
+		uint32_t first = current->firstChild, end = first + current->children;
+		if (first <= end && end <= stateCount) {
+			uint32_t low = first, high = end;
+			while (low < high) {
+				uint32_t middle = low + (high - low) / 2;
+				if (automaton->states[middle].byte < byte) low = middle + 1;
+				else high = middle;
+			}
+			if (low < end && automaton->states[low].byte == byte) return low;
+		}
+		state = current->fail < state ? current->fail : RESERVED_ROOT;
+	}
+}
+
+// TRUE IF ANY ENTRY MATCHES 'label', -1 IF NO AUTOMATON IS PUBLISHED. NO LOCKS, NO ALLOCATION.
+static int reservedAutomatonMatch (const struct reservedAutomatonStruct *automaton, const char *label)
+{
+	uint32_t stateCount = automaton->stateCount;
+	if (stateCount == 0 || stateCount > (reservedVersions.halfSize - sizeof(*automaton)) / sizeof(struct reservedStateStruct)) return -1;
+
+	uint32_t state = reservedAutomatonNext(automaton, stateCount, RESERVED_ROOT, (unsigned char)RESERVED_ANCHOR_START[0]);
+	if (automaton->states[state].match) return TRUE;
+	for (const unsigned char *c = (const unsigned char *)label; *c; c++) {
+		state = reservedAutomatonNext(automaton, stateCount, state, (unsigned char)tolower(*c));
+		if (automaton->states[state].match) return TRUE;
+	}
+	state = reservedAutomatonNext(automaton, stateCount, state, (unsigned char)RESERVED_ANCHOR_END[0]);
+	return automaton->states[state].match != 0;
+}
+
+// TRIE NODE WHILE BUILDING, LINKED AS FIRST CHILD AND NEXT SIBLING
+struct reservedTrieStruct {
+	uint32_t firstChild;
+	uint32_t lastChild;
+	uint32_t nextSibling;
+	uint8_t byte;
+	uint8_t terminal;
+};
+
+// COMPILE ANCHORED PATTERNS, SORTED IN PLACE HERE, INTO THE 'room' BYTES AT 'into'. A SORTED INPUT SHARES ITS
+// PREFIX WITH THE PATTERN BEFORE IT, SO THE TRIE ONLY EVER COMPARES WITH, OR APPENDS AFTER, THE LAST CHILD.
+// RETURNS NULL ON FAILURE.
+static struct reservedAutomatonStruct *reservedAutomatonBuild (char **patterns, size_t count, unsigned char *into, size_t room)
+{
+	size_t bytes = 1;
+	for (size_t i = 0; i < count; i++) bytes += strlen(patterns[i]);
+	if (bytes >= UINT32_MAX) return NULL;
+	if (count > 1) qsort(patterns, count, sizeof(char *), compareReservedWords);
+
+	struct reservedTrieStruct *trie = calloc(bytes, sizeof(*trie));
+	uint32_t *order = malloc(bytes * sizeof(uint32_t));
+	uint32_t *renumbered = malloc(bytes * sizeof(uint32_t));
+	if (!trie || !order || !renumbered) {
+		free(trie);
+		free(order);
+		free(renumbered);
+		return NULL;
+	}
+
+	uint32_t nodes = 1;
+	for (size_t i = 0; i < count; i++) {
+		uint32_t node = RESERVED_ROOT;
+		for (const unsigned char *c = (const unsigned char *)patterns[i]; *c; c++) {
+			uint32_t last = trie[node].lastChild;
+			if (last != RESERVED_ROOT && trie[last].byte == *c) {
+				node = last;
+				continue;
+			}
+			trie[nodes].byte = *c;
+			if (last != RESERVED_ROOT) trie[last].nextSibling = nodes;
+			else trie[node].firstChild = nodes;
+			trie[node].lastChild = nodes;
+			node = nodes++;
+		}
+		trie[node].terminal = TRUE;
+	}
+
+	// BREADTH FIRST ORDER BECOMES THE STATE NUMBERING
+	uint32_t queued = 1;
+	order[0] = RESERVED_ROOT;
+	for (uint32_t i = 0; i < queued; i++) {
+		renumbered[order[i]] = i;
+		for (uint32_t child = trie[order[i]].firstChild; child != RESERVED_ROOT; child = trie[child].nextSibling) order[queued++] = child;
+	}
+
+	struct reservedAutomatonStruct *automaton = (struct reservedAutomatonStruct *)into;
+	if (nodes > (room - sizeof(*automaton)) / sizeof(struct reservedStateStruct)) {
+		fprintf(stderr, "Reserved list of %u states does not fit the %zu bytes reserved\n", nodes, room);
+		free(trie);
+		free(order);
+		free(renumbered);
+		return NULL;
+	}
+	memset(automaton, 0, sizeof(*automaton) + nodes * sizeof(struct reservedStateStruct));
+	automaton->stateCount = nodes;
+	automaton->entries = count;
+	for (uint32_t i = 0; i < nodes; i++) {
+		struct reservedTrieStruct *node = &trie[order[i]];
+		struct reservedStateStruct *state = &automaton->states[i];
+		state->byte = node->byte;
+		state->match = node->terminal;
+		if (node->firstChild != RESERVED_ROOT) state->firstChild = renumbered[node->firstChild];
+		for (uint32_t child = node->firstChild; child != RESERVED_ROOT; child = trie[child].nextSibling) state->children++;
+	}
+	free(trie);
+	free(order);
+	free(renumbered);
+
+	// FAILURE LINKS, SHALLOWEST FIRST: A STATE'S LINK ONLY FOLLOWS LINKS OF SHALLOWER STATES, ALREADY SET
+	struct reservedStateStruct *states = automaton->states;
+	for (uint32_t child = 0; child < states[RESERVED_ROOT].children; child++) {
+		uint32_t state = states[RESERVED_ROOT].firstChild + child;
+		automaton->root[states[state].byte] = state;
+		states[state].fail = RESERVED_ROOT;
+	}
+	for (uint32_t parent = 1; parent < nodes; parent++) {
+		for (uint32_t child = 0; child < states[parent].children; child++) {
+			uint32_t state = states[parent].firstChild + child;
+			states[state].fail = reservedAutomatonNext(automaton, nodes, states[parent].fail, states[state].byte);
+			states[state].match |= states[states[state].fail].match;
+		}
+	}
+	return automaton;
+}
+
+// ENTRY AS STORED TO ITS ANCHORED PATTERN, APPENDED TO 'arena' AS A LINE. RETURNS 0 ON SUCCESS, 1 ON FAILURE AND
+// -1 IF THE ENTRY HAS NO WORD ('*' ALONE).
+static int reservedEntryPattern (const char *entry, struct textBuffer *arena)
+{
+	size_t length = strlen(entry);
+	int leadingStar = (length > 0 && entry[0] == '*');
+	int trailingStar = (length > 1 && entry[length - 1] == '*');
+	if (length <= (size_t)(leadingStar + trailingStar)) return -1;
+
+	return textBufferAppend(arena, "%s%.*s%s\n", leadingStar ? "" : RESERVED_ANCHOR_START,
+		(int)(length - (size_t)leadingStar - (size_t)trailingStar), entry + leadingStar, trailingStar ? "" : RESERVED_ANCHOR_END);
+}
+
+// COMPILE THE RESERVED LIST FROM THE FILTER DATABASE AND PUBLISH IT. CALLED AT START AND ON SIGHUP, AFTER
+// 'handled update', IN THE SUPERVISOR OR THE ONLY PROCESS. ON FAILURE THE PREVIOUS AUTOMATON STAYS, OR
+// labelReserved ASKS SQLITE (EXACT WORDS ONLY). RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+int loadReservedTerms (void)
+{
+	long long started = monotonicMicroseconds();
+	if (!reservedVersions.control && sharedVersionsCreate(&reservedVersions, RESERVED_LIST_RESERVE) != 0) return 1;
+
+	sqlite3 *db = databaseOpen( filterDatabaseGlobal );
+	if (!db) return 1;
+	sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT word FROM reservedHandleTable;");
+	if (!stmt) {
+		sqlite3_close(db);
+		return 1;
+	}
+
+	struct textBuffer arena = { NULL, 0, 0 };
+	size_t *offsets = NULL;
+	size_t count = 0, capacity = 0, skipped = 0;
+	int failed = 0, rc;
+	while (!failed && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *entry = (const char *)sqlite3_column_text(stmt, 0);
+		if (!entry) continue;
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 4096;
+			size_t *grown = realloc(offsets, capacity * sizeof(size_t));
+			if (!grown) {
+				failed = 1;
+				break;
+			}
+			offsets = grown;
+		}
+		size_t offset = arena.length;
+		int result = reservedEntryPattern(entry, &arena);
+		if (result < 0) skipped++;
+		else if (result > 0) failed = 1;
+		else offsets[count++] = offset;
+	}
+	if (!failed && rc != SQLITE_DONE) {
+		fprintf(stderr, "Failed to read the reserved list: %s\n", sqlite3_errmsg(db));
+		failed = 1;
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	char **patterns = failed ? NULL : malloc((count ? count : 1) * sizeof(char *));
+	struct reservedAutomatonStruct *automaton = NULL;
+	if (patterns) {
+		for (size_t i = 0; i < count; i++) {
+			patterns[i] = arena.data + offsets[i];
+			*strchr(patterns[i], '\n') = '\0';
+		}
+		automaton = reservedAutomatonBuild(patterns, count, sharedVersionsNext(&reservedVersions), reservedVersions.halfSize);
+	}
+	free(patterns);
+	free(offsets);
+	free(arena.data);
+	if (!automaton) {
+		fprintf(stderr, "Failed to compile the reserved list\n");
+		return 1;
+	}
+
+	sharedVersionsPublish(&reservedVersions);
+
+	if (skipped) fprintf(stderr, "WARNING: %zu reserved entries without a word ignored\n", skipped);
+	printf("Reserved terms compiled: %zu entries, %u states (%zu bytes) in %.3f s\n", automaton->entries,
+		automaton->stateCount, sizeof(*automaton) + automaton->stateCount * sizeof(struct reservedStateStruct),
+		(double)(monotonicMicroseconds() - started) / 1e6);
+	return 0;
+}
+
+void freeReservedTerms (void)
+{
+	sharedVersionsFree(&reservedVersions);
+}
+
+
+// QUERY FILTER DATABASE FOR EXISTENCE OF SPECIFIC 'word' (LABEL/SUBDOMAIN)
+// THE COMPILED AUTOMATON ANSWERS WHEN LOADED (EVERY PATTERN), SQLITE OTHERWISE (EXACT WORDS).
+int labelReserved(const char *word) {
+	if (reservedVersions.control) {
+		unsigned char *half;
+		unsigned long long sequence;
+		int reserved;
+		do {
+			sequence = sharedVersionsReadBegin(&reservedVersions, &half);
+			reserved = reservedAutomatonMatch((const struct reservedAutomatonStruct *)half, word);
+		} while (!sharedVersionsReadValid(&reservedVersions, sequence));
+		if (reserved >= 0) return reserved ? HANDLE_ACTIVE : HANDLE_INACTIVE;
+	}
+
+    const char *sql = "SELECT 1 FROM reservedHandleTable WHERE word = ? LIMIT 1;";
+    return databaseGenericSingularQuery(filterDatabaseGlobal, sql, word);
+}
+
+
+// QUERY DATABASE FOR A VALID IDENTIFIER ASSOCIATED WITH HANDLE
+const char* queryForDid (const char *handle) {
+	#ifdef VERBOSE_FLAG
+	printf("VERBOSE: Begin queryForDid for handle '%s'.\n", handle);
+	#endif	
+
+	HANDLED_PROBE1(query_start, handle);
+
+	// OPEN DATABASE (THE HANDLE'S SHARD, IF SHARDED)
+    sqlite3 *db = databaseOpen(userDatabaseFor(handle));
+	if (!db) {
+		HANDLED_PROBE2(query_done, handle, 0);
+		return NULL;
+	}
+
+	// PREPARE SQL STATEMENT
+    const char *sql = "SELECT did FROM did_plc_users WHERE handle = ?";
+    sqlite3_stmt *stmt = databasePrepareStatement (db, sql);	
+	if (!stmt) {
+		sqlite3_close(db);
+		HANDLED_PROBE2(query_done, handle, 0);
+		return NULL;
+	}
+
+	// BIND HANDLE KEY TO PREPARED SQL STATEMENT (1 IS SUCCESS)
+    if ( databaseBindKey(stmt, 1, handle, db) != SQLITE_OK ) {
+        sqlite3_finalize(stmt);
+		sqlite3_close(db);
+		HANDLED_PROBE2(query_done, handle, 0);
+        return NULL;
+    }
+
+	// REMEMBER TO FREE RESULT
+	char *result = NULL;
+	
+    // Execute SQL statement
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *tempResult = (const char *)sqlite3_column_text(stmt, 0);
+        // Validate and copy the result
+        if (tempResult && validateDid(tempResult) != KEY_INVALID) {
+            result = strndup(tempResult, MAX_SIZE_DID_PLC + 1);
+            if (!result) fprintf(stderr, "ERROR: Failed to allocate memory for DID result buffer.\n");
+        } else fprintf(stderr, "ERROR: DID value for handle '%s' is null or invalid. Remove record.\n", handle);
+    }
+	
+    // Clean up
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+	#ifdef VERBOSE_FLAG
+	if (result) printf("VERBOSE: queryForDid found 'did' result for handle '%s': '%s'.\n", handle, result);
+	else printf("VERBOSE: No result found for handle '%s'.\n", handle);
+	#endif	
+
+	HANDLED_PROBE2(query_done, handle, result != NULL);
+    return result; // CALLER MUST FREE THE RESULT
+}
+
+
+// THE HIGHEST SEQUENCE RETENTION REMOVED A DELETE AT, 0 IF NONE, -1 ON FAILURE. A FOLLOWER POSITIONED BEFORE IT (BUT
+// NOT AT 0, WHICH ONLY NEEDS WHAT IS KEPT) MAY HAVE MISSED THAT DELETE AND MUST START OVER.
+static long long changeLogPrunedThrough (sqlite3 *db)
+{
+	sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT IFNULL(MAX(pruned), 0) FROM change_log_state;");
+	if (!stmt) return -1;
+
+	long long pruned = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+	sqlite3_finalize(stmt);
+	return pruned;
+}
+
+// TRUE IF A FOLLOWER AT 'after' HAS FALLEN BEHIND THE PRUNED PART OF THE LOG. A FAILED READ COUNTS AS UP TO DATE.
+static int changeLogTooOld (sqlite3 *db, long long after)
+{
+	return after > 0 && after < changeLogPrunedThrough(db);
+}
+
+// RETENTION: REMOVE ENTRIES OLDER THAN change_log_days THAT A LATER ENTRY FOR THE SAME HANDLE SUPERSEDES, AND OLD
+// DELETES. THE LATEST PUT OF EVERY HANDLE STAYS, SO A FOLLOWER STARTING FROM 0 STILL BUILDS EVERY USER. THE HIGHEST
+// DELETE REMOVED IS KEPT IN change_log_state FOR changeLogTooOld. RETURNS THE ENTRIES REMOVED, OR -1 ON FAILURE.
+static long long pruneChangeLog (void)
+{
+	if (configGlobal.changeLogDays <= 0) return 0;
+
+	sqlite3 *db = databaseOpen(changeLogDatabase());
+	if (!db) return -1;
+
+	char sql[1024];
+	snprintf(sql, sizeof(sql),
+			"CREATE TEMP TABLE IF NOT EXISTS change_log_prune (sequence INTEGER PRIMARY KEY, removes_delete BOOLEAN);"
+			"DELETE FROM temp.change_log_prune;"
+			"INSERT INTO temp.change_log_prune SELECT c.sequence, c.sequence = (SELECT MAX(l.sequence) FROM did_plc_changes l WHERE l.handle = c.handle) "
+			"FROM did_plc_changes c WHERE c.change_time < datetime('now', '-%d days') AND (c.operation = 'delete' OR "
+			"c.sequence < (SELECT MAX(l.sequence) FROM did_plc_changes l WHERE l.handle = c.handle));"
+			"INSERT OR REPLACE INTO change_log_state (id, pruned) SELECT 1, MAX((SELECT IFNULL(MAX(pruned), 0) FROM change_log_state), "
+			"IFNULL((SELECT MAX(sequence) FROM temp.change_log_prune WHERE removes_delete), 0));"
+			"DELETE FROM did_plc_changes WHERE sequence IN (SELECT sequence FROM temp.change_log_prune);", configGlobal.changeLogDays);
+
+	long long removed = -1;
+	char *err_msg = NULL;
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, &err_msg) == SQLITE_OK && sqlite3_exec(db, sql, 0, 0, &err_msg) == SQLITE_OK) {
+		removed = sqlite3_changes(db);
+		if (sqlite3_exec(db, "COMMIT;", 0, 0, &err_msg) != SQLITE_OK) removed = -1;
+	}
+	if (removed < 0) {
+		fprintf(stderr, "ERROR: Pruning the change log failed: %s\n", err_msg ? err_msg : sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+	}
+	sqlite3_free(err_msg);
+	sqlite3_close(db);
+
+	if (removed > 0) {
+		METRIC_ADD(changeLogPruned, (unsigned long long)removed);
+		syslog(LOG_INFO, "Pruned %lld change log entries older than %d days", removed, configGlobal.changeLogDays);
+	}
+	return removed;
+}
+
+// CHANGE LOG ENTRIES AFTER SEQUENCE 'after', ONE PER LINE, TAB SEPARATED: sequence, operation, handle, did, label, domain,
+// locked (0 OR 1).
+// AT MOST REPLICATION_BATCH ENTRIES. '*head' IS SET TO THE LATEST SEQUENCE, OR TO CHANGE_LOG_TOO_OLD IF 'after' IS
+// BEHIND THE PRUNED PART OF THE LOG. RETURNS NULL ON FAILURE OR TOO OLD, CALLER MUST FREE.
+char *renderChangeLog (long long after, long long *head, size_t *length)
+{
+	*head = after;
+	collectShardChanges();
+	sqlite3 *db = databaseOpen(changeLogDatabase());
+	if (!db) return NULL;
+
+	if (changeLogTooOld(db, after)) {
+		*head = CHANGE_LOG_TOO_OLD;
+		sqlite3_close(db);
+		return NULL;
+	}
+
+	const char *sql = "SELECT sequence, operation, handle, did, label, domain, locked, (SELECT MAX(sequence) FROM did_plc_changes) "
+						"FROM did_plc_changes WHERE sequence > ? ORDER BY sequence LIMIT ?;";
+	sqlite3_stmt *stmt = databasePrepareStatement(db, sql);
+	if (!stmt) {
+		sqlite3_close(db);
+		return NULL;
+	}
+
+	sqlite3_bind_int64(stmt, 1, after);
+	sqlite3_bind_int(stmt, 2, REPLICATION_BATCH);
+
+	struct textBuffer buffer = {NULL, 0, 0};
+	int failed = textBufferAppend(&buffer, "%s", "");
+	int rc;
+	*head = after;
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		failed |= textBufferAppend(&buffer, "%lld\t%s\t%s\t%s\t%s\t%s\t%d\n", (long long)sqlite3_column_int64(stmt, 0),
+									(const char *)sqlite3_column_text(stmt, 1), (const char *)sqlite3_column_text(stmt, 2),
+									(const char *)sqlite3_column_text(stmt, 3), (const char *)sqlite3_column_text(stmt, 4),
+									(const char *)sqlite3_column_text(stmt, 5), sqlite3_column_int(stmt, 6) != 0);
+		*head = sqlite3_column_int64(stmt, 7);
+	}
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "ERROR: Reading the change log failed: %s\n", sqlite3_errmsg(db));
+		failed = 1;
+	}
+
+	// NOTHING NEWER, BUT THE REPLICA STILL LEARNS WHERE THE PRIMARY IS
+	if (rc == SQLITE_DONE && *head == after) {
+		sqlite3_stmt *latest = databasePrepareStatement(db, "SELECT IFNULL(MAX(sequence), 0) FROM did_plc_changes;");
+		if (!latest) {
+			free(buffer.data);
+			sqlite3_finalize(stmt);
+			sqlite3_close(db);
+			return NULL;
+		}
+		if (sqlite3_step(latest) == SQLITE_ROW) *head = sqlite3_column_int64(latest, 0);
+		sqlite3_finalize(latest);
+	}
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	if (failed) {
+		free(buffer.data);
+		return NULL;
+	}
+
+	*length = buffer.length;
+	return buffer.data;
+}
+
+// THE LATEST CHANGE LOG SEQUENCE, 0 FOR AN EMPTY LOG, -1 ON FAILURE
+long long changeLogHead (void)
+{
+	collectShardChanges();
+	sqlite3 *db = databaseOpen(changeLogDatabase());
+	if (!db) return -1;
+
+	sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT IFNULL(MAX(sequence), 0) FROM did_plc_changes;");
+	if (!stmt) {
+		sqlite3_close(db);
+		return -1;
+	}
+
+	long long sequence = -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW) sequence = sqlite3_column_int64(stmt, 0);
+	else fprintf(stderr, "ERROR: Reading the change log failed: %s\n", sqlite3_errmsg(db));
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return sequence;
+}
+
+// THE LAST CHANGE LOG SEQUENCE A REPLICA APPLIED, 0 FOR A NEW ONE, -1 ON FAILURE
+long long replicaAppliedSequence (void)
+{
+	sqlite3 *db = databaseOpen(principalDatabaseGlobal);
+	if (!db) return -1;
+
+	sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT IFNULL(MAX(sequence), 0) FROM replication_state;");
+	if (!stmt) {
+		sqlite3_close(db);
+		return -1;
+	}
+
+	long long sequence = -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW) sequence = sqlite3_column_int64(stmt, 0);
+	else fprintf(stderr, "ERROR: Reading the replication state failed: %s\n", sqlite3_errmsg(db));
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return sequence;
+}
+
+// WHILE A REPLICA RESYNCS FROM SEQUENCE 0, replica_resync HOLDS EVERY HANDLE THE LOG HAS MENTIONED SINCE. THE USERS
+// STAY SERVED MEANWHILE, AND THOSE THE LOG NEVER MENTIONS (THEIR DELETES WERE PRUNED) ARE REMOVED ONCE IT CATCHES UP.
+static int replicaResyncPending (sqlite3 *db)
+{
+	sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'replica_resync';");
+	if (!stmt) return FALSE;
+
+	int pending = sqlite3_step(stmt) == SQLITE_ROW;
+	sqlite3_finalize(stmt);
+	return pending;
+}
+
+// THE PRIMARY PRUNED PAST THIS REPLICA'S POSITION: START AGAIN FROM SEQUENCE 0. RETURNS DATABASE_SUCCESS OR DATABASE_ERROR.
+int replicaStartResync (void)
+{
+	sqlite3 *db = databaseOpen(principalDatabaseGlobal);
+	if (!db) return DATABASE_ERROR;
+
+	char *err_msg = NULL;
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE;"
+						"CREATE TABLE IF NOT EXISTS replica_resync (handle TEXT PRIMARY KEY);"
+						"INSERT OR REPLACE INTO replication_state (id, sequence) VALUES (1, 0);"
+						"COMMIT;", 0, 0, &err_msg) != SQLITE_OK) {
+		fprintf(stderr, "ERROR: Starting the replica resync failed: %s\n", err_msg);
+		sqlite3_free(err_msg);
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+		sqlite3_close(db);
+		return DATABASE_ERROR;
+	}
+
+	sqlite3_close(db);
+	return DATABASE_SUCCESS;
+}
+
+// THE RESYNC CAUGHT UP: REMOVE THE USERS IT NEVER MENTIONED, FROM THE DATABASE AND THE INDEX.
+// RETURNS THE NUMBER REMOVED (0 IF NO RESYNC IS PENDING), OR -1 ON FAILURE.
+long replicaFinishResync (void)
+{
+	sqlite3 *db = databaseOpen(principalDatabaseGlobal);
+	if (!db) return -1;
+
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, NULL) != SQLITE_OK || !replicaResyncPending(db)) {
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+		sqlite3_close(db);
+		return 0;
+	}
+
+	sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT handle FROM did_plc_users WHERE handle NOT IN (SELECT handle FROM replica_resync);");
+	if (!stmt) {
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+		sqlite3_close(db);
+		return -1;
+	}
+
+	struct changeEntryStruct *entries = NULL;
+	size_t count = 0, capacity = 0;
+	int failed = FALSE;
+	int rc;
+	while (!failed && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			struct changeEntryStruct *grown = realloc(entries, capacity * sizeof(*entries));
+			if (!grown) {
+				failed = TRUE;
+				break;
+			}
+			entries = grown;
+		}
+		memset(&entries[count], 0, sizeof(*entries));
+		entries[count].handle = strdup((const char *)sqlite3_column_text(stmt, 0));
+		if (!entries[count].handle) failed = TRUE;
+		else count++;
+	}
+	if (!failed && rc != SQLITE_DONE) failed = TRUE;
+	sqlite3_finalize(stmt);
+
+	char *err_msg = NULL;
+	if (failed || sqlite3_exec(db, "DELETE FROM did_plc_users WHERE handle NOT IN (SELECT handle FROM replica_resync);"
+									"DROP TABLE replica_resync;"
+									"COMMIT;", 0, 0, &err_msg) != SQLITE_OK) {
+		fprintf(stderr, "ERROR: Finishing the replica resync failed: %s\n", err_msg ? err_msg : sqlite3_errmsg(db));
+		sqlite3_free(err_msg);
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+		failed = TRUE;
+	}
+	sqlite3_close(db);
+
+	if (!failed) handleIndexApply(entries, count);
+	for (size_t i = 0; i < count; i++) free((char *)entries[i].handle);
+	free(entries);
+	return failed ? -1 : (long)count;
+}
+
+// APPLY PARSED CHANGE LOG ENTRIES TO A REPLICA'S DATABASE IN ONE TRANSACTION, WITH THE NEW POSITION (WHICH MAY BE
+// PAST THE LAST ENTRY, WHEN MALFORMED ONES WERE SKIPPED).
+// ENTRIES ARE IDEMPOTENT, SO APPLYING ONE TWICE (AN UPGRADE OVERLAP) IS HARMLESS. TOKENS AND EMAILS ARE
+// NEVER REPLICATED. RETURNS DATABASE_SUCCESS OR DATABASE_ERROR.
+int applyChangeEntries (const struct changeEntryStruct *entries, size_t count, long long position)
+{
+	sqlite3 *db = databaseOpen(principalDatabaseGlobal);
+	if (!db) return DATABASE_ERROR;
+
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, NULL) != SQLITE_OK) {
+		fprintf(stderr, "ERROR: Unable to start replication transaction: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return DATABASE_ERROR;
+	}
+
+	// A PUT REPLACES ANY ROW HOLDING THE SAME HANDLE, DID OR LABEL
+	sqlite3_stmt *putStmt = NULL;
+	sqlite3_stmt *deleteStmt = NULL;
+	sqlite3_stmt *resyncStmt = NULL;
+	if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO did_plc_users (handle, did, label, domain, token, locked) VALUES (?, ?, ?, ?, '', ?);", -1, &putStmt, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "DELETE FROM did_plc_users WHERE handle = ?;", -1, &deleteStmt, NULL) != SQLITE_OK ||
+		(replicaResyncPending(db) && sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO replica_resync (handle) VALUES (?);", -1, &resyncStmt, NULL) != SQLITE_OK)) {
+		fprintf(stderr, "Query SQL preparation error: %s\n", sqlite3_errmsg(db));
+		sqlite3_finalize(putStmt);
+		sqlite3_finalize(deleteStmt);
+		sqlite3_finalize(resyncStmt);
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+		sqlite3_close(db);
+		return DATABASE_ERROR;
+	}
+
+	int failed = FALSE;
+	for (size_t i = 0; i < count && !failed; i++) {
+		const struct changeEntryStruct *entry = &entries[i];
+		sqlite3_stmt *stmt = entry->put ? putStmt : deleteStmt;
+
+		if (entry->put) {
+			failed |= databaseBindKey(stmt, 1, entry->handle, db) != SQLITE_OK || databaseBindKey(stmt, 2, entry->did, db) != SQLITE_OK ||
+						databaseBindKey(stmt, 3, entry->label, db) != SQLITE_OK || databaseBindKey(stmt, 4, entry->domain, db) != SQLITE_OK ||
+						sqlite3_bind_int(stmt, 5, entry->locked) != SQLITE_OK;
+		}
+		else failed |= databaseBindKey(stmt, 1, entry->handle, db) != SQLITE_OK;
+
+		if (!failed && sqlite3_step(stmt) != SQLITE_DONE) {
+			fprintf(stderr, "ERROR: Applying change %lld failed: %s\n", entry->sequence, sqlite3_errmsg(db));
+			failed = TRUE;
+		}
+		sqlite3_reset(stmt);
+
+		if (!failed && resyncStmt) {
+			failed = databaseBindKey(resyncStmt, 1, entry->handle, db) != SQLITE_OK || sqlite3_step(resyncStmt) != SQLITE_DONE;
+			sqlite3_reset(resyncStmt);
+		}
+	}
+	sqlite3_finalize(putStmt);
+	sqlite3_finalize(deleteStmt);
+	sqlite3_finalize(resyncStmt);
+
+	if (!failed) {
+		sqlite3_stmt *positionStmt = databasePrepareStatement(db, "INSERT OR REPLACE INTO replication_state (id, sequence) VALUES (1, ?);");
+		if (positionStmt) {
+			sqlite3_bind_int64(positionStmt, 1, position);
+			failed = sqlite3_step(positionStmt) != SQLITE_DONE;
+			sqlite3_finalize(positionStmt);
+		}
+		else failed = TRUE;
+	}
+
+	if (failed || sqlite3_exec(db, "COMMIT;", 0, 0, NULL) != SQLITE_OK) {
+		fprintf(stderr, "ERROR: Replication transaction failed: %s\n", sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+		sqlite3_close(db);
+		return DATABASE_ERROR;
+	}
+
+	sqlite3_close(db);
+	return DATABASE_SUCCESS;
+}
+
+
+// COPY EVERY USER IN ONE FILE TO THE INSERT OF ITS NEW SHARD, COLUMNS AS THEY ARE, AND TO THE NEW SHARD INDEX
+// IF THERE IS ONE. RETURNS THE ROWS COPIED, OR -1 ON FAILURE.
+static long reshardCopyUsers (const char *sourcePath, sqlite3_stmt **inserts, sqlite3_stmt *indexInsert, int targetShards)
+{
+	sqlite3 *source = databaseOpen(sourcePath);
+	if (!source) return -1;
+
+	sqlite3_stmt *select = databasePrepareStatement(source, "SELECT handle, did, label, domain, token, email, locked, notes, creation_time FROM did_plc_users;");
+	if (!select) {
+		sqlite3_close(source);
+		return -1;
+	}
+
+	long copied = 0;
+	int rc;
+	while ((rc = sqlite3_step(select)) == SQLITE_ROW) {
+		const char *handle = (const char *)sqlite3_column_text(select, 0);
+		int shard = targetShards ? shardForHandle(handle, targetShards) : 0;
+		sqlite3_stmt *insert = inserts[shard];
+
+		for (int column = 0; column < 9; column++) sqlite3_bind_value(insert, column + 1, sqlite3_column_value(select, column));
+		rc = sqlite3_step(insert);
+		sqlite3_reset(insert);
+
+		if (rc == SQLITE_DONE && indexInsert) {
+			sqlite3_bind_value(indexInsert, 1, sqlite3_column_value(select, 1));
+			sqlite3_bind_value(indexInsert, 2, sqlite3_column_value(select, 2));
+			sqlite3_bind_value(indexInsert, 3, sqlite3_column_value(select, 0));
+			sqlite3_bind_int(indexInsert, 4, shard);
+			rc = sqlite3_step(indexInsert);
+			sqlite3_reset(indexInsert);
+		}
+		if (rc != SQLITE_DONE) {
+			fprintf(stderr, "ERROR: Copying '%s' failed (%d)\n", handle, rc);
+			break;
+		}
+		copied++;
+	}
+
+	sqlite3_finalize(select);
+	sqlite3_close(source);
+	return rc == SQLITE_DONE ? copied : -1;
+}
+
+// MOVE THE USER DATABASE TO 'targetShards' FILES (0 FOR ONE FILE). OFFLINE ONLY, WITH THE DAEMON STOPPED.
+// EVERY USER AND THE CHANGE LOG, WITH ITS SEQUENCE NUMBERS, ARE COPIED INTO FILES BUILT UNDER A TEMPORARY NAME.
+// ONCE ALL OF THEM ARE COMMITTED, reshard-commit SWITCHES TO THEM IN ONE STEP (reshardFinishSwitch). THE OLD FILES
+// STAY UNTIL THEN.
+// THE CALLER HAS SET UP THE CURRENT LAYOUT (buildShardDatabasePaths). RETURNS DATABASE_SUCCESS OR DATABASE_ERROR.
+int reshardDatabases (int targetShards)
+{
+	int currentShards = shardCountGlobal;
+	int targetCount = targetShards ? targetShards : 1;
+	collectShardChanges();
+	int result = DATABASE_ERROR;
+	char *err_msg = NULL;
+
+	char **temporary = calloc(targetCount, sizeof(char *));
+	sqlite3 **targetDbs = calloc(targetCount, sizeof(sqlite3 *));
+	sqlite3_stmt **inserts = calloc(targetCount, sizeof(sqlite3_stmt *));
+	char *indexTemporary = (char *)buildAbsolutePath(baseDirectory, SHARD_INDEX_DB_FILENAME RESHARD_SUFFIX);
+	char *commitPath = (char *)buildAbsolutePath(baseDirectory, RESHARD_COMMIT_FILENAME);
+	char *commitTemporary = (char *)buildAbsolutePath(baseDirectory, RESHARD_COMMIT_FILENAME RESHARD_SUFFIX);
+	int committed = FALSE;
+	sqlite3 *indexDb = NULL;
+	sqlite3_stmt *indexInsert = NULL;
+	sqlite3_stmt *logSelect = NULL;
+	sqlite3_stmt *logInsert = NULL;
+	sqlite3 *logSource = NULL;
+	if (!temporary || !targetDbs || !inserts || !indexTemporary) goto cleanup;
+
+	// CREATE THE NEW FILES, EACH IN ONE TRANSACTION
+	for (int i = 0; i < targetCount; i++) {
+		temporary[i] = targetShards ? shardDatabasePath(i, RESHARD_SUFFIX) : (char *)buildAbsolutePath(baseDirectory, PRINCIPAL_DB_FILENAME RESHARD_SUFFIX);
+		if (!temporary[i]) goto cleanup;
+		unlink(temporary[i]);
+
+		targetDbs[i] = databaseOpen(temporary[i]);
+		if (!targetDbs[i]) goto cleanup;
+		const char *schema = targetShards ? "BEGIN;" SQL_CREATE_USER_TABLE : "BEGIN;" SQL_CREATE_USER_TABLE SQL_CREATE_CHANGE_LOG;
+		if (sqlite3_exec(targetDbs[i], schema, 0, 0, &err_msg) != SQLITE_OK ||
+			sqlite3_prepare_v2(targetDbs[i], "INSERT INTO did_plc_users (handle, did, label, domain, token, email, locked, notes, creation_time) "
+								"VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);", -1, &inserts[i], NULL) != SQLITE_OK) goto cleanup;
+	}
+
+	sqlite3 *logDb = targetDbs[0];
+	if (targetShards) {
+		char layout[128];
+		snprintf(layout, sizeof(layout), "INSERT INTO shard_layout (id, shards) VALUES (1, %d);", targetShards);
+
+		unlink(indexTemporary);
+		indexDb = databaseOpen(indexTemporary);
+		if (!indexDb) goto cleanup;
+		if (sqlite3_exec(indexDb, "BEGIN;" SQL_CREATE_SHARD_INDEX, 0, 0, &err_msg) != SQLITE_OK ||
+			sqlite3_exec(indexDb, layout, 0, 0, &err_msg) != SQLITE_OK ||
+			sqlite3_prepare_v2(indexDb, "INSERT INTO did_plc_index (did, label, handle, shard) VALUES (?, ?, ?, ?);", -1, &indexInsert, NULL) != SQLITE_OK) goto cleanup;
+		logDb = indexDb;
+	}
+
+	// COPY THE USERS, SHARD BY SHARD
+	long copied = 0;
+	for (int i = 0; i < (currentShards ? currentShards : 1); i++) {
+		long rows = reshardCopyUsers(currentShards ? shardDatabasesGlobal[i] : principalDatabaseGlobal, inserts, indexInsert, targetShards);
+		if (rows < 0) goto cleanup;
+		copied += rows;
+	}
+
+	// COPY THE CHANGE LOG, SO REPLICAS KEEP THEIR POSITION
+	logSource = databaseOpen(changeLogDatabase());
+	if (!logSource) goto cleanup;
+	if (sqlite3_prepare_v2(logSource, "SELECT sequence, operation, handle, did, label, domain, locked, change_time FROM did_plc_changes ORDER BY sequence;", -1, &logSelect, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(logDb, "INSERT INTO did_plc_changes (sequence, operation, handle, did, label, domain, locked, change_time) VALUES (?, ?, ?, ?, ?, ?, ?, ?);", -1, &logInsert, NULL) != SQLITE_OK) {
+		fprintf(stderr, "ERROR: Unable to copy the change log\n");
+		goto cleanup;
+	}
+	int rc;
+	while ((rc = sqlite3_step(logSelect)) == SQLITE_ROW) {
+		for (int column = 0; column < 8; column++) sqlite3_bind_value(logInsert, column + 1, sqlite3_column_value(logSelect, column));
+		rc = sqlite3_step(logInsert);
+		sqlite3_reset(logInsert);
+		if (rc != SQLITE_DONE) break;
+	}
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "ERROR: Copying the change log failed (%d)\n", rc);
+		goto cleanup;
+	}
+	long long pruned = changeLogPrunedThrough(logSource);
+	if (pruned < 0) goto cleanup;
+	if (pruned > 0) {
+		char state[128];
+		snprintf(state, sizeof(state), "INSERT OR REPLACE INTO change_log_state (id, pruned) VALUES (1, %lld);", pruned);
+		if (sqlite3_exec(logDb, state, 0, 0, &err_msg) != SQLITE_OK) goto cleanup;
+	}
+
+	// COMMIT EVERYTHING BEFORE ANY FILE IS RENAMED
+	for (int i = 0; i < targetCount; i++) {
+		sqlite3_finalize(inserts[i]);
+		inserts[i] = NULL;
+	}
+	sqlite3_finalize(indexInsert);
+	sqlite3_finalize(logInsert);
+	indexInsert = logInsert = NULL;
+	for (int i = 0; i < targetCount; i++) {
+		// THE TRIGGERS GO IN AFTER THE COPY, WHICH IS ALREADY IN THE CHANGE LOG
+		if (targetShards && sqlite3_exec(targetDbs[i], SQL_CREATE_SHARD_PENDING, 0, 0, &err_msg) != SQLITE_OK) goto cleanup;
+		if (sqlite3_exec(targetDbs[i], "COMMIT;", 0, 0, &err_msg) != SQLITE_OK) goto cleanup;
+	}
+	if (indexDb && sqlite3_exec(indexDb, "COMMIT;", 0, 0, &err_msg) != SQLITE_OK) goto cleanup;
+
+	for (int i = 0; i < targetCount; i++) {
+		sqlite3_close(targetDbs[i]);
+		targetDbs[i] = NULL;
+	}
+	if (indexDb) {
+		sqlite3_close(indexDb);
+		indexDb = NULL;
+	}
+
+	// THE COMMIT POINT: UNTIL reshard-commit IS ON DISK THE OLD FILES ARE THE DATABASE, AFTER IT THE NEW ONES ARE
+	char text[32];
+	snprintf(text, sizeof(text), "%d\n", targetShards);
+	syncDirectory(baseDirectory);
+	if (!commitTemporary || !commitPath) goto cleanup;
+	int commitFile = open(commitTemporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	int written = commitFile >= 0 && write(commitFile, text, strlen(text)) == (ssize_t)strlen(text) && fsync(commitFile) == 0;
+	if (commitFile >= 0 && close(commitFile) != 0) written = 0;
+	if (!written || rename(commitTemporary, commitPath) != 0) {
+		perror("Unable to commit the new layout");
+		unlink(commitTemporary);
+		goto cleanup;
+	}
+	syncDirectory(baseDirectory);
+	committed = TRUE;
+
+	if (reshardFinishSwitch(targetShards) != 0) {
+		fprintf(stderr, "ERROR: The new layout is committed but not in place yet, any 'handled' command finishes it\n");
+		goto cleanup;
+	}
+
+	printf("Moved %ld users from %d to %d user database files.\n", copied, currentShards ? currentShards : 1, targetCount);
+	syslog(LOG_INFO, "Resharded %ld users from %d to %d files", copied, currentShards ? currentShards : 1, targetCount);
+	result = DATABASE_SUCCESS;
+
+cleanup:
+	if (err_msg) {
+		fprintf(stderr, "ERROR: Resharding failed: %s\n", err_msg);
+		sqlite3_free(err_msg);
+	}
+	sqlite3_finalize(logSelect);
+	sqlite3_finalize(logInsert);
+	sqlite3_finalize(indexInsert);
+	if (logSource) sqlite3_close(logSource);
+	if (indexDb) sqlite3_close(indexDb);
+	for (int i = 0; i < targetCount; i++) {
+		if (inserts) sqlite3_finalize(inserts[i]);
+		if (targetDbs && targetDbs[i]) sqlite3_close(targetDbs[i]);
+		if (!committed && temporary && temporary[i]) unlink(temporary[i]);
+		if (temporary) free(temporary[i]);
+	}
+	if (!committed && indexTemporary) unlink(indexTemporary);
+	free(temporary);
+	free(targetDbs);
+	free(inserts);
+	free(indexTemporary);
+	free(commitPath);
+	free(commitTemporary);
+	return result;
+}
+
+// AN EXPORT OF EVERY USER, READ WITH KEYSET PAGINATION ON THE handle PRIMARY KEY, FILE BY FILE IN SHARD ORDER.
+// EACH PAGE IS ITS OWN SHORT READ TRANSACTION, SO A LONG EXPORT NEVER KEEPS A WRITER WAITING FOR MORE THAN ONE
+// PAGE, AND ONLY ONE PAGE OF TEXT IS EVER HELD. TOKENS ARE NOT EXPORTED.
+struct userExportStruct {
+	exportFormat format;
+	int file;					// User database file being read, -1 before the first
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	struct textBuffer after;	// Last handle read from this file, empty before its first page
+	long long rows;
+	int finished;
+	int failed;
+	struct textBuffer page;
+	size_t pageOffset;			// Bytes of 'page' already sent
+};
+
+static void userExportFree (void *cls)
+{
+	struct userExportStruct *export = cls;
+	if (!export) return;
+
+	sqlite3_finalize(export->stmt);
+	if (export->db) sqlite3_close(export->db);
+	free(export->after.data);
+	free(export->page.data);
+	free(export);
+}
+
+// START AN EXPORT, WITH THE CSV HEADER AS ITS FIRST PAGE. RETURNS NULL ON FAILURE, FREE WITH userExportFree.
+struct userExportStruct *userExportOpen (exportFormat format)
+{
+	struct userExportStruct *export = calloc(1, sizeof(*export));
+	if (!export) {
+		fprintf(stderr, "ERROR: Memory allocation failed (userExportOpen)\n");
+		return NULL;
+	}
+	export->format = format;
+	export->file = -1;
+
+	if (format == EXPORT_CSV && textBufferAppend(&export->page, "handle,did,label,domain,email,locked,notes,creation_time\r\n") != 0) {
+		userExportFree(export);
+		return NULL;
+	}
+	return export;
+}
+
+// APPEND ONE CSV FIELD, QUOTED ONLY WHEN IT NEEDS TO BE. NULL IS AN EMPTY FIELD.
+static int userExportAppendCsv (struct textBuffer *buffer, const char *text, const char *separator)
+{
+	if (!text) return textBufferAppend(buffer, "%s", separator);
+	if (!strpbrk(text, ",\"\r\n")) return textBufferAppend(buffer, "%s%s", text, separator);
+
+	int failed = textBufferAppend(buffer, "\"");
+	for (const char *quote; !failed && (quote = strchr(text, '"')); text = quote + 1) {
+		failed |= textBufferAppend(buffer, "%.*s\"\"", (int)(quote - text), text);
+	}
+	return failed | textBufferAppend(buffer, "%s\"%s", text, separator);
+}
+
+// APPEND ONE JSON MEMBER, null FOR NULL
+static int userExportAppendJson (struct textBuffer *buffer, const char *name, const char *text)
+{
+	int failed = textBufferAppend(buffer, "\"%s\":", name);
+	return failed | (text ? textBufferAppendJson(buffer, text) : textBufferAppend(buffer, "null"));
+}
+
+// APPEND THE CURRENT ROW OF 'stmt' IN THE EXPORT FORMAT. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+static int userExportAppendRow (struct userExportStruct *export, sqlite3_stmt *stmt)
+{
+	const char *handle = (const char *)sqlite3_column_text(stmt, 0);
+	const char *did = (const char *)sqlite3_column_text(stmt, 1);
+	const char *label = (const char *)sqlite3_column_text(stmt, 2);
+	const char *domain = (const char *)sqlite3_column_text(stmt, 3);
+	const char *email = (const char *)sqlite3_column_text(stmt, 4);
+	int locked = sqlite3_column_int(stmt, 5);
+	const char *notes = (const char *)sqlite3_column_text(stmt, 6);
+	const char *created = (const char *)sqlite3_column_text(stmt, 7);
+	struct textBuffer *page = &export->page;
+	int failed = 0;
+
+	if (export->format == EXPORT_CSV) {
+		failed |= userExportAppendCsv(page, handle, ",");
+		failed |= userExportAppendCsv(page, did, ",");
+		failed |= userExportAppendCsv(page, label, ",");
+		failed |= userExportAppendCsv(page, domain, ",");
+		failed |= userExportAppendCsv(page, email, ",");
+		failed |= textBufferAppend(page, "%d,", locked ? 1 : 0);
+		failed |= userExportAppendCsv(page, notes, ",");
+		failed |= userExportAppendCsv(page, created, "\r\n");
+		return failed;
+	}
+
+	failed |= textBufferAppend(page, "{");
+	failed |= userExportAppendJson(page, "handle", handle);
+	failed |= textBufferAppend(page, ",");
+	failed |= userExportAppendJson(page, "did", did);
+	failed |= textBufferAppend(page, ",");
+	failed |= userExportAppendJson(page, "label", label);
+	failed |= textBufferAppend(page, ",");
+	failed |= userExportAppendJson(page, "domain", domain);
+	failed |= textBufferAppend(page, ",");
+	failed |= userExportAppendJson(page, "email", email);
+	failed |= textBufferAppend(page, ",\"locked\":%s,", locked ? "true" : "false");
+	failed |= userExportAppendJson(page, "notes", notes);
+	failed |= textBufferAppend(page, ",");
+	failed |= userExportAppendJson(page, "creation_time", created);
+	failed |= textBufferAppend(page, "}\n");
+	return failed;
+}
+
+// REPLACE THE PAGE WITH THE NEXT EXPORT_PAGE_ROWS USERS, MOVING TO THE NEXT FILE WHEN ONE RUNS OUT.
+// THE STATEMENT IS RESET AFTER EVERY PAGE, WHICH ENDS ITS READ TRANSACTION. RETURNS 0 ON SUCCESS, WITH
+// 'finished' SET AND AN EMPTY PAGE ONCE EVERY FILE IS READ, OR 1 ON FAILURE.
+int userExportNextPage (struct userExportStruct *export)
+{
+	int files = shardCountGlobal > 0 ? shardCountGlobal : 1;
+	export->page.length = 0;
+	export->pageOffset = 0;
+
+	while (!export->finished && export->page.length == 0) {
+		if (!export->stmt) {
+			if (++export->file >= files) {
+				export->finished = TRUE;
+				break;
+			}
+			export->db = databaseOpen(shardCountGlobal > 0 ? shardDatabasesGlobal[export->file] : principalDatabaseGlobal);
+			if (!export->db) return 1;
+			export->stmt = databasePrepareStatement(export->db,
+				"SELECT handle, did, label, domain, email, locked, notes, creation_time FROM did_plc_users "
+				"WHERE handle > ?1 ORDER BY handle LIMIT ?2;");
+			if (!export->stmt) {
+				sqlite3_close(export->db);
+				export->db = NULL;
+				return 1;
+			}
+			export->after.length = 0;
+		}
+
+		sqlite3_bind_text(export->stmt, 1, export->after.length ? export->after.data : "", -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int(export->stmt, 2, EXPORT_PAGE_ROWS);
+
+		int rc, count = 0;
+		while ((rc = sqlite3_step(export->stmt)) == SQLITE_ROW) {
+			export->after.length = 0;
+			if (textBufferAppend(&export->after, "%s", (const char *)sqlite3_column_text(export->stmt, 0)) != 0 ||
+				userExportAppendRow(export, export->stmt) != 0) {
+				rc = SQLITE_NOMEM;
+				break;
+			}
+			count++;
+		}
+		if (rc != SQLITE_DONE) fprintf(stderr, "ERROR: Reading users for the export failed: %s\n", sqlite3_errmsg(export->db));
+		sqlite3_reset(export->stmt);
+		if (rc != SQLITE_DONE) return 1;
+		export->rows += count;
+
+		// A SHORT PAGE IS THE END OF THIS FILE
+		if (count < EXPORT_PAGE_ROWS) {
+			sqlite3_finalize(export->stmt);
+			sqlite3_close(export->db);
+			export->stmt = NULL;
+			export->db = NULL;
+		}
+	}
+	return 0;
+}
+
+// 'handled export': WRITE EVERY USER TO 'out', ONE PAGE AT A TIME. RETURNS THE USERS WRITTEN, OR -1 ON FAILURE.
+long long exportUserDatabase (exportFormat format, FILE *out)
+{
+	struct userExportStruct *export = userExportOpen(format);
+	if (!export) return -1;
+
+	int failed = 0;
+	while (!failed) {
+		if (export->page.length > 0 && fwrite(export->page.data, 1, export->page.length, out) != export->page.length) {
+			fprintf(stderr, "ERROR: Writing the export failed: %s\n", strerror(errno));
+			failed = 1;
+		}
+		else if (export->finished) break;
+		else failed = userExportNextPage(export);
+	}
+
+	long long rows = failed ? -1 : export->rows;
+	userExportFree(export);
+	return rows;
+}
+
+
+// ************************************
+// ********* SERVER FUNCTIONS *********
+// ************************************
+
+
+// FILL A TEMPLATE PAGE PLACEHOLDER AND SEND IT, COMPRESSED ON THE FLY WHEN IT IS WORTH THE CPU
+static enum MHD_Result sendTemplateResponse (struct MHD_Connection *connection, const char *filename, const char *placeholder, const char *value)
+{
+	enum MHD_Result ret;
+	struct MHD_Response *response;
+	char *fileContent = NULL;
+	char *responseContent;
+	const char *htmlContent;
+
+	HANDLED_PROBE1(render_start, filename);
+
+	// USE THE CACHED TEMPLATE, ONLY READ FROM DISK IF IT FAILED TO LOAD AT STARTUP
+	struct staticPageStruct *page = findStaticPage(filename);
+	if (page) htmlContent = page->body[ENCODING_IDENTITY];
+	else {
+		fileContent = readFile(filename);
+		if (!fileContent) {
+			fprintf(stderr, "ERROR: Failed to access file '%s' (sendTemplateResponse)\n", filename);
+			return MHD_NO; // SIGNAL FAILURE TO READ FILE
+		}
+		htmlContent = fileContent;
+	}
+
+	responseContent = replacePlaceholder(htmlContent, placeholder, value);
+	free(fileContent);
+	if (!responseContent) {
+        fprintf(stderr, "ERROR: Failed to replace placeholder in file content (sendTemplateResponse)\n");
+		return MHD_NO; // SIGNAL FAILURE TO ALLOCATE MEMORY
+	}
+
+	size_t identitySize = strlen(responseContent);
+	size_t responseSize = identitySize;
+	contentEncoding encoding = ENCODING_IDENTITY;
+	int compressible = page && page->compressTemplate && identitySize >= COMPRESSION_MIN_SIZE;
+
+	if (compressible) {
+		unsigned int accepted = acceptedEncodings(connection);
+		for (int candidate = ENCODING_COUNT - 1; candidate > ENCODING_IDENTITY; candidate--) {
+			if (!(accepted & (1u << candidate))) continue;
+
+			size_t compressedSize;
+			char *compressed = compressBuffer((contentEncoding)candidate, responseContent, identitySize, FALSE, &compressedSize);
+			if (!compressed) continue;	// ENCODING NOT BUILT IN, TRY THE NEXT ONE
+
+			free(responseContent);
+			responseContent = compressed;
+			responseSize = compressedSize;
+			encoding = (contentEncoding)candidate;
+			METRIC_ADD(dynamicCompressions, 1);
+			break;
+		}
+	}
+
+	response = MHD_create_response_from_buffer(responseSize, (void *)responseContent, MHD_RESPMEM_MUST_FREE );
+	if (!response) {
+		fprintf(stderr, "ERROR: Memory allocation failed (sendTemplateResponse)\n");
+		free(responseContent); // Must free, MHD_RESPMEM_MUST_FREE did not work
+		return MHD_NO; // SIGNAL FAILURE TO ALLOCATE MEMORY
+	}
+
+	// Add content type and encoding headers to response
+	MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_HTML);
+	if (compressible) MHD_add_response_header(response, MHD_HTTP_HEADER_VARY, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+	if (encoding != ENCODING_IDENTITY) MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING, encodingNames[encoding]);
+	countEncodedResponse(encoding, identitySize, responseSize);
+	HANDLED_PROBE3(render_done, filename, responseSize, encodingNames[encoding]);
+
+	// Queue the response
+	ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+
+	// Clean up
+	MHD_destroy_response(response);
+	
+	return ret;
+}
+
+// SENDS AN HTML ERROR RESPONSE WITH A CUSTOM MESSAGE
+// TO DO: MAKE SURE THE STATIC_ERROR IS A ABSOLUTE PATH
+static enum MHD_Result sendErrorResponse (struct MHD_Connection *connection, const char *message)
+{
+	#ifdef VERBOSE_FLAG
+	printf("RESPONSE: '%s' with '%s'\n", message, STATIC_ERROR);
+	#endif
+
+	return sendTemplateResponse(connection, STATIC_ERROR, PLACEHOLDER_ERROR, message);
+}
+
+// SEND FILE WITH SPECIFIC CONTENT-TYPE HEADER (HTML, PLAIN TEXT, CSV, JSON, ETC)
+static enum MHD_Result sendFileResponse (struct MHD_Connection *connection, const char *filename, const char *contentType)
+{
+	enum MHD_Result ret;
+	struct MHD_Response *response;
+
+	// SERVE THE PRE-BUILT RESPONSE FOR THE BEST ENCODING THE CLIENT ACCEPTS
+	struct staticPageStruct *page = findStaticPage(filename);
+	if (page && page->response[ENCODING_IDENTITY]) {
+		contentEncoding encoding = selectEncoding(acceptedEncodings(connection), page);
+		countEncodedResponse(encoding, page->bodySize[ENCODING_IDENTITY], page->bodySize[encoding]);
+		return MHD_queue_response(connection, page->statusCode, page->response[encoding]);
+	}
+
+    char *htmlContent = readFile(filename);
+    if (!htmlContent) {
+        return MHD_NO; // Return failure if file reading failed
+    }
+
+    response = MHD_create_response_from_buffer(strlen(htmlContent), (void *)htmlContent, MHD_RESPMEM_MUST_FREE);
+	if (! response) {
+		free(htmlContent); // Cleanup in case of failure
+		return MHD_NO; 
+	}
+
+	// Add content type header to response
+	if (contentType != NULL) MHD_add_response_header(response, "Content-Type", contentType);
+
+	// Queue the response
+	if (strcmp(filename, STATIC_NOTFOUND) == 0) ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
+	else ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+
+	// Clean up
+	MHD_destroy_response(response);
+
+	return ret;
+}
+
+// SEND THE RESPONSE TO THE WELL-KNOWN DID PLC METHOD
+// TO DO: CHANGE FROM LABEL/SEGMENT TO FULL HANDLE
+static enum MHD_Result sendWellKnownResponse (struct MHD_Connection *connection, const char *handle, const char *label)
+{
+	// QUERY DATABASE FOR *VALID* DID PLC ASSOCIATED WITH 'label'. A REPLICA ANSWERS FROM ITS INDEX.
+	const char *tempDid = replicaMode ? handleIndexLookup(handle) : queryForDid(handle);
+	struct MHD_Response *response;
+	enum MHD_Result ret;
+
+	// A LOCKED OR SLOW DATABASE IS NOT A MISSING HANDLE, DO NOT ANSWER 404
+	if (tempDid == NULL && deadlineExceeded()) return sendDeadlineResponse(connection);
+	
+	if (tempDid != NULL ) { 
+		// CONFIRM DID EXISTS AND SEND IT AS PLAIN TEXT
+		if (DEBUG_FLAG) printf("REQUEST: DID found for handle '%s': %s\n", handle, tempDid);	
+
+		// MHD TAKES OWNERSHIP OF tempDid AND WILL FREE IT   
+		// response = MHD_create_response_from_buffer (strlen (tempDid), (void *)tempDid, MHD_RESPMEM_MUST_COPY);
+		response = MHD_create_response_from_buffer (strlen (tempDid), (void *)tempDid, MHD_RESPMEM_MUST_FREE);
+		if (!response) {
+			free((char *)tempDid);
+			return logMHDError ("Memory allocation failed for well-known response (DID found)");
+		}
+		// Log response
+		HANDLED_PROBE2(wellknown_hit, handle, tempDid);
+		syslog(LOG_INFO, "REQUEST: Responded with valid DID for handle '%s': %s", handle, tempDid);			
+		// Add text content type header to response
+		MHD_add_response_header( response, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_TEXT );
+		// Queue the response
+		ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+		// Clean up
+		MHD_destroy_response(response);
+		return ret; // tempDid FREED BY MHD
+	}
+
+	// THIS IS WHERE THE MIRRORING HAPPENS
+	// *******************************
+
+/*     // Calculate the length of the new string
+    size_t newLength = strlen(handle) + strlen(".bsky.social") + 1;
+
+    // Allocate memory for the new string
+    char *fullURL = malloc(newLength);
+    if (fullURL == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return MHD_NO;
+    }
+
+    // Concatenate the strings
+    strcpy(fullURL, label);
+    strcat(fullURL, ".bsky.social");
+
+    // Output the result
+    if (DEBUG_FLAG) printf("Full bsky.social label: %s\n", fullURL);
+
+	const char *temp2DID = getWellKnownDID(fullURL);
+	if (temp2DID) {
+		if (DEBUG_FLAG) printf("POST: DID:PLC found via CURL: %s\n", temp2DID);
+
+	     // MHD TAKES OWNERSHIP OF temp2Did AND WILL FREE IT   
+		// response = MHD_create_response_from_buffer (strlen (tempDid), (void *)tempDid, MHD_RESPMEM_MUST_COPY);
+		response = MHD_create_response_from_buffer (strlen (temp2DID), (void *)temp2DID, MHD_RESPMEM_MUST_FREE);
+		if (!response) {
+			free((char *) temp2DID);
+			free((char *) fullURL);
+			return MHD_NO;
+		}
+		// Add text content type header to response
+		MHD_add_response_header( response, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_TEXT );
+		// Queue the response
+		ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+		// Clean up
+		MHD_destroy_response(response);
+		free((char *) fullURL);
+		return ret; // temp2DID FREED BY MHD	
+	} else {
+		if (DEBUG_FLAG) printf("POST: No Valid DID:PLC found via CURL: '%s'\n", temp2DID);
+	}
+	
+    // Free the allocated memory
+    free((char *) fullURL); */
+
+	// *******************************
+
+    // HANDLE CASE WHERE DID IS NOT FOUND	
+    if (DEBUG_FLAG) printf("REQUEST: DID not found for handle '%s', sending HTTP 404\n", handle);
+	
+	response = MHD_create_response_from_buffer (strlen (userNotFoundPage), (void *)userNotFoundPage, MHD_RESPMEM_PERSISTENT);	
+	if (!response) return logMHDError ("Memory allocation failed for well-known response (DID not found)");
+	// Log response
+	HANDLED_PROBE1(wellknown_miss, handle);
+	syslog(LOG_INFO, "REQUEST: No DID found for for handle '%s', sending HTTP 404", handle);
+	MHD_add_response_header( response, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_HTML );		
+	ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
+	// Clean up
+	MHD_destroy_response(response);
+
+	return ret;
+}
+
+// SEND THE RESPONSE TO A NEW USER REQUEST, ONCE processRegistration RAN
+static enum MHD_Result sendNewUserResponse (struct MHD_Connection *connection, struct connectionInfoStruct *con_info)
+{
+	if (con_info->did == NULL) return sendErrorResponse (connection, ERROR_INVALID_DID_ENTERED );
+
+	newRecordResult *record = con_info->record;
+	if (!record)
+	{
+		fprintf(stderr, "ERROR: Unable to create new record result (sendNewUserResponse)\n");
+		return MHD_NO; // SIGNAL FAILURE TO ALLOCATE MEMORY
+	}
+	
+	if ( record->result != RECORD_VALID)
+	{
+		printf("ERROR: Unable to create new user record.\n"); //DEBUG
+		const char *errorMessage;
+		
+		switch (record->result) {
+			case RECORD_INVALID_DID:
+				errorMessage = ERROR_INVALID_DID;
+				break;		
+			case RECORD_INVALID_HANDLE:
+				errorMessage = ERROR_INVALID_HANDLE;
+				break;
+			case RECORD_INVALID_LABEL:
+				errorMessage = ERROR_INVALID_LABEL;
+				break;			
+			case RECORD_NULL_DATA:  // CONSOLIDATED HANDLING
+			case RECORD_EMPTY_DATA:
+				errorMessage = ERROR_NULL_OR_EMPTY_DATA;
+				break;
+			case RECORD_ERROR_DATABASE:
+				errorMessage = ERROR_DATABASE;
+				break;
+			case RECORD_ERROR_DUPLICATE_DATA:
+				errorMessage = ERROR_DUPLICATE_DATA;
+				break;
+			default:
+				errorMessage = "ERROR: Unknown validation result.";	
+				break;
+		}
+		
+		return sendErrorResponse (connection, errorMessage);
+	}
+		
+	#ifdef VERBOSE_FLAG
+	printf("RESPONSE: New Record Created, token: %s\n", record->token);
+	#endif
+	
+	// REPLACE TOKEN PLACEHOLDER AND SEND THE SUCCESS PAGE. THE RECORD IS FREED WITH con_info.
+	return sendTemplateResponse(connection, STATIC_SUCCESS, PLACEHOLDER_TOKEN, record->token);
+}
+
+
+// *********************************************
+// ********* ADMISSION CONTROL *****************
+// *********************************************
+
+// ONE BLOCKLIST ENTRY: AN ADDRESS AND A PREFIX LENGTH (32 OR 128 FOR A SINGLE HOST)
+struct blockedNetworkStruct {
+	int family;
+	unsigned char address[16];
+	unsigned int prefix;
+};
+
+static struct blockedNetworkStruct *blocklistGlobal = NULL;
+static size_t blocklistCount = 0;
+
+// REQUESTS THIS PROCESS IS SERVING, THE QUEUE DEPTH LOAD SHEDDING LOOKS AT
+static atomic_uint processRequestsInFlight = 0;
+
+static const char *trafficClassNames[TRAFFIC_CLASS_COUNT] = { "registration", "well_known" };
+
+// PREBUILT 503, QUEUED FOR EVERY SHED REQUEST WITHOUT TOUCHING THE DATABASES
+static struct MHD_Response *overloadResponse = NULL;
+static const char overloadPage[] = "<html><head><title>Busy</title></head><body>The server is busy. Please try again in a few seconds.</body></html>";
+
+// COPY THE ADDRESS BYTES OF A SOCKET ADDRESS. RETURNS AF_INET OR AF_INET6, 0 IF UNSUPPORTED.
+// IPv4-MAPPED IPv6 ADDRESSES ARE RETURNED AS IPv4.
+static int socketAddressBytes (const struct sockaddr *address, unsigned char *bytes)
+{
+	if (address->sa_family == AF_INET) {
+		memcpy(bytes, &((const struct sockaddr_in *)address)->sin_addr, 4);
+		return AF_INET;
+	}
+
+	if (address->sa_family == AF_INET6) {
+		const struct in6_addr *address6 = &((const struct sockaddr_in6 *)address)->sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(address6)) {
+			memcpy(bytes, address6->s6_addr + 12, 4);
+			return AF_INET;
+		}
+		memcpy(bytes, address6->s6_addr, 16);
+		return AF_INET6;
+	}
+
+	return 0;
+}
+
+// SAME FOR A TEXT ADDRESS
+static int textAddressBytes (const char *text, unsigned char *bytes)
+{
+	if (inet_pton(AF_INET, text, bytes) == 1) return AF_INET;
+	if (inet_pton(AF_INET6, text, bytes) != 1) return 0;
+	if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)bytes)) {
+		memmove(bytes, bytes + 12, 4);
+		return AF_INET;
+	}
+	return AF_INET6;
+}
+
+// TRUE FOR 127.0.0.0/8 AND ::1
+static int addressLoopback (int family, const unsigned char *bytes)
+{
+	static const unsigned char loopback6[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+	if (family == AF_INET) return bytes[0] == 127;
+	return family == AF_INET6 && memcmp(bytes, loopback6, 16) == 0;
+}
+
+// PARSE 'address[/prefix]' INTO A BLOCKLIST ENTRY. RETURNS 0 ON SUCCESS, 1 IF INVALID.
+static int parseBlockedNetwork (char *text, struct blockedNetworkStruct *entry)
+{
+	char *slash = strchr(text, '/');
+	if (slash) *slash = '\0';
+
+	memset(entry, 0, sizeof(*entry));
+	entry->family = textAddressBytes(text, entry->address);
+	if (entry->family == 0) return 1;
+	entry->prefix = (entry->family == AF_INET) ? 32 : 128;
+
+	if (slash) {
+		char *end;
+		long prefix = strtol(slash + 1, &end, 10);
+		if (end == slash + 1 || *end != '\0' || prefix < 0 || prefix > (long)entry->prefix) return 1;
+		entry->prefix = (unsigned int)prefix;
+	}
+
+	return 0;
+}
+
+// LOAD THE OPTIONAL BLOCKLIST, ONE ADDRESS OR CIDR NETWORK PER LINE. RETURNS 0 ON SUCCESS OR WHEN NONE IS CONFIGURED.
+int loadBlocklist (void)
+{
+	if (configGlobal.blocklist[0] == '\0') return 0;
+
+	char *path = configFilePath(configGlobal.blocklist);
+	FILE *file = path ? fopen(path, "r") : NULL;
+	blocklistGlobal = calloc(BLOCKLIST_MAX_ENTRIES, sizeof(*blocklistGlobal));
+	if (!file || !blocklistGlobal) {
+		fprintf(stderr, "ERROR: Unable to load blocklist '%s'\n", configGlobal.blocklist);
+		if (file) fclose(file);
+		free(path);
+		return 1;
+	}
+
+	char line[CONFIG_LINE_MAX];
+	int lineNumber = 0;
+	int failed = 0;
+
+	while (!failed && fgets(line, sizeof(line), file)) {
+		lineNumber++;
+
+		// EVERYTHING AFTER '#' IS A COMMENT
+		char *comment = strchr(line, '#');
+		if (comment) *comment = '\0';
+		char *content = trimWhitespace(line);
+		if (content[0] == '\0') continue;
+
+		if (blocklistCount >= BLOCKLIST_MAX_ENTRIES || parseBlockedNetwork(content, &blocklistGlobal[blocklistCount]) != 0) {
+			fprintf(stderr, "ERROR: Invalid blocklist entry on line %d of '%s'\n", lineNumber, path);
+			failed = 1;
+			continue;
+		}
+		blocklistCount++;
+	}
+
+	fclose(file);
+	if (!failed) {
+		printf("BLOCKLIST: %zu entries loaded from '%s'\n", blocklistCount, path);
+		syslog(LOG_INFO, "Blocklist: %zu entries loaded from '%s'", blocklistCount, path);
+	}
+	free(path);
+	return failed;
+}
+
+// TRUE IF THE ADDRESS FALLS IN ANY BLOCKLIST NETWORK. IPv4-MAPPED IPv6 ADDRESSES MATCH IPv4 ENTRIES.
+static int addressBlocked (const struct sockaddr *address)
+{
+	unsigned char bytes[16];
+	int family = socketAddressBytes(address, bytes);
+	if (family == 0) return FALSE;
+
+	for (size_t i = 0; i < blocklistCount; i++) {
+		const struct blockedNetworkStruct *entry = &blocklistGlobal[i];
+		if (entry->family != family) continue;
+
+		unsigned int fullBytes = entry->prefix / 8;
+		unsigned int remainingBits = entry->prefix % 8;
+		if (memcmp(bytes, entry->address, fullBytes) != 0) continue;
+
+		unsigned char mask = (unsigned char)(0xFF << (8 - remainingBits));
+		if (remainingBits == 0 || (bytes[fullBytes] & mask) == (entry->address[fullBytes] & mask)) return TRUE;
+	}
+
+	return FALSE;
+}
+
+// MHD ACCEPT POLICY: REFUSE BLOCKED ADDRESSES BEFORE ANY BUFFER IS ALLOCATED FOR THEM
+static enum MHD_Result acceptPolicy (void *cls, const struct sockaddr *address, socklen_t addressLength)
+{
+	(void) cls;            /* Unused. Silent compiler warning. */
+	(void) addressLength;  /* Unused. Silent compiler warning. */
+
+	if (blocklistCount == 0 || !addressBlocked(address)) return MHD_YES;
+
+	METRIC_ADD(connectionsBlocked, 1);
+	return MHD_NO;
+}
+
+// BUILD THE SHARED 503 RESPONSE. RETURNS 0 ON SUCCESS.
+int buildOverloadResponse (void)
+{
+	overloadResponse = MHD_create_response_from_buffer(sizeof(overloadPage) - 1, (void *)overloadPage, MHD_RESPMEM_PERSISTENT);
+	if (!overloadResponse) return 1;
+
+	MHD_add_response_header(overloadResponse, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_HTML);
+	MHD_add_response_header(overloadResponse, MHD_HTTP_HEADER_RETRY_AFTER, SHED_RETRY_AFTER);
+	MHD_add_response_header(overloadResponse, MHD_HTTP_HEADER_CACHE_CONTROL, "no-store");
+	return 0;
+}
+
+// FREE THE BLOCKLIST AND THE 503 RESPONSE (AFTER THE DAEMONS STOPPED)
+void freeAdmissionControl (void)
+{
+	if (overloadResponse) MHD_destroy_response(overloadResponse);
+	overloadResponse = NULL;
+	free(blocklistGlobal);
+	blocklistGlobal = NULL;
+	blocklistCount = 0;
+}
+
+// WELL-KNOWN LOOKUPS ARE CHEAP AND KEEP EXISTING HANDLES VERIFIED, SO THEY ARE SHED LAST
+static trafficClass classifyRequest (const char *url)
+{
+	return (0 == strcasecmp(url, URL_WELL_KNOWN_ATPROTO)) ? TRAFFIC_WELL_KNOWN : TRAFFIC_REGISTRATION;
+}
+
+// COUNT A NEW REQUEST IN, OR RETURN FALSE IF THIS PROCESS ALREADY HAS TOO MANY IN FLIGHT FOR ITS CLASS
+static int admitRequest (trafficClass traffic)
+{
+	unsigned int limit = (unsigned int)(traffic == TRAFFIC_WELL_KNOWN ? configGlobal.shedWellKnown : configGlobal.shedRegistrations);
+
+	if (atomic_fetch_add_explicit(&processRequestsInFlight, 1, memory_order_relaxed) >= limit) {
+		atomic_fetch_sub_explicit(&processRequestsInFlight, 1, memory_order_relaxed);
+		METRIC_ADD(shedResponses[traffic], 1);
+		return FALSE;
+	}
+
+	GAUGE_ADD(requestsInFlight, 1);
+	return TRUE;
+}
+
+// COUNT A FINISHED REQUEST OUT
+static void releaseRequest (void)
+{
+	atomic_fetch_sub_explicit(&processRequestsInFlight, 1, memory_order_relaxed);
+	GAUGE_SUB(requestsInFlight, 1);
+}
+
+// QUEUE THE PREBUILT 503
+static enum MHD_Result sendOverloadResponse (struct MHD_Connection *connection)
+{
+	if (!overloadResponse) return MHD_NO;
+	return MHD_queue_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE, overloadResponse);
+}
+
+
+// *********************************************
+// ********* RATE LIMITING *********************
+// *********************************************
+
+// ONE TOKEN BUCKET. 'key' IS A HASH OF THE CLIENT ADDRESS OR THE LABEL, 'updated' IS 0 FOR A FREE SLOT.
+struct rateBucketStruct {
+	uint64_t key;
+	double tokens;
+	long long updated;			// Milliseconds, CLOCK_MONOTONIC
+};
+
+// ONE LOCK STRIPE. THE SHARDS LIVE IN A SHARED MAPPING, SO PREFORK WORKERS ENFORCE ONE LIMIT TOGETHER.
+struct rateShardStruct {
+	pthread_mutex_t mutex;
+	struct rateBucketStruct buckets[RATE_KEY_COUNT][RATE_LIMIT_SHARD_SLOTS];
+};
+
+static struct rateShardStruct *rateShards = NULL;
+
+static const char *rateKeyNames[RATE_KEY_COUNT] = { "address", "label" };
+
+// PREBUILT 429, QUEUED FOR EVERY RATE LIMITED REGISTRATION
+static struct MHD_Response *rateLimitedResponse = NULL;
+static const char rateLimitedPage[] = "<html><head><title>Too many requests</title></head><body>Too many registration attempts. Please wait a minute and try again.</body></html>";
+
+// CREATE THE BUCKET TABLES AND THEIR PROCESS-SHARED MUTEXES (CALL BEFORE FORKING WORKERS). THE MUTEXES ARE ROBUST, SO A
+// WORKER THAT DIES HOLDING ONE DOES NOT DEADLOCK THE OTHERS. RETURNS 0 ON SUCCESS.
+int initializeRateLimiter (void)
+{
+	rateShards = sharedMappingCreate(sizeof(struct rateShardStruct) * RATE_LIMIT_SHARDS);
+	if (!rateShards) return 1;
+
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+	for (int i = 0; i < RATE_LIMIT_SHARDS; i++) pthread_mutex_init(&rateShards[i].mutex, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+
+	rateLimitedResponse = MHD_create_response_from_buffer(sizeof(rateLimitedPage) - 1, (void *)rateLimitedPage, MHD_RESPMEM_PERSISTENT);
+	if (!rateLimitedResponse) return 1;
+
+	MHD_add_response_header(rateLimitedResponse, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_HTML);
+	MHD_add_response_header(rateLimitedResponse, MHD_HTTP_HEADER_RETRY_AFTER, RATE_LIMIT_RETRY_AFTER);
+	MHD_add_response_header(rateLimitedResponse, MHD_HTTP_HEADER_CACHE_CONTROL, "no-store");
+	return 0;
+}
+
+// RELEASE THE BUCKET TABLES AND THE 429 RESPONSE (AFTER THE DAEMONS STOPPED)
+void freeRateLimiter (void)
+{
+	if (rateLimitedResponse) MHD_destroy_response(rateLimitedResponse);
+	rateLimitedResponse = NULL;
+
+	if (rateShards) munmap(rateShards, sizeof(struct rateShardStruct) * RATE_LIMIT_SHARDS);
+	rateShards = NULL;
+}
+
+// FNV-1a. LABELS ARE CASE-FOLDED SO 'Alice' AND 'alice' SHARE A BUCKET; ADDRESSES ARE RAW BYTES, HASHED AS THEY ARE.
+static uint64_t rateKeyHash (rateLimitKey type, const unsigned char *data, size_t length)
+{
+	uint64_t hash = 14695981039346656037ULL ^ (uint64_t)type;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (uint64_t)(type == RATE_KEY_LABEL ? tolower(data[i]) : data[i]);
+		hash *= 1099511628211ULL;
+	}
+	return hash ? hash : 1;
+}
+
+// LOCK A STRIPE. IF ITS LAST OWNER DIED HOLDING IT, THE BUCKETS MAY BE HALF WRITTEN: CLEAR THEM AND MARK THE MUTEX
+// CONSISTENT AGAIN. THE STRIPE'S CLIENTS START WITH FULL BUCKETS. RETURNS 0 ONCE LOCKED.
+static int rateShardLock (struct rateShardStruct *shard)
+{
+	int rc = pthread_mutex_lock(&shard->mutex);
+	if (rc == EOWNERDEAD) {
+		memset(shard->buckets, 0, sizeof(shard->buckets));
+		rc = pthread_mutex_consistent(&shard->mutex);
+		METRIC_ADD(rateStripesRecovered, 1);
+		syslog(LOG_WARNING, "Rate limit stripe recovered from a worker that died holding it");
+	}
+	return rc;
+}
+
+// TAKE ONE TOKEN FROM THE BUCKET OF 'key'. RETURNS TRUE IF ALLOWED. A KEY NOT IN ITS PROBE WINDOW REPLACES
+// A FREE SLOT OR ELSE THE STALEST ONE, WHICH HAS REFILLED THE MOST, SO IDLE ENTRIES ARE EVICTED FIRST.
+static int rateLimitTake (rateLimitKey type, uint64_t key, int perMinute, int burst)
+{
+	if (perMinute <= 0 || !rateShards) return TRUE;
+
+	struct rateShardStruct *shard = &rateShards[key % RATE_LIMIT_SHARDS];
+	size_t first = (size_t)(key / RATE_LIMIT_SHARDS);
+	long long now = monotonicMicroseconds() / 1000;
+	struct rateBucketStruct *bucket = NULL;
+	struct rateBucketStruct *stalest = NULL;
+
+	if (rateShardLock(shard) != 0) return TRUE;
+
+	for (size_t probe = 0; probe < RATE_LIMIT_PROBE; probe++) {
+		struct rateBucketStruct *slot = &shard->buckets[type][(first + probe) % RATE_LIMIT_SHARD_SLOTS];
+		if (slot->updated != 0 && slot->key == key) {
+			bucket = slot;
+			break;
+		}
+		if (!stalest || slot->updated < stalest->updated) stalest = slot;
+	}
+
+	if (bucket) {
+		bucket->tokens += (double)(now - bucket->updated) * perMinute / 60000.0;
+		if (bucket->tokens > burst) bucket->tokens = burst;
+	} else {
+		bucket = stalest;
+		bucket->key = key;
+		bucket->tokens = burst;
+	}
+	bucket->updated = now ? now : 1;
+
+	int allowed = bucket->tokens >= 1.0;
+	if (allowed) bucket->tokens -= 1.0;
+
+	pthread_mutex_unlock(&shard->mutex);
+	return allowed;
+}
+
+// RATE LIMIT KEY OF THE CLIENT: ITS IPv4 ADDRESS, OR THE /64 NETWORK OF AN IPv6 ADDRESS (ONE SUBSCRIBER).
+// BEHIND OUR OWN REVERSE PROXY THE PEER IS LOOPBACK, AND THE CLIENT IS THE LAST X-Forwarded-For ENTRY.
+static uint64_t clientRateKey (struct MHD_Connection *connection)
+{
+	unsigned char address[16] = {0};
+	int family = 0;
+
+	const union MHD_ConnectionInfo *info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+	if (info && info->client_addr) family = socketAddressBytes(info->client_addr, address);
+
+	if (configGlobal.trustForwardedFor && (family == 0 || addressLoopback(family, address))) {
+		const char *forwarded = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, HEADER_FORWARDED_FOR);
+		if (forwarded) {
+			char last[CLIENT_ADDRESS_MAX];
+			const char *comma = strrchr(forwarded, ',');
+			snprintf(last, sizeof(last), "%s", comma ? comma + 1 : forwarded);
+			family = textAddressBytes(trimWhitespace(last), address);
+		}
+	}
+
+	if (family == AF_INET6) memset(address + 8, 0, 8);
+	return rateKeyHash(RATE_KEY_ADDRESS, address, family == AF_INET ? 4 : 16);
+}
+
+// CHECK A REGISTRATION AGAINST THE ADDRESS AND LABEL BUCKETS. RETURNS TRUE IF IT MAY PROCEED.
+static int registrationAllowed (struct MHD_Connection *connection, const char *label)
+{
+	if (!rateLimitTake(RATE_KEY_ADDRESS, clientRateKey(connection), configGlobal.rateAddress, configGlobal.burstAddress)) {
+		METRIC_ADD(rateLimited[RATE_KEY_ADDRESS], 1);
+		return FALSE;
+	}
+
+	if (label && !rateLimitTake(RATE_KEY_LABEL, rateKeyHash(RATE_KEY_LABEL, (const unsigned char *)label, strlen(label)),
+								configGlobal.rateLabel, configGlobal.burstLabel)) {
+		METRIC_ADD(rateLimited[RATE_KEY_LABEL], 1);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// QUEUE THE PREBUILT 429
+static enum MHD_Result sendRateLimitedResponse (struct MHD_Connection *connection)
+{
+	if (!rateLimitedResponse) return MHD_NO;
+	return MHD_queue_response(connection, MHD_HTTP_TOO_MANY_REQUESTS, rateLimitedResponse);
+}
+
+
+// *********************************************
+// ********* SINGLE-FLIGHT DID RESOLUTION ******
+// *********************************************
+
+// ONE OUTBOUND LOOKUP IN PROGRESS. CONCURRENT REQUESTS FOR THE SAME HANDLE WAIT FOR IT AND SHARE ITS RESULT.
+struct resolutionFlightStruct {
+	char key[URL_MAX_SIZE];				// Normalized full handle
+	char *did;							// Shared result, NULL on failure
+	int done;
+	int waiters;						// Followers still holding this entry
+	pthread_cond_t finished;
+	struct resolutionFlightStruct *next;
+};
+
+static pthread_mutex_t resolutionFlightMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct resolutionFlightStruct *resolutionFlights = NULL;
+
+// WAIT AS A FOLLOWER FOR THE LEADER'S RESULT, WITHIN THIS REQUEST'S DEADLINE. CALLED AND RETURNS WITH THE MUTEX HELD.
+static char *awaitResolutionFlight (struct resolutionFlightStruct *flight)
+{
+	long remaining = deadlineRemainingMs();
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	if (remaining >= 0) {
+		until.tv_sec += remaining / 1000;
+		until.tv_nsec += (remaining % 1000) * 1000000L;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+	}
+
+	while (!flight->done) {
+		if (remaining < 0) pthread_cond_wait(&flight->finished, &resolutionFlightMutex);
+		else if (pthread_cond_timedwait(&flight->finished, &resolutionFlightMutex, &until) == ETIMEDOUT) break;
+	}
+
+	char *did = NULL;
+	if (flight->done && flight->did) did = strdup(flight->did);
+	else if (!flight->done) deadlineExpire(DEADLINE_STAGE_RESOLVE);
+
+	// THE LAST ONE OUT FREES A FINISHED ENTRY, THE LEADER ALREADY UNLINKED IT
+	flight->waiters--;
+	if (flight->done && flight->waiters == 0) {
+		pthread_cond_destroy(&flight->finished);
+		free(flight->did);
+		free(flight);
+	}
+
+	return did;
+}
+
+// RESOLVE A FULL HANDLE THROUGH ITS WELL-KNOWN URL, WITH ONE OUTBOUND FETCH PER HANDLE AT A TIME.
+// RETURNS A DID TO FREE, OR NULL. A FAILED FETCH IS SHARED TOO, SO A BURST DOES NOT RETRY IT.
+static char *resolveHandleCoalesced (const char *handle)
+{
+	struct resolutionFlightStruct *flight;
+	char key[URL_MAX_SIZE];
+	size_t length = strlen(handle);
+
+	if (length >= sizeof(key)) return (char *)getWellKnownDID(handle);
+	for (size_t i = 0; i <= length; i++) key[i] = (char)tolower((unsigned char)handle[i]);
+
+	pthread_mutex_lock(&resolutionFlightMutex);
+	for (flight = resolutionFlights; flight; flight = flight->next) {
+		if (strcmp(flight->key, key) != 0) continue;
+
+		flight->waiters++;
+		METRIC_ADD(resolutionsCoalesced, 1);
+		char *did = awaitResolutionFlight(flight);
+		pthread_mutex_unlock(&resolutionFlightMutex);
+		return did;
+	}
+
+	// NO LOOKUP IN PROGRESS, LEAD ONE
+	flight = calloc(1, sizeof(*flight));
+	if (!flight) {
+		pthread_mutex_unlock(&resolutionFlightMutex);
+		return (char *)getWellKnownDID(key);
+	}
+	memcpy(flight->key, key, length + 1);
+	pthread_cond_init(&flight->finished, NULL);
+	flight->next = resolutionFlights;
+	resolutionFlights = flight;
+	pthread_mutex_unlock(&resolutionFlightMutex);
+
+	char *did = (char *)getWellKnownDID(key);
+	METRIC_ADD(resolutionsFetched, 1);
+
+	pthread_mutex_lock(&resolutionFlightMutex);
+	struct resolutionFlightStruct **link = &resolutionFlights;
+	while (*link != flight) link = &(*link)->next;
+	*link = flight->next;
+
+	flight->did = did ? strdup(did) : NULL;
+	flight->done = TRUE;
+	pthread_cond_broadcast(&flight->finished);
+	if (flight->waiters == 0) {
+		pthread_cond_destroy(&flight->finished);
+		free(flight->did);
+		free(flight);
+	}
+	pthread_mutex_unlock(&resolutionFlightMutex);
+
+	return did;
+}
+
+
+// *********************************************
+// ********* REQUEST STAGES ********************
+// *********************************************
+
+// EVERY REQUEST KEEPS A FEW TIMESTAMPS ON ITS con_info, ONE PER STAGE BOUNDARY. WHEN IT COMPLETES, THE TIME IN EACH
+// STAGE GOES INTO A HISTOGRAM, AND A REQUEST SLOWER THAN trace_threshold IS APPENDED TO trace_file AS CHROME TRACE
+// EVENTS (JSON ARRAY FORMAT, LOADS IN chrome://tracing AND PERFETTO), ONE ROW PER REQUEST. A MARK IS ONE READ OF THE
+// MONOTONIC CLOCK, AND ONLY SLOW REQUESTS, AT MOST TRACE_MAX_PER_SECOND OF THEM, COST A WRITE.
+static const char *requestStageNames[REQUEST_STAGE_COUNT] = { "receive", "queue", "extract", "resolve", "store", "lookup", "render", "send" };
+
+static int traceFile = -1;
+static atomic_llong traceSecond = 0;				// Second of the monotonic clock the count below is for
+static atomic_int traceSecondCount = 0;
+static atomic_ullong traceRow = 0;					// Chrome trace 'tid', one per traced request of this process
+
+// THE TIME SINCE THE LAST MARK (OR THE START) WENT TO 'stage'. A STAGE MARKED TWICE IN A ROW GROWS ITS SPAN.
+static void stageMark (struct connectionInfoStruct *con_info, requestStage stage)
+{
+	long long now = monotonicMicroseconds();
+	int last = con_info->spanCount - 1;
+
+	#ifdef HANDLED_ALLOCPROF
+	// SO DID THE ALLOCATIONS, SEE ALLOCATION PROFILE
+	con_info->allocStages[stage].count += con_info->allocPending.count;
+	con_info->allocStages[stage].bytes += con_info->allocPending.bytes;
+	con_info->allocPending.count = 0;
+	con_info->allocPending.bytes = 0;
+	#endif
+
+	if (last >= 0 && (con_info->spanStage[last] == stage || con_info->spanCount == REQUEST_SPAN_MAX)) {
+		con_info->spanEnd[last] = now;
+		return;
+	}
+
+	con_info->spanStage[con_info->spanCount] = stage;
+	con_info->spanEnd[con_info->spanCount] = now;
+	con_info->spanCount++;
+}
+
+// OPEN trace_file FOR APPENDING, BEFORE ANY FORK SO WORKERS SHARE IT, AND START AN EMPTY FILE WITH THE OPENING '['.
+// WRITING IT HERE, IN ONE PROCESS, KEEPS TWO WORKERS FROM BOTH SEEING AN EMPTY FILE. RETURNS 0 ON SUCCESS OR WITHOUT ONE.
+int openTraceFile (void)
+{
+	if (configGlobal.traceFile[0] == '\0') return 0;
+
+	char *path = configFilePath(configGlobal.traceFile);
+	if (!path) return 1;
+
+	struct stat info;
+	traceFile = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+	if (traceFile >= 0 && fstat(traceFile, &info) == 0 && info.st_size == 0 && write(traceFile, "[\n", 2) != 2) {
+		close(traceFile);
+		traceFile = -1;
+	}
+	if (traceFile < 0) fprintf(stderr, "ERROR: Unable to open trace file '%s': %s\n", path, strerror(errno));
+	free(path);
+
+	return traceFile < 0 ? 1 : 0;
+}
+
+void closeTraceFile (void)
+{
+	if (traceFile >= 0) close(traceFile);
+	traceFile = -1;
+}
+
+// TRUE IF ANOTHER TRACE FITS IN THIS SECOND'S ALLOWANCE
+static int traceAllowed (long long now)
+{
+	long long second = now / 1000000;
+	long long current = atomic_load(&traceSecond);
+
+	if (second != current && atomic_compare_exchange_strong(&traceSecond, &current, second)) {
+		atomic_store(&traceSecondCount, 0);
+	}
+
+	return atomic_fetch_add(&traceSecondCount, 1) < TRACE_MAX_PER_SECOND;
+}
+
+// APPEND A SLOW REQUEST TO trace_file: ONE EVENT FOR THE REQUEST AND ONE PER SPAN UNDER IT. EACH REQUEST GOES OUT IN
+// ONE write, SO WORKERS SHARING THE FILE DO NOT INTERLEAVE. THE OPENING '[' IS WRITTEN BY openTraceFile. THE CLOSING ']'
+// IS OPTIONAL IN THIS FORMAT, AND THE VIEWERS IGNORE THE TRAILING COMMA.
+static void writeRequestTrace (const struct connectionInfoStruct *con_info, int completed)
+{
+	struct textBuffer trace = {NULL, 0, 0};
+	int failed = 0;
+	int pid = (int)getpid();
+	unsigned long long row = atomic_fetch_add(&traceRow, 1) + 1;
+	long long begin = con_info->started;
+	long long end = con_info->spanEnd[con_info->spanCount - 1];
+
+	failed |= textBufferAppend(&trace, "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%llu,\"args\":{\"host\":",
+								trafficClassNames[con_info->traffic], begin, end - begin, pid, row);
+	failed |= textBufferAppendJson(&trace, con_info->host ? con_info->host : "");
+	failed |= textBufferAppend(&trace, ",\"completed\":%s}},\n", completed ? "true" : "false");
+
+	for (int span = 0; span < con_info->spanCount; span++) {
+		failed |= textBufferAppend(&trace, "{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%llu},\n",
+									requestStageNames[con_info->spanStage[span]], begin, con_info->spanEnd[span] - begin, pid, row);
+		begin = con_info->spanEnd[span];
+	}
+
+	if (!failed && write(traceFile, trace.data, trace.length) == (ssize_t)trace.length) METRIC_ADD(tracesWritten, 1);
+	else METRIC_ADD(tracesDropped, 1);
+
+	free(trace.data);
+}
+
+// *********************************************
+// ********* ALLOCATION PROFILE ****************
+// *********************************************
+
+// make ALLOCPROF=1 LINKS WITH --wrap FOR malloc, calloc, realloc, strdup AND strndup, SO EVERY ALLOCATION MADE BY
+// THIS FILE (NOT BY SQLITE, CURL OR MHD) PASSES THROUGH A COUNTER. A THREAD SERVING A REQUEST POINTS 'allocTarget' AT
+// IT, stageMark MOVES THE COUNT INTO THE STAGE THAT JUST ENDED, AND THE FINISHED REQUEST ADDS ITS STAGES TO THE
+// METRICS UNDER ITS ROUTE. ALLOCATIONS MADE AFTER A REQUEST'S LAST MARK IN A CALL GO TO THE NEXT STAGE MARKED, SO A
+// PAGE BUILT RIGHT BEFORE THE HANDLER RETURNS COUNTS UNDER 'send'. free IS NOT COUNTED.
+#ifdef HANDLED_ALLOCPROF
+static const char *requestRouteNames[REQUEST_ROUTE_COUNT] = { "well-known", "landing", "result", "error" };
+
+static _Thread_local struct allocCountStruct *allocTarget = NULL;	// NULL outside requests
+
+void *__real_malloc (size_t size);
+void *__real_calloc (size_t count, size_t size);
+void *__real_realloc (void *pointer, size_t size);
+char *__real_strdup (const char *string);
+char *__real_strndup (const char *string, size_t size);
+
+static void allocationCount (size_t bytes)
+{
+	if (!allocTarget) return;
+	allocTarget->count++;
+	allocTarget->bytes += bytes;
+}
+
+void *__wrap_malloc (size_t size)
+{
+	allocationCount(size);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc (size_t count, size_t size)
+{
+	allocationCount(count * size);
+	return __real_calloc(count, size);
+}
+
+void *__wrap_realloc (void *pointer, size_t size)
+{
+	allocationCount(size);
+	return __real_realloc(pointer, size);
+}
+
+char *__wrap_strdup (const char *string)
+{
+	allocationCount(strlen(string) + 1);
+	return __real_strdup(string);
+}
+
+char *__wrap_strndup (const char *string, size_t size)
+{
+	allocationCount(strnlen(string, size) + 1);
+	return __real_strndup(string, size);
+}
+
+// COUNT THIS THREAD'S ALLOCATIONS FOR con_info, UNTIL allocationDetach
+static void allocationAttribute (struct connectionInfoStruct *con_info)
+{
+	allocTarget = &con_info->allocPending;
+}
+
+static void allocationDetach (void)
+{
+	allocTarget = NULL;
+}
+
+// ADD A FINISHED REQUEST TO ITS ROUTE
+static void observeAllocations (const struct connectionInfoStruct *con_info)
+{
+	METRIC_ADD(allocRequests[con_info->route], 1);
+	for (int stage = REQUEST_STAGE_RECEIVE; stage < REQUEST_STAGE_COUNT; stage++) {
+		METRIC_ADD(allocCount[con_info->route][stage], con_info->allocStages[stage].count);
+		METRIC_ADD(allocBytes[con_info->route][stage], con_info->allocStages[stage].bytes);
+	}
+}
+
+// ALLOCATIONS PER REQUEST BY ROUTE AND STAGE, PRINTED AT SHUTDOWN BY THE PROCESS THAT OWNS THE METRICS
+static void printAllocationProfile (void)
+{
+	printf("ALLOCATIONS PER REQUEST (bytes per request in parentheses)\n");
+	printf("%-11s %9s", "route", "requests");
+	for (int stage = REQUEST_STAGE_RECEIVE; stage < REQUEST_STAGE_COUNT; stage++) printf(" %15s", requestStageNames[stage]);
+	printf("\n");
+
+	for (int route = REQUEST_ROUTE_WELL_KNOWN; route < REQUEST_ROUTE_COUNT; route++) {
+		unsigned long long requests = METRIC_GET(allocRequests[route]);
+		if (requests == 0) continue;
+
+		printf("%-11s %9llu", requestRouteNames[route], requests);
+		for (int stage = REQUEST_STAGE_RECEIVE; stage < REQUEST_STAGE_COUNT; stage++) {
+			char cell[32];
+			snprintf(cell, sizeof(cell), "%.2f (%.0f)", (double)METRIC_GET(allocCount[route][stage]) / (double)requests,
+						(double)METRIC_GET(allocBytes[route][stage]) / (double)requests);
+			printf(" %15s", cell);
+		}
+		printf("\n");
+	}
+}
+#else
+static void allocationAttribute (struct connectionInfoStruct *con_info) { (void) con_info; }
+static void allocationDetach (void) {}
+static void observeAllocations (const struct connectionInfoStruct *con_info) { (void) con_info; }
+static void printAllocationProfile (void) {}
+#endif
+
+
+// *********************************************
+// ********* REQUEST CAPTURE *******************
+// *********************************************
+
+// WITH capture_file SET, EVERY REQUEST IS LOGGED AS IT ARRIVES (METHOD, HOST AS SENT, URL, BODY SIZE AND ARRIVAL TIME,
+// NEVER THE BODY) FOR handled-replay TO PLAY BACK. RECORDS COLLECT IN A BUFFER PER PROCESS, WRITTEN WITH O_APPEND
+// WHEN FULL, WHEN A REQUEST FINDS THEM OLDER THAN CAPTURE_FLUSH_INTERVAL, AND AT EXIT. WORKERS SHARE THE FILE, SO
+// RECORDS ARE IN ARRIVAL ORDER PER WORKER ONLY AND THE REPLAY SORTS THEM.
+struct captureBufferStruct {
+	pthread_mutex_t mutex;
+	char *data;							// CAPTURE_BUFFER_SIZE bytes
+	size_t length;
+	unsigned long long records;			// Records in 'data'
+	long long written;					// CLOCK_MONOTONIC microseconds of the last write
+};
+
+static int captureFile = -1;
+static struct captureBufferStruct captureBuffer = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
+
+// WRITE THE BUFFERED RECORDS. CALL WITH THE MUTEX HELD.
+static void captureFlush (void)
+{
+	int failed = FALSE;
+
+	if (captureBuffer.length > 0) failed = write(captureFile, captureBuffer.data, captureBuffer.length) != (ssize_t)captureBuffer.length;
+
+	if (failed) METRIC_ADD(captureErrors, captureBuffer.records);
+	else METRIC_ADD(capturedRequests, captureBuffer.records);
+
+	captureBuffer.length = 0;
+	captureBuffer.records = 0;
+	captureBuffer.written = monotonicMicroseconds();
+}
+
+// OPEN capture_file FOR APPENDING, BEFORE ANY FORK, AND START AN EMPTY FILE WITH CAPTURE_MAGIC. WRITING IT HERE, IN
+// ONE PROCESS, KEEPS WORKERS FLUSHING AT THE SAME TIME FROM BOTH SEEING AN EMPTY FILE. RETURNS 0 ON SUCCESS OR WITHOUT ONE.
+int openCaptureFile (void)
+{
+	if (configGlobal.captureFile[0] == '\0') return 0;
+
+	char *path = configFilePath(configGlobal.captureFile);
+	captureBuffer.data = malloc(CAPTURE_BUFFER_SIZE);
+	if (!path || !captureBuffer.data) {
+		free(path);
+		free(captureBuffer.data);
+		captureBuffer.data = NULL;
+		return 1;
+	}
+
+	struct stat info;
+	captureFile = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+	if (captureFile >= 0 && fstat(captureFile, &info) == 0 && info.st_size == 0 &&
+		write(captureFile, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != CAPTURE_MAGIC_SIZE) {
+		close(captureFile);
+		captureFile = -1;
+	}
+	if (captureFile < 0) {
+		fprintf(stderr, "ERROR: Unable to open capture file '%s': %s\n", path, strerror(errno));
+		free(captureBuffer.data);
+		captureBuffer.data = NULL;
+	}
+	free(path);
+
+	return captureFile < 0 ? 1 : 0;
+}
+
+// WRITE WHAT IS LEFT AND CLOSE THE FILE (AFTER THE DAEMONS STOPPED)
+void closeCaptureFile (void)
+{
+	if (captureFile < 0) return;
+
+	pthread_mutex_lock(&captureBuffer.mutex);
+	captureFlush();
+	close(captureFile);
+	captureFile = -1;
+	free(captureBuffer.data);
+	captureBuffer.data = NULL;
+	pthread_mutex_unlock(&captureBuffer.mutex);
+}
+
+// LOG ONE ARRIVING REQUEST
+static void captureRequest (const char *method, const char *host, const char *url, const char *contentLength)
+{
+	unsigned char record[CAPTURE_RECORD_HEADER + CAPTURE_HOST_MAX + CAPTURE_URL_MAX];
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	uint64_t arrival = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+	unsigned long long declared = contentLength ? strtoull(contentLength, NULL, 10) : 0;
+	uint32_t bodySize = declared > UINT32_MAX ? UINT32_MAX : (uint32_t)declared;
+	size_t hostSize = host ? strnlen(host, CAPTURE_HOST_MAX) : 0;
+	size_t urlSize = strnlen(url, CAPTURE_URL_MAX);
+	uint16_t hostLength = (uint16_t)hostSize, urlLength = (uint16_t)urlSize;
+	uint8_t kind = CAPTURE_OTHER;
+
+	if (0 == strcasecmp(method, MHD_HTTP_METHOD_GET)) kind = CAPTURE_GET;
+	else if (0 == strcasecmp(method, MHD_HTTP_METHOD_POST)) kind = CAPTURE_POST;
+	else if (0 == strcasecmp(method, MHD_HTTP_METHOD_HEAD)) kind = CAPTURE_HEAD;
+
+	memcpy(record, &arrival, 8);
+	memcpy(record + 8, &bodySize, 4);
+	memcpy(record + 12, &hostLength, 2);
+	memcpy(record + 14, &urlLength, 2);
+	record[16] = kind;
+	if (hostSize > 0) memcpy(record + CAPTURE_RECORD_HEADER, host, hostSize);
+	memcpy(record + CAPTURE_RECORD_HEADER + hostSize, url, urlSize);
+	size_t size = CAPTURE_RECORD_HEADER + hostSize + urlSize;
+
+	pthread_mutex_lock(&captureBuffer.mutex);
+	if (captureFile >= 0) {
+		if (captureBuffer.length + size > CAPTURE_BUFFER_SIZE) captureFlush();
+		memcpy(captureBuffer.data + captureBuffer.length, record, size);
+		captureBuffer.length += size;
+		captureBuffer.records++;
+		if (monotonicMicroseconds() - captureBuffer.written > CAPTURE_FLUSH_INTERVAL * 1000LL) captureFlush();
+	}
+	pthread_mutex_unlock(&captureBuffer.mutex);
+}
+
+// *********************************************
+// ********* REQUEST LANES *********************
+// *********************************************
+
+// UPPER BOUNDS OF THE LATENCY HISTOGRAM BUCKETS IN MICROSECONDS, THE LAST ONE CATCHES EVERYTHING ELSE
+static const long long latencyBucketBounds[LATENCY_BUCKET_COUNT] = { 500, 1000, 5000, 25000, 100000, 500000, 2500000, 0 };
+
+static const char *laneNames[LANE_COUNT] = { "io", "registration" };
+
+// BOUNDED QUEUE OF SUSPENDED REGISTRATIONS AND THE THREADS SERVING IT, ONE PER PROCESS
+struct registrationLaneStruct {
+	pthread_mutex_t mutex;
+	pthread_cond_t available;
+	struct connectionInfoStruct **queue;	// Ring buffer of configGlobal.registrationQueue entries
+	size_t head;
+	size_t count;
+	pthread_t threads[MAX_REGISTRATION_THREADS];
+	int threadCount;
+	int stopping;
+};
+
+static struct registrationLaneStruct registrationLane = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, {0}, 0, FALSE };
+
+// RESOLVE THE 'did' FORM FIELD: A DID:PLC, A FULL bsky.social HANDLE OR A PARTIAL ONE. RETURNS A DID TO FREE, OR NULL.
+static char *resolveDidInput (struct connectionInfoStruct *con_info)
+{
+	const char *data = con_info->didInput;
+	size_t size = strlen(data);
+	printf("POST: DID key value: %s\n", data);
+
+	// STEP 1: LOOK FOR DID PLC
+	if ( strcasestr(data, "did:plc:") )
+	{
+		char output[MAX_SIZE_DID_PLC + 1] = {0};
+		extractDid(data, output, sizeof(output));
+		stageMark(con_info, REQUEST_STAGE_EXTRACT);
+		if (output[0] != '\0') {
+			printf("POST: Valid DID:PLC found in data: '%s'\n", output);
+			return strndup(output, strlen(output));
+		}
+	}
+
+	// STEP 2: LOOK FOR FULL HANDLE
+	if ( strcasestr(data, "bsky.social") ) {
+		printf("POST: Valid 'bsky.social' handle entered: %s\n", data);
+		char *tempDID = resolveHandleCoalesced(data);
+		stageMark(con_info, REQUEST_STAGE_RESOLVE);
+		if (tempDID) {
+			printf("POST: Valid DID:PLC found via CURL: %s\n", tempDID);
+			char *did = strndup(tempDID, MAX_SIZE_DID_PLC);
+			free(tempDID);
+			return did;
+		}
+		printf("POST: No Valid DID:PLC found via CURL: '%s'\n", data);
+		return NULL;
+	}
+
+	// STEP 3: CHECK TO SEE IF IT IS A PARTIAL HANDLE BETWEEN 2 and 63 CHARACTERS
+	if (size >= 2 && size <= 63) {
+		printf("POST: Data entered could contain partial handle: '%s'\n", data);
+
+		char fullHandle[64 + sizeof(".bsky.social")];
+		snprintf(fullHandle, sizeof(fullHandle), "%s.bsky.social", data);
+
+		char *tempDID = resolveHandleCoalesced(fullHandle);
+		stageMark(con_info, REQUEST_STAGE_RESOLVE);
+		if (tempDID) {
+			printf("POST: DID:PLC found via CURL: %s\n", tempDID);
+			char *did = strndup(tempDID, MAX_SIZE_DID_PLC);
+			free(tempDID);
+			return did;
+		}
+	}
+
+	printf("POST: No Valid DID:PLC found via CURL: '%s'\n", data);
+	return NULL;
+}
+
+// THE EXPENSIVE PART OF A REGISTRATION: RESOLVE THE DID (UP TO TWO LOOKUPS) AND INSERT THE RECORD.
+// RUNS ON A REGISTRATION LANE THREAD, OR ON THE I/O THREAD WITHOUT ONE.
+static void processRegistration (struct connectionInfoStruct *con_info)
+{
+	con_info->did = resolveDidInput(con_info);
+	if (!con_info->did) return;
+
+	const char *email = con_info->email ? con_info->email : "NO EMAIL PROVIDED";
+	if (!con_info->host || !con_info->handle) {
+		fprintf(stderr, "ERROR: Incomplete user information (processRegistration)\n");
+		return;
+	}
+
+	#ifdef VERBOSE_FLAG
+	printf("RESPONSE: New Record Attempt for: handle=%s, label=%s, did=%s, email=%s\n", con_info->host, con_info->handle, con_info->did, email);
+	#endif
+
+	con_info->record = addNewRecord(con_info->host, con_info->handle, con_info->did, email);
+	stageMark(con_info, REQUEST_STAGE_STORE);
+}
+
+// REGISTRATION LANE THREAD: RUN QUEUED REGISTRATIONS AND RESUME THEIR CONNECTIONS
+static void *registrationLaneThread (void *unused)
+{
+	(void) unused;
+
+	pthread_mutex_lock(&registrationLane.mutex);
+	for (;;) {
+		while (registrationLane.count == 0 && !registrationLane.stopping) pthread_cond_wait(&registrationLane.available, &registrationLane.mutex);
+		if (registrationLane.count == 0) break;	// STOPPING AND NOTHING LEFT
+
+		struct connectionInfoStruct *con_info = registrationLane.queue[registrationLane.head];
+		registrationLane.head = (registrationLane.head + 1) % (size_t)configGlobal.registrationQueue;
+		registrationLane.count--;
+		GAUGE_SUB(laneQueued, 1);
+		pthread_mutex_unlock(&registrationLane.mutex);
+		allocationAttribute(con_info);
+		stageMark(con_info, REQUEST_STAGE_QUEUE);
+
+		// THE DEADLINE ALSO COVERS THE TIME SPENT IN THE QUEUE
+		deadlineBegin(con_info->deadline);
+		if (deadlineRemainingMs() == 0) deadlineExpire(DEADLINE_STAGE_QUEUE);
+		else processRegistration(con_info);
+		con_info->timedOut = deadlineExceeded();
+		deadlineBegin(0);
+
+		con_info->state = REGISTRATION_DONE;
+		allocationDetach();
+		MHD_resume_connection(con_info->connection);
+
+		pthread_mutex_lock(&registrationLane.mutex);
+	}
+	pthread_mutex_unlock(&registrationLane.mutex);
+
+	return NULL;
+}
+
+// START THE REGISTRATION THREADS OF THIS PROCESS (AFTER FORKING). RETURNS 0 ON SUCCESS.
+int startRegistrationLane (void)
+{
+	if (configGlobal.registrationThreads == 0) return 0;
+
+	registrationLane.queue = calloc((size_t)configGlobal.registrationQueue, sizeof(*registrationLane.queue));
+	if (!registrationLane.queue) return 1;
+	registrationLane.head = registrationLane.count = 0;
+	registrationLane.stopping = FALSE;
+
+	for (int i = 0; i < configGlobal.registrationThreads; i++) {
+		if (pthread_create(&registrationLane.threads[i], NULL, registrationLaneThread, NULL) != 0) {
+			fprintf(stderr, "ERROR: Unable to start registration thread %d\n", i);
+			break;
+		}
+		registrationLane.threadCount++;
+	}
+
+	return registrationLane.threadCount > 0 ? 0 : 1;
+}
+
+// FINISH THE QUEUED REGISTRATIONS AND STOP THE THREADS. CALL BEFORE STOPPING MHD, WHICH CANNOT CLOSE SUSPENDED CONNECTIONS.
+void stopRegistrationLane (void)
+{
+	pthread_mutex_lock(&registrationLane.mutex);
+	registrationLane.stopping = TRUE;
+	pthread_cond_broadcast(&registrationLane.available);
+	pthread_mutex_unlock(&registrationLane.mutex);
+
+	for (int i = 0; i < registrationLane.threadCount; i++) pthread_join(registrationLane.threads[i], NULL);
+	registrationLane.threadCount = 0;
+
+	free(registrationLane.queue);
+	registrationLane.queue = NULL;
+}
+
+// SUSPEND THE CONNECTION AND QUEUE ITS REGISTRATION. RETURNS 0 ON SUCCESS, 1 IF THE QUEUE IS FULL.
+// THE CONNECTION IS SUSPENDED UNDER THE LOCK, SO A LANE THREAD CANNOT RESUME IT FIRST.
+static int enqueueRegistration (struct connectionInfoStruct *con_info)
+{
+	pthread_mutex_lock(&registrationLane.mutex);
+	if (registrationLane.stopping || registrationLane.count >= (size_t)configGlobal.registrationQueue) {
+		pthread_mutex_unlock(&registrationLane.mutex);
+		METRIC_ADD(laneRejected, 1);
+		return 1;
+	}
+
+	// FROM HERE ON THE LANE THREAD COUNTS THIS REQUEST'S ALLOCATIONS
+	allocationDetach();
+	con_info->state = REGISTRATION_QUEUED;
+	MHD_suspend_connection(con_info->connection);
+
+	size_t tail = (registrationLane.head + registrationLane.count) % (size_t)configGlobal.registrationQueue;
+	registrationLane.queue[tail] = con_info;
+	registrationLane.count++;
+	GAUGE_ADD(laneQueued, 1);
+
+	pthread_cond_signal(&registrationLane.available);
+	pthread_mutex_unlock(&registrationLane.mutex);
+	return 0;
+}
+
+// RECORD A FINISHED REQUEST IN ITS LANE HISTOGRAM
+static void observeLatency (requestLane lane, long long microseconds)
+{
+	int bucket = 0;
+	while (bucket < LATENCY_BUCKET_COUNT - 1 && microseconds > latencyBucketBounds[bucket]) bucket++;
+
+	METRIC_ADD(latencyBuckets[lane][bucket], 1);
+	METRIC_ADD(latencyMicroseconds[lane], (unsigned long long)microseconds);
+	METRIC_ADD(latencyCount[lane], 1);
+}
+
+// RECORD THE TIME A FINISHED REQUEST SPENT IN EACH STAGE IT WENT THROUGH, AND TRACE IT IF IT WAS SLOW
+static void observeStages (const struct connectionInfoStruct *con_info, int completed)
+{
+	long long stageTime[REQUEST_STAGE_COUNT] = {0};
+	int stageSeen[REQUEST_STAGE_COUNT] = {0};
+	long long begin = con_info->started;
+
+	for (int span = 0; span < con_info->spanCount; span++) {
+		stageTime[con_info->spanStage[span]] += con_info->spanEnd[span] - begin;
+		stageSeen[con_info->spanStage[span]] = TRUE;
+		begin = con_info->spanEnd[span];
+	}
+
+	for (int stage = REQUEST_STAGE_RECEIVE; stage < REQUEST_STAGE_COUNT; stage++) {
+		if (!stageSeen[stage]) continue;
+		int bucket = 0;
+		while (bucket < LATENCY_BUCKET_COUNT - 1 && stageTime[stage] > latencyBucketBounds[bucket]) bucket++;
+		METRIC_ADD(stageBuckets[stage][bucket], 1);
+		METRIC_ADD(stageMicroseconds[stage], (unsigned long long)stageTime[stage]);
+		METRIC_ADD(stageCount[stage], 1);
+	}
+
+	if (traceFile < 0 || begin - con_info->started < configGlobal.traceThreshold * 1000LL) return;
+	if (traceAllowed(begin)) writeRequestTrace(con_info, completed);
+	else METRIC_ADD(tracesDropped, 1);
+}
+
+
+// POST REQUEST MANAGER
+static enum MHD_Result iteratePost	(void *coninfo_cls, enum MHD_ValueKind kind, const char *key,
+										const char *filename, const char *content_type,
+										const char *transfer_encoding, const char *data, uint64_t off,
+										size_t size)
+{
+  struct connectionInfoStruct *con_info = coninfo_cls;
+  (void) kind;               /* Unused. Silent compiler warning. */
+  (void) filename;           /* Unused. Silent compiler warning. */
+  (void) content_type;       /* Unused. Silent compiler warning. */
+  (void) transfer_encoding;  /* Unused. Silent compiler warning. */
+  (void) off;                /* Unused. Silent compiler warning. */
+  
+	// THIS KEY IS A GENERAL DID:PLC FIELD WITH EITHER A DID OR A FULL HANDLE. IT IS RESOLVED ONCE THE BODY IS IN (processRegistration).
+ 	if ( strcmp(key, "did") == 0 ) {
+		if ( (con_info->didInput == NULL) && (size > 0) && (size <= MAXDIDSIZE) ) con_info->didInput = strndup(data, size);
+		return MHD_YES; // Iterate again looking for email.
+	}
+
+	if ( (strcmp(key, "email") == 0) && (size <= 256 ) ) {
+		if ( (data != NULL) && (size > 0) )  con_info->email = strndup(data, size);		
+		return MHD_NO;			
+	}
+
+	return MHD_YES;
+}
+
+// CLEAN-UP FUNCTION AFTER REQUEST COMPLETED
+static void requestCompleted (void *cls, struct MHD_Connection *connection, void **con_cls, enum MHD_RequestTerminationCode toe)
+{
+	struct connectionInfoStruct *con_info = *con_cls;
+	(void) cls;         /* Unused. Silent compiler warning. */
+	(void) connection;  /* Unused. Silent compiler warning. */
+
+	if (NULL == con_info) return;
+
+	releaseRequest();
+	GAUGE_SUB(laneInFlight[con_info->lane], 1);
+	allocationAttribute(con_info);
+	stageMark(con_info, REQUEST_STAGE_SEND);
+	HANDLED_PROBE3(request_done, con_info, con_info->spanEnd[con_info->spanCount - 1] - con_info->started, (int)toe);
+	observeLatency(con_info->lane, con_info->spanEnd[con_info->spanCount - 1] - con_info->started);
+	observeStages(con_info, toe == MHD_REQUEST_TERMINATED_COMPLETED_OK);
+	allocationDetach();
+	observeAllocations(con_info);
+	
+	if (con_info->connectiontype == POST)
+    {
+		MHD_destroy_post_processor (con_info->postprocessor);
+	}
+	
+/* 	// COMMENTED OUT BECAUSE ONE WILL 1ST REQUIRES FREEING, BUT SECOND ONE DOES NOT
+	#ifdef NGINX_FLAG
+
+	#else
+	// FIX THIS, WHICH WILL BE DYNAMICALLY ALLOCATED, NEEDS TO BE FREED
+	#endif */
+
+	// Free each member that was dynamically allocated	
+	if (con_info->host) {
+		free((char *)con_info->host);
+	}
+
+	if (con_info->handle) {
+		free((char *)con_info->handle);
+	}
+
+	if (con_info->did) {
+		free((char *)con_info->did);
+	}
+	
+	if (con_info->email) {
+		free((char *)con_info->email);
+	}	
+
+	if (con_info->didInput) {
+		free((char *)con_info->didInput);
+	}
+
+	if (con_info->record) {
+		freeNewRecordResult(con_info->record);
+	}
+	
+	// if (con_info->answerstring) {
+		// free((char *)con_info->answerstring);
+	// }	
+
+    // Free the structure itself
+	free (con_info);
+	*con_cls = NULL;
+}
+
+// *********************************************
+// ********* PRINCIPAL REQUEST HANDLER *********
+// *********************************************
+
+static enum MHD_Result routeRequest	   (void *cls, struct MHD_Connection *connection,
+												const char *url, const char *method,
+												const char *version, const char *upload_data,
+												size_t *upload_data_size, void **con_cls)
+{	
+	(void) cls;               /* Unused. Silent compiler warning. */
+	(void) version;           /* Unused. Silent compiler warning. */
+	
+	if (NULL == *con_cls) { // FIRST CALL, SETUP DATA STRUCTURES, SOME ONLY APPLY TO 'POST' REQUESTS
+	
+		// VALIDATE HOST HEADER. A REVERSE PROXY MAKES THIS UNNECESSARY, BUT THE NATIVE TLS LISTENER RELIES ON IT
+		const char *hostHeader = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Host");		
+
+		// LOG THE REQUEST AS SENT, REJECTED ONES INCLUDED, FOR handled-replay
+		if (captureFile >= 0) {
+			captureRequest(method, hostHeader, url, MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_LENGTH));
+		}
+		char *host = normalizeHost(hostHeader);
+		if (!host) {			
+			// REJECT REQUEST IF HOST HEADER IS NOT THE EXPECTED DOMAIN OR ONE OF ITS SUBDOMAINS
+			return logMHDError ("Invalid domain name request rejected");
+		}
+		
+		// SHED LOAD WITH THE PREBUILT 503 WHEN TOO MANY REQUESTS ARE IN FLIGHT, REGISTRATIONS FIRST
+		trafficClass traffic = classifyRequest(url);
+		if (!admitRequest(traffic)) {
+			free (host);
+			return sendOverloadResponse (connection);
+		}
+
+		struct connectionInfoStruct *con_info;
+
+		con_info = malloc (sizeof (struct connectionInfoStruct));
+		if (NULL == con_info) {
+			free (host);
+			releaseRequest ();
+			// INTERNAL ERROR
+			return logMHDError ("Memory allocation failed for connection information");
+		}
+
+		con_info->traffic = traffic;
+		con_info->started = monotonicMicroseconds();
+		con_info->deadline = requestDeadlineFor(url, method, con_info->started);
+		con_info->timedOut = FALSE;
+		con_info->spanCount = 0;
+		con_info->route = REQUEST_ROUTE_ERROR;
+		#ifdef HANDLED_ALLOCPROF
+		memset(&con_info->allocPending, 0, sizeof(con_info->allocPending));
+		memset(con_info->allocStages, 0, sizeof(con_info->allocStages));
+		#endif
+
+		// LOWERCASE HOST WITHOUT PORT, NEEDS TO BE FREED
+		con_info->host = host;
+
+ 		#ifdef NGINX_FLAG
+		// 'X-ATPROTO-HANDLE' OPTIONAL AND REQUIRES NGINX REVERSE PROXY. COPIED SO IT IS FREED LIKE THE OTHER BRANCH.
+		const char *handleHeader = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-ATPROTO-HANDLE");
+		con_info->handle = handleHeader ? strdup(handleHeader) : NULL;
+		#else
+		// DYNAMICALLY ALLOCATED, NEEDS TO BE FREED
+		con_info->handle = removeDomainName(con_info->host);
+		#endif
+
+		con_info->did = NULL;
+		con_info->email = NULL;
+
+		// POST REQUESTS RUN ON THE REGISTRATION LANE, EVERYTHING ELSE STAYS ON THE I/O THREADS
+		con_info->lane = ( 0 == strcasecmp (method, MHD_HTTP_METHOD_POST) ) ? LANE_REGISTRATION : LANE_IO;
+		con_info->connection = connection;
+		con_info->state = REGISTRATION_RECEIVING;
+		con_info->didInput = NULL;
+		con_info->record = NULL;
+		GAUGE_ADD(laneInFlight[con_info->lane], 1);
+		HANDLED_PROBE4(request_start, con_info, method, url, con_info->host);
+
+		// A REPLICA IS READ ONLY, REGISTRATIONS GO TO THE PRIMARY. requestCompleted FREES con_info, AS FOR A GET.
+		if ( 0 == strcasecmp (method, MHD_HTTP_METHOD_POST) && replicaMode ) {
+			con_info->connectiontype = GET;
+			con_info->postprocessor = NULL;
+			*con_cls = (void *) con_info;
+			return sendErrorResponse (connection, ERROR_REPLICA_READ_ONLY);
+		}
+
+		// REGISTRATIONS OVER THEIR RATE ARE REJECTED BEFORE THE POST PROCESSOR AND ANY LOOKUP RUN.
+		if ( 0 == strcasecmp (method, MHD_HTTP_METHOD_POST) && !registrationAllowed(connection, con_info->handle) ) {
+			con_info->connectiontype = GET;
+			con_info->postprocessor = NULL;
+			*con_cls = (void *) con_info;
+			return sendRateLimitedResponse (connection);
+		}
+
+		// INITIALIZE THE CONNECTIONINFO STRUCT. SOME ONLY APPLY TO 'POST' REQUESTS.
+		if ( 0 == strcasecmp (method, MHD_HTTP_METHOD_POST) ) {
+			con_info->postprocessor = MHD_create_post_processor (connection, POSTBUFFERSIZE, iteratePost, (void *) con_info);
+			// Creating postprocessor failed, free memory manually and exit.
+			if (NULL == con_info->postprocessor) {
+				free ((char *)con_info->host);
+				free ((char *)con_info->handle);
+				free (con_info);
+				releaseRequest ();
+				GAUGE_SUB(laneInFlight[LANE_REGISTRATION], 1);
+				// INTERNAL ERROR
+				return logMHDError ("Creating postprocessor failed"); 
+			}
+			
+			con_info->connectiontype = POST;
+		}
+		else { 
+			//PROBABLY BEST TO CONFIRM IT IS A GET REQUEST?
+			con_info->connectiontype = GET;
+		}
+
+		// INITIALIZE ANSWER VARIABLES
+		// con_info->answerstring = NULL;			// Make sure answer string is empty
+
+		*con_cls = (void *) con_info;
+
+		return MHD_YES; // QUITE CERTAIN THIS IS NOT NECESSARY FOR GETS
+	}
+
+	struct connectionInfoStruct *con_info = *con_cls;
+
+	// THE RESOLVER AND DATABASE CALLS BELOW RUN WITHIN THIS REQUEST'S DEADLINE
+	deadlineBegin(con_info->deadline);
+
+	// THE FIRST CALL WITHOUT BODY DATA ENDS THE RECEIVE STAGE
+	if (con_info->spanCount == 0 && *upload_data_size == 0) stageMark(con_info, REQUEST_STAGE_RECEIVE);
+
+	printf ("REQUEST: New %s request to %s for '%s'\n", method, con_info->host, url);
+	syslog(LOG_INFO, "REQUEST: %s request to https://%s%s", method, con_info->host, url);	
+
+	// **************************************
+	// ************ GET REQUESTS ************
+	// **************************************
+	if (0 == strcasecmp (method, MHD_HTTP_METHOD_GET))
+	{	
+		// SEND RESPONSE TO WELL-KNOWN URL GET REQUEST BASED ON DATABASE RESULTS HANDLE/SUBDOMAIN
+		// HANDLE/SUBDOMAIN VERIFICATION NOT NECESSARY
+		if ( 0 == strcasecmp (url, URL_WELL_KNOWN_ATPROTO) )
+		{
+			con_info->route = REQUEST_ROUTE_WELL_KNOWN;
+			enum MHD_Result ret = sendWellKnownResponse (connection, con_info->host, con_info->handle);
+			stageMark(con_info, REQUEST_STAGE_LOOKUP);
+			return ret;
+		}
+		
+		// A REPLICA ONLY KNOWS WHICH HANDLES ARE ACTIVE
+		if ( (0 == strcasecmp (url, "/")) && replicaMode ) {
+			con_info->route = REQUEST_ROUTE_LANDING;
+			char *did = handleIndexLookup(con_info->host);
+			stageMark(con_info, REQUEST_STAGE_LOOKUP);
+			if (!did) return sendFileResponse (connection, STATIC_NOTFOUND, CONTENT_HTML);
+			free(did);
+			return sendFileResponse (connection, STATIC_ACTIVE, CONTENT_HTML);
+		}
+
+		if ( (0 == strcasecmp (url, "/")) && (validateHandle (con_info->handle) ==  KEY_VALID ) ) {
+			// CREATE A NEW RESPONSE PAGE FOR THIS BLOCK
+			con_info->route = REQUEST_ROUTE_LANDING;
+			int registered = handleRegistered(con_info->host);
+			stageMark(con_info, REQUEST_STAGE_LOOKUP);
+			if ( deadlineExceeded() ) return sendDeadlineResponse (connection);
+			if ( registered == HANDLE_ACTIVE ) return sendFileResponse (connection, STATIC_ACTIVE, CONTENT_HTML);
+
+			int reserved = labelReserved(con_info->handle);
+			stageMark(con_info, REQUEST_STAGE_LOOKUP);
+			if ( deadlineExceeded() ) return sendDeadlineResponse (connection);
+			if ( reserved == HANDLE_ACTIVE ) return sendFileResponse (connection, STATIC_RESERVED, CONTENT_HTML); 
+			return sendFileResponse (connection, STATIC_REGISTER, CONTENT_HTML); 
+		}
+			
+		// ALL OTHER URLS RECEIVE A 404 RESPONSE
+		return sendFileResponse (connection, STATIC_NOTFOUND, CONTENT_HTML);
+	}
+	
+	// ***************************************
+	// ************ POST REQUESTS ************
+	// ***************************************	
+	if ( ( 0 == strcasecmp (method, MHD_HTTP_METHOD_POST)) && ( 0 == strcasecmp (url, "/result") ) )
+	{
+		con_info->route = REQUEST_ROUTE_RESULT;
+		if ( 0 != *upload_data_size )
+		{
+			// A BODY TRICKLING IN SLOWER THAN request_timeout ONLY HOLDS A CONNECTION, CLOSE IT
+			if (configGlobal.requestTimeout > 0 && monotonicMicroseconds() - con_info->started > configGlobal.requestTimeout * 1000000LL) {
+				METRIC_ADD(requestTimeouts, 1);
+				return logMHDError ("Request body timeout, connection closed");
+			}
+
+			MHD_post_process (con_info->postprocessor, upload_data, *upload_data_size);		
+			*upload_data_size = 0;
+			return MHD_YES;
+		} 
+				
+		// THE BODY IS IN. RESOLVE THE DID AND STORE THE RECORD ON THE REGISTRATION LANE, WHICH RESUMES THE
+		// CONNECTION WHEN DONE, SO THE LOOKUPS NEVER HOLD AN I/O THREAD. WITHOUT A LANE, RUN THEM HERE.
+		if (con_info->state == REGISTRATION_RECEIVING) {
+			if (con_info->didInput == NULL) return sendErrorResponse (connection, ERROR_INVALID_DID_ENTERED );
+
+			if (configGlobal.registrationThreads > 0) {
+				if (enqueueRegistration(con_info) != 0) return sendOverloadResponse (connection);
+				return MHD_YES;
+			}
+
+			processRegistration(con_info);
+			con_info->timedOut = deadlineExceeded();
+			con_info->state = REGISTRATION_DONE;
+		}
+		else if (con_info->state == REGISTRATION_DONE) {
+			stageMark(con_info, REQUEST_STAGE_QUEUE);	// BACK FROM THE LANE, ONCE MHD RESUMED THE CONNECTION
+		}
+
+		if (con_info->state == REGISTRATION_QUEUED) return MHD_YES;
+		if (con_info->timedOut) return sendDeadlineResponse (connection);
+
+		enum MHD_Result ret = sendNewUserResponse(connection, con_info);
+		stageMark(con_info, REQUEST_STAGE_RENDER);
+		return ret;
+	}
+
+	// GENERAL ERROR MESSAGE
+	return sendErrorResponse (connection, ERROR_REQUEST_FAILED);	
+}
+
+// MHD ENTRY POINT. WITH ALLOCATION PROFILING, WHAT A CALL ALLOCATES IS COUNTED FOR ITS REQUEST, THE FIRST CALL'S
+// INCLUDED, WHICH RUNS BEFORE con_info EXISTS.
+static enum MHD_Result requestHandler	   (void *cls, struct MHD_Connection *connection,
+												const char *url, const char *method,
+												const char *version, const char *upload_data,
+												size_t *upload_data_size, void **con_cls)
+{
+	#ifdef HANDLED_ALLOCPROF
+	struct allocCountStruct setup = {0, 0};
+	int first = (NULL == *con_cls);
+
+	if (first) allocTarget = &setup;
+	else allocationAttribute(*con_cls);
+
+	enum MHD_Result ret = routeRequest(cls, connection, url, method, version, upload_data, upload_data_size, con_cls);
+	allocationDetach();
+
+	// A QUEUED REGISTRATION BELONGS TO THE LANE NOW, BUT THE FIRST CALL NEVER QUEUES ONE
+	if (first && *con_cls) {
+		struct connectionInfoStruct *con_info = *con_cls;
+		con_info->allocPending.count += setup.count;
+		con_info->allocPending.bytes += setup.bytes;
+	}
+	return ret;
+	#else
+	return routeRequest(cls, connection, url, method, version, upload_data, upload_data_size, con_cls);
+	#endif
+}
+
+
+// *********************************************
+// ********* DNS RESPONDER *********************
+// *********************************************
+
+// AUTHORITATIVE ANSWERS FOR '_atproto.<label>.<domain>' TXT QUERIES, THE DNS WAY TO RESOLVE A HANDLE, STRAIGHT FROM
+// THE HANDLE INDEX. ONE THREAD PER PROCESS SERVES UDP, IN BATCHES OF DNS_UDP_BATCH DATAGRAMS PER SYSTEM CALL, AND TCP
+// (RFC 7766), ALL WITH poll. PREFORK WORKERS BIND THE SAME PORT WITH SO_REUSEPORT AND THE KERNEL SPREADS QUERIES OVER
+// THEM. EVERY RECORD IS BUILT IN WIRE FORMAT AT START, BUT FOR ITS OWNER NAME (A POINTER INTO THE QUESTION) AND, IN A
+// TXT ANSWER, THE DID. NAMES OUTSIDE THE DOMAIN ARE REFUSED. NO EDNS, QUERIES AND ANSWERS FIT IN 512 BYTES.
+#define DNS_TYPE_NS				2
+#define DNS_TYPE_SOA			6
+#define DNS_TYPE_TXT			16
+#define DNS_TYPE_ANY			255
+#define DNS_CLASS_IN			1
+#define DNS_FLAG_QR				0x80			// Third header byte
+#define DNS_FLAG_AA				0x04
+#define DNS_FLAG_TC				0x02
+#define DNS_FLAGS_ECHOED		0x79			// Opcode and RD, copied from the query
+#define DNS_POINTER				0xC000			// A compressed name: offset into the message
+#define DNS_TXT_RDATA_LENGTH	(sizeof(DNS_TXT_PREFIX) - 1 + MAX_SIZE_DID_PLC)
+
+static const char *dnsTransportNames[DNS_TRANSPORT_COUNT] = { "udp", "tcp" };
+static const char *dnsResponseCodeNames[DNS_RCODE_COUNT] = { "noerror", "formerr", "servfail", "nxdomain", "notimp", "refused" };
+
+// RECORDS AFTER THEIR OWNER NAME: TYPE, CLASS, TTL, LENGTH AND DATA. THE TXT DATA ENDS WITH 'did=', THE DID FOLLOWS.
+struct dnsRecordStruct {
+	uint8_t data[10 + 2 * (DNS_MAX_NAME + 1) + 20];
+	size_t length;
+};
+
+static struct dnsRecordStruct dnsTxtRecord;
+static struct dnsRecordStruct dnsSoaRecord;
+static struct dnsRecordStruct dnsNsRecord;
+
+struct dnsConnectionStruct {
+	int fd;
+	time_t active;
+	size_t length;
+	uint8_t buffer[2 + DNS_MAX_MESSAGE];		// Length prefix, then one message
+};
+
+static pthread_t dnsThread;
+static int dnsRunning = FALSE;
+static int dnsWakePipe[2] = { -1, -1 };
+static int dnsUdpSocket = -1;
+static int dnsTcpSocket = -1;
+static atomic_int dnsStopping = 0;
+
+static void dnsPut16 (uint8_t *bytes, unsigned int value)
+{
+	bytes[0] = (uint8_t)(value >> 8);
+	bytes[1] = (uint8_t)value;
+}
+
+static void dnsPut32 (uint8_t *bytes, uint32_t value)
+{
+	dnsPut16(bytes, value >> 16);
+	dnsPut16(bytes + 2, value & 0xFFFF);
+}
+
+// DOTTED 'name' IN WIRE FORMAT. RETURNS ITS LENGTH, OR 0 IF IT IS NOT A VALID NAME.
+static size_t dnsEncodeName (const char *name, uint8_t *out)
+{
+	size_t length = 0;
+	while (*name) {
+		const char *dot = strchr(name, '.');
+		size_t labelLength = dot ? (size_t)(dot - name) : strlen(name);
+		if (labelLength == 0 || labelLength > 63 || length + labelLength + 2 > DNS_MAX_NAME + 1) return 0;
+		out[length++] = (uint8_t)labelLength;
+		memcpy(out + length, name, labelLength);
+		length += labelLength;
+		name += labelLength + (dot ? 1 : 0);
+	}
+	out[length++] = 0;
+	return length;
+}
+
+static void dnsRecordHeader (struct dnsRecordStruct *record, unsigned int type, uint32_t ttl, size_t dataLength)
+{
+	dnsPut16(record->data, type);
+	dnsPut16(record->data + 2, DNS_CLASS_IN);
+	dnsPut32(record->data + 4, ttl);
+	dnsPut16(record->data + 8, (unsigned int)dataLength);
+	record->length = 10;
+}
+
+// BUILD THE RECORDS FOR domainName. THE SOA SERIAL IS THE START TIME. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+static int dnsPrepareRecords (void)
+{
+	uint8_t nameserver[DNS_MAX_NAME + 1], hostmaster[DNS_MAX_NAME + 1];
+	char mailbox[CONFIG_VALUE_MAX + sizeof(DNS_HOSTMASTER) + 1];
+	snprintf(mailbox, sizeof(mailbox), DNS_HOSTMASTER ".%s", domainName);
+	size_t nameserverLength = dnsEncodeName(configGlobal.dnsNameserver[0] ? configGlobal.dnsNameserver : domainName, nameserver);
+	size_t hostmasterLength = dnsEncodeName(mailbox, hostmaster);
+	if (nameserverLength == 0 || hostmasterLength == 0) {
+		fprintf(stderr, "ERROR: Invalid DNS name server or domain name\n");
+		return 1;
+	}
+
+	dnsRecordHeader(&dnsTxtRecord, DNS_TYPE_TXT, (uint32_t)configGlobal.dnsTtl, 1 + DNS_TXT_RDATA_LENGTH);
+	dnsTxtRecord.data[dnsTxtRecord.length++] = (uint8_t)DNS_TXT_RDATA_LENGTH;
+	memcpy(dnsTxtRecord.data + dnsTxtRecord.length, DNS_TXT_PREFIX, sizeof(DNS_TXT_PREFIX) - 1);
+	dnsTxtRecord.length += sizeof(DNS_TXT_PREFIX) - 1;
+
+	dnsRecordHeader(&dnsSoaRecord, DNS_TYPE_SOA, DNS_NEGATIVE_TTL, nameserverLength + hostmasterLength + 20);
+	memcpy(dnsSoaRecord.data + dnsSoaRecord.length, nameserver, nameserverLength);
+	dnsSoaRecord.length += nameserverLength;
+	memcpy(dnsSoaRecord.data + dnsSoaRecord.length, hostmaster, hostmasterLength);
+	dnsSoaRecord.length += hostmasterLength;
+	uint32_t soaValues[5] = { (uint32_t)time(NULL), DNS_SOA_REFRESH, DNS_SOA_RETRY, DNS_SOA_EXPIRE, DNS_NEGATIVE_TTL };
+	for (int i = 0; i < 5; i++, dnsSoaRecord.length += 4) dnsPut32(dnsSoaRecord.data + dnsSoaRecord.length, soaValues[i]);
+
+	dnsRecordHeader(&dnsNsRecord, DNS_TYPE_NS, (uint32_t)configGlobal.dnsTtl, nameserverLength);
+	memcpy(dnsNsRecord.data + dnsNsRecord.length, nameserver, nameserverLength);
+	dnsNsRecord.length += nameserverLength;
+	return 0;
+}
+
+// APPEND A RECORD OWNED BY THE NAME AT 'owner' AND COUNT IT IN SECTION 'countOffset' OF THE HEADER. A RECORD THAT
+// DOES NOT FIT SETS TC INSTEAD. RETURNS THE NEW MESSAGE LENGTH.
+static size_t dnsAppendRecord (uint8_t *response, size_t length, unsigned int owner, int countOffset,
+	const struct dnsRecordStruct *record, const char *tail, size_t tailLength)
+{
+	if (length + 2 + record->length + tailLength > DNS_MAX_MESSAGE) {
+		response[2] |= DNS_FLAG_TC;
+		return length;
+	}
+	dnsPut16(response + length, DNS_POINTER | owner);
+	memcpy(response + length + 2, record->data, record->length);
+	if (tailLength > 0) memcpy(response + length + 2 + record->length, tail, tailLength);
+	dnsPut16(response + countOffset, ((unsigned int)response[countOffset] << 8 | response[countOffset + 1]) + 1);
+	return length + 2 + record->length + tailLength;
+}
+
+static size_t dnsRespond (uint8_t *response, size_t length, dnsResponseCode rcode)
+{
+	response[3] = (uint8_t)rcode;
+	METRIC_ADD(dnsResponses[rcode], 1);
+	return length;
+}
+
+// ANSWER ONE QUERY INTO 'response' (DNS_MAX_MESSAGE BYTES). RETURNS THE RESPONSE LENGTH, 0 TO SEND NOTHING.
+static size_t dnsAnswerQuery (const uint8_t *query, size_t length, uint8_t *response)
+{
+	// TOO SHORT TO ANSWER, OR A RESPONSE ITSELF
+	if (length < DNS_HEADER_SIZE || (query[2] & DNS_FLAG_QR)) return 0;
+
+	memset(response, 0, DNS_HEADER_SIZE);
+	memcpy(response, query, 2);
+	response[2] = DNS_FLAG_QR | (query[2] & DNS_FLAGS_ECHOED);
+	if ((query[2] >> 3) & 0x0F) return dnsRespond(response, DNS_HEADER_SIZE, DNS_RCODE_NOTIMP);
+	if (query[4] != 0 || query[5] != 1) return dnsRespond(response, DNS_HEADER_SIZE, DNS_RCODE_FORMERR);
+
+	// THE QUESTION NAME, LOWER CASED AND DOTTED. ITS WIRE BYTES ARE ECHOED AS THEY CAME.
+	char name[DNS_MAX_NAME + 1];
+	size_t nameLength = 0, offset = DNS_HEADER_SIZE;
+	for (;;) {
+		if (offset >= length) return dnsRespond(response, DNS_HEADER_SIZE, DNS_RCODE_FORMERR);
+		size_t labelLength = query[offset++];
+		if (labelLength == 0) break;
+		if (labelLength > 63 || offset + labelLength > length || nameLength + labelLength + 1 > DNS_MAX_NAME) {
+			return dnsRespond(response, DNS_HEADER_SIZE, DNS_RCODE_FORMERR);
+		}
+		if (nameLength > 0) name[nameLength++] = '.';
+		for (size_t i = 0; i < labelLength; i++) name[nameLength++] = (char)tolower(query[offset + i]);
+		offset += labelLength;
+	}
+	name[nameLength] = '\0';
+	if (offset + 4 > length) return dnsRespond(response, DNS_HEADER_SIZE, DNS_RCODE_FORMERR);
+	unsigned int type = (unsigned int)query[offset] << 8 | query[offset + 1];
+	unsigned int class = (unsigned int)query[offset + 2] << 8 | query[offset + 3];
+	offset += 4;
+
+	memcpy(response + DNS_HEADER_SIZE, query + DNS_HEADER_SIZE, offset - DNS_HEADER_SIZE);
+	response[5] = 1;
+
+	// ONLY OUR DOMAIN. A LABEL STARTS AT THE SAME OFFSET IN THE DOTTED NAME AS ITS LENGTH BYTE IN THE QUESTION.
+	size_t domainLength = strlen(domainName);
+	int apex = (nameLength == domainLength && strcasecmp(name, domainName) == 0);
+	if (!apex && !(nameLength > domainLength && name[nameLength - domainLength - 1] == '.' &&
+		strcasecmp(name + nameLength - domainLength, domainName) == 0)) return dnsRespond(response, offset, DNS_RCODE_REFUSED);
+	if (class != DNS_CLASS_IN && class != DNS_TYPE_ANY) return dnsRespond(response, offset, DNS_RCODE_REFUSED);
+	if (!handleIndexLoaded) return dnsRespond(response, offset, DNS_RCODE_SERVFAIL);
+	response[2] |= DNS_FLAG_AA;
+	unsigned int apexOffset = (unsigned int)(DNS_HEADER_SIZE + nameLength - domainLength);
+
+	if (apex) {
+		if (type == DNS_TYPE_SOA || type == DNS_TYPE_ANY) offset = dnsAppendRecord(response, offset, apexOffset, 6, &dnsSoaRecord, NULL, 0);
+		if (type == DNS_TYPE_NS || type == DNS_TYPE_ANY) offset = dnsAppendRecord(response, offset, apexOffset, 6, &dnsNsRecord, NULL, 0);
+		if (response[7] == 0) offset = dnsAppendRecord(response, offset, apexOffset, 8, &dnsSoaRecord, NULL, 0);
+		return dnsRespond(response, offset, DNS_RCODE_NOERROR);
+	}
+
+	// '_atproto.<label>.<domain>' HOLDS THE TXT RECORD, '<label>.<domain>' EXISTS BUT HAS NO RECORDS OF OURS
+	const char *handle = name;
+	int atproto = FALSE;
+	size_t prefixLength = sizeof(DNS_ATPROTO_LABEL);
+	if (nameLength > prefixLength + domainLength && strncmp(name, DNS_ATPROTO_LABEL ".", prefixLength) == 0) {
+		handle = name + prefixLength;
+		atproto = TRUE;
+	}
+	char did[MAX_SIZE_DID_PLC + 1];
+	int found = FALSE;
+	if (memchr(handle, '.', nameLength - (size_t)(handle - name) - domainLength - 1) == NULL) found = handleIndexFind(handle, did);
+
+	if (!found) {
+		offset = dnsAppendRecord(response, offset, apexOffset, 8, &dnsSoaRecord, NULL, 0);
+		return dnsRespond(response, offset, DNS_RCODE_NXDOMAIN);
+	}
+	if (atproto && (type == DNS_TYPE_TXT || type == DNS_TYPE_ANY)) {
+		offset = dnsAppendRecord(response, offset, DNS_HEADER_SIZE, 6, &dnsTxtRecord, did, MAX_SIZE_DID_PLC);
+	} else offset = dnsAppendRecord(response, offset, apexOffset, 8, &dnsSoaRecord, NULL, 0);
+	return dnsRespond(response, offset, DNS_RCODE_NOERROR);
+}
+
+// READ AND ANSWER THE DATAGRAMS WAITING, DNS_UDP_BATCH AT A TIME
+static void dnsServeUdp (uint8_t (*queries)[DNS_MAX_MESSAGE], uint8_t (*responses)[DNS_MAX_MESSAGE])
+{
+	struct mmsghdr received[DNS_UDP_BATCH], replies[DNS_UDP_BATCH];
+	struct iovec queryVectors[DNS_UDP_BATCH], replyVectors[DNS_UDP_BATCH];
+	struct sockaddr_storage addresses[DNS_UDP_BATCH];
+
+	for (;;) {
+		memset(received, 0, sizeof(received));
+		for (int i = 0; i < DNS_UDP_BATCH; i++) {
+			queryVectors[i].iov_base = queries[i];
+			queryVectors[i].iov_len = DNS_MAX_MESSAGE;
+			received[i].msg_hdr.msg_iov = &queryVectors[i];
+			received[i].msg_hdr.msg_iovlen = 1;
+			received[i].msg_hdr.msg_name = &addresses[i];
+			received[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+		}
+		int count = recvmmsg(dnsUdpSocket, received, DNS_UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (count <= 0) return;
+		METRIC_ADD(dnsQueries[DNS_TRANSPORT_UDP], (unsigned long long)count);
+
+		unsigned int answers = 0;
+		memset(replies, 0, sizeof(replies));
+		for (int i = 0; i < count; i++) {
+			if (addressBlocked((struct sockaddr *)&addresses[i])) continue;
+			size_t length = dnsAnswerQuery(queries[i], received[i].msg_len, responses[answers]);
+			if (length == 0) continue;
+			replyVectors[answers].iov_base = responses[answers];
+			replyVectors[answers].iov_len = length;
+			replies[answers].msg_hdr.msg_iov = &replyVectors[answers];
+			replies[answers].msg_hdr.msg_iovlen = 1;
+			replies[answers].msg_hdr.msg_name = &addresses[i];
+			replies[answers].msg_hdr.msg_namelen = received[i].msg_hdr.msg_namelen;
+			answers++;
+		}
+		if (answers > 0) sendmmsg(dnsUdpSocket, replies, answers, MSG_DONTWAIT);
+		if (count < DNS_UDP_BATCH) return;
+	}
+}
+
+static void dnsCloseConnection (struct dnsConnectionStruct *connections, int *count, int index)
+{
+	close(connections[index].fd);
+	connections[index] = connections[--(*count)];
+}
+
+// READ FROM A TCP CONNECTION AND ANSWER EVERY COMPLETE MESSAGE. RETURNS 1 WHEN THE CONNECTION SHOULD CLOSE.
+static int dnsServeTcp (struct dnsConnectionStruct *connection)
+{
+	ssize_t received = recv(connection->fd, connection->buffer + connection->length, sizeof(connection->buffer) - connection->length, MSG_DONTWAIT);
+	if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) return 1;
+	if (received < 0) return 0;
+	connection->length += (size_t)received;
+	connection->active = time(NULL);
+
+	while (connection->length >= 2) {
+		size_t messageLength = (size_t)connection->buffer[0] << 8 | connection->buffer[1];
+		if (messageLength > DNS_MAX_MESSAGE) return 1;
+		if (connection->length < 2 + messageLength) break;
+
+		METRIC_ADD(dnsQueries[DNS_TRANSPORT_TCP], 1);
+		uint8_t response[2 + DNS_MAX_MESSAGE];
+		size_t length = dnsAnswerQuery(connection->buffer + 2, messageLength, response + 2);
+		if (length == 0) return 1;
+		dnsPut16(response, (unsigned int)length);
+		if (send(connection->fd, response, length + 2, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)(length + 2)) return 1;
+
+		connection->length -= 2 + messageLength;
+		memmove(connection->buffer, connection->buffer + 2 + messageLength, connection->length);
+	}
+	return 0;
+}
+
+static void *dnsServeThread (void *unused)
+{
+	(void) unused;  /* Unused. Silent compiler warning. */
+
+	uint8_t (*queries)[DNS_MAX_MESSAGE] = malloc(2 * DNS_UDP_BATCH * DNS_MAX_MESSAGE);
+	struct dnsConnectionStruct *connections = malloc(DNS_TCP_MAX_CONNECTIONS * sizeof(struct dnsConnectionStruct));
+	struct pollfd descriptors[3 + DNS_TCP_MAX_CONNECTIONS];
+	int connectionCount = 0;
+	if (!queries || !connections) {
+		fprintf(stderr, "ERROR: Memory allocation failed (DNS responder)\n");
+		free(queries);
+		free(connections);
+		return NULL;
+	}
+
+	while (!atomic_load(&dnsStopping)) {
+		descriptors[0] = (struct pollfd){ .fd = dnsWakePipe[0], .events = POLLIN };
+		descriptors[1] = (struct pollfd){ .fd = dnsUdpSocket, .events = POLLIN };
+		descriptors[2] = (struct pollfd){ .fd = dnsTcpSocket, .events = POLLIN };
+		for (int i = 0; i < connectionCount; i++) descriptors[3 + i] = (struct pollfd){ .fd = connections[i].fd, .events = POLLIN };
+		int polled = connectionCount;
+		if (poll(descriptors, (nfds_t)(3 + polled), 1000) < 0 && errno != EINTR) break;
+
+		if (descriptors[1].revents & POLLIN) dnsServeUdp(queries, queries + DNS_UDP_BATCH);
+
+		// CONNECTIONS CLOSED HERE MOVE THE LAST ONE INTO THEIR SLOT, SO WALK BACKWARDS
+		time_t now = time(NULL);
+		for (int i = polled - 1; i >= 0; i--) {
+			int finished = (descriptors[3 + i].revents & (POLLIN | POLLHUP | POLLERR)) ? dnsServeTcp(&connections[i])
+																				: now - connections[i].active > DNS_TCP_IDLE_TIMEOUT;
+			if (finished) dnsCloseConnection(connections, &connectionCount, i);
+		}
+
+		if (descriptors[2].revents & POLLIN) {
+			struct sockaddr_storage address;
+			socklen_t addressLength = sizeof(address);
+			int client;
+			while ((client = accept4(dnsTcpSocket, (struct sockaddr *)&address, &addressLength, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				addressLength = sizeof(address);
+				if (connectionCount == DNS_TCP_MAX_CONNECTIONS || addressBlocked((struct sockaddr *)&address)) {
+					close(client);
+					continue;
+				}
+				connections[connectionCount++] = (struct dnsConnectionStruct){ .fd = client, .active = now, .length = 0 };
+			}
+		}
+	}
+
+	for (int i = 0; i < connectionCount; i++) close(connections[i].fd);
+	free(connections);
+	free(queries);
+	return NULL;
+}
+
+// A NON-BLOCKING SOCKET OF 'type' BOUND TO dns_address AND dns_port, WITH SO_REUSEPORT. RETURNS -1 ON FAILURE.
+static int dnsOpenSocket (int type)
+{
+	struct sockaddr_storage address;
+	socklen_t addressLength;
+	memset(&address, 0, sizeof(address));
+	struct sockaddr_in *address4 = (struct sockaddr_in *)&address;
+	struct sockaddr_in6 *address6 = (struct sockaddr_in6 *)&address;
+	if (inet_pton(AF_INET, configGlobal.dnsAddress, &address4->sin_addr) == 1) {
+		address4->sin_family = AF_INET;
+		address4->sin_port = htons((uint16_t)configGlobal.dnsPort);
+		addressLength = sizeof(*address4);
+	} else if (inet_pton(AF_INET6, configGlobal.dnsAddress, &address6->sin6_addr) == 1) {
+		address6->sin6_family = AF_INET6;
+		address6->sin6_port = htons((uint16_t)configGlobal.dnsPort);
+		addressLength = sizeof(*address6);
+	} else {
+		fprintf(stderr, "ERROR: Invalid dns_address '%s'\n", configGlobal.dnsAddress);
+		return -1;
+	}
+
+	int fd = socket(address.ss_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int enable = 1;
+	if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0 ||
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0 ||
+		bind(fd, (struct sockaddr *)&address, addressLength) != 0 || (type == SOCK_STREAM && listen(fd, SOMAXCONN) != 0)) {
+		fprintf(stderr, "ERROR: DNS listener on %s port %d: %s\n", configGlobal.dnsAddress, configGlobal.dnsPort, strerror(errno));
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// START THE DNS RESPONDER OF THIS PROCESS. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+int startDns (void)
+{
+	if (dnsRunning) return 0;
+	if (dnsPrepareRecords() != 0) return 1;
+
+	dnsUdpSocket = dnsOpenSocket(SOCK_DGRAM);
+	dnsTcpSocket = dnsUdpSocket >= 0 ? dnsOpenSocket(SOCK_STREAM) : -1;
+	if (dnsTcpSocket < 0 || pipe2(dnsWakePipe, O_CLOEXEC) != 0) {
+		if (dnsUdpSocket >= 0) close(dnsUdpSocket);
+		if (dnsTcpSocket >= 0) close(dnsTcpSocket);
+		dnsUdpSocket = dnsTcpSocket = -1;
+		return 1;
+	}
+
+	atomic_store(&dnsStopping, 0);
+	if (pthread_create(&dnsThread, NULL, dnsServeThread, NULL) != 0) {
+		close(dnsUdpSocket);
+		close(dnsTcpSocket);
+		close(dnsWakePipe[0]);
+		close(dnsWakePipe[1]);
+		dnsUdpSocket = dnsTcpSocket = dnsWakePipe[0] = dnsWakePipe[1] = -1;
+		return 1;
+	}
+	dnsRunning = TRUE;
+
+	printf("DNS responder running on %s port %d (UDP and TCP).\n", configGlobal.dnsAddress, configGlobal.dnsPort);
+	syslog(LOG_INFO, "DNS responder running on %s port %d", configGlobal.dnsAddress, configGlobal.dnsPort);
+	return 0;
+}
+
+void stopDns (void)
+{
+	if (!dnsRunning) return;
+
+	atomic_store(&dnsStopping, 1);
+	if (write(dnsWakePipe[1], "S", 1) != 1) perror("Failed to wake the DNS responder");
+	pthread_join(dnsThread, NULL);
+	dnsRunning = FALSE;
+
+	close(dnsUdpSocket);
+	close(dnsTcpSocket);
+	close(dnsWakePipe[0]);
+	close(dnsWakePipe[1]);
+	dnsUdpSocket = dnsTcpSocket = dnsWakePipe[0] = dnsWakePipe[1] = -1;
+}
+
+
+// *********************************************
+// ********* ADMIN REQUEST HANDLER *************
+// *********************************************
+
+// RENDER ALL COUNTERS IN PROMETHEUS TEXT FORMAT. CALLER MUST FREE THE RETURNED BUFFER.
+char *renderMetrics (size_t *length)
+{
+	struct textBuffer buffer = {NULL, 0, 0};
+	int failed = 0;
+
+	failed |= textBufferAppend(&buffer, "# HELP handled_encoded_responses_total Static and template responses sent, by content encoding.\n"
+										"# TYPE handled_encoded_responses_total counter\n");
+	for (int encoding = ENCODING_IDENTITY; encoding < ENCODING_COUNT; encoding++) {
+		failed |= textBufferAppend(&buffer, "handled_encoded_responses_total{encoding=\"%s\"} %llu\n",
+									encodingNames[encoding], METRIC_GET(encodedResponses[encoding]));
+	}
+
+	unsigned long long inputBytes = METRIC_GET(compressionInputBytes);
+	unsigned long long outputBytes = METRIC_GET(compressionOutputBytes);
+
+	failed |= textBufferAppend(&buffer, "# HELP handled_dynamic_compressions_total Template responses compressed on the fly.\n"
+										"# TYPE handled_dynamic_compressions_total counter\n"
+										"handled_dynamic_compressions_total %llu\n", METRIC_GET(dynamicCompressions));
+	failed |= textBufferAppend(&buffer, "# HELP handled_compression_input_bytes_total Uncompressed size of compressed responses.\n"
+										"# TYPE handled_compression_input_bytes_total counter\n"
+										"handled_compression_input_bytes_total %llu\n", inputBytes);
+	failed |= textBufferAppend(&buffer, "# HELP handled_compression_output_bytes_total Bytes sent for compressed responses.\n"
+										"# TYPE handled_compression_output_bytes_total counter\n"
+										"handled_compression_output_bytes_total %llu\n", outputBytes);
+	failed |= textBufferAppend(&buffer, "# HELP handled_compression_saved_bytes_total Bytes saved by compression.\n"
+										"# TYPE handled_compression_saved_bytes_total counter\n"
+										"handled_compression_saved_bytes_total %llu\n", inputBytes - outputBytes);
+	failed |= textBufferAppend(&buffer, "# HELP handled_compression_ratio Compressed over uncompressed bytes, lower is better.\n"
+										"# TYPE handled_compression_ratio gauge\n"
+										"handled_compression_ratio %.4f\n", inputBytes ? (double)outputBytes / (double)inputBytes : 1.0);
+
+	failed |= textBufferAppend(&buffer, "# HELP handled_shed_requests_total Requests answered with 503 under load, by traffic class.\n"
+										"# TYPE handled_shed_requests_total counter\n");
+	for (int traffic = TRAFFIC_REGISTRATION; traffic < TRAFFIC_CLASS_COUNT; traffic++) {
+		failed |= textBufferAppend(&buffer, "handled_shed_requests_total{class=\"%s\"} %llu\n",
+									trafficClassNames[traffic], METRIC_GET(shedResponses[traffic]));
+	}
+	failed |= textBufferAppend(&buffer, "# HELP handled_rate_limited_total Registrations answered with 429, by the limit reached.\n"
+										"# TYPE handled_rate_limited_total counter\n");
+	for (int key = RATE_KEY_ADDRESS; key < RATE_KEY_COUNT; key++) {
+		failed |= textBufferAppend(&buffer, "handled_rate_limited_total{key=\"%s\"} %llu\n",
+									rateKeyNames[key], METRIC_GET(rateLimited[key]));
+	}
+	failed |= textBufferAppend(&buffer, "# HELP handled_rate_stripes_recovered_total Rate limit stripes reset because a worker died holding their lock.\n"
+										"# TYPE handled_rate_stripes_recovered_total counter\n"
+										"handled_rate_stripes_recovered_total %llu\n", METRIC_GET(rateStripesRecovered));
+	failed |= textBufferAppend(&buffer, "# HELP handled_blocked_connections_total Connections refused by the blocklist.\n"
+										"# TYPE handled_blocked_connections_total counter\n"
+										"handled_blocked_connections_total %llu\n", METRIC_GET(connectionsBlocked));
+	failed |= textBufferAppend(&buffer, "# HELP handled_request_timeouts_total Requests closed for arriving slower than request_timeout.\n"
+										"# TYPE handled_request_timeouts_total counter\n"
+										"handled_request_timeouts_total %llu\n", METRIC_GET(requestTimeouts));
+	unsigned long long inFlight, laneInFlight[LANE_COUNT], laneQueued;
+	sumWorkerGauges(&inFlight, laneInFlight, &laneQueued);
+	failed |= textBufferAppend(&buffer, "# HELP handled_requests_in_flight Requests being served.\n"
+										"# TYPE handled_requests_in_flight gauge\n"
+										"handled_requests_in_flight %llu\n", inFlight);
+	failed |= textBufferAppend(&buffer, "# HELP handled_lane_in_flight Requests being served, by lane.\n"
+										"# TYPE handled_lane_in_flight gauge\n");
+	for (int lane = LANE_IO; lane < LANE_COUNT; lane++) {
+		failed |= textBufferAppend(&buffer, "handled_lane_in_flight{lane=\"%s\"} %llu\n", laneNames[lane], laneInFlight[lane]);
+	}
+	failed |= textBufferAppend(&buffer, "# HELP handled_lane_queue_depth Registrations waiting for a lane thread.\n"
+										"# TYPE handled_lane_queue_depth gauge\n"
+										"handled_lane_queue_depth{lane=\"registration\"} %llu\n", laneQueued);
+	failed |= textBufferAppend(&buffer, "# HELP handled_lane_rejected_total Registrations answered with 503 because the lane queue was full.\n"
+										"# TYPE handled_lane_rejected_total counter\n"
+										"handled_lane_rejected_total{lane=\"registration\"} %llu\n", METRIC_GET(laneRejected));
+	failed |= textBufferAppend(&buffer, "# HELP handled_request_duration_seconds Request latency, by lane.\n"
+										"# TYPE handled_request_duration_seconds histogram\n");
+	for (int lane = LANE_IO; lane < LANE_COUNT; lane++) {
+		unsigned long long cumulative = 0;
+		for (int bucket = 0; bucket < LATENCY_BUCKET_COUNT; bucket++) {
+			cumulative += METRIC_GET(latencyBuckets[lane][bucket]);
+			if (bucket < LATENCY_BUCKET_COUNT - 1) {
+				failed |= textBufferAppend(&buffer, "handled_request_duration_seconds_bucket{lane=\"%s\",le=\"%g\"} %llu\n",
+											laneNames[lane], latencyBucketBounds[bucket] / 1e6, cumulative);
+			} else {
+				failed |= textBufferAppend(&buffer, "handled_request_duration_seconds_bucket{lane=\"%s\",le=\"+Inf\"} %llu\n", laneNames[lane], cumulative);
+			}
+		}
+		failed |= textBufferAppend(&buffer, "handled_request_duration_seconds_sum{lane=\"%s\"} %.6f\n"
+											"handled_request_duration_seconds_count{lane=\"%s\"} %llu\n",
+									laneNames[lane], METRIC_GET(latencyMicroseconds[lane]) / 1e6, laneNames[lane], METRIC_GET(latencyCount[lane]));
+	}
+	failed |= textBufferAppend(&buffer, "# HELP handled_request_stage_duration_seconds Time requests spent in each stage.\n"
+										"# TYPE handled_request_stage_duration_seconds histogram\n");
+	for (int stage = REQUEST_STAGE_RECEIVE; stage < REQUEST_STAGE_COUNT; stage++) {
+		unsigned long long cumulative = 0;
+		for (int bucket = 0; bucket < LATENCY_BUCKET_COUNT; bucket++) {
+			cumulative += METRIC_GET(stageBuckets[stage][bucket]);
+			if (bucket < LATENCY_BUCKET_COUNT - 1) {
+				failed |= textBufferAppend(&buffer, "handled_request_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+											requestStageNames[stage], latencyBucketBounds[bucket] / 1e6, cumulative);
+			} else {
+				failed |= textBufferAppend(&buffer, "handled_request_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", requestStageNames[stage], cumulative);
+			}
+		}
+		failed |= textBufferAppend(&buffer, "handled_request_stage_duration_seconds_sum{stage=\"%s\"} %.6f\n"
+											"handled_request_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+									requestStageNames[stage], METRIC_GET(stageMicroseconds[stage]) / 1e6, requestStageNames[stage], METRIC_GET(stageCount[stage]));
+	}
+	if (configGlobal.captureFile[0] != '\0') {
+		failed |= textBufferAppend(&buffer, "# HELP handled_captured_requests_total Requests logged to the capture file.\n"
+											"# TYPE handled_captured_requests_total counter\n"
+											"handled_captured_requests_total %llu\n", METRIC_GET(capturedRequests));
+		failed |= textBufferAppend(&buffer, "# HELP handled_capture_errors_total Requests lost to a failed capture file write.\n"
+											"# TYPE handled_capture_errors_total counter\n"
+											"handled_capture_errors_total %llu\n", METRIC_GET(captureErrors));
+	}
+
+	// WHAT REQUESTS ALLOCATED, BY ROUTE AND STAGE. DIVIDED BY THE REQUESTS, ZERO IS THE GOAL FOR THE LOOKUPS.
+	#ifdef HANDLED_ALLOCPROF
+	failed |= textBufferAppend(&buffer, "# HELP handled_allocation_requests_total Requests profiled, by route.\n"
+										"# TYPE handled_allocation_requests_total counter\n");
+	for (int route = REQUEST_ROUTE_WELL_KNOWN; route < REQUEST_ROUTE_COUNT; route++) {
+		failed |= textBufferAppend(&buffer, "handled_allocation_requests_total{route=\"%s\"} %llu\n", requestRouteNames[route], METRIC_GET(allocRequests[route]));
+	}
+	failed |= textBufferAppend(&buffer, "# HELP handled_allocations_total Allocations made by those requests, by route and stage.\n"
+										"# TYPE handled_allocations_total counter\n");
+	for (int route = REQUEST_ROUTE_WELL_KNOWN; route < REQUEST_ROUTE_COUNT; route++) {
+		for (int stage = REQUEST_STAGE_RECEIVE; stage < REQUEST_STAGE_COUNT; stage++) {
+			failed |= textBufferAppend(&buffer, "handled_allocations_total{route=\"%s\",stage=\"%s\"} %llu\n",
+										requestRouteNames[route], requestStageNames[stage], METRIC_GET(allocCount[route][stage]));
+		}
+	}
+	failed |= textBufferAppend(&buffer, "# HELP handled_allocated_bytes_total Bytes asked for by those allocations.\n"
+										"# TYPE handled_allocated_bytes_total counter\n");
+	for (int route = REQUEST_ROUTE_WELL_KNOWN; route < REQUEST_ROUTE_COUNT; route++) {
+		for (int stage = REQUEST_STAGE_RECEIVE; stage < REQUEST_STAGE_COUNT; stage++) {
+			failed |= textBufferAppend(&buffer, "handled_allocated_bytes_total{route=\"%s\",stage=\"%s\"} %llu\n",
+										requestRouteNames[route], requestStageNames[stage], METRIC_GET(allocBytes[route][stage]));
+		}
+	}
+	#endif
+	if (configGlobal.traceFile[0] != '\0') {
+		failed |= textBufferAppend(&buffer, "# HELP handled_traces_written_total Slow requests appended to the trace file.\n"
+											"# TYPE handled_traces_written_total counter\n"
+											"handled_traces_written_total %llu\n", METRIC_GET(tracesWritten));
+		failed |= textBufferAppend(&buffer, "# HELP handled_traces_dropped_total Slow requests not traced, over the per second limit or not written.\n"
+											"# TYPE handled_traces_dropped_total counter\n"
+											"handled_traces_dropped_total %llu\n", METRIC_GET(tracesDropped));
+	}
+	failed |= textBufferAppend(&buffer, "# HELP handled_deadline_exceeded_total Requests that ran out of time, by stage.\n"
+										"# TYPE handled_deadline_exceeded_total counter\n");
+	for (int stage = DEADLINE_STAGE_QUEUE; stage < DEADLINE_STAGE_COUNT; stage++) {
+		failed |= textBufferAppend(&buffer, "handled_deadline_exceeded_total{stage=\"%s\"} %llu\n",
+									deadlineStageNames[stage], METRIC_GET(deadlineExceeded[stage]));
+	}
+	failed |= textBufferAppend(&buffer, "# HELP handled_resolutions_fetched_total Outbound DID lookups made for registrations.\n"
+										"# TYPE handled_resolutions_fetched_total counter\n"
+										"handled_resolutions_fetched_total %llu\n", METRIC_GET(resolutionsFetched));
+	failed |= textBufferAppend(&buffer, "# HELP handled_resolutions_coalesced_total DID lookups saved by waiting for an identical one in flight.\n"
+										"# TYPE handled_resolutions_coalesced_total counter\n"
+										"handled_resolutions_coalesced_total %llu\n", METRIC_GET(resolutionsCoalesced));
+	failed |= textBufferAppend(&buffer, "# HELP handled_worker_restarts_total Prefork workers restarted after exiting unexpectedly.\n"
+										"# TYPE handled_worker_restarts_total counter\n"
+										"handled_worker_restarts_total %llu\n", METRIC_GET(workerRestarts));
+
+	// LAG IS HOW FAR BEHIND THE PRIMARY A REPLICA IS, IN ENTRIES AND IN SECONDS SINCE IT WAS LAST CAUGHT UP
+	if (replicaMode) {
+		long long applied = METRIC_GET(replicaApplied);
+		long long primary = METRIC_GET(replicaPrimary);
+		double lagSeconds = applied >= primary ? 0.0 : (double)(monotonicMicroseconds() - METRIC_GET(replicaSynced)) / 1e6;
+
+		failed |= textBufferAppend(&buffer, "# HELP handled_replica_applied_sequence Last change log sequence applied from the primary.\n"
+											"# TYPE handled_replica_applied_sequence gauge\n"
+											"handled_replica_applied_sequence %lld\n", applied);
+		failed |= textBufferAppend(&buffer, "# HELP handled_replica_primary_sequence Latest change log sequence the primary reported.\n"
+											"# TYPE handled_replica_primary_sequence gauge\n"
+											"handled_replica_primary_sequence %lld\n", primary);
+		failed |= textBufferAppend(&buffer, "# HELP handled_replica_lag_entries Change log entries not applied yet.\n"
+											"# TYPE handled_replica_lag_entries gauge\n"
+											"handled_replica_lag_entries %lld\n", applied >= primary ? 0LL : primary - applied);
+		failed |= textBufferAppend(&buffer, "# HELP handled_replica_lag_seconds Seconds since the replica was last caught up, 0 while it is.\n"
+											"# TYPE handled_replica_lag_seconds gauge\n"
+											"handled_replica_lag_seconds %.3f\n", lagSeconds);
+		failed |= textBufferAppend(&buffer, "# HELP handled_replica_entries_total Change log entries applied.\n"
+											"# TYPE handled_replica_entries_total counter\n"
+											"handled_replica_entries_total %llu\n", METRIC_GET(replicaEntries));
+		failed |= textBufferAppend(&buffer, "# HELP handled_replica_errors_total Failed polls of the primary and failed applies.\n"
+											"# TYPE handled_replica_errors_total counter\n"
+											"handled_replica_errors_total %llu\n", METRIC_GET(replicaErrors));
+		failed |= textBufferAppend(&buffer, "# HELP handled_replica_resyncs_total Restarts from sequence 0 after the primary pruned past this replica.\n"
+											"# TYPE handled_replica_resyncs_total counter\n"
+											"handled_replica_resyncs_total %llu\n", METRIC_GET(replicaResyncs));
+	}
+
+	failed |= textBufferAppend(&buffer, "# HELP handled_change_log_pruned_total Change log entries removed by retention.\n"
+										"# TYPE handled_change_log_pruned_total counter\n"
+										"handled_change_log_pruned_total %llu\n", METRIC_GET(changeLogPruned));
+	failed |= textBufferAppend(&buffer, "# HELP handled_replication_skipped_total Malformed or out of order change log entries passed over.\n"
+										"# TYPE handled_replication_skipped_total counter\n"
+										"handled_replication_skipped_total %llu\n", METRIC_GET(replicationSkipped));
+	if (shardCountGlobal > 0) {
+		failed |= textBufferAppend(&buffer, "# HELP handled_shard_changes_quarantined_total Shard edits moved to did_plc_quarantine for conflicting with another shard.\n"
+											"# TYPE handled_shard_changes_quarantined_total counter\n"
+											"handled_shard_changes_quarantined_total %llu\n", METRIC_GET(shardQuarantined));
+	}
+
+	if (handleIndexLoaded) {
+		unsigned long long indexRecords = METRIC_GET(indexRecords);
+		unsigned long long indexBytes = METRIC_GET(indexBytes);
+		failed |= textBufferAppend(&buffer, "# HELP handled_index_records Handles in the in-memory index.\n"
+											"# TYPE handled_index_records gauge\n"
+											"handled_index_records %llu\n", indexRecords);
+		failed |= textBufferAppend(&buffer, "# HELP handled_index_bytes Memory held by the in-memory index, slack included.\n"
+											"# TYPE handled_index_bytes gauge\n"
+											"handled_index_bytes %llu\n", indexBytes);
+		failed |= textBufferAppend(&buffer, "# HELP handled_index_bytes_per_record Index memory divided by the handles in it.\n"
+											"# TYPE handled_index_bytes_per_record gauge\n"
+											"handled_index_bytes_per_record %.1f\n", indexRecords ? (double)indexBytes / (double)indexRecords : 0.0);
+		failed |= textBufferAppend(&buffer, "# HELP handled_index_skipped_total Users left out of the index: not a did:plc, or a handle too long.\n"
+											"# TYPE handled_index_skipped_total counter\n"
+											"handled_index_skipped_total %llu\n", METRIC_GET(indexSkipped));
+	}
+
+	// SQLITE'S OWN HEAP, A LEAKED STATEMENT OR CONNECTION SHOWS UP HERE BEFORE IT SHOWS UP IN RSS
+	failed |= textBufferAppend(&buffer, "# HELP handled_sqlite_memory_bytes Memory held by SQLite, current and high-water.\n"
+										"# TYPE handled_sqlite_memory_bytes gauge\n"
+										"handled_sqlite_memory_bytes{kind=\"current\"} %lld\n"
+										"handled_sqlite_memory_bytes{kind=\"highwater\"} %lld\n",
+										(long long)sqlite3_memory_used(), (long long)sqlite3_memory_highwater(0));
+
+	// THE LAST GOOD BACKUP'S DURATION AND SPEED, TO PICK AN OFF-PEAK SCHEDULE
+	if (configGlobal.backupInterval > 0) {
+		double backupSeconds = (double)METRIC_GET(backupMicroseconds) / 1e6;
+		unsigned long long backupPages = METRIC_GET(backupPages);
+		failed |= textBufferAppend(&buffer, "# HELP handled_backups_total Backups taken and verified.\n"
+											"# TYPE handled_backups_total counter\n"
+											"handled_backups_total %llu\n", METRIC_GET(backups));
+		failed |= textBufferAppend(&buffer, "# HELP handled_backup_failures_total Backups that failed or did not verify.\n"
+											"# TYPE handled_backup_failures_total counter\n"
+											"handled_backup_failures_total %llu\n", METRIC_GET(backupFailures));
+		failed |= textBufferAppend(&buffer, "# HELP handled_backup_duration_seconds Duration of the last good backup.\n"
+											"# TYPE handled_backup_duration_seconds gauge\n"
+											"handled_backup_duration_seconds %.3f\n", backupSeconds);
+		failed |= textBufferAppend(&buffer, "# HELP handled_backup_pages_per_second Database pages copied per second by the last good backup.\n"
+											"# TYPE handled_backup_pages_per_second gauge\n"
+											"handled_backup_pages_per_second %.0f\n", backupSeconds > 0 ? (double)backupPages / backupSeconds : 0.0);
+		failed |= textBufferAppend(&buffer, "# HELP handled_backup_last_success_timestamp_seconds Unix time the last good backup finished.\n"
+											"# TYPE handled_backup_last_success_timestamp_seconds gauge\n"
+											"handled_backup_last_success_timestamp_seconds %lld\n", METRIC_GET(backupCompleted));
+	}
+
+	if (configGlobal.staticRoot[0] != '\0') {
+		failed |= textBufferAppend(&buffer, "# HELP handled_static_files_written_total Well-known files written under static_root.\n"
+											"# TYPE handled_static_files_written_total counter\n"
+											"handled_static_files_written_total %llu\n", METRIC_GET(staticFilesWritten));
+		failed |= textBufferAppend(&buffer, "# HELP handled_static_files_removed_total Well-known files removed with their handle.\n"
+											"# TYPE handled_static_files_removed_total counter\n"
+											"handled_static_files_removed_total %llu\n", METRIC_GET(staticFilesRemoved));
+		failed |= textBufferAppend(&buffer, "# HELP handled_static_file_errors_total Well-known files that could not be written or removed.\n"
+											"# TYPE handled_static_file_errors_total counter\n"
+											"handled_static_file_errors_total %llu\n", METRIC_GET(staticFileErrors));
+		failed |= textBufferAppend(&buffer, "# HELP handled_static_sequence Change log sequence the well-known files reflect.\n"
+											"# TYPE handled_static_sequence gauge\n"
+											"handled_static_sequence %lld\n", METRIC_GET(staticSequence));
+	}
+
+	if (configGlobal.dnsEnabled) {
+		failed |= textBufferAppend(&buffer, "# HELP handled_dns_queries_total DNS messages received, by transport.\n"
+											"# TYPE handled_dns_queries_total counter\n");
+		for (int transport = 0; transport < DNS_TRANSPORT_COUNT; transport++) {
+			failed |= textBufferAppend(&buffer, "handled_dns_queries_total{transport=\"%s\"} %llu\n",
+										dnsTransportNames[transport], METRIC_GET(dnsQueries[transport]));
+		}
+		failed |= textBufferAppend(&buffer, "# HELP handled_dns_responses_total DNS responses sent, by response code.\n"
+											"# TYPE handled_dns_responses_total counter\n");
+		for (int rcode = 0; rcode < DNS_RCODE_COUNT; rcode++) {
+			failed |= textBufferAppend(&buffer, "handled_dns_responses_total{rcode=\"%s\"} %llu\n",
+										dnsResponseCodeNames[rcode], METRIC_GET(dnsResponses[rcode]));
+		}
+	}
+
+	if (failed) {
+		free(buffer.data);
+		return NULL;
+	}
+
+	*length = buffer.length;
+	return buffer.data;
+}
+
+// SEND A PLAIN TEXT ADMIN RESPONSE. 'body' IS COPIED.
+static enum MHD_Result sendAdminText (struct MHD_Connection *connection, unsigned int statusCode, const char *body)
+{
+	struct MHD_Response *response = MHD_create_response_from_buffer(strlen(body), (void *)body, MHD_RESPMEM_MUST_COPY);
+	if (!response) return logMHDError("Memory allocation failed for admin response");
+
+	MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_TEXT);
+	enum MHD_Result ret = MHD_queue_response(connection, statusCode, response);
+	MHD_destroy_response(response);
+	return ret;
+}
+
+// CHANGE LOG ENTRIES AFTER ?after=N FOR A REPLICA, WITH THE PRIMARY'S LATEST SEQUENCE IN A HEADER
+static enum MHD_Result sendChangeLog (struct MHD_Connection *connection)
+{
+	const char *afterArgument = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "after");
+	char *end = NULL;
+	long long after = afterArgument ? strtoll(afterArgument, &end, 10) : 0;
+	if (afterArgument && (end == afterArgument || *end != '\0' || after < 0)) return sendAdminText(connection, MHD_HTTP_BAD_REQUEST, "Invalid sequence\n");
+
+	long long head;
+	size_t length;
+	char *body = renderChangeLog(after, &head, &length);
+	if (!body && head == CHANGE_LOG_TOO_OLD) return sendAdminText(connection, MHD_HTTP_GONE, "Sequence too old, resync\n");
+	if (!body) return sendAdminText(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, "Change log unavailable\n");
+
+	struct MHD_Response *response = MHD_create_response_from_buffer(length, body, MHD_RESPMEM_MUST_FREE);
+	if (!response) {
+		free(body);
+		return logMHDError("Memory allocation failed for change log response");
+	}
+
+	char sequence[32];
+	snprintf(sequence, sizeof(sequence), "%lld", head);
+	MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_TEXT);
+	MHD_add_response_header(response, HEADER_REPLICATION_SEQUENCE, sequence);
+	enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	MHD_destroy_response(response);
+	return ret;
+}
+
+// ONE ?did= ARGUMENT, A DID OR A COMMA SEPARATED LIST, ADDED TO THE REVERSE LOOKUP ANSWER
+struct reverseLookupStruct {
+	struct textBuffer body;
+	int count;
+	int failed;
+};
+
+static enum MHD_Result reverseLookupArgument (void *cls, enum MHD_ValueKind kind, const char *key, const char *value)
+{
+	(void) kind;	/* Unused. Silent compiler warning. */
+	struct reverseLookupStruct *lookup = cls;
+	if (strcmp(key, "did") != 0 || !value) return MHD_YES;
+
+	for (const char *did = value; *did && !lookup->failed; ) {
+		size_t length = strcspn(did, ",");
+		char handle[URL_MAX_SIZE];
+		char requested[URL_MAX_SIZE];
+		int locked = FALSE;
+
+		if (++lookup->count > REVERSE_LOOKUP_MAX) return MHD_NO;
+		snprintf(requested, sizeof(requested), "%.*s", (int)(length < sizeof(requested) ? length : sizeof(requested) - 1), did);
+
+		lookup->failed |= textBufferAppend(&lookup->body, "%s{\"did\":", lookup->count > 1 ? ",\n" : "");
+		lookup->failed |= textBufferAppendJson(&lookup->body, requested);
+		if (handleIndexReverseLookup(requested, handle, sizeof(handle), &locked)) {
+			lookup->failed |= textBufferAppend(&lookup->body, ",\"handle\":");
+			lookup->failed |= textBufferAppendJson(&lookup->body, handle);
+			lookup->failed |= textBufferAppend(&lookup->body, ",\"locked\":%s}", locked ? "true" : "false");
+		}
+		else lookup->failed |= textBufferAppend(&lookup->body, ",\"handle\":null}");
+
+		did += length;
+		if (*did == ',') did++;
+	}
+
+	return MHD_YES;
+}
+
+// HANDLES HOLDING ?did=... (REPEATED OR COMMA SEPARATED), WITH THEIR LOCK STATUS, AS A JSON ARRAY
+static enum MHD_Result sendReverseLookup (struct MHD_Connection *connection)
+{
+	struct reverseLookupStruct lookup = {{NULL, 0, 0}, 0, FALSE};
+	lookup.failed = textBufferAppend(&lookup.body, "[");
+	MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, reverseLookupArgument, &lookup);
+
+	if (lookup.count > REVERSE_LOOKUP_MAX) {
+		free(lookup.body.data);
+		return sendAdminText(connection, MHD_HTTP_BAD_REQUEST, "Too many DIDs in one request\n");
+	}
+	if (lookup.count == 0) {
+		free(lookup.body.data);
+		return sendAdminText(connection, MHD_HTTP_BAD_REQUEST, "Missing ?did=\n");
+	}
+	lookup.failed |= textBufferAppend(&lookup.body, "]\n");
+	if (lookup.failed) {
+		free(lookup.body.data);
+		return sendAdminText(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, "Lookup failed\n");
+	}
+
+	struct MHD_Response *response = MHD_create_response_from_buffer(lookup.body.length, lookup.body.data, MHD_RESPMEM_MUST_FREE);
+	if (!response) {
+		free(lookup.body.data);
+		return logMHDError("Memory allocation failed for reverse lookup response");
+	}
+	MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_JSON);
+	enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	MHD_destroy_response(response);
+	return ret;
+}
+
+// TRUE IF THE REQUEST CARRIES 'Authorization: Bearer {admin_token}'. COMPARED IN CONSTANT TIME.
+static int adminAuthorized (struct MHD_Connection *connection)
+{
+	const char *header = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_AUTHORIZATION);
+	const char *token = configGlobal.adminToken;
+	size_t prefixLength = strlen(ADMIN_AUTH_SCHEME);
+	if (!token[0] || !header || strncasecmp(header, ADMIN_AUTH_SCHEME, prefixLength) != 0) return FALSE;
+
+	const char *offered = header + prefixLength;
+	size_t length = strlen(token);
+	if (strlen(offered) != length) return FALSE;
+
+	unsigned char difference = 0;
+	for (size_t i = 0; i < length; i++) difference |= (unsigned char)(offered[i] ^ token[i]);
+	return difference == 0;
+}
+
+// A BATCH LOOKUP: THE UPLOADED LIST, THEN THE READER'S POSITION IN IT. THE ANSWER IS BUILT ONE LINE AT A TIME
+// IN 'pending', SO NOTHING IS ALLOCATED PER NAME. THE DIDS COME FROM WHERE THE WELL-KNOWN PATH GETS THEM: THE
+// INDEX ON A REPLICA, THE USER DATABASE ON THE PRIMARY, READ WITH ONE STATEMENT PER FILE KEPT FOR THE REQUEST.
+struct batchLookupStruct {
+	char *body;
+	size_t length;
+	size_t capacity;
+	int tooLarge;
+	int json;									// A JSON array of strings, otherwise one name per line
+	size_t cursor;
+	size_t answered;
+	int finished;
+	char pending[URL_MAX_SIZE * 6 + 128];		// Room for a name escaped in full
+	size_t pendingLength;
+	size_t pendingOffset;
+	int files;									// Primary only: user database files, each with its statement
+	sqlite3 **dbs;
+	sqlite3_stmt **statements;
+	int failed;									// A database read failed, the stream ends with an error
+};
+
+// DID OF 'handle' (LOWER CASE) FROM THE USER DATABASE INTO 'did', AS queryForDid. RETURNS TRUE IF FOUND.
+static int batchLookupQuery (struct batchLookupStruct *batch, const char *handle, char *did)
+{
+	sqlite3_stmt *stmt = batch->statements[batch->files > 1 ? shardForHandle(handle, batch->files) : 0];
+	int found = FALSE;
+
+	if (sqlite3_bind_text(stmt, 1, handle, -1, SQLITE_STATIC) != SQLITE_OK) batch->failed = TRUE;
+	else {
+		int rc = sqlite3_step(stmt);
+		const char *value = rc == SQLITE_ROW ? (const char *)sqlite3_column_text(stmt, 0) : NULL;
+		if (value && validateDid(value) == KEY_VALID) {
+			strcpy(did, value);
+			found = TRUE;
+		}
+		if (rc != SQLITE_ROW && rc != SQLITE_DONE) batch->failed = TRUE;
+	}
+	sqlite3_reset(stmt);
+	return found;
+}
+
+// NEXT NAME IN THE LIST: SETS '*name' AND '*length' AND RETURNS TRUE, OR FALSE AT THE END
+static int batchLookupNextName (struct batchLookupStruct *batch, const char **name, size_t *length)
+{
+	const char *body = batch->body;
+
+	while (batch->cursor < batch->length) {
+		if (batch->json) {
+			// THE NEXT STRING, UP TO AN UNESCAPED QUOTE. ANYTHING BETWEEN STRINGS IS SKIPPED, A ']' ENDS THE LIST.
+			while (batch->cursor < batch->length && body[batch->cursor] != '"' && body[batch->cursor] != ']') batch->cursor++;
+			if (batch->cursor >= batch->length || body[batch->cursor] == ']') break;
+
+			size_t start = ++batch->cursor;
+			while (batch->cursor < batch->length && body[batch->cursor] != '"') batch->cursor += body[batch->cursor] == '\\' ? 2 : 1;
+			if (batch->cursor > batch->length) batch->cursor = batch->length;
+			*name = body + start;
+			*length = batch->cursor - start;
+			if (batch->cursor < batch->length) batch->cursor++;
+			return TRUE;
+		}
+
+		size_t start = batch->cursor;
+		while (batch->cursor < batch->length && body[batch->cursor] != '\n') batch->cursor++;
+		size_t end = batch->cursor;
+		if (batch->cursor < batch->length) batch->cursor++;
+
+		while (start < end && isspace((unsigned char)body[start])) start++;
+		while (end > start && isspace((unsigned char)body[end - 1])) end--;
+		if (end == start) continue;
+
+		*name = body + start;
+		*length = end - start;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+// PUT THE ANSWER FOR THE NEXT NAME (OR THE CLOSING OF A JSON ARRAY) IN 'pending'
+static void batchLookupAnswerNext (struct batchLookupStruct *batch)
+{
+	const char *name;
+	size_t length;
+	batch->pendingLength = batch->pendingOffset = 0;
+
+	if (!batchLookupNextName(batch, &name, &length)) {
+		if (batch->json) batch->pendingLength = (size_t)snprintf(batch->pending, sizeof(batch->pending), "%s]\n", batch->answered ? "\n" : "[");
+		batch->finished = TRUE;
+		return;
+	}
+
+	// A LABEL IS UNDER OUR DOMAIN, A HANDLE IS TAKEN AS IT IS. BOTH ARE CASE INSENSITIVE.
+	char handle[URL_MAX_SIZE];
+	char did[MAX_SIZE_DID_PLC + 1];
+	int found = FALSE;
+	if (length + 1 + strlen(domainName) < sizeof(handle)) {
+		for (size_t i = 0; i < length; i++) handle[i] = (char)tolower((unsigned char)name[i]);
+		handle[length] = '\0';
+		if (!memchr(name, '.', length)) snprintf(handle + length, sizeof(handle) - length, ".%s", domainName);
+		found = replicaMode ? handleIndexFind(handle, did) : batchLookupQuery(batch, handle, did);
+	}
+	if (length >= URL_MAX_SIZE) length = URL_MAX_SIZE - 1;
+
+	char *out = batch->pending;
+	if (!batch->json) {
+		memcpy(out, name, length);
+		out += length;
+		out += sprintf(out, "\t%s\n", found ? did : "not-found");
+	} else {
+		out += sprintf(out, "%s{\"handle\":\"", batch->answered ? ",\n" : "[");
+		for (size_t i = 0; i < length; i++) {
+			if ((unsigned char)name[i] < 0x20) out += sprintf(out, "\\u%04x", (unsigned char)name[i]);
+			else if (name[i] == '"' || name[i] == '\\') out += sprintf(out, "\\%c", name[i]);
+			else *out++ = name[i];
+		}
+		out += found ? sprintf(out, "\",\"did\":\"%s\"}", did) : sprintf(out, "\",\"did\":null}");
+	}
+	batch->pendingLength = (size_t)(out - batch->pending);
+	batch->answered++;
+}
+
+// MHD CONTENT READER: FILL 'buf' WITH WHOLE ANSWERS
+static ssize_t batchLookupReader (void *cls, uint64_t pos, char *buf, size_t max)
+{
+	(void) pos;		/* Unused. Silent compiler warning. */
+	struct batchLookupStruct *batch = cls;
+	size_t written = 0;
+
+	while (written < max && !batch->failed) {
+		if (batch->pendingOffset < batch->pendingLength) {
+			size_t chunk = batch->pendingLength - batch->pendingOffset;
+			if (chunk > max - written) chunk = max - written;
+			memcpy(buf + written, batch->pending + batch->pendingOffset, chunk);
+			batch->pendingOffset += chunk;
+			written += chunk;
+			continue;
+		}
+		if (batch->finished) break;
+		batchLookupAnswerNext(batch);
+	}
+
+	if (batch->failed) {
+		fprintf(stderr, "ERROR: Batch lookup stopped after %zu names, the user database could not be read\n", batch->answered);
+		return MHD_CONTENT_READER_END_WITH_ERROR;
+	}
+	if (written == 0) return MHD_CONTENT_READER_END_OF_STREAM;
+	return (ssize_t)written;
+}
+
+static void batchLookupFree (void *cls)
+{
+	struct batchLookupStruct *batch = cls;
+	if (!batch) return;
+
+	for (int i = 0; i < batch->files; i++) {
+		if (batch->statements) sqlite3_finalize(batch->statements[i]);
+		if (batch->dbs && batch->dbs[i]) sqlite3_close(batch->dbs[i]);
+	}
+	free(batch->statements);
+	free(batch->dbs);
+	free(batch->body);
+	free(batch);
+}
+
+// OPEN EVERY USER DATABASE FILE AND PREPARE ITS LOOKUP FOR A BATCH ON THE PRIMARY. RETURNS 0, OR 1 ON FAILURE.
+static int batchLookupOpen (struct batchLookupStruct *batch)
+{
+	int files = shardCountGlobal > 0 ? shardCountGlobal : 1;
+	batch->dbs = calloc(files, sizeof(sqlite3 *));
+	batch->statements = calloc(files, sizeof(sqlite3_stmt *));
+	if (!batch->dbs || !batch->statements) return 1;
+	batch->files = files;
+
+	for (int i = 0; i < files; i++) {
+		batch->dbs[i] = databaseOpen(shardCountGlobal > 0 ? shardDatabasesGlobal[i] : principalDatabaseGlobal);
+		if (!batch->dbs[i]) return 1;
+		batch->statements[i] = databasePrepareStatement(batch->dbs[i], "SELECT did FROM did_plc_users WHERE handle = ?;");
+		if (!batch->statements[i]) return 1;
+	}
+	return 0;
+}
+
+// POST /lookup: A LIST OF HANDLES OR LABELS, ONE PER LINE OR AS A JSON ARRAY, ANSWERED WITH THEIR DIDS IN ONE
+// CHUNKED RESPONSE, FROM THE SAME SOURCE AS THE WELL-KNOWN PATH. NEEDS admin_token. THE UPLOAD IS KEPT IN '*con_cls' UNTIL IT IS COMPLETE.
+static enum MHD_Result sendBatchLookup (struct MHD_Connection *connection, const char *method,
+											const char *upload_data, size_t *upload_data_size, void **con_cls)
+{
+	struct batchLookupStruct *batch = *con_cls;
+
+	if (!batch) {
+		if (0 != strcasecmp(method, MHD_HTTP_METHOD_POST)) return sendAdminText(connection, MHD_HTTP_METHOD_NOT_ALLOWED, "Method not allowed\n");
+		if (!configGlobal.adminToken[0]) return sendAdminText(connection, MHD_HTTP_FORBIDDEN, "Batch lookups are off, set admin_token\n");
+		if (!adminAuthorized(connection)) return sendAdminText(connection, MHD_HTTP_UNAUTHORIZED, "Unauthorized\n");
+
+		batch = calloc(1, sizeof(*batch));
+		if (!batch) return logMHDError("Memory allocation failed for batch lookup");
+		*con_cls = batch;
+		return MHD_YES;
+	}
+
+	if (*upload_data_size > 0) {
+		size_t needed = batch->length + *upload_data_size;
+		if (needed > LOOKUP_MAX_BODY) batch->tooLarge = TRUE;
+		if (!batch->tooLarge && needed > batch->capacity) {
+			size_t capacity = batch->capacity ? batch->capacity : LOOKUP_BLOCK_SIZE;
+			while (capacity < needed) capacity *= 2;
+			char *body = realloc(batch->body, capacity);
+			if (!body) batch->tooLarge = TRUE;
+			else {
+				batch->body = body;
+				batch->capacity = capacity;
+			}
+		}
+		if (!batch->tooLarge) {
+			memcpy(batch->body + batch->length, upload_data, *upload_data_size);
+			batch->length = needed;
+		}
+		*upload_data_size = 0;
+		return MHD_YES;
+	}
+
+	// THE UPLOAD IS COMPLETE. FROM HERE THE RESPONSE OWNS THE BATCH.
+	*con_cls = NULL;
+	if (batch->tooLarge) {
+		batchLookupFree(batch);
+		return sendAdminText(connection, MHD_HTTP_PAYLOAD_TOO_LARGE, "List too large\n");
+	}
+
+	size_t first = 0;
+	while (first < batch->length && isspace((unsigned char)batch->body[first])) first++;
+	batch->json = first < batch->length && batch->body[first] == '[';
+	if (!replicaMode && batchLookupOpen(batch) != 0) {
+		batchLookupFree(batch);
+		return sendAdminText(connection, MHD_HTTP_SERVICE_UNAVAILABLE, "User database unavailable\n");
+	}
+
+	struct MHD_Response *response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, LOOKUP_BLOCK_SIZE, batchLookupReader, batch, batchLookupFree);
+	if (!response) {
+		batchLookupFree(batch);
+		return logMHDError("Memory allocation failed for batch lookup response");
+	}
+	MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, batch->json ? CONTENT_JSON : CONTENT_TEXT);
+	enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	MHD_destroy_response(response);
+	return ret;
+}
+
+// MHD CONTENT READER: SEND THE PAGE HELD, READING THE NEXT ONE WHEN IT IS DRAINED
+static ssize_t userExportReader (void *cls, uint64_t pos, char *buf, size_t max)
+{
+	(void) pos;		/* Unused. Silent compiler warning. */
+	struct userExportStruct *export = cls;
+	size_t written = 0;
+
+	while (written < max && !export->failed) {
+		if (export->pageOffset < export->page.length) {
+			size_t chunk = export->page.length - export->pageOffset;
+			if (chunk > max - written) chunk = max - written;
+			memcpy(buf + written, export->page.data + export->pageOffset, chunk);
+			export->pageOffset += chunk;
+			written += chunk;
+			continue;
+		}
+		if (export->finished) break;
+		export->failed = userExportNextPage(export);
+	}
+
+	if (written > 0) return (ssize_t)written;
+	return export->failed ? MHD_CONTENT_READER_END_WITH_ERROR : MHD_CONTENT_READER_END_OF_STREAM;
+}
+
+// GET /export?format=csv|jsonl: EVERY USER, STREAMED A PAGE AT A TIME (SEE userExportNextPage). NEEDS admin_token.
+static enum MHD_Result sendUserExport (struct MHD_Connection *connection)
+{
+	if (!configGlobal.adminToken[0]) return sendAdminText(connection, MHD_HTTP_FORBIDDEN, "Exports are off, set admin_token\n");
+	if (!adminAuthorized(connection)) return sendAdminText(connection, MHD_HTTP_UNAUTHORIZED, "Unauthorized\n");
+
+	const char *formatArgument = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "format");
+	exportFormat format = EXPORT_CSV;
+	if (formatArgument && 0 == strcmp(formatArgument, "jsonl")) format = EXPORT_JSONL;
+	else if (formatArgument && 0 != strcmp(formatArgument, "csv")) return sendAdminText(connection, MHD_HTTP_BAD_REQUEST, "Invalid format, use csv or jsonl\n");
+
+	struct userExportStruct *export = userExportOpen(format);
+	if (!export) return logMHDError("Memory allocation failed for export");
+
+	struct MHD_Response *response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, EXPORT_BLOCK_SIZE, userExportReader, export, userExportFree);
+	if (!response) {
+		userExportFree(export);
+		return logMHDError("Memory allocation failed for export response");
+	}
+	MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, format == EXPORT_CSV ? CONTENT_CSV : CONTENT_JSONL);
+	enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	MHD_destroy_response(response);
+	return ret;
+}
+
+// FREE A BATCH LOOKUP WHOSE UPLOAD NEVER COMPLETED
+static void adminRequestCompleted (void *cls, struct MHD_Connection *connection, void **con_cls, enum MHD_RequestTerminationCode toe)
+{
+	(void) cls;			/* Unused. Silent compiler warning. */
+	(void) connection;	/* Unused. Silent compiler warning. */
+	(void) toe;			/* Unused. Silent compiler warning. */
+
+	batchLookupFree(*con_cls);
+	*con_cls = NULL;
+}
+
+// LOCAL-ONLY ADMIN LISTENER, NEVER EXPOSED THROUGH THE REVERSE PROXY
+static enum MHD_Result adminRequestHandler (void *cls, struct MHD_Connection *connection,
+												const char *url, const char *method,
+												const char *version, const char *upload_data,
+												size_t *upload_data_size, void **con_cls)
+{
+	(void) cls;               /* Unused. Silent compiler warning. */
+	(void) version;           /* Unused. Silent compiler warning. */
+
+	if (0 == strcmp(url, URL_ADMIN_LOOKUP)) return sendBatchLookup(connection, method, upload_data, upload_data_size, con_cls);
+
+	if (0 != strcasecmp(method, MHD_HTTP_METHOD_GET)) return sendAdminText(connection, MHD_HTTP_METHOD_NOT_ALLOWED, "Method not allowed\n");
+
+	if (0 == strcmp(url, URL_ADMIN_METRICS)) {
+		size_t length;
+		char *body = renderMetrics(&length);
+		if (!body) return logMHDError("Unable to render metrics");
+
+		struct MHD_Response *response = MHD_create_response_from_buffer(length, body, MHD_RESPMEM_MUST_FREE);
+		if (!response) {
+			free(body);
+			return logMHDError("Memory allocation failed for metrics response");
+		}
+		MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_METRICS);
+		enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+		MHD_destroy_response(response);
+		return ret;
+	}
+
+	if (0 == strcmp(url, URL_ADMIN_REPLICATION)) return sendChangeLog(connection);
+	if (0 == strcmp(url, URL_ADMIN_HANDLES)) return sendReverseLookup(connection);
+	if (0 == strcmp(url, URL_ADMIN_EXPORT)) return sendUserExport(connection);
+
+	return sendAdminText(connection, MHD_HTTP_NOT_FOUND, "Not found\n");
+}
+
+// *********************************************
+// ********* REPLICATION ***********************
+// *********************************************
+
+// 'handled replica' POLLS THE PRIMARY'S CHANGE LOG FROM ONE THREAD, APPLIES EACH BATCH TO ITS OWN DATABASE
+// AND THEN TO THE INDEX. THE PRIMARY FOLLOWS ITS OWN CHANGE LOG THE SAME WAY, INTO ITS INDEX ONLY, TO PICK UP
+// OTHER WORKERS' REGISTRATIONS AND sqlite3 SHELL EDITS. A FULL BATCH IS FOLLOWED BY ANOTHER POLL AT ONCE,
+// OTHERWISE IT WAITS replica_interval.
+static pthread_t replicationThread;
+static int replicationRunning = FALSE;
+static int replicationStopping = FALSE;
+static long long replicationApplied = 0;
+static time_t changeLogPrunedAt = 0;
+static int replicationResyncing = TRUE;			// A replica checks once for a resync left unfinished by a restart
+static pthread_mutex_t replicationMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replicationWake = PTHREAD_COND_INITIALIZER;
+
+// PICK THE PRIMARY'S LATEST SEQUENCE OUT OF THE RESPONSE HEADERS
+static size_t replicationHeader (char *buffer, size_t size, size_t count, void *userdata)
+{
+	size_t total = size * count;
+	size_t nameLength = strlen(HEADER_REPLICATION_SEQUENCE);
+
+	if (total > nameLength + 1 && buffer[nameLength] == ':' && strncasecmp(buffer, HEADER_REPLICATION_SEQUENCE, nameLength) == 0) {
+		char value[32];
+		size_t valueLength = total - nameLength - 1;
+		if (valueLength >= sizeof(value)) valueLength = sizeof(value) - 1;
+		memcpy(value, buffer + nameLength + 1, valueLength);
+		value[valueLength] = '\0';
+		*(long long *)userdata = strtoll(value, NULL, 10);
+	}
+
+	return total;
+}
+
+// FETCH CHANGE LOG ENTRIES AFTER 'after' FROM THE PRIMARY. RETURNS THE BODY, OR NULL. CALLER MUST FREE.
+static char *fetchChangeLog (long long after, long long *head)
+{
+	*head = -1;
+	char url[URL_MAX_SIZE];
+	int length;
+	if (configGlobal.replicaSource[0]) length = snprintf(url, sizeof(url), "%s" URL_ADMIN_REPLICATION "?after=%lld", configGlobal.replicaSource, after);
+	else length = snprintf(url, sizeof(url), "http://127.0.0.1:%d" URL_ADMIN_REPLICATION "?after=%lld", ADMIN_PORT, after);
+	if (length < 0 || (size_t)length >= sizeof(url)) {
+		fprintf(stderr, "REPLICA: Source URL is too long\n");
+		return NULL;
+	}
+
+	CURL *curl = curl_easy_init();
+	if (!curl) {
+		fprintf(stderr, "REPLICA: Failed to initialize curl\n");
+		return NULL;
+	}
+
+	struct curlResponse response = {NULL, 0};
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)RESOLVER_TIMEOUT);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)RESOLVER_CONNECT_TIMEOUT);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlReceiveData);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, replicationHeader);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, head);
+
+	CURLcode res = curl_easy_perform(curl);
+	long responseCode = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &responseCode);
+	curl_easy_cleanup(curl);
+
+	if (res != CURLE_OK || responseCode != 200 || *head < 0) {
+		if (res != CURLE_OK) fprintf(stderr, "REPLICA: Polling %s failed: %s\n", url, curl_easy_strerror(res));
+		else fprintf(stderr, "REPLICA: Polling %s failed with HTTP code %ld\n", url, responseCode);
+		if (res == CURLE_OK && responseCode == MHD_HTTP_GONE) *head = CHANGE_LOG_TOO_OLD;
+		free(response.data);
+		return NULL;
+	}
+
+	// AN EMPTY BATCH HAS NO BODY AT ALL
+	if (!response.data) response.data = calloc(1, 1);
+	return response.data;
+}
+
+// SPLIT A CHANGE LOG BODY (MODIFIED IN PLACE) INTO ENTRIES. A MALFORMED OR OUT OF ORDER LINE IS COUNTED AND SKIPPED,
+// SO ONE BAD ENTRY DOES NOT STOP THE FOLLOWER FOR GOOD. '*position' GETS THE LAST SEQUENCE READ, SKIPPED LINES
+// INCLUDED, OR 'after' IF NONE. A TRUNCATED LAST LINE IS LEFT FOR THE NEXT POLL. RETURNS NULL IF MEMORY RUNS OUT.
+static struct changeEntryStruct *parseChangeLog (char *body, long long after, size_t *count, long long *position)
+{
+	size_t lines = 0;
+	for (const char *c = body; *c; c++) if (*c == '\n') lines++;
+
+	struct changeEntryStruct *entries = calloc(lines ? lines : 1, sizeof(*entries));
+	if (!entries) return NULL;
+	*count = 0;
+	*position = after;
+
+	char *next;
+	for (char *line = body; *line; line = next + 1) {
+		next = strchr(line, '\n');
+		if (!next) break;				// Truncated
+		*next = '\0';
+
+		char *fields[7];
+		int fieldCount = 0;
+		for (char *field = line; field && fieldCount < 7; fieldCount++) {
+			fields[fieldCount] = field;
+			field = strchr(field, '\t');
+			if (field) *field++ = '\0';
+		}
+
+		struct changeEntryStruct *entry = &entries[*count];
+		entry->sequence = strtoll(fields[0], NULL, 10);
+		entry->put = fieldCount == 7 && strcmp(fields[1], "put") == 0;
+		if (entry->sequence <= *position) {
+			fprintf(stderr, "REPLICA: Skipping change log entry out of order after sequence %lld\n", *position);
+			METRIC_ADD(replicationSkipped, 1);
+			continue;
+		}
+		*position = entry->sequence;
+		if (fieldCount != 7 || (!entry->put && strcmp(fields[1], "delete") != 0) ||
+			(strcmp(fields[6], "0") != 0 && strcmp(fields[6], "1") != 0) ||
+			(entry->put && validateDid(fields[3]) == KEY_INVALID)) {
+			fprintf(stderr, "REPLICA: Skipping malformed change log entry %lld\n", entry->sequence);
+			METRIC_ADD(replicationSkipped, 1);
+			continue;
+		}
+		entry->handle = fields[2];
+		entry->did = fields[3];
+		entry->label = fields[4];
+		entry->domain = fields[5];
+		entry->locked = fields[6][0] == '1';
+		(*count)++;
+	}
+
+	return entries;
+}
+
+// POLL ONCE. RETURNS THE NUMBER OF ENTRIES APPLIED, OR -1 ON FAILURE.
+static long replicationPoll (void)
+{
+	long long head;
+	size_t length;
+	char *body = replicaMode ? fetchChangeLog(replicationApplied, &head) : renderChangeLog(replicationApplied, &head, &length);
+	if (!body && head == CHANGE_LOG_TOO_OLD && replicaMode) {
+		fprintf(stderr, "REPLICA: The primary pruned past sequence %lld, resyncing from 0\n", replicationApplied);
+		syslog(LOG_WARNING, "Replica fell behind the pruned change log at sequence %lld, resyncing", replicationApplied);
+		if (replicaStartResync() != DATABASE_SUCCESS) return -1;
+		METRIC_ADD(replicaResyncs, 1);
+		replicationResyncing = TRUE;
+		replicationApplied = 0;
+		handleIndexFollowed(0);
+		METRIC_SET(replicaApplied, 0);
+		return 0;
+	}
+	if (!body && head == CHANGE_LOG_TOO_OLD) fprintf(stderr, "INDEX: The change log was pruned past sequence %lld, restart to reload the handle index\n", replicationApplied);
+	if (!body) return -1;
+
+	// A PRIMARY BEHIND ITS REPLICA LOST ITS DATABASE OR IS THE WRONG ONE, KEEP SERVING WHAT IS HERE
+	if (replicaMode && head < replicationApplied) {
+		fprintf(stderr, "REPLICA: Primary is at sequence %lld, behind this replica (%lld)\n", head, replicationApplied);
+		free(body);
+		return -1;
+	}
+
+	size_t count = 0;
+	long long position;
+	struct changeEntryStruct *entries = parseChangeLog(body, replicationApplied, &count, &position);
+	if (!entries || (replicaMode && position > replicationApplied && applyChangeEntries(entries, count, position) != DATABASE_SUCCESS)) {
+		free(entries);
+		free(body);
+		return -1;
+	}
+
+	// THE DATABASE HAS THE BATCH, SO THE POSITION MOVES EVEN IF THE INDEX RAN OUT OF MEMORY
+	int indexFailed = handleIndexApply(entries, count);
+	replicationApplied = position;
+	handleIndexFollowed(position);
+	free(entries);
+	free(body);
+	// RETENTION RUNS IN ONE PROCESS. A REPLICA'S OWN LOG, WHICH ITS APPLIES FILL, IS PRUNED THE SAME WAY
+	if (workerSlot == 0 && time(NULL) - changeLogPrunedAt >= CHANGE_LOG_PRUNE_INTERVAL) {
+		changeLogPrunedAt = time(NULL);
+		pruneChangeLog();
+	}
+	if (!replicaMode) {
+		if (indexFailed) fprintf(stderr, "INDEX: Update failed, restart to reload the handle index\n");
+		return indexFailed ? -1 : (long)count;
+	}
+
+	METRIC_ADD(replicaEntries, count);
+	METRIC_SET(replicaApplied, replicationApplied);
+	METRIC_SET(replicaPrimary, head);
+	if (replicationApplied >= head) {
+		METRIC_SET(replicaSynced, monotonicMicroseconds());
+		long removed = replicationResyncing ? replicaFinishResync() : 0;
+		if (removed < 0) return -1;
+		replicationResyncing = FALSE;
+		if (removed > 0) syslog(LOG_INFO, "Replica resync done, removed %ld users the primary no longer has", removed);
+	}
+	if (indexFailed) {
+		fprintf(stderr, "REPLICA: Index update failed, restart the replica to reload it\n");
+		return -1;
+	}
+
+	return (long)count;
+}
+
+static void *replicationTailThread (void *unused)
+{
+	(void) unused;
+
+	pthread_mutex_lock(&replicationMutex);
+	while (!replicationStopping) {
+		pthread_mutex_unlock(&replicationMutex);
+		long applied = replicationPoll();
+		if (applied < 0 && replicaMode) METRIC_ADD(replicaErrors, 1);
+		pthread_mutex_lock(&replicationMutex);
+
+		if (applied == REPLICATION_BATCH) continue;
+
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += configGlobal.replicaInterval / 1000;
+		until.tv_nsec += (configGlobal.replicaInterval % 1000) * 1000000L;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		while (!replicationStopping) {
+			if (pthread_cond_timedwait(&replicationWake, &replicationMutex, &until) == ETIMEDOUT) break;
+		}
+	}
+	pthread_mutex_unlock(&replicationMutex);
+
+	return NULL;
+}
+
+// START TAILING FROM WHERE THE LOADED INDEX IS, FOR A REPLICA THE POSITION SAVED IN ITS DATABASE.
+// RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+int startReplication (void)
+{
+	replicationApplied = handleIndex.header->sequence;
+	if (!replicaMode) {
+		replicationStopping = FALSE;
+		if (pthread_create(&replicationThread, NULL, replicationTailThread, NULL) != 0) return 1;
+		replicationRunning = TRUE;
+		return 0;
+	}
+
+	METRIC_SET(replicaApplied, replicationApplied);
+	METRIC_SET(replicaSynced, monotonicMicroseconds());
+	replicationStopping = FALSE;
+	if (pthread_create(&replicationThread, NULL, replicationTailThread, NULL) != 0) return 1;
+	replicationRunning = TRUE;
+
+	printf("Replicating from change log sequence %lld.\n", replicationApplied);
+	syslog(LOG_INFO, "Replicating from change log sequence %lld", replicationApplied);
+	return 0;
+}
+
+void stopReplication (void)
+{
+	if (!replicationRunning) return;
+
+	pthread_mutex_lock(&replicationMutex);
+	replicationStopping = TRUE;
+	pthread_cond_signal(&replicationWake);
+	pthread_mutex_unlock(&replicationMutex);
+
+	pthread_join(replicationThread, NULL);
+	replicationRunning = FALSE;
+}
+
+// *********************************************
+// ********* BACKUPS ***************************
+// *********************************************
+
+// 'handled backup' AND backup_interval COPY THE DATABASES WITH THE SQLITE BACKUP API, backup_pages PAGES PER STEP
+// AND backup_sleep MILLISECONDS BETWEEN STEPS. A STEP HOLDS THE SOURCE'S READ LOCK ONLY WHILE IT RUNS, SO WRITERS
+// GET IN BETWEEN STEPS. A WRITE SENDS THE COPY BACK TO THE FIRST PAGE, SO EVERY RESTART DOUBLES THE STEP, AND AFTER
+// BACKUP_MAX_RESTARTS THE REST IS COPIED IN ONE STEP. A BACKUP IS BUILT UNDER A .partial NAME, EACH COPY PASSES
+// integrity_check AND GOES IN A MANIFEST WITH ITS CRC-32. THE DIRECTORY IS THEN RENAMED INTO PLACE, READ BACK
+// AGAINST THE MANIFEST, AND ALL BUT THE NEWEST backup_keep ARE REMOVED.
+
+static pthread_t backupThread;
+static pthread_mutex_t backupMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backupWake = PTHREAD_COND_INITIALIZER;
+static int backupStopping = FALSE;
+static int backupRunning = FALSE;
+
+// TOTALS OF ONE BACKUP
+struct backupStatsStruct {
+	int files;
+	long long pages;
+	long long bytes;
+	int restarts;
+};
+
+static int backupStopRequested (void)
+{
+	pthread_mutex_lock(&backupMutex);
+	int stopping = backupStopping;
+	pthread_mutex_unlock(&backupMutex);
+	return stopping;
+}
+
+// COPY ONE DATABASE FILE AND CHECK THE COPY. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+static int backupCopyDatabase (const char *sourcePath, const char *targetPath, struct backupStatsStruct *stats)
+{
+	sqlite3 *source = NULL;
+	sqlite3 *target = NULL;
+	sqlite3_backup *backup = NULL;
+	int failed = 0;
+
+	if (sqlite3_open_v2(sourcePath, &source, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+		fprintf(stderr, "ERROR: Unable to open '%s' for a backup: %s\n", sourcePath, sqlite3_errmsg(source));
+		failed = 1;
+	}
+	else if (sqlite3_open(targetPath, &target) != SQLITE_OK || !(backup = sqlite3_backup_init(target, "main", source, "main"))) {
+		fprintf(stderr, "ERROR: Unable to start the backup of '%s': %s\n", sourcePath, sqlite3_errmsg(target));
+		failed = 1;
+	}
+
+	int step = configGlobal.backupPages;
+	int restarts = 0;
+	int previous = -1;
+	int rc = SQLITE_OK;
+	while (backup) {
+		rc = sqlite3_backup_step(backup, step);
+		if (rc == SQLITE_DONE) break;
+		if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED) break;
+
+		// MORE PAGES LEFT THAN AFTER THE LAST STEP: THE SOURCE CHANGED AND THE COPY STARTED OVER
+		int remaining = sqlite3_backup_remaining(backup);
+		if (rc == SQLITE_OK && previous >= 0 && remaining > previous) {
+			restarts++;
+			step = restarts >= BACKUP_MAX_RESTARTS ? -1 : step * 2;
+		}
+		if (rc == SQLITE_OK) previous = remaining;
+
+		if (backupStopRequested()) {
+			rc = SQLITE_ABORT;
+			break;
+		}
+		if (configGlobal.backupSleep > 0) {
+			struct timespec pause = {configGlobal.backupSleep / 1000, (configGlobal.backupSleep % 1000) * 1000000L};
+			nanosleep(&pause, NULL);
+		}
+	}
+
+	if (backup) {
+		stats->pages += sqlite3_backup_pagecount(backup);
+		stats->restarts += restarts;
+		sqlite3_backup_finish(backup);
+		if (rc != SQLITE_DONE) {
+			fprintf(stderr, "ERROR: Backup of '%s' failed: %s\n", sourcePath, sqlite3_errstr(rc));
+			failed = 1;
+		}
+	}
+
+	if (!failed) {
+		sqlite3_stmt *stmt = NULL;
+		if (sqlite3_prepare_v2(target, "PRAGMA integrity_check;", -1, &stmt, NULL) != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW ||
+			strcmp((const char *)sqlite3_column_text(stmt, 0), "ok") != 0) {
+			fprintf(stderr, "ERROR: The backup of '%s' failed its integrity check\n", sourcePath);
+			failed = 1;
+		}
+		sqlite3_finalize(stmt);
+	}
+
+	sqlite3_close(target);
+	sqlite3_close(source);
+	return failed;
+}
+
+// CRC-32 AND SIZE OF A FILE, ONCE IT IS FLUSHED TO DISK. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+static int backupChecksum (const char *path, unsigned long *crc, long long *bytes)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return 1;
+
+	unsigned char block[65536];
+	ssize_t length;
+	*crc = crc32(0L, Z_NULL, 0);
+	*bytes = 0;
+	while ((length = read(fd, block, sizeof(block))) > 0) {
+		*crc = crc32(*crc, block, (uInt)length);
+		*bytes += length;
+	}
+
+	int failed = length < 0 || fsync(fd) != 0;
+	close(fd);
+	return failed;
+}
+
+// REMOVE A BACKUP DIRECTORY AND THE FILES IN IT
+static void backupRemove (const char *path)
+{
+	DIR *directory = opendir(path);
+	if (directory) {
+		struct dirent *entry;
+		while ((entry = readdir(directory))) {
+			if (entry->d_name[0] == '.') continue;
+			char *file = (char *)buildAbsolutePath(path, entry->d_name);
+			if (file) unlink(file);
+			free(file);
+		}
+		closedir(directory);
+	}
+	rmdir(path);
+}
+
+// CHECK EVERY FILE IN A BACKUP AGAINST ITS MANIFEST. RETURNS THE FILES CHECKED, OR -1 IF ONE IS MISSING OR DIFFERS.
+int backupVerify (const char *path)
+{
+	char *manifestPath = (char *)buildAbsolutePath(path, BACKUP_MANIFEST);
+	FILE *manifest = manifestPath ? fopen(manifestPath, "r") : NULL;
+	free(manifestPath);
+	if (!manifest) {
+		fprintf(stderr, "ERROR: Backup '%s' has no manifest\n", path);
+		return -1;
+	}
+
+	char line[CONFIG_LINE_MAX];
+	int files = 0;
+	while (files >= 0 && fgets(line, sizeof(line), manifest)) {
+		unsigned long expectedCrc, crc;
+		long long expectedBytes, bytes;
+		char name[CONFIG_VALUE_MAX];
+		if (sscanf(line, "%lx %lld %255s", &expectedCrc, &expectedBytes, name) != 3 || strchr(name, '/')) {
+			fprintf(stderr, "ERROR: Malformed manifest line in '%s'\n", path);
+			files = -1;
+			break;
+		}
+
+		char *file = (char *)buildAbsolutePath(path, name);
+		if (!file || backupChecksum(file, &crc, &bytes) != 0 || crc != expectedCrc || bytes != expectedBytes) {
+			fprintf(stderr, "ERROR: '%s' in backup '%s' is missing or does not match its checksum\n", name, path);
+			files = -1;
+		}
+		else files++;
+		free(file);
+	}
+
+	fclose(manifest);
+	return files;
+}
+
+static int backupCompareNames (const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// THE NAMES OF THE FINISHED BACKUPS IN 'root', OLDEST FIRST. RETURNS AN ARRAY TO FREE, OR NULL IF THERE ARE NONE.
+static char **backupList (const char *root, int *count)
+{
+	*count = 0;
+	DIR *directory = opendir(root);
+	if (!directory) return NULL;
+
+	char **names = NULL;
+	int capacity = 0;
+	struct dirent *entry;
+	while ((entry = readdir(directory))) {
+		// A .partial NAME IS LONGER, AND MAY BE IN USE BY ANOTHER BACKUP
+		if (strlen(entry->d_name) != BACKUP_NAME_LENGTH || entry->d_name[8] != 'T') continue;
+		if (*count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			char **grown = realloc(names, capacity * sizeof(char *));
+			if (!grown) break;
+			names = grown;
+		}
+		if (!(names[*count] = strdup(entry->d_name))) break;
+		(*count)++;
+	}
+	closedir(directory);
+
+	if (*count > 1) qsort(names, *count, sizeof(char *), backupCompareNames);
+	return names;
+}
+
+// TAKE ONE BACKUP OF THE USER DATABASE (ONE FILE, OR THE SHARD INDEX AND EVERY SHARD) AND THE RESERVED WORDS,
+// VERIFY IT AND ROTATE. RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+int runBackup (void)
+{
+	long long started = monotonicMicroseconds();
+	struct backupStatsStruct stats = {0};
+	struct textBuffer manifest = {0};
+
+	char name[BACKUP_NAME_LENGTH + 1];
+	char partialName[BACKUP_NAME_LENGTH + sizeof(BACKUP_PARTIAL_SUFFIX)];
+	time_t now = time(NULL);
+	struct tm utc;
+	gmtime_r(&now, &utc);
+	strftime(name, sizeof(name), BACKUP_NAME_FORMAT, &utc);
+	snprintf(partialName, sizeof(partialName), "%s" BACKUP_PARTIAL_SUFFIX, name);
+
+	char *root = configFilePath(configGlobal.backupDirectory);
+	char *partial = root ? (char *)buildAbsolutePath(root, partialName) : NULL;
+	char *final = root ? (char *)buildAbsolutePath(root, name) : NULL;
+	int failed = !partial || !final;
+	if (!failed && mkdir(root, 0700) != 0 && errno != EEXIST) {
+		fprintf(stderr, "ERROR: Unable to create '%s': %s\n", root, strerror(errno));
+		failed = 1;
+	}
+	if (!failed && mkdir(partial, 0700) != 0) {
+		fprintf(stderr, "ERROR: Unable to create '%s': %s\n", partial, strerror(errno));
+		free(partial);
+		partial = NULL;
+		failed = 1;
+	}
+
+	int sources = shardCountGlobal > 0 ? shardCountGlobal + 2 : 2;
+	for (int i = 0; i < sources && !failed; i++) {
+		const char *source = i == 0 ? filterDatabaseGlobal
+						   : shardCountGlobal == 0 ? principalDatabaseGlobal
+						   : i == 1 ? shardIndexDatabaseGlobal : shardDatabasesGlobal[i - 2];
+		if (i == 0 && access(source, F_OK) != 0) continue;		// 'handled init' not run yet
+
+		const char *fileName = strrchr(source, '/') ? strrchr(source, '/') + 1 : source;
+		char *target = (char *)buildAbsolutePath(partial, fileName);
+		unsigned long crc;
+		long long bytes;
+		failed = !target || backupCopyDatabase(source, target, &stats) != 0 || backupChecksum(target, &crc, &bytes) != 0 ||
+				 textBufferAppend(&manifest, "%08lx %lld %s\n", crc, bytes, fileName) != 0;
+		if (!failed) {
+			stats.files++;
+			stats.bytes += bytes;
+		}
+		free(target);
+	}
+
+	// THE MANIFEST GOES IN LAST, AND THE DIRECTORY IS ONLY RENAMED ONCE EVERYTHING IN IT IS ON DISK
+	if (!failed) {
+		char *manifestPath = (char *)buildAbsolutePath(partial, BACKUP_MANIFEST);
+		FILE *file = manifestPath ? fopen(manifestPath, "w") : NULL;
+		failed = !file || fwrite(manifest.data, 1, manifest.length, file) != manifest.length || fflush(file) != 0 || fsync(fileno(file)) != 0;
+		if (file && fclose(file) != 0) failed = 1;
+		if (failed) fprintf(stderr, "ERROR: Unable to write the manifest of '%s'\n", partial);
+		free(manifestPath);
+	}
+	if (!failed) {
+		syncDirectory(partial);
+		if (rename(partial, final) != 0) {
+			fprintf(stderr, "ERROR: Unable to rename '%s': %s\n", partial, strerror(errno));
+			failed = 1;
+		}
+		else {
+			syncDirectory(root);
+			if (backupVerify(final) != stats.files) {
+				backupRemove(final);
+				failed = 1;
+			}
+		}
+	}
+	else if (partial) backupRemove(partial);
+
+	double seconds = (double)(monotonicMicroseconds() - started) / 1e6;
+	if (failed) {
+		METRIC_ADD(backupFailures, 1);
+		fprintf(stderr, "ERROR: Backup %s failed after %.2f s\n", name, seconds);
+		syslog(LOG_ERR, "Backup %s failed after %.2f s", name, seconds);
+	}
+	else {
+		METRIC_ADD(backups, 1);
+		METRIC_SET(backupMicroseconds, (unsigned long long)(seconds * 1e6));
+		METRIC_SET(backupPages, (unsigned long long)stats.pages);
+		METRIC_SET(backupCompleted, (long long)time(NULL));
+
+		// OLDEST FIRST, SO THE ONES BEFORE THE LAST backup_keep GO
+		int count;
+		char **names = backupList(root, &count);
+		for (int i = 0; i < count; i++) {
+			if (i < count - configGlobal.backupKeep) {
+				char *old = (char *)buildAbsolutePath(root, names[i]);
+				if (old) backupRemove(old);
+				free(old);
+			}
+			free(names[i]);
+		}
+		free(names);
+
+		double rate = seconds > 0 ? (double)stats.pages / seconds : 0.0;
+		printf("Backup %s: %d files, %lld pages, %lld bytes in %.2f s (%.0f pages/s, %d restarts)\n",
+			   final, stats.files, stats.pages, stats.bytes, seconds, rate, stats.restarts);
+		syslog(LOG_INFO, "Backup %s: %d files, %lld pages, %lld bytes in %.2f s (%.0f pages/s, %d restarts)",
+			   final, stats.files, stats.pages, stats.bytes, seconds, rate, stats.restarts);
+	}
+
+	free(manifest.data);
+	free(root);
+	free(partial);
+	free(final);
+	return failed;
+}
+
+// 'handled backup {basedir} verify': CHECK EVERY FINISHED BACKUP. RETURNS 0 IF ALL MATCH, 1 OTHERWISE.
+int verifyBackups (void)
+{
+	char *root = configFilePath(configGlobal.backupDirectory);
+	if (!root) return 1;
+
+	int count, failed = 0;
+	char **names = backupList(root, &count);
+	for (int i = 0; i < count; i++) {
+		char *path = (char *)buildAbsolutePath(root, names[i]);
+		int files = path ? backupVerify(path) : -1;
+		if (files < 0) failed = 1;
+		else printf("Backup %s: %d files match the manifest\n", names[i], files);
+		free(path);
+		free(names[i]);
+	}
+	if (count == 0) printf("No backups in '%s'\n", root);
+
+	free(names);
+	free(root);
+	return failed;
+}
+
+static void *backupScheduleThread (void *unused)
+{
+	(void) unused;
+
+	pthread_mutex_lock(&backupMutex);
+	while (!backupStopping) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += configGlobal.backupInterval;
+		while (!backupStopping) {
+			if (pthread_cond_timedwait(&backupWake, &backupMutex, &until) == ETIMEDOUT) break;
+		}
+		if (backupStopping) break;
+
+		pthread_mutex_unlock(&backupMutex);
+		runBackup();
+		pthread_mutex_lock(&backupMutex);
+	}
+	pthread_mutex_unlock(&backupMutex);
+
+	return NULL;
+}
+
+// START THE PERIODIC BACKUPS, IF backup_interval IS SET. ONE PROCESS TAKES THEM, WORKER 0 WITH PREFORK WORKERS.
+// RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+int startBackups (void)
+{
+	if (configGlobal.backupInterval == 0) return 0;
+
+	backupStopping = FALSE;
+	if (pthread_create(&backupThread, NULL, backupScheduleThread, NULL) != 0) return 1;
+	backupRunning = TRUE;
+
+	printf("Backing up every %d seconds into '%s', keeping %d.\n", configGlobal.backupInterval, configGlobal.backupDirectory, configGlobal.backupKeep);
+	syslog(LOG_INFO, "Backing up every %d seconds into '%s', keeping %d", configGlobal.backupInterval, configGlobal.backupDirectory, configGlobal.backupKeep);
+	return 0;
+}
+
+// STOP THE PERIODIC BACKUPS. ONE IN PROGRESS IS ABANDONED AT ITS NEXT STEP.
+void stopBackups (void)
+{
+	if (!backupRunning) return;
+
+	pthread_mutex_lock(&backupMutex);
+	backupStopping = TRUE;
+	pthread_cond_signal(&backupWake);
+	pthread_mutex_unlock(&backupMutex);
+
+	pthread_join(backupThread, NULL);
+	backupRunning = FALSE;
+}
+
+// *********************************************
+// ********* WELL-KNOWN FILE FOLLOWER **********
+// *********************************************
+
+// ONE PROCESS, WORKER 0 WITH PREFORK WORKERS, BRINGS EVERY CHANGE LOG ENTRY INTO THE TREE: OTHER WORKERS'
+// REGISTRATIONS AGAIN, LOCKS, AND EDITS AND DELETIONS MADE WITH THE sqlite3 SHELL. IT RECORDS HOW FAR IT GOT IN
+// <static_root>/.handled-sequence. WITHOUT THAT FILE IT WRITES EVERY USER FIRST, LIKE 'handled materialize'.
+static pthread_t staticThread;
+static pthread_mutex_t staticMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t staticWake = PTHREAD_COND_INITIALIZER;
+static int staticStopping = FALSE;
+static int staticRunning = FALSE;
+
+static int staticStopRequested (void)
+{
+	pthread_mutex_lock(&staticMutex);
+	int stopping = staticStopping;
+	pthread_mutex_unlock(&staticMutex);
+	return stopping;
+}
+
+// CHANGE LOG SEQUENCE THE TREE UNDER 'root' REFLECTS, OR -1 IF IT HAS NONE
+static long long staticReadSequence (const char *root)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/" STATIC_SEQUENCE_FILENAME, root);
+	FILE *file = fopen(path, "r");
+	if (!file) return -1;
+
+	long long sequence = -1;
+	if (fscanf(file, "%lld", &sequence) != 1 || sequence < 0) sequence = -1;
+	fclose(file);
+	return sequence;
+}
+
+static int staticWriteSequence (const char *root, long long sequence)
+{
+	char path[PATH_MAX], text[32];
+	snprintf(path, sizeof(path), "%s/" STATIC_SEQUENCE_FILENAME, root);
+	snprintf(text, sizeof(text), "%lld\n", sequence);
+	METRIC_SET(staticSequence, sequence);
+	return staticReplaceFile(path, text);
+}
+
+// WRITE EVERY USER'S FILE UNDER 'root' AND RECORD THE CHANGE LOG SEQUENCE, READ BEFORE THE USERS SO THE ENTRIES
+// AFTER IT COVER EVERY LATER CHANGE. FILES OF USERS REMOVED BEFORE ARE NOT DELETED. RETURNS THE NUMBER OF FILES
+// WRITTEN, OR -1 ON FAILURE OR WHEN THE DAEMON STOPS FIRST.
+long long materializeAllHandles (const char *root)
+{
+	if (mkdir(root, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "STATIC: Unable to create '%s': %s\n", root, strerror(errno));
+		return -1;
+	}
+	long long sequence = changeLogHead();
+	if (sequence < 0) return -1;
+
+	long long written = 0;
+	int failed = 0;
+	int files = shardCountGlobal > 0 ? shardCountGlobal : 1;
+	for (int i = 0; i < files && !failed; i++) {
+		sqlite3 *db = databaseOpen(shardCountGlobal > 0 ? shardDatabasesGlobal[i] : principalDatabaseGlobal);
+		if (!db) return -1;
+		sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT handle, did FROM did_plc_users;");
+		if (!stmt) {
+			sqlite3_close(db);
+			return -1;
+		}
+
+		int rc;
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && !(written % REPLICATION_BATCH == 0 && staticStopRequested())) {
+			const char *handle = (const char *)sqlite3_column_text(stmt, 0);
+			const char *did = (const char *)sqlite3_column_text(stmt, 1);
+			if (handle && validateDid(did) == KEY_VALID && materializeHandle(root, handle, did) == 0) written++;
+		}
+		if (rc != SQLITE_DONE) {
+			fprintf(stderr, "STATIC: Reading users failed: %s\n", sqlite3_errmsg(db));
+			failed = 1;
+		}
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
+	}
+
+	if (failed || staticWriteSequence(root, sequence) != 0) return -1;
+	return written;
+}
+
+// APPLY UP TO REPLICATION_BATCH CHANGE LOG ENTRIES AFTER 'after' TO THE TREE. A FILE THAT CANNOT BE WRITTEN IS
+// LOGGED AND SKIPPED, IT DOES NOT HOLD BACK THE OTHERS. '*count' GETS THE NUMBER OF ENTRIES READ.
+// RETURNS THE LAST SEQUENCE APPLIED ('after' IF NONE), CHANGE_LOG_TOO_OLD IF RETENTION PRUNED PAST 'after', OR -1 ON FAILURE.
+static long long staticApplyChanges (const char *root, long long after, int *count)
+{
+	*count = 0;
+	collectShardChanges();
+	sqlite3 *db = databaseOpen(changeLogDatabase());
+	if (!db) return -1;
+	if (changeLogTooOld(db, after)) {
+		sqlite3_close(db);
+		return CHANGE_LOG_TOO_OLD;
+	}
+	sqlite3_stmt *stmt = databasePrepareStatement(db, "SELECT sequence, operation, handle, did FROM did_plc_changes "
+														"WHERE sequence > ? ORDER BY sequence LIMIT ?;");
+	if (!stmt) {
+		sqlite3_close(db);
+		return -1;
+	}
+
+	long long sequence = after;
+	int rc = SQLITE_ERROR;
+	int lock = staticLockTree(root);
+	if (lock < 0) fprintf(stderr, "STATIC: Unable to lock '%s': %s\n", root, strerror(errno));
+	else if (sqlite3_bind_int64(stmt, 1, after) == SQLITE_OK && sqlite3_bind_int(stmt, 2, REPLICATION_BATCH) == SQLITE_OK) {
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+			const char *operation = (const char *)sqlite3_column_text(stmt, 1);
+			const char *handle = (const char *)sqlite3_column_text(stmt, 2);
+			const char *did = (const char *)sqlite3_column_text(stmt, 3);
+			sequence = sqlite3_column_int64(stmt, 0);
+			(*count)++;
+			if (!operation || !handle) continue;
+			if (strcmp(operation, "put") == 0 && validateDid(did) == KEY_VALID) materializeHandle(root, handle, did);
+			else if (strcmp(operation, "delete") == 0) materializeHandle(root, handle, NULL);
+		}
+	}
+	staticUnlockTree(lock);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "STATIC: Reading the change log failed: %s\n", sqlite3_errmsg(db));
+		sequence = -1;
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return sequence;
+}
 
-	#ifdef VERBOSE_FLAG
-	printf("Principal user table ready: '%s'\n", principalDatabaseGlobal);
-	#endif
+static void *staticFollowThread (void *unused)
+{
+	(void) unused;  /* Unused. Silent compiler warning. */
+
+	char *root = configFilePath(configGlobal.staticRoot);
+	if (!root) return NULL;
+
+	long long sequence = staticReadSequence(root);
+	if (sequence < 0) {
+		long long started = monotonicMicroseconds();
+		long long written = materializeAllHandles(root);
+		if (written >= 0) {
+			printf("Well-known files written for %lld handles in %.1f s.\n", written, (double)(monotonicMicroseconds() - started) / 1e6);
+			syslog(LOG_INFO, "Well-known files written for %lld handles", written);
+		}
+		sequence = staticReadSequence(root);
+	} else METRIC_SET(staticSequence, sequence);
+
+	pthread_mutex_lock(&staticMutex);
+	while (!staticStopping) {
+		pthread_mutex_unlock(&staticMutex);
+		int count = 0;
+		if (sequence < 0) {
+			// THE FIRST FULL WRITE FAILED, TRY AGAIN
+			if (materializeAllHandles(root) >= 0) sequence = staticReadSequence(root);
+		} else {
+			long long applied = staticApplyChanges(root, sequence, &count);
+			if (applied == CHANGE_LOG_TOO_OLD) {
+				// THE ENTRIES SINCE WERE PRUNED: WRITE EVERY FILE AGAIN. FILES OF USERS DELETED MEANWHILE STAY.
+				fprintf(stderr, "STATIC: The change log was pruned past sequence %lld, writing every file again\n", sequence);
+				sequence = -1;
+				count = REPLICATION_BATCH;
+			}
+			else if (applied > sequence) {
+				staticWriteSequence(root, applied);
+				sequence = applied;
+			}
+		}
+		pthread_mutex_lock(&staticMutex);
+
+		// A FULL BATCH MEANS MORE ENTRIES ARE WAITING
+		if (count == REPLICATION_BATCH) continue;
+
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += configGlobal.replicaInterval / 1000;
+		until.tv_nsec += (configGlobal.replicaInterval % 1000) * 1000000L;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		while (!staticStopping) {
+			if (pthread_cond_timedwait(&staticWake, &staticMutex, &until) == ETIMEDOUT) break;
+		}
+	}
+	pthread_mutex_unlock(&staticMutex);
 
-    // CLOSE THE DATABASE
-	sqlite3_free(err_msg);
-    sqlite3_close(db);
+	free(root);
+	return NULL;
+}
 
-	return DATABASE_SUCCESS;
+// FOLLOW THE CHANGE LOG INTO static_root, IF SET. ONE PROCESS DOES IT, WORKER 0 WITH PREFORK WORKERS.
+// RETURNS 0 ON SUCCESS, 1 ON FAILURE.
+int startStaticFiles (void)
+{
+	if (configGlobal.staticRoot[0] == '\0') return 0;
+
+	staticStopping = FALSE;
+	if (pthread_create(&staticThread, NULL, staticFollowThread, NULL) != 0) return 1;
+	staticRunning = TRUE;
+
+	printf("Writing well-known files under '%s'.\n", configGlobal.staticRoot);
+	syslog(LOG_INFO, "Writing well-known files under '%s'", configGlobal.staticRoot);
+	return 0;
 }
 
+void stopStaticFiles (void)
+{
+	if (!staticRunning) return;
 
-// INITIALIZE/REBUILD FILTER DATABASE
-// RETURNS DATABASE_SUCCESS 0 IF SUCESSFUL, DATABASE_ERROR 1 IF IT FAILED.
-int initializeFilterDatabase( ) {
-	char *err_msg = 0;
-    int rc;
-	
-    sqlite3 *db = databaseOpen( filterDatabaseGlobal );
-    if (!db) {
-        return DATABASE_ERROR;
-    }
-    
-	// RECREATE THE RESERVED HANDLE TABLE TO THE DB
-    const char *sqlCreateReserveLabelTable  =  "BEGIN TRANSACTION;"
-											"DROP TABLE IF EXISTS reservedHandleTable;"
-											"CREATE TABLE reservedHandleTable (word TEXT NOT NULL);"
-											"COMMIT;";
-
-    rc = sqlite3_exec(db, sqlCreateReserveLabelTable, 0, 0, &err_msg);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Reserved Label Table Creation Failed: %s\n", err_msg);
-		sqlite3_free(err_msg);
-		sqlite3_close(db);
-		return DATABASE_ERROR;
+	pthread_mutex_lock(&staticMutex);
+	staticStopping = TRUE;
+	pthread_cond_signal(&staticWake);
+	pthread_mutex_unlock(&staticMutex);
+
+	pthread_join(staticThread, NULL);
+	staticRunning = FALSE;
+}
+
+
+// *********************************************
+// ********* NATIVE TLS LISTENER ***************
+// *********************************************
+
+#ifdef HANDLED_TLS
+
+// ONE LOADED CERTIFICATE CHAIN AND KEY. RETIRED GENERATIONS STAY ALIVE UNTIL EXIT,
+// SINCE HANDSHAKES IN FLIGHT MAY STILL REFERENCE THEM (RELOADS ARE RARE).
+struct tlsCredentialStruct {
+	gnutls_pcert_st certificates[TLS_MAX_CHAIN_LENGTH];
+	unsigned int certificateCount;
+	gnutls_privkey_t key;
+	time_t certificateModified;
+	time_t keyModified;
+	struct tlsCredentialStruct *previous;
+};
+
+static struct tlsCredentialStruct *tlsCredentials = NULL;
+static pthread_mutex_t tlsCredentialMutex = PTHREAD_MUTEX_INITIALIZER;
+static time_t tlsLastReloadCheck = 0;
+static gnutls_datum_t tlsTicketKey = {NULL, 0};
+
+// MODIFICATION TIME OF A FILE, 0 IF IT CANNOT BE READ
+static time_t fileModifiedTime (const char *path)
+{
+	struct stat fileStatus;
+	if (!path || stat(path, &fileStatus) != 0) return 0;
+	return fileStatus.st_mtime;
+}
+
+// FREE ONE CREDENTIAL GENERATION
+static void freeTlsCredential (struct tlsCredentialStruct *credential)
+{
+	for (unsigned int i = 0; i < credential->certificateCount; i++) gnutls_pcert_deinit(&credential->certificates[i]);
+	if (credential->key) gnutls_privkey_deinit(credential->key);
+	free(credential);
+}
+
+// LOAD THE CERTIFICATE CHAIN AND PRIVATE KEY FROM DISK. RETURNS NULL ON FAILURE.
+static struct tlsCredentialStruct *loadTlsCredential (void)
+{
+	char *certificatePath = configFilePath(configGlobal.tlsCertificate);
+	char *keyPath = configFilePath(configGlobal.tlsKey);
+	gnutls_datum_t certificateData = {NULL, 0};
+	gnutls_datum_t keyData = {NULL, 0};
+	struct tlsCredentialStruct *credential = calloc(1, sizeof(struct tlsCredentialStruct));
+	int rc;
+
+	if (!certificatePath || !keyPath || !credential) {
+		fprintf(stderr, "ERROR: Memory allocation failed (loadTlsCredential)\n");
+		goto failure;
 	}
 
-    // Prepare the INSERT statement
-    const char *sqlInsertWord = "INSERT INTO reservedHandleTable (word) VALUES (?);";
-    sqlite3_stmt *stmt = databasePrepareStatement (db, sqlInsertWord);	
-	if (!stmt) {
-		fprintf(stderr, "Reserved Label Table Creation Failed: %s\n", err_msg);
-		return DATABASE_ERROR;
+	credential->certificateModified = fileModifiedTime(certificatePath);
+	credential->keyModified = fileModifiedTime(keyPath);
+
+	if ((rc = gnutls_load_file(certificatePath, &certificateData)) < 0) {
+		fprintf(stderr, "ERROR: Unable to read TLS certificate '%s': %s\n", certificatePath, gnutls_strerror(rc));
+		goto failure;
 	}
-	
-	const char *reservedHandleFile = buildAbsolutePath( baseDirectory, RESERVED_HANDLES_FILENAME );
-	if (!reservedHandleFile) {
-		fprintf(stderr, "Memory allocation failure (file name).\n");
-		return DATABASE_ERROR;
+
+	credential->certificateCount = TLS_MAX_CHAIN_LENGTH;
+	rc = gnutls_pcert_list_import_x509_raw(credential->certificates, &credential->certificateCount, &certificateData, GNUTLS_X509_FMT_PEM, 0);
+	if (rc < 0) {
+		fprintf(stderr, "ERROR: Unable to parse TLS certificate '%s': %s\n", certificatePath, gnutls_strerror(rc));
+		credential->certificateCount = 0;
+		goto failure;
 	}
 
-	#ifdef VERBOSE_FLAG
-	printf("Loading database from reserved handle list: %s\n", reservedHandleFile);
-	#endif	
-	
-    char line[512];		// Buffer for reading lines from the file
-    FILE *file = fopen(reservedHandleFile, "r");
-    if (!file) {
-        perror("Failed to open file reserved word list");
-		free((char *)reservedHandleFile);
-		reservedHandleFile = NULL;
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return DATABASE_ERROR;
-    }
+	if ((rc = gnutls_load_file(keyPath, &keyData)) < 0) {
+		fprintf(stderr, "ERROR: Unable to read TLS key '%s': %s\n", keyPath, gnutls_strerror(rc));
+		goto failure;
+	}
 
-    // Read lines from the file and insert them into the database
-    while (fgets(line, sizeof(line), file)) {
-        // Remove trailing newline character
-        line[strcspn(line, "\n")] = '\0';
+	if (gnutls_privkey_init(&credential->key) < 0 ||
+		(rc = gnutls_privkey_import_x509_raw(credential->key, &keyData, GNUTLS_X509_FMT_PEM, NULL, 0)) < 0) {
+		fprintf(stderr, "ERROR: Unable to parse TLS key '%s'\n", keyPath);
+		goto failure;
+	}
 
-		// Skip lines that start with '#', which are comments
-		if (line[0] == '#') {
-			continue;
-		}
+	syslog(LOG_INFO, "TLS certificate loaded: %s (%u certificates in chain)", certificatePath, credential->certificateCount);
+	gnutls_free(certificateData.data);
+	gnutls_free(keyData.data);
+	free(certificatePath);
+	free(keyPath);
+	return credential;
+
+failure:
+	if (credential) freeTlsCredential(credential);
+	gnutls_free(certificateData.data);
+	gnutls_free(keyData.data);
+	free(certificatePath);
+	free(keyPath);
+	return NULL;
+}
 
-        // Bind the line to the SQL statement
-        sqlite3_bind_text(stmt, 1, line, -1, SQLITE_STATIC);
+// RELOAD THE CERTIFICATE IF 'force' IS SET OR THE FILES CHANGED ON DISK. THE OLD ONE STAYS IN USE IF LOADING FAILS.
+int tlsReloadCredentials (int force)
+{
+	if (!force) {
+		char *certificatePath = configFilePath(configGlobal.tlsCertificate);
+		char *keyPath = configFilePath(configGlobal.tlsKey);
+		time_t certificateModified = fileModifiedTime(certificatePath);
+		time_t keyModified = fileModifiedTime(keyPath);
+		free(certificatePath);
+		free(keyPath);
+
+		pthread_mutex_lock(&tlsCredentialMutex);
+		int unchanged = tlsCredentials && tlsCredentials->certificateModified == certificateModified && tlsCredentials->keyModified == keyModified;
+		pthread_mutex_unlock(&tlsCredentialMutex);
+		if (unchanged) return 0;
+	}
 
-        // Execute the SQL statement
-        rc = sqlite3_step(stmt);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(db));
-        }
+	struct tlsCredentialStruct *credential = loadTlsCredential();
+	if (!credential) {
+		syslog(LOG_ERR, "TLS certificate reload failed, keeping the current certificate");
+		return 1;
+	}
 
-        // Reset the statement for the next iteration
-        sqlite3_reset(stmt);
-    }
+	pthread_mutex_lock(&tlsCredentialMutex);
+	credential->previous = tlsCredentials;
+	tlsCredentials = credential;
+	pthread_mutex_unlock(&tlsCredentialMutex);
 
-    // Clean up
-    fclose(file);
- 	free((char *)reservedHandleFile);
-	reservedHandleFile = NULL;
-	sqlite3_finalize(stmt);
+	printf("TLS: Certificate loaded.\n");
+	return 0;
+}
 
-	#ifdef VERBOSE_FLAG
-	printf("Reserved handle database is ready: %s\n", filterDatabaseGlobal);
-	#endif
+// GNUTLS CERTIFICATE CALLBACK, CALLED BY MHD ON EVERY HANDSHAKE. PICKS UP RENEWED CERTIFICATES WITHOUT A RESTART.
+static int tlsCertificateCallback (gnutls_session_t session, const gnutls_datum_t *req_ca_dn, int nreqs,
+									const gnutls_pk_algorithm_t *pk_algos, int pk_algos_length,
+									gnutls_pcert_st **pcert, unsigned int *pcert_length, gnutls_privkey_t *pkey)
+{
+	(void) session;          /* Unused. Silent compiler warning. */
+	(void) req_ca_dn;        /* Unused. Silent compiler warning. */
+	(void) nreqs;            /* Unused. Silent compiler warning. */
+	(void) pk_algos;         /* Unused. Silent compiler warning. */
+	(void) pk_algos_length;  /* Unused. Silent compiler warning. */
+
+	// CHECK THE FILES AT MOST EVERY TLS_RELOAD_CHECK_INTERVAL SECONDS
+	time_t now = time(NULL);
+	pthread_mutex_lock(&tlsCredentialMutex);
+	int checkFiles = now - tlsLastReloadCheck >= TLS_RELOAD_CHECK_INTERVAL;
+	if (checkFiles) tlsLastReloadCheck = now;
+	pthread_mutex_unlock(&tlsCredentialMutex);
+	if (checkFiles) tlsReloadCredentials(FALSE);
+
+	pthread_mutex_lock(&tlsCredentialMutex);
+	struct tlsCredentialStruct *credential = tlsCredentials;
+	pthread_mutex_unlock(&tlsCredentialMutex);
+	if (!credential) return -1;
+
+	*pcert = credential->certificates;
+	*pcert_length = credential->certificateCount;
+	*pkey = credential->key;
+	return 0;
+}
 
-    // CLOSE THE DATABASE
-	sqlite3_free(err_msg);
-    sqlite3_close(db);
+// ENABLE SESSION TICKETS ON EVERY NEW TLS CONNECTION, BEFORE ITS HANDSHAKE STARTS
+static void tlsConnectionNotify (void *cls, struct MHD_Connection *connection, void **socket_context,
+									enum MHD_ConnectionNotificationCode toe)
+{
+	(void) cls;             /* Unused. Silent compiler warning. */
+	(void) socket_context;  /* Unused. Silent compiler warning. */
 
-	return DATABASE_SUCCESS;
+	if (toe != MHD_CONNECTION_NOTIFY_STARTED || !tlsTicketKey.data) return;
+
+	const union MHD_ConnectionInfo *info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_GNUTLS_SESSION);
+	if (info && info->tls_session) gnutls_session_ticket_enable_server((gnutls_session_t)info->tls_session, &tlsTicketKey);
 }
 
+// LOAD CREDENTIALS AND THE SESSION TICKET KEY. CALLED ONCE BEFORE FORKING, SO PREFORK WORKERS SHARE THE TICKET KEY.
+int tlsInitialize (void)
+{
+	if (MHD_is_feature_supported(MHD_FEATURE_HTTPS_CERT_CALLBACK) != MHD_YES) {
+		fprintf(stderr, "ERROR: libmicrohttpd was built without HTTPS certificate callback support\n");
+		return 1;
+	}
 
-void freeNewRecordResult(newRecordResult *record) {
-    if (record) {
-        free(record->token);  // Free the token
-        free(record);         // Free the struct
-    }
+	if (tlsReloadCredentials(TRUE) != 0) return 1;
+	tlsLastReloadCheck = time(NULL);
+
+	// ONE TICKET KEY FOR ALL CONNECTIONS SO RETURNING CLIENTS SKIP THE FULL HANDSHAKE
+	if (gnutls_session_ticket_key_generate(&tlsTicketKey) < 0) {
+		fprintf(stderr, "WARNING: Unable to generate TLS session ticket key, session tickets disabled\n");
+		tlsTicketKey.data = NULL;
+	}
+
+	return 0;
 }
 
+// FREE ALL CREDENTIAL GENERATIONS AND THE TICKET KEY (CALLED AFTER THE TLS DAEMON STOPS)
+void freeTlsCredentials (void)
+{
+	while (tlsCredentials) {
+		struct tlsCredentialStruct *previous = tlsCredentials->previous;
+		freeTlsCredential(tlsCredentials);
+		tlsCredentials = previous;
+	}
 
-// TRY ADDING A NEW REPORT. RETURNS newRecordResult (result and token IF SUCCESSFUL). CONSIDER MAKING TOKEN INTO A POINTER.
-// HANDLE IS HOST, LABEL IS SUBDOMAIN
-newRecordResult *addNewRecord (const char *handle, const char *label, const char *did, const char *email) {
-	newRecordResult *newRecord = malloc(sizeof(newRecordResult));
-	
-	if (!newRecord) {
-		fprintf(stderr, "ERROR: Memory allocation failed\n");
-		return NULL;  // Signal failure to allocate memory
+	if (tlsTicketKey.data) {
+		gnutls_memset(tlsTicketKey.data, 0, tlsTicketKey.size);
+		gnutls_free(tlsTicketKey.data);
+		tlsTicketKey.data = NULL;
 	}
-	
-	newRecord->result = RECORD_ERROR_DATABASE;  // Default error status
-	newRecord->token = NULL;                    // NULL to indicate no token yet
+}
 
-	// ADD AN EMAIL DETAIL CHECKER HERE
+#endif // HANDLED_TLS
 
-    if (!handle || !label || !did ) {
-        newRecord->result = RECORD_NULL_DATA;
-        return newRecord;
-    }	
 
-    if ( strlen(handle) == 0 || strlen(label) == 0 || strlen(did) == 0 ) {
-        newRecord->result = RECORD_EMPTY_DATA;
-        return newRecord;
-    }	
-	
-	// VALIDATION
-	
-	// ADD HANDLE (HOST) VALIDATION, UNTIL THEN ASSUME IT IS OK
-	
-	if ( validateHandle(label) == KEY_INVALID ) {
-		newRecord->result = RECORD_INVALID_LABEL;
-		return newRecord;
-	}
+// *********************************************
+// ********* DAEMON LIFECYCLE ******************
+// *********************************************
 
-	if ( validateDid(did) == KEY_INVALID ) {
-		newRecord->result = RECORD_INVALID_DID;
-		return newRecord;
-	}
-	
-	// BASIC INFO VALID, CREATE TOKEN
-	char tempToken[TOKEN_LENGTH + 1]; // +1 for the null terminator
-	generateSecureToken(tempToken);
+// MHD OPTIONS COLLECTED FOR MHD_OPTION_ARRAY, SO OPTIONAL SETTINGS CAN BE ADDED CONDITIONALLY
+struct daemonOptionsStruct {
+	struct MHD_OptionItem items[DAEMON_MAX_OPTIONS + 1];	// +1 for MHD_OPTION_END
+	unsigned int count;
+};
 
-    sqlite3 *db = databaseOpen(principalDatabaseGlobal);
-    if (!db) return newRecord;
+// EVERY LISTENER RUN BY ONE PROCESS
+struct daemonSetStruct {
+	struct MHD_Daemon *http;
+	struct MHD_Daemon *admin;
+	struct MHD_Daemon *tls;
+	int sharedListeners;		// Another live process accepts on the same sockets, leave its backlog alone
+};
 
-    // SQL STATEMENT WITH PLACEHOLDERS FOR THE PARAMETERS
-	// ALL VALUES ARE NORMALIZED TO LOWERCASE EXCEPT FOR TOKEN
-    const char *insertUserRecordSql = 
-        "INSERT INTO did_plc_users (handle, did, label, domain, token, email) "
-        "VALUES (LOWER(?), LOWER(?), LOWER(?), LOWER(?), ?, ?);";
+// PREFORK WORKER SLOT TRACKED BY THE SUPERVISOR
+struct workerStruct {
+	pid_t pid;					// 0 when not running
+	time_t started;
+	time_t restartAt;
+};
 
-	// PREPARE SQL STATEMENT
-    sqlite3_stmt *stmt = databasePrepareStatement (db, insertUserRecordSql);	
-	if (!stmt) return newRecord;
+// LISTENING SOCKETS HANDED OVER BY SYSTEMD SOCKET ACTIVATION OR BY A PREDECESSOR
+struct inheritedSocketsStruct {
+	MHD_socket http;
+	MHD_socket tls;
+};
 
-    // Bind parameters to the prepared statement using databaseBindKey
-    if (databaseBindKey(stmt, 1, handle, db) != SQLITE_OK || databaseBindKey(stmt, 2, did, db) != SQLITE_OK ||
-		databaseBindKey(stmt, 3, label, db) != SQLITE_OK || databaseBindKey(stmt, 4, domainName, db) != SQLITE_OK ||
-        databaseBindKey(stmt, 5, tempToken, db) != SQLITE_OK || databaseBindKey(stmt, 6, email, db) != SQLITE_OK)
-	{
-		fprintf(stderr, "ERROR: Unable to prepare SQL statement: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
-        sqlite3_close(db);
-		return newRecord;
-	}
+static struct inheritedSocketsStruct inheritedSockets = { MHD_INVALID_SOCKET, MHD_INVALID_SOCKET };
 
-    // Execute the statement
-    int rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-		if (rc == SQLITE_CONSTRAINT) {
-			newRecord->result = RECORD_ERROR_DUPLICATE_DATA;
-			fprintf(stderr, "ERROR: Duplicate account found, unable to process: %s\n", sqlite3_errmsg(db));
-		}
-        else fprintf(stderr, "ERROR: New record creation failed (%d): %s\n", rc, sqlite3_errmsg(db));
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-		return newRecord;
-    }
+// LIFECYCLE FLAGS SET BY THE SIGNAL HANDLER, CHECKED BY THE MAIN LOOPS
+static volatile sig_atomic_t stopRequested = 0;			// SIGTERM, SIGINT
+static volatile sig_atomic_t reloadRequested = 0;		// SIGHUP
+static volatile sig_atomic_t upgradeRequested = 0;		// SIGUSR2
+static volatile sig_atomic_t successorReady = 0;		// SIGUSR1, SENT BY OUR SUCCESSOR
+static volatile sig_atomic_t childExited = 0;			// SIGCHLD
 
-    // Dynamically allocate memory for the token
-    newRecord->token = strndup(tempToken, TOKEN_LENGTH + 1); // Ensure caller frees this memory
-    if (!newRecord->token) {
-        fprintf(stderr, "ERROR: Memory allocation for token failed\n");
-        free(newRecord);  // Clean up previously allocated memory
-        return NULL;
-    }
-    newRecord->result = RECORD_VALID; // Ensure caller frees this memory
-	printf("New record created successfully: %s\n", handle);
+static char **savedArgv = NULL;							// Used to re-execute a successor
 
-    // Finalize the statement and close the database
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+// APPEND ONE OPTION. 'value' CARRIES NUMBERS AND CALLBACKS, 'pointer' CARRIES DATA AND CALLBACK CLOSURES.
+static void daemonOption (struct daemonOptionsStruct *options, enum MHD_OPTION option, intptr_t value, void *pointer)
+{
+	if (options->count >= DAEMON_MAX_OPTIONS) {
+		fprintf(stderr, "ERROR: Too many daemon options, raise DAEMON_MAX_OPTIONS\n");
+		return;
+	}
 
-    return newRecord;
+	options->items[options->count].option = option;
+	options->items[options->count].value = value;
+	options->items[options->count].ptr_value = pointer;
+	options->count++;
+	options->items[options->count].option = MHD_OPTION_END;
+	options->items[options->count].value = 0;
+	options->items[options->count].ptr_value = NULL;
 }
 
+// OPTIONS SHARED BY ALL LISTENERS. AN INHERITED SOCKET IS USED AS IS, OTHERWISE PREFORK WORKERS
+// BIND THE SAME PORT WITH SO_REUSEPORT.
+static void daemonCommonOptions (struct daemonOptionsStruct *options, int reusePort, MHD_socket inherited)
+{
+	options->count = 0;
+	options->items[0].option = MHD_OPTION_END;
+	if (inherited != MHD_INVALID_SOCKET) daemonOption(options, MHD_OPTION_LISTEN_SOCKET, inherited, NULL);
+	else if (reusePort) daemonOption(options, MHD_OPTION_LISTENING_ADDRESS_REUSE, 1, NULL);
+}
 
-// QUERY PRINCIPAL DATABASE FOR EXISTENCE OF SPECIFIC 'handle' (FULL HOST NAME)
-int handleRegistered(const char *handle) {
-	const char *sql = "SELECT 1 FROM did_plc_users WHERE handle = ? LIMIT 1;";
-    return databaseGenericSingularQuery(principalDatabaseGlobal, sql, handle);
+// CONNECTION LIMITS, TIMEOUTS AND I/O THREADS FOR THE PUBLIC LISTENERS
+static void daemonAdmissionOptions (struct daemonOptionsStruct *options)
+{
+	if (configGlobal.ioThreads > 1) daemonOption(options, MHD_OPTION_THREAD_POOL_SIZE, configGlobal.ioThreads, NULL);
+	daemonOption(options, MHD_OPTION_CONNECTION_LIMIT, configGlobal.maxConnections, NULL);
+	if (configGlobal.maxConnectionsPerIp > 0) daemonOption(options, MHD_OPTION_PER_IP_CONNECTION_LIMIT, configGlobal.maxConnectionsPerIp, NULL);
+	daemonOption(options, MHD_OPTION_CONNECTION_TIMEOUT, configGlobal.idleTimeout, NULL);
+	daemonOption(options, MHD_OPTION_CONNECTION_MEMORY_LIMIT, configGlobal.connectionMemory, NULL);
 }
 
+// START THE PLAIN HTTP LISTENER THE REVERSE PROXY FORWARDS TO
+static struct MHD_Daemon *startHttpDaemon (int reusePort)
+{
+	struct daemonOptionsStruct options;
+	daemonCommonOptions(&options, reusePort, inheritedSockets.http);
+	daemonOption(&options, MHD_OPTION_NOTIFY_COMPLETED, (intptr_t)&requestCompleted, NULL);
+	daemonAdmissionOptions(&options);
+
+	// TO DO, ADD MHD_OPTION_STRICT_FOR_CLIENT OF 1 FOR STRICT HOST DETAILS
+/* 	daemon = MHD_start_daemon (MHD_USE_AUTO | MHD_USE_THREAD_PER_CONNECTION, PORT,
+							 NULL, NULL,  // No client connect/disconnect callbacks
+							 &requestHandler, NULL,  // Request handler
+							 MHD_OPTION_NOTIFY_COMPLETED, requestCompleted,
+							 NULL, MHD_OPTION_END); */
+	// MHD_USE_ITC IS REQUIRED BY MHD_quiesce_daemon FOR A GRACEFUL STOP
+	// MHD_ALLOW_SUSPEND_RESUME (WHICH INCLUDES MHD_USE_ITC) LETS THE REGISTRATION LANE PARK CONNECTIONS
+	return MHD_start_daemon (MHD_USE_AUTO | MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_ITC | MHD_ALLOW_SUSPEND_RESUME, configGlobal.port,
+							 &acceptPolicy, NULL,  // Blocklist
+							 &requestHandler, NULL,  // Request handler
+							 MHD_OPTION_ARRAY, options.items,
+							 MHD_OPTION_END);
+}
 
-// QUERY FILTER DATABASE FOR EXISTENCE OF SPECIFIC 'word' (LABEL/SUBDOMAIN)
-int labelReserved(const char *word) {
-    const char *sql = "SELECT 1 FROM reservedHandleTable WHERE word = ? LIMIT 1;";
-    return databaseGenericSingularQuery(filterDatabaseGlobal, sql, word);
+// START THE ADMIN LISTENER ON THE LOOPBACK INTERFACE ONLY. ALWAYS SO_REUSEPORT, SO A SUCCESSOR CAN BIND IT EARLY.
+static struct MHD_Daemon *startAdminDaemon (void)
+{
+	static struct sockaddr_in adminAddress;
+	memset(&adminAddress, 0, sizeof(adminAddress));
+	adminAddress.sin_family = AF_INET;
+	adminAddress.sin_port = htons(configGlobal.adminPort);
+	adminAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	struct daemonOptionsStruct options;
+	daemonCommonOptions(&options, TRUE, MHD_INVALID_SOCKET);
+	daemonOption(&options, MHD_OPTION_SOCK_ADDR, 0, &adminAddress);
+	daemonOption(&options, MHD_OPTION_NOTIFY_COMPLETED, (intptr_t)&adminRequestCompleted, NULL);
+
+	return MHD_start_daemon (MHD_USE_AUTO | MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_ITC, configGlobal.adminPort,
+							 NULL, NULL,
+							 &adminRequestHandler, NULL,
+							 MHD_OPTION_ARRAY, options.items,
+							 MHD_OPTION_END);
 }
 
+#ifdef HANDLED_TLS
+// START THE HTTPS LISTENER ON configGlobal.tlsPort (CALL tlsInitialize FIRST)
+static struct MHD_Daemon *startTlsDaemon (int reusePort)
+{
+	struct daemonOptionsStruct options;
+	daemonCommonOptions(&options, reusePort, inheritedSockets.tls);
+	daemonOption(&options, MHD_OPTION_NOTIFY_COMPLETED, (intptr_t)&requestCompleted, NULL);
+	daemonAdmissionOptions(&options);
+	daemonOption(&options, MHD_OPTION_NOTIFY_CONNECTION, (intptr_t)&tlsConnectionNotify, NULL);
+	daemonOption(&options, MHD_OPTION_HTTPS_CERT_CALLBACK, 0, (void *)(intptr_t)&tlsCertificateCallback);	// MHD READS THIS ONE FROM ptr_value
+	daemonOption(&options, MHD_OPTION_HTTPS_PRIORITIES, 0, configGlobal.tlsPriorities);
+
+	return MHD_start_daemon (MHD_USE_AUTO | MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_ITC | MHD_ALLOW_SUSPEND_RESUME | MHD_USE_TLS, configGlobal.tlsPort,
+							 &acceptPolicy, NULL,
+							 &requestHandler, NULL,
+							 MHD_OPTION_ARRAY, options.items,
+							 MHD_OPTION_END);
+}
+#endif
 
-// QUERY DATABASE FOR A VALID IDENTIFIER ASSOCIATED WITH HANDLE
-const char* queryForDid (const char *handle) {
-	#ifdef VERBOSE_FLAG
-	printf("VERBOSE: Begin queryForDid for handle '%s'.\n", handle);
-	#endif	
+// STOP EVERY LISTENER THAT IS RUNNING
+void stopDaemons (struct daemonSetStruct *daemons)
+{
+	// FINISH AND RESUME SUSPENDED REGISTRATIONS FIRST
+	stopRegistrationLane ();
+	stopReplication ();
+	stopDns ();
+
+	if (daemons->http) MHD_stop_daemon (daemons->http);
+	if (daemons->admin) MHD_stop_daemon (daemons->admin);
+	if (daemons->tls) MHD_stop_daemon (daemons->tls);
+	daemons->http = daemons->admin = daemons->tls = NULL;
+}
 
-	// OPEN DATABASE
-    sqlite3 *db = databaseOpen(principalDatabaseGlobal);
-	if (!db) return NULL;
+// START EVERY CONFIGURED LISTENER. RETURNS 0 ON SUCCESS, 1 IF A REQUIRED LISTENER FAILED.
+int startDaemons (struct daemonSetStruct *daemons, int reusePort)
+{
+	daemons->http = daemons->admin = daemons->tls = NULL;
+	daemons->sharedListeners = reusePort && inheritedSockets.http != MHD_INVALID_SOCKET;
+
+	// REGISTRATION THREADS BELONG TO THIS PROCESS, SO THEY START AFTER ANY FORK
+	if (startRegistrationLane() != 0) {
+		stopRegistrationLane ();
+		logErrorAndExit ("Failed to start registration threads");
+		return 1;
+	}
 
-	// PREPARE SQL STATEMENT
-    const char *sql = "SELECT did FROM did_plc_users WHERE handle = ?";
-    sqlite3_stmt *stmt = databasePrepareStatement (db, sql);	
-	if (!stmt) return NULL;
+	// THE INDEX IS FOLLOWED BY THE PROCESS WRITING IT, A REPLICA'S FROM THE PRIMARY
+	if (handleIndexLoaded && handleIndexWriter && startReplication() != 0) {
+		stopRegistrationLane ();
+		logErrorAndExit ("Failed to start replication");
+		return 1;
+	}
 
-	// BIND HANDLE KEY TO PREPARED SQL STATEMENT (1 IS SUCCESS)
-    if ( databaseBindKey(stmt, 1, handle, db) != SQLITE_OK ) {
-        sqlite3_finalize(stmt);
-		sqlite3_close(db);
-        return NULL;
-    }
+	daemons->http = startHttpDaemon (reusePort);
+	if (NULL == daemons->http) {
+		stopRegistrationLane ();
+		stopReplication ();
+		logErrorAndExit ("Failed to start HTTP daemon");
+		return 1;
+	}
 
-	// REMEMBER TO FREE RESULT
-	char *result = NULL;
-	
-    // Execute SQL statement
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        const char *tempResult = (const char *)sqlite3_column_text(stmt, 0);
-        // Validate and copy the result
-        if (tempResult && validateDid(tempResult) != KEY_INVALID) {
-            result = strndup(tempResult, MAX_SIZE_DID_PLC + 1);
-            if (!result) fprintf(stderr, "ERROR: Failed to allocate memory for DID result buffer.\n");
-        } else fprintf(stderr, "ERROR: DID value for handle '%s' is null or invalid. Remove record.\n", handle);
-    }
-	
-    // Clean up
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+	// START THE LOCAL ADMIN LISTENER (METRICS). THE DAEMON STILL SERVES TRAFFIC WITHOUT IT.
+	daemons->admin = startAdminDaemon ();
+	if (NULL == daemons->admin) {
+		fprintf(stderr, "WARNING: Failed to start admin listener on 127.0.0.1:%d\n", configGlobal.adminPort);
+		syslog(LOG_WARNING, "Failed to start admin listener on 127.0.0.1:%d", configGlobal.adminPort);
+	}
 
-	#ifdef VERBOSE_FLAG
-	if (result) printf("VERBOSE: queryForDid found 'did' result for handle '%s': '%s'.\n", handle, result);
-	else printf("VERBOSE: No result found for handle '%s'.\n", handle);
-	#endif	
+	// ANSWER _atproto TXT QUERIES FROM THE HANDLE INDEX, IF ENABLED
+	if (configGlobal.dnsEnabled && startDns() != 0) {
+		stopDaemons (daemons);
+		logErrorAndExit ("Failed to start DNS responder");
+		return 1;
+	}
+
+	// START THE NATIVE HTTPS LISTENER, IF ENABLED
+	#ifdef HANDLED_TLS
+	if (configGlobal.tlsEnabled) {
+		daemons->tls = startTlsDaemon (reusePort);
+		if (NULL == daemons->tls) {
+			stopDaemons (daemons);
+			logErrorAndExit ("Failed to start HTTPS daemon");
+			return 1;
+		}
+		printf("HTTPS listener running on port %d.\n", configGlobal.tlsPort);
+		syslog(LOG_INFO, "HTTPS listener running on port %d", configGlobal.tlsPort);
+	}
+	#endif
 
-    return result; // CALLER MUST FREE THE RESULT
+	return 0;
 }
 
+// STOP ACCEPTING ON ONE LISTENER. A PRIVATE SOCKET MAY STILL HOLD QUEUED CONNECTIONS, WHICH ARE
+// HANDED TO MHD INSTEAD OF BEING RESET WHEN THE SOCKET CLOSES.
+static void quiesceDaemon (struct MHD_Daemon *daemon, int acceptBacklog)
+{
+	if (!daemon) return;
 
-// ************************************
-// ********* SERVER FUNCTIONS *********
-// ************************************
-
+	MHD_socket listenSocket = MHD_quiesce_daemon(daemon);
+	if (listenSocket == MHD_INVALID_SOCKET) return;
 
-// SENDS AN HTML ERROR RESPONSE WITH A CUSTOM MESSAGE
-// TO DO: MAKE SURE THE STATIC_ERROR IS A ABSOLUTE PATH
-static enum MHD_Result sendErrorResponse (struct MHD_Connection *connection, const char *message)
-{
-	#ifdef VERBOSE_FLAG
-	printf("RESPONSE: '%s' with '%s'\n", message, STATIC_ERROR);
-	#endif
-	
-	enum MHD_Result ret;
-	struct MHD_Response *response;
-	char *htmlContent;	
-	char *responseContent;
+	if (acceptBacklog && fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL) | O_NONBLOCK) == 0) {
+		struct sockaddr_storage clientAddress;
+		socklen_t addressLength = sizeof(clientAddress);
+		int client;
 
-	htmlContent = readFile(STATIC_ERROR);
-	if (!htmlContent) {
-		fprintf(stderr, "ERROR: Failed to access file '%s' (sendErrorResponse)\n", STATIC_ERROR);
-		return MHD_NO; // SIGNAL FAILURE TO READ FILE
+		while ((client = accept(listenSocket, (struct sockaddr *)&clientAddress, &addressLength)) >= 0) {
+			MHD_add_connection(daemon, client, (struct sockaddr *)&clientAddress, addressLength);
+			addressLength = sizeof(clientAddress);
+		}
 	}
 
-	responseContent = replacePlaceholder(htmlContent, PLACEHOLDER_ERROR, message);
-	free(htmlContent);
-	if (!responseContent) {
-        fprintf(stderr, "ERROR: Failed to replace placeholder in file content (sendErrorResponse)\n");
-		return MHD_NO; // SIGNAL FAILURE TO ALLOCATE MEMORY
-	}
-	
-	response = MHD_create_response_from_buffer(strlen(responseContent), (void *)responseContent, MHD_RESPMEM_MUST_FREE );
-	if (!response) {
-		fprintf(stderr, "ERROR: Memory allocation failed (sendErrorResponse)\n");
-		free(responseContent); // Must free, MHD_RESPMEM_MUST_FREE did not work
-		return MHD_NO; // SIGNAL FAILURE TO ALLOCATE MEMORY
-	}
+	close(listenSocket);
+}
 
-	// Add content type header to response
-	MHD_add_response_header(response, "Content-Type", CONTENT_HTML);
+// OPEN CONNECTIONS ACROSS ALL LISTENERS
+static unsigned int openConnections (struct daemonSetStruct *daemons)
+{
+	struct MHD_Daemon *list[] = { daemons->http, daemons->tls, daemons->admin };
+	unsigned int total = 0;
 
-	// Queue the response
-	ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	for (size_t i = 0; i < sizeof(list) / sizeof(list[0]); i++) {
+		if (!list[i]) continue;
+		const union MHD_DaemonInfo *info = MHD_get_daemon_info(list[i], MHD_DAEMON_INFO_CURRENT_CONNECTIONS);
+		if (info) total += info->num_connections;
+	}
 
-	// Clean up
-	MHD_destroy_response(response);
-	
-	return ret;
+	return total;
 }
 
-// SEND FILE WITH SPECIFIC CONTENT-TYPE HEADER (HTML, PLAIN TEXT, CSV, JSON, ETC)
-static enum MHD_Result sendFileResponse (struct MHD_Connection *connection, const char *filename, const char *contentType)
+// GRACEFUL STOP: CLOSE THE LISTENERS, LET IN-FLIGHT REQUESTS FINISH FOR UP TO configGlobal.drainTimeout SECONDS, THEN STOP
+void drainDaemons (struct daemonSetStruct *daemons)
 {
-	enum MHD_Result ret;
-	struct MHD_Response *response;
-		
-    char *htmlContent = readFile(filename);
-    if (!htmlContent) {
-        return MHD_NO; // Return failure if file reading failed
-    }
-
-    response = MHD_create_response_from_buffer(strlen(htmlContent), (void *)htmlContent, MHD_RESPMEM_MUST_FREE);
-	if (! response) {
-		free(htmlContent); // Cleanup in case of failure
-		return MHD_NO; 
-	}
+	int acceptBacklog = !daemons->sharedListeners;
 
-	// Add content type header to response
-	if (contentType != NULL) MHD_add_response_header(response, "Content-Type", contentType);
+	quiesceDaemon(daemons->http, acceptBacklog);
+	quiesceDaemon(daemons->tls, acceptBacklog);
+	quiesceDaemon(daemons->admin, TRUE);
 
-	// Queue the response
-	if (strcmp(filename, STATIC_NOTFOUND) == 0) ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
-	else ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	time_t deadline = time(NULL) + configGlobal.drainTimeout;
+	unsigned int remaining;
+	while ((remaining = openConnections(daemons)) > 0 && time(NULL) < deadline) {
+		struct timespec pause = {0, 100000000};	// 100 ms
+		nanosleep(&pause, NULL);
+	}
 
-	// Clean up
-	MHD_destroy_response(response);
+	if (remaining > 0) syslog(LOG_WARNING, "Drain timeout reached, closing %u connections", remaining);
+	else syslog(LOG_INFO, "All connections drained");
 
-	return ret;
+	stopDaemons(daemons);
 }
 
-// SEND THE RESPONSE TO THE WELL-KNOWN DID PLC METHOD
-// TO DO: CHANGE FROM LABEL/SEGMENT TO FULL HANDLE
-static enum MHD_Result sendWellKnownResponse (struct MHD_Connection *connection, const char *handle, const char *label)
+// SIGNAL HANDLER FOR EVERY LIFECYCLE SIGNAL, THE MAIN LOOPS CHECK THE FLAGS
+static void lifecycleSignalHandler (int signalNumber)
 {
-	// QUERY DATABASE FOR *VALID* DID PLC ASSOCIATED WITH 'label'
-	const char *tempDid = queryForDid(handle);
-	struct MHD_Response *response;
-	enum MHD_Result ret;
-	
-	if (tempDid != NULL ) { 
-		// CONFIRM DID EXISTS AND SEND IT AS PLAIN TEXT
-		if (DEBUG_FLAG) printf("REQUEST: DID found for handle '%s': %s\n", handle, tempDid);	
+	switch (signalNumber) {
+		case SIGTERM:
+		case SIGINT:  stopRequested = 1; break;
+		case SIGHUP:  reloadRequested = 1; break;
+		case SIGUSR2: upgradeRequested = 1; break;
+		case SIGUSR1: successorReady = 1; break;
+		case SIGCHLD: childExited = 1; break;
+	}
+}
 
-		// MHD TAKES OWNERSHIP OF tempDid AND WILL FREE IT   
-		// response = MHD_create_response_from_buffer (strlen (tempDid), (void *)tempDid, MHD_RESPMEM_MUST_COPY);
-		response = MHD_create_response_from_buffer (strlen (tempDid), (void *)tempDid, MHD_RESPMEM_MUST_FREE);
-		if (!response) {
-			free((char *)tempDid);
-			return logMHDError ("Memory allocation failed for well-known response (DID found)");
-		}
-		// Log response
-		syslog(LOG_INFO, "REQUEST: Responded with valid DID for handle '%s': %s", handle, tempDid);			
-		// Add text content type header to response
-		MHD_add_response_header( response, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_TEXT );
-		// Queue the response
-		ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-		// Clean up
-		MHD_destroy_response(response);
-		return ret; // tempDid FREED BY MHD
+// INSTALL THE LIFECYCLE HANDLERS AND BLOCK THOSE SIGNALS. THEY ARE ONLY DELIVERED INSIDE pselect/sigsuspend
+// WITH THE RETURNED MASK, SO NO FLAG CAN BE MISSED, AND MHD THREADS STARTED AFTERWARDS NEVER SEE THEM.
+static void installLifecycleHandlers (sigset_t *waitMask)
+{
+	int signals[] = { SIGTERM, SIGINT, SIGHUP, SIGUSR1, SIGUSR2, SIGCHLD };
+	sigset_t blocked;
+	struct sigaction action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = lifecycleSignalHandler;
+	sigemptyset(&action.sa_mask);
+	sigemptyset(&blocked);
+
+	for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+		sigaction(signals[i], &action, NULL);
+		sigaddset(&blocked, signals[i]);
 	}
 
-	// THIS IS WHERE THE MIRRORING HAPPENS
-	// *******************************
+	// A BROKEN CLIENT CONNECTION MUST NOT KILL THE PROCESS
+	signal(SIGPIPE, SIG_IGN);
 
-/*     // Calculate the length of the new string
-    size_t newLength = strlen(handle) + strlen(".bsky.social") + 1;
+	pthread_sigmask(SIG_BLOCK, &blocked, waitMask);
+	for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) sigdelset(waitMask, signals[i]);
+}
 
-    // Allocate memory for the new string
-    char *fullURL = malloc(newLength);
-    if (fullURL == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        return MHD_NO;
-    }
+// WAIT FOR A SIGNAL, A LINE ON STDIN OR 'timeoutSeconds'. RETURNS TRUE IF 'q' WAS ENTERED.
+// 'extraFd' (OR -1) IS ALSO WATCHED AND REPORTED THROUGH 'extraReady'.
+static int waitForLifecycleEvent (const sigset_t *waitMask, int *stdinOpen, int timeoutSeconds, int extraFd, int *extraReady)
+{
+	fd_set readSet;
+	int highest = -1;
 
-    // Concatenate the strings
-    strcpy(fullURL, label);
-    strcat(fullURL, ".bsky.social");
+	FD_ZERO(&readSet);
+	if (*stdinOpen) {
+		FD_SET(STDIN_FILENO, &readSet);
+		highest = STDIN_FILENO;
+	}
+	if (extraFd >= 0) {
+		FD_SET(extraFd, &readSet);
+		if (extraFd > highest) highest = extraFd;
+	}
+	if (extraReady) *extraReady = FALSE;
 
-    // Output the result
-    if (DEBUG_FLAG) printf("Full bsky.social label: %s\n", fullURL);
+	struct timespec timeout = {timeoutSeconds, 0};
+	if (pselect(highest + 1, &readSet, NULL, NULL, timeoutSeconds >= 0 ? &timeout : NULL, waitMask) <= 0) return FALSE;
 
-	const char *temp2DID = getWellKnownDID(fullURL);
-	if (temp2DID) {
-		if (DEBUG_FLAG) printf("POST: DID:PLC found via CURL: %s\n", temp2DID);
+	if (extraFd >= 0 && FD_ISSET(extraFd, &readSet) && extraReady) *extraReady = TRUE;
 
-	     // MHD TAKES OWNERSHIP OF temp2Did AND WILL FREE IT   
-		// response = MHD_create_response_from_buffer (strlen (tempDid), (void *)tempDid, MHD_RESPMEM_MUST_COPY);
-		response = MHD_create_response_from_buffer (strlen (temp2DID), (void *)temp2DID, MHD_RESPMEM_MUST_FREE);
-		if (!response) {
-			free((char *) temp2DID);
-			free((char *) fullURL);
-			return MHD_NO;
+	if (*stdinOpen && FD_ISSET(STDIN_FILENO, &readSet)) {
+		char input[64];
+		ssize_t length = read(STDIN_FILENO, input, sizeof(input));
+		if (length <= 0) *stdinOpen = FALSE;		// EOF, E.G. RUNNING WITHOUT A TERMINAL
+		else if (input[0] == 'q') {
+			printf("Exiting Handler daemon...\n");
+			return TRUE;
 		}
-		// Add text content type header to response
-		MHD_add_response_header( response, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_TEXT );
-		// Queue the response
-		ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-		// Clean up
-		MHD_destroy_response(response);
-		free((char *) fullURL);
-		return ret; // temp2DID FREED BY MHD	
-	} else {
-		if (DEBUG_FLAG) printf("POST: No Valid DID:PLC found via CURL: '%s'\n", temp2DID);
 	}
-	
-    // Free the allocated memory
-    free((char *) fullURL); */
 
-	// *******************************
+	return FALSE;
+}
 
-    // HANDLE CASE WHERE DID IS NOT FOUND	
-    if (DEBUG_FLAG) printf("REQUEST: DID not found for handle '%s', sending HTTP 404\n", handle);
-	
-	response = MHD_create_response_from_buffer (strlen (userNotFoundPage), (void *)userNotFoundPage, MHD_RESPMEM_PERSISTENT);	
-	if (!response) return logMHDError ("Memory allocation failed for well-known response (DID not found)");
-	// Log response
-	syslog(LOG_INFO, "REQUEST: No DID found for for handle '%s', sending HTTP 404", handle);
-	MHD_add_response_header( response, MHD_HTTP_HEADER_CONTENT_TYPE, CONTENT_HTML );		
-	ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
-	// Clean up
-	MHD_destroy_response(response);
+// SEND A STATE STRING TO SYSTEMD (Type=notify), IF NOTIFY_SOCKET IS SET
+static void notifySystemd (const char *state)
+{
+	const char *socketPath = getenv(ENV_NOTIFY_SOCKET);
+	if (!socketPath || (socketPath[0] != '/' && socketPath[0] != '@')) return;
 
-	return ret;
+	struct sockaddr_un address;
+	size_t pathLength = strlen(socketPath);
+	if (pathLength >= sizeof(address.sun_path)) return;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, socketPath, pathLength);
+	if (address.sun_path[0] == '@') address.sun_path[0] = '\0';	// ABSTRACT NAMESPACE
+
+	int notifySocket = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (notifySocket < 0) return;
+
+	sendto(notifySocket, state, strlen(state), 0, (struct sockaddr *)&address, offsetof(struct sockaddr_un, sun_path) + pathLength);
+	close(notifySocket);
 }
 
-// SEND THE RESPONSE TO A NEW USER REQUEST
-// TO DO: CHANGE FROM LABEL/SEGMENT TO FULL HANDLE
-static enum MHD_Result sendNewUserResponse (struct MHD_Connection *connection, const char *handle, const char *label, const char *did, const char *email)
+// EVERY LISTENER IS UP AND CACHES ARE WARM: TELL THE PROCESS WE REPLACE AND SYSTEMD
+static void announceReady (void)
 {
-	if ( !handle || !label || !did || !email )
-	{
-		fprintf(stderr, "ERROR: Incomplete user information (sendNewUserResponse)\n");
-		return MHD_NO; // SIGNAL PROCESSING INFORMATION
+	char state[64];
+	const char *predecessor = getenv(ENV_PREDECESSOR_PID);
+
+	if (predecessor) {
+		pid_t predecessorPid = (pid_t)atoi(predecessor);
+		if (predecessorPid > 1) kill(predecessorPid, SIGUSR1);
+		unsetenv(ENV_PREDECESSOR_PID);
+		snprintf(state, sizeof(state), "READY=1\nMAINPID=%d", (int)getpid());
+		syslog(LOG_INFO, "Ready, predecessor %d can drain", (int)predecessorPid);
+	} else {
+		snprintf(state, sizeof(state), "READY=1");
 	}
 
-	#ifdef VERBOSE_FLAG
-	printf("RESPONSE: New Record Attempt for: handle=%s, label=%s, did=%s, email=%s\n", handle, label, did, email);
-	#endif
+	notifySystemd(state);
+}
 
-	newRecordResult *record = addNewRecord(handle, label, did, email);
-	if (!record)
-	{
-		fprintf(stderr, "ERROR: Unable to create new record result (sendNewUserResponse)\n");
-		return MHD_NO; // SIGNAL FAILURE TO ALLOCATE MEMORY
-	}
-	
-	if ( record->result != RECORD_VALID)
-	{
-		printf("ERROR: Unable to create new user record.\n"); //DEBUG
-		const char *errorMessage;
-		
-		switch (record->result) {
-			case RECORD_INVALID_DID:
-				errorMessage = ERROR_INVALID_DID;
-				break;		
-			case RECORD_INVALID_HANDLE:
-				errorMessage = ERROR_INVALID_HANDLE;
-				break;
-			case RECORD_INVALID_LABEL:
-				errorMessage = ERROR_INVALID_LABEL;
-				break;			
-			case RECORD_NULL_DATA:  // CONSOLIDATED HANDLING
-			case RECORD_EMPTY_DATA:
-				errorMessage = ERROR_NULL_OR_EMPTY_DATA;
-				break;
-			case RECORD_ERROR_DATABASE:
-				errorMessage = ERROR_DATABASE;
-				break;
-			case RECORD_ERROR_DUPLICATE_DATA:
-				errorMessage = ERROR_DUPLICATE_DATA;
-				break;
-			default:
-				errorMessage = "ERROR: Unknown validation result.";	
-				break;
-		}
-		
-		freeNewRecordResult(record);
-		return sendErrorResponse (connection, errorMessage);
-	}
-		
-	#ifdef VERBOSE_FLAG
-	printf("RESPONSE: New Record Created, token: %s\n", record->token);
-	#endif
-	
-	enum MHD_Result ret;
-	struct MHD_Response *response;
-	char *htmlContent;	
-	char *responseContent;	
-	
-	htmlContent = readFile(STATIC_SUCCESS);
-	if (!htmlContent) {
-		freeNewRecordResult(record);
-		fprintf(stderr, "ERROR: Failed to access file '%s' (sendNewUserResponse)\n", STATIC_SUCCESS);		
-		return MHD_NO; // SIGNAL FAILURE TO READ FILE
+// PICK UP LISTENING SOCKETS FROM SYSTEMD SOCKET ACTIVATION OR A PREDECESSOR (SAME PROTOCOL).
+// NAMED SOCKETS ('http', 'https') GO TO THEIR LISTENER, UNNAMED ONES ARE TAKEN IN THAT ORDER.
+void collectInheritedSockets (void)
+{
+	const char *listenPid = getenv(ENV_LISTEN_PID);
+	const char *listenFds = getenv(ENV_LISTEN_FDS);
+	if (!listenPid || !listenFds || (pid_t)atoi(listenPid) != getpid()) return;
+
+	int count = atoi(listenFds);
+	char names[CONFIG_LINE_MAX] = "";
+	const char *fdNames = getenv(ENV_LISTEN_FDNAMES);
+	if (fdNames) snprintf(names, sizeof(names), "%s", fdNames);
+
+	char *savePointer = NULL;
+	char *name = strtok_r(names, ":", &savePointer);
+
+	for (int i = 0; i < count && i < 2; i++) {
+		MHD_socket inherited = SD_LISTEN_FDS_START + i;
+		fcntl(inherited, F_SETFD, FD_CLOEXEC);
+
+		if (name && strcmp(name, LISTEN_NAME_TLS) == 0) inheritedSockets.tls = inherited;
+		else if (name && strcmp(name, LISTEN_NAME_HTTP) == 0) inheritedSockets.http = inherited;
+		else if (inheritedSockets.http == MHD_INVALID_SOCKET) inheritedSockets.http = inherited;
+		else inheritedSockets.tls = inherited;
+
+		name = strtok_r(NULL, ":", &savePointer);
 	}
 
-	// REPLACE TOKEN PLACEHOLDER
-	responseContent = replacePlaceholder(htmlContent, PLACEHOLDER_TOKEN, record->token);
+	syslog(LOG_INFO, "Inherited %d listening sockets", count);
+	unsetenv(ENV_LISTEN_PID);
+	unsetenv(ENV_LISTEN_FDS);
+	unsetenv(ENV_LISTEN_FDNAMES);
+}
+
+// RE-EXECUTE THIS PROGRAM AS A SUCCESSOR THAT INHERITS THE GIVEN LISTENING SOCKETS (EITHER MAY BE INVALID).
+// RETURNS THE SUCCESSOR PID, OR -1 ON FAILURE.
+static pid_t spawnSuccessor (MHD_socket httpSocket, MHD_socket tlsSocket)
+{
+	fflush(NULL);	// DO NOT DUPLICATE BUFFERED OUTPUT INTO THE CHILD
 
-	free(htmlContent);
-	if (!responseContent) {
-        fprintf(stderr, "ERROR: Failed to replace placeholder in file content (sendNewUserResponse)\n");
-		freeNewRecordResult(record);
-		return MHD_NO; // SIGNAL FAILURE TO ALLOCATE MEMORY
-	}		
-	
-	response = MHD_create_response_from_buffer(strlen(responseContent), (void *)responseContent, MHD_RESPMEM_MUST_FREE );
-	if (!response) {
-		fprintf(stderr, "ERROR: Memory allocation failed (sendNewUserResponse)\n");
-		freeNewRecordResult(record); // Cleanup in case of failure
-		free(responseContent); // Must free, MHD_RESPMEM_MUST_FREE did not work
-		return MHD_NO; // SIGNAL FAILURE TO ALLOCATE MEMORY
+	pid_t pid = fork();
+	if (pid != 0) {
+		if (pid < 0) perror("Failed to fork successor");
+		else syslog(LOG_INFO, "Successor %d starting", (int)pid);
+		return pid;
 	}
 
-	// ADD CONTENT TYPE HEADER TO RESPONSE
-	MHD_add_response_header(response, "Content-Type", CONTENT_HTML);
+	// CHILD: MOVE THE SOCKETS OUT OF THE WAY, THEN TO 3 AND UP, LIKE SYSTEMD SOCKET ACTIVATION
+	MHD_socket sockets[2] = { httpSocket, tlsSocket };
+	const char *socketNames[2] = { LISTEN_NAME_HTTP, LISTEN_NAME_TLS };
+	int moved[2];
+	char names[64] = "";
+	int count = 0;
+
+	for (int i = 0; i < 2; i++) {
+		if (sockets[i] == MHD_INVALID_SOCKET) continue;
+		moved[count] = fcntl(sockets[i], F_DUPFD, 64);
+		if (moved[count] < 0) _exit(127);
+		if (count > 0) strcat(names, ":");
+		strcat(names, socketNames[i]);
+		count++;
+	}
 
-	// QUEUE THE RESPONSE
-	ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	for (int i = 0; i < count; i++) {
+		if (dup2(moved[i], SD_LISTEN_FDS_START + i) < 0) _exit(127);
+		fcntl(SD_LISTEN_FDS_START + i, F_SETFD, 0);		// KEEP IT ACROSS exec
+		close(moved[i]);
+	}
 
-	// CLEAN UP
-	MHD_destroy_response(response);
-	freeNewRecordResult(record);
-	// free(responseContent); // NOT NECESSARY DUE TO MHD_RESPMEM_MUST_FREE FLAG
-	return ret;
+	char value[32];
+	snprintf(value, sizeof(value), "%d", count);
+	if (count > 0) setenv(ENV_LISTEN_FDS, value, 1);
+	snprintf(value, sizeof(value), "%d", (int)getpid());
+	if (count > 0) setenv(ENV_LISTEN_PID, value, 1);
+	if (count > 0) setenv(ENV_LISTEN_FDNAMES, names, 1);
+	snprintf(value, sizeof(value), "%d", (int)getppid());
+	setenv(ENV_PREDECESSOR_PID, value, 1);
+
+	// THE SIGNAL MASK SURVIVES exec, START THE SUCCESSOR WITH A CLEAN ONE
+	sigset_t empty;
+	sigemptyset(&empty);
+	pthread_sigmask(SIG_SETMASK, &empty, NULL);
+
+	execvp(savedArgv[0], savedArgv);
+	perror("Failed to execute successor");
+	_exit(127);
 }
 
+// LISTENING SOCKET OF A RUNNING DAEMON, MHD_INVALID_SOCKET IF NONE
+static MHD_socket daemonListenSocket (struct MHD_Daemon *daemon)
+{
+	if (!daemon) return MHD_INVALID_SOCKET;
+	const union MHD_DaemonInfo *info = MHD_get_daemon_info(daemon, MHD_DAEMON_INFO_LISTEN_FD);
+	return info ? info->listen_fd : MHD_INVALID_SOCKET;
+}
 
-// POST REQUEST MANAGER
-static enum MHD_Result iteratePost	(void *coninfo_cls, enum MHD_ValueKind kind, const char *key,
-										const char *filename, const char *content_type,
-										const char *transfer_encoding, const char *data, uint64_t off,
-										size_t size)
+// REAP A SUCCESSOR THAT EXITED BEFORE IT WAS READY. WE KEEP SERVING.
+static void reapFailedSuccessor (pid_t *successor)
 {
-  struct connectionInfoStruct *con_info = coninfo_cls;
-  (void) kind;               /* Unused. Silent compiler warning. */
-  (void) filename;           /* Unused. Silent compiler warning. */
-  (void) content_type;       /* Unused. Silent compiler warning. */
-  (void) transfer_encoding;  /* Unused. Silent compiler warning. */
-  (void) off;                /* Unused. Silent compiler warning. */
-  
-	// THIS KEY IS A GENERAL DID:PLC FIELD WITH EITHER A DID OR A FULL HANDLE. ONLY NEED TO MAKE SURE IT EXISTS AND THAT IT IS <= MAXDIDSIZE
- 	if ( strcmp(key, "did") == 0 ) {
-        printf("POST: DID key value: %s\n", data);
-		
-		// STEP 1: LOOK FOR DID PLC
-		if ( strcasestr(data, "did:plc:") )
-		{
-			char output[MAX_SIZE_DID_PLC + 1] = {0};
-			extractDid(data, output, sizeof(output));
-			if (output[0] != '\0') {
-				printf("POST: Valid DID:PLC found in data: '%s'\n", output);
-				con_info->did = strndup(output, strlen(output));
-				return MHD_YES;
-			}
-		}
-		
-		// STEP 2: LOOK FOR FULL HANDLE
-		if ( strcasestr(data, "bsky.social") ) {
-			printf("POST: Valid 'bsky.social' handle entered: %s\n", data);		
-			const char *tempDID = getWellKnownDID(data);
-			if (tempDID) {
-				printf("POST: Valid DID:PLC found via CURL: %s\n", tempDID);
-				con_info->did = strndup(tempDID, MAX_SIZE_DID_PLC);
-				free((void *)tempDID);
-				return MHD_YES; // Iterate again looking for email.
-			}
-			printf("POST: No Valid DID:PLC found via CURL: '%s'\n", data);
-			return logMHDError ("No Valid DID:PLC found via CURL (POST)");
-		}
-		
-		// STEP 3: CHECK TO SEE IF IT IS A PARTIAL HANDLE BETWEEN 2 and 63 CHARACTERS
-		if (size >= 2 && size <= 63) {
-			printf("POST: Data entered could contain partial handle: '%s'\n", data);
+	int status;
+	if (*successor <= 0 || waitpid(*successor, &status, WNOHANG) != *successor) return;
 
-			size_t newLength = size + strlen(".bsky.social") + 1;
+	fprintf(stderr, "ERROR: Successor %d exited before it was ready, still serving\n", (int)*successor);
+	syslog(LOG_ERR, "Successor %d exited before it was ready, still serving", (int)*successor);
+	*successor = 0;
+}
 
-			// Allocate memory for the new string
-			char *fullHandle = malloc(newLength);
-			if (fullHandle == NULL) {
-				fprintf(stderr, "POST: Memory allocation failed\n");
-				return logMHDError ("Memory allocation failed (POST)");
-			}
+// PRE-WARM: READ A DATABASE FILE SO ITS PAGES ARE IN THE OS CACHE BEFORE THE FIRST REQUEST. RETURNS BYTES READ.
+static size_t prewarmFile (const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
 
-			// Concatenate strings
-			strcpy(fullHandle, data);
-			strcat(fullHandle, ".bsky.social");
+	char *buffer = malloc(PREWARM_BUFFER_SIZE);
+	size_t total = 0;
+	ssize_t length;
 
-			const char *tempDID = getWellKnownDID(fullHandle);
-			free((void *)fullHandle);
+	while (buffer && (length = read(fd, buffer, PREWARM_BUFFER_SIZE)) > 0) total += (size_t)length;
 
-			if (tempDID) {
-				printf("POST: DID:PLC found via CURL: %s\n", tempDID);
-				con_info->did = strndup(tempDID, MAX_SIZE_DID_PLC);
-				free((void *)tempDID);
-				return MHD_YES; // Iterate again looking for email.
-			}
-		}
-			
-		printf("POST: No Valid DID:PLC found via CURL: '%s'\n", data);
-		return MHD_NO;
+	free(buffer);
+	close(fd);
+	return total;
+}
+
+// PRE-WARM EVERY CACHE THE REQUEST PATHS DEPEND ON, BEFORE THE LISTENERS TAKE TRAFFIC
+void prewarmCaches (void)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	}
+	size_t bytes = prewarmFile(principalDatabaseGlobal) + prewarmFile(filterDatabaseGlobal);
 
-	if ( (strcmp(key, "email") == 0) && (size <= 256 ) ) {
-		if ( (data != NULL) && (size > 0) )  con_info->email = strndup(data, size);		
-		return MHD_NO;			
+	// SHARDED, THE USERS LIVE IN THE SHARD FILES AND THE INDEX, principalDatabaseGlobal IS ONLY A LEFTOVER
+	for (int i = 0; shardDatabasesGlobal && i < shardCountGlobal; i++) bytes += prewarmFile(shardDatabasesGlobal[i]);
+	if (shardIndexDatabaseGlobal) bytes += prewarmFile(shardIndexDatabaseGlobal);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+	printf("WARM: %zu database bytes read in %.1f ms\n", bytes, elapsed);
+	syslog(LOG_INFO, "Caches warm: %zu database bytes read in %.1f ms", bytes, elapsed);
+}
+
+// PREFORK WORKER: SERVE UNTIL THE SUPERVISOR SENDS SIGTERM, THEN DRAIN. REPORTS READINESS ON 'readyPipe'.
+static int runWorker (int workerIndex, pid_t supervisor, int readyPipe)
+{
+	#ifdef __linux__
+	// DIE WITH THE SUPERVISOR, EVEN IF IT IS KILLED WITHOUT A CHANCE TO STOP US
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	#endif
+	if (getppid() != supervisor) return 1;
+	workerSlot = workerIndex;
+
+	// WORKER 0 WRITES THE HANDLE INDEX, THE OTHERS ONLY READ IT. NONE OF THEM CHANGES THE RESERVED LIST.
+	handleIndexWriter = (workerIndex == 0);
+	if (handleIndexWriter && handleIndexTakeOver() != 0) return 1;
+	if (!handleIndexWriter) sharedVersionsProtect(&handleIndexVersions);
+	sharedVersionsProtect(&reservedVersions);
+
+	// THE SIGNALS ARE ALREADY BLOCKED BY THE SUPERVISOR, SO MHD THREADS NEVER RECEIVE THEM
+	sigset_t waitMask;
+	installLifecycleHandlers(&waitMask);
+
+	struct daemonSetStruct daemons;
+	if (startDaemons(&daemons, TRUE) != 0) return 1;
+
+	// THE SAME WORKER TAKES THE BACKUPS AND FOLLOWS THE CHANGE LOG INTO THE WELL-KNOWN FILES. THE SUPERVISOR FORKS,
+	// SO IT STARTS NO THREADS OF ITS OWN.
+	if (workerIndex == 0 && startBackups() != 0) fprintf(stderr, "WARNING: Failed to start the backup thread\n");
+	if (workerIndex == 0 && startStaticFiles() != 0) fprintf(stderr, "WARNING: Failed to start the well-known file thread\n");
+
+	if (write(readyPipe, "R", 1) != 1) perror("Failed to report worker readiness");
+	close(readyPipe);
+	syslog(LOG_INFO, "Worker %d (pid %d) serving on port %d", workerIndex, (int)getpid(), configGlobal.port);
+
+	while (!stopRequested) {
+		sigsuspend(&waitMask);
+		#ifdef HANDLED_TLS
+		if (reloadRequested && configGlobal.tlsEnabled) tlsReloadCredentials(TRUE);
+		#endif
+		reloadRequested = 0;
 	}
 
-	return MHD_YES;
+	stopBackups ();
+	stopStaticFiles ();
+	drainDaemons(&daemons);
+	syslog(LOG_INFO, "Worker %d (pid %d) stopped", workerIndex, (int)getpid());
+	return 0;
 }
 
-// CLEAN-UP FUNCTION AFTER REQUEST COMPLETED
-static void requestCompleted (void *cls, struct MHD_Connection *connection, void **con_cls, enum MHD_RequestTerminationCode toe)
+// FORK ONE WORKER INTO 'worker'. RETURNS THE fork() RESULT.
+static pid_t spawnWorker (struct workerStruct *worker)
 {
-	struct connectionInfoStruct *con_info = *con_cls;
-	(void) cls;         /* Unused. Silent compiler warning. */
-	(void) connection;  /* Unused. Silent compiler warning. */
-	(void) toe;         /* Unused. Silent compiler warning. */
+	fflush(NULL);	// DO NOT DUPLICATE BUFFERED OUTPUT INTO THE CHILD
 
-	if (NULL == con_info) return;
-	
-	if (con_info->connectiontype == POST)
-    {
-		MHD_destroy_post_processor (con_info->postprocessor);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("Failed to fork worker");
+		return pid;
 	}
-	
-/* 	// COMMENTED OUT BECAUSE ONE WILL 1ST REQUIRES FREEING, BUT SECOND ONE DOES NOT
-	#ifdef NGINX_FLAG
 
-	#else
-	// FIX THIS, WHICH WILL BE DYNAMICALLY ALLOCATED, NEEDS TO BE FREED
-	#endif */
+	if (pid > 0) {
+		worker->pid = pid;
+		worker->started = time(NULL);
+	}
+	return pid;
+}
 
-	// Free each member that was dynamically allocated	
-	if (con_info->handle) {
-		free((char *)con_info->handle);
+// SEND A SIGNAL TO EVERY RUNNING WORKER
+static void signalWorkers (struct workerStruct *workers, int signalNumber)
+{
+	for (int i = 0; i < configGlobal.workers; i++) {
+		if (workers[i].pid > 0) kill(workers[i].pid, signalNumber);
 	}
+}
 
-	if (con_info->did) {
-		free((char *)con_info->did);
+// PREFORK SUPERVISOR: KEEP configGlobal.workers WORKERS RUNNING UNTIL 'q', SIGTERM OR A READY SUCCESSOR.
+// IN A WORKER THIS RETURNS THE WORKER'S EXIT CODE, SO THE CALLER CAN CLEAN UP THE SAME WAY.
+int superviseWorkers (void)
+{
+	struct workerStruct workers[MAX_WORKERS];
+	pid_t supervisor = getpid();
+	pid_t successor = 0;
+	int stdinOpen = TRUE;
+	int readyPipe[2];
+	int readyWorkers = 0;
+	sigset_t waitMask;
+
+	memset(workers, 0, sizeof(workers));
+	installLifecycleHandlers(&waitMask);
+
+	if (pipe(readyPipe) != 0) return logErrorAndExit("Unable to create worker readiness pipe");
+
+	for (int i = 0; i < configGlobal.workers; i++) {
+		pid_t pid = spawnWorker(&workers[i]);
+		if (pid == 0) {
+			close(readyPipe[0]);
+			return runWorker(i, supervisor, readyPipe[1]);
+		}
+		if (pid < 0) workers[i].restartAt = time(NULL) + WORKER_RESTART_DELAY;
 	}
-	
-	if (con_info->email) {
-		free((char *)con_info->email);
-	}	
-	
-	// if (con_info->answerstring) {
-		// free((char *)con_info->answerstring);
-	// }	
 
-    // Free the structure itself
-	free (con_info);
-	*con_cls = NULL;
-}
+	printf("Supervisor running %d workers on port %d. Type 'q' and press Enter to quit.\n", configGlobal.workers, configGlobal.port);
+	syslog(LOG_INFO, "Supervisor running %d workers on port %d", configGlobal.workers, configGlobal.port);
 
-// *********************************************
-// ********* PRINCIPAL REQUEST HANDLER *********
-// *********************************************
+	while (!stopRequested && !successorReady) {
+		// WAIT UP TO A SECOND FOR A SIGNAL, 'q' ON STDIN OR A WORKER REPORTING READY
+		int workerReported;
+		if (waitForLifecycleEvent(&waitMask, &stdinOpen, 1, readyPipe[0], &workerReported)) break;
 
-static enum MHD_Result requestHandler	   (void *cls, struct MHD_Connection *connection,
-												const char *url, const char *method,
-												const char *version, const char *upload_data,
-												size_t *upload_data_size, void **con_cls)
-{	
-	(void) cls;               /* Unused. Silent compiler warning. */
-	(void) version;           /* Unused. Silent compiler warning. */
-	
-	if (NULL == *con_cls) { // FIRST CALL, SETUP DATA STRUCTURES, SOME ONLY APPLY TO 'POST' REQUESTS
-	
-		// VALIDATE HOST HEADER. A REVERSE PROXY SHOULD MAKE THIS UNNECESSARY
-		const char *hostHeader = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Host");		
-		if (!hostHeader || (NULL == strcasestr(hostHeader, domainName))) {			
-			// REJECT REQUEST IF HOST HEADER DOES NOT CONTAIN THE EXPECTED DOMAIN
-			return logMHDError ("Invalid domain name request rejected");
+		if (workerReported) {
+			char reports[MAX_WORKERS];
+			ssize_t length = read(readyPipe[0], reports, sizeof(reports));
+			// ANNOUNCE ONCE, WHEN THE FIRST FULL SET OF WORKERS IS SERVING
+			if (length > 0 && readyWorkers < configGlobal.workers && (readyWorkers += (int)length) >= configGlobal.workers) announceReady();
 		}
-		
-		struct connectionInfoStruct *con_info;
 
-		con_info = malloc (sizeof (struct connectionInfoStruct));
-		if (NULL == con_info) {
-			// INTERNAL ERROR
-			return logMHDError ("Memory allocation failed for connection information");
+		if (reloadRequested) {
+			reloadRequested = 0;
+			loadReservedTerms();		// Published to every worker
+			signalWorkers(workers, SIGHUP);
 		}
 
-		// DIRECT COPIES OF CONSTANTS, NO NEED TO FREE
-		con_info->host = hostHeader;
+		if (upgradeRequested) {
+			upgradeRequested = 0;
+			if (successor == 0) successor = spawnSuccessor(inheritedSockets.http, inheritedSockets.tls);
+			if (successor < 0) successor = 0;
+		}
 
- 		#ifdef NGINX_FLAG
-		// 'X-ATPROTO-HANDLE' OPTIONAL AND REQUIRES NGINX REVERSE PROXY.
-		con_info->handle = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-ATPROTO-HANDLE");
-		#else
-		// DYNAMICALLY ALLOCATED, NEEDS TO BE FREED
-		con_info->handle = removeDomainName(con_info->host);
-		#endif
+		// REAP WORKERS THAT EXITED AND SCHEDULE THEIR RESTART
+		int status;
+		pid_t pid;
+		time_t now = time(NULL);
+		childExited = 0;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			if (pid == successor) {
+				fprintf(stderr, "ERROR: Successor %d exited before it was ready, still serving\n", (int)pid);
+				syslog(LOG_ERR, "Successor %d exited before it was ready, still serving", (int)pid);
+				successor = 0;
+				continue;
+			}
 
-		con_info->did = NULL;
-		con_info->email = NULL;
+			for (int i = 0; i < configGlobal.workers; i++) {
+				if (workers[i].pid != pid) continue;
 
-		// INITIALIZE THE CONNECTIONINFO STRUCT. SOME ONLY APPLY TO 'POST' REQUESTS.
-		if ( 0 == strcasecmp (method, MHD_HTTP_METHOD_POST) ) {
-			con_info->postprocessor = MHD_create_post_processor (connection, POSTBUFFERSIZE, iteratePost, (void *) con_info);
-			// Creating postprocessor failed, free memory manually and exit.
-			if (NULL == con_info->postprocessor) {
-				free (con_info);
-				// INTERNAL ERROR
-				return logMHDError ("Creating postprocessor failed"); 
+				if (WIFSIGNALED(status)) syslog(LOG_ERR, "Worker %d (pid %d) killed by signal %d", i, (int)pid, WTERMSIG(status));
+				else syslog(LOG_ERR, "Worker %d (pid %d) exited with status %d", i, (int)pid, WEXITSTATUS(status));
+				fprintf(stderr, "ERROR: Worker %d (pid %d) exited, restarting\n", i, (int)pid);
+
+				// A WORKER THAT DIES RIGHT AWAY IS RESTARTED WITH A DELAY, TO AVOID A FORK LOOP
+				workers[i].pid = 0;
+				clearWorkerGauges(i);
+				if (i == 0) handleIndexWriterExited();
+				workers[i].restartAt = (now - workers[i].started < WORKER_MIN_UPTIME) ? now + WORKER_RESTART_DELAY : now;
+				METRIC_ADD(workerRestarts, 1);
 			}
-			
-			con_info->connectiontype = POST;
-		}
-		else { 
-			//PROBABLY BEST TO CONFIRM IT IS A GET REQUEST?
-			con_info->connectiontype = GET;
 		}
 
-		// INITIALIZE ANSWER VARIABLES
-		// con_info->answerstring = NULL;			// Make sure answer string is empty
+		for (int i = 0; i < configGlobal.workers; i++) {
+			if (workers[i].pid != 0 || now < workers[i].restartAt) continue;
 
-		*con_cls = (void *) con_info;
+			pid = spawnWorker(&workers[i]);
+			if (pid == 0) {
+				close(readyPipe[0]);
+				return runWorker(i, supervisor, readyPipe[1]);
+			}
+			if (pid < 0) workers[i].restartAt = now + WORKER_RESTART_DELAY;
+		}
+	}
 
-		return MHD_YES; // QUITE CERTAIN THIS IS NOT NECESSARY FOR GETS
+	if (successorReady) syslog(LOG_INFO, "Successor %d is ready, draining workers", (int)successor);
+	notifySystemd("STOPPING=1");
+
+	// WORKERS DRAIN ON SIGTERM. WAIT FOR THEM, BUT NOT FOREVER.
+	signalWorkers(workers, SIGTERM);
+	time_t deadline = time(NULL) + configGlobal.drainTimeout + WORKER_MIN_UPTIME;
+	for (int i = 0; i < configGlobal.workers; i++) {
+		while (workers[i].pid > 0) {
+			pid_t pid = waitpid(workers[i].pid, NULL, WNOHANG);
+			if (pid == workers[i].pid || pid < 0) workers[i].pid = 0;
+			else if (time(NULL) >= deadline) kill(workers[i].pid, SIGKILL);
+			else {
+				struct timespec pause = {0, 100000000};	// 100 ms
+				nanosleep(&pause, NULL);
+			}
+		}
 	}
 
-	struct connectionInfoStruct *con_info = *con_cls;
+	close(readyPipe[0]);
+	close(readyPipe[1]);
+	printAllocationProfile ();
+	return 0;
+}
 
-	printf ("REQUEST: New %s request to %s for '%s'\n", method, con_info->host, url);
-	syslog(LOG_INFO, "REQUEST: %s request to https://%s%s", method, con_info->host, url);	
+// SINGLE PROCESS MODE: SERVE UNTIL 'q', SIGTERM OR A READY SUCCESSOR, THEN DRAIN
+int serveSingleProcess (void)
+{
+	struct daemonSetStruct daemons;
+	sigset_t waitMask;
+	pid_t successor = 0;
+	int stdinOpen = TRUE;
 
-	// **************************************
-	// ************ GET REQUESTS ************
-	// **************************************
-	if (0 == strcasecmp (method, MHD_HTTP_METHOD_GET))
-	{	
-		// SEND RESPONSE TO WELL-KNOWN URL GET REQUEST BASED ON DATABASE RESULTS HANDLE/SUBDOMAIN
-		// HANDLE/SUBDOMAIN VERIFICATION NOT NECESSARY
-		if ( 0 == strcasecmp (url, URL_WELL_KNOWN_ATPROTO) )
-		{
-			return sendWellKnownResponse (connection, con_info->host, con_info->handle);
-		}
-		
-		if ( (0 == strcasecmp (url, "/")) && (validateHandle (con_info->handle) ==  KEY_VALID ) ) {
-			// CREATE A NEW RESPONSE PAGE FOR THIS BLOCK
-			if ( (handleRegistered(con_info->host) == HANDLE_ACTIVE) ) return sendFileResponse (connection, STATIC_ACTIVE, CONTENT_HTML);
-			if ( (labelReserved(con_info->handle) == HANDLE_ACTIVE) ) return sendFileResponse (connection, STATIC_RESERVED, CONTENT_HTML); 
-			return sendFileResponse (connection, STATIC_REGISTER, CONTENT_HTML); 
+	installLifecycleHandlers(&waitMask);
+	if (startDaemons(&daemons, FALSE) != 0) return 1;
+	if (startBackups() != 0) fprintf(stderr, "WARNING: Failed to start the backup thread\n");
+	if (startStaticFiles() != 0) fprintf(stderr, "WARNING: Failed to start the well-known file thread\n");
+	announceReady();
+
+	printf("Handler Daemon running on port %d. Type 'q' and press Enter to quit.\n", configGlobal.port);
+	syslog(LOG_INFO, "Handler Daemon running on port %d. Type 'q' and press Enter to quit", configGlobal.port);
+
+	while (!stopRequested && !successorReady) {
+		if (waitForLifecycleEvent(&waitMask, &stdinOpen, -1, -1, NULL)) break;
+
+		#ifdef HANDLED_TLS
+		if (reloadRequested && configGlobal.tlsEnabled) tlsReloadCredentials(TRUE);
+		#endif
+		if (reloadRequested) loadReservedTerms();
+		reloadRequested = 0;
+
+		// HAND OUR LISTENING SOCKETS TO A FRESH COPY OF THE PROGRAM, KEEP SERVING UNTIL IT IS READY
+		if (upgradeRequested) {
+			upgradeRequested = 0;
+			if (successor == 0) successor = spawnSuccessor(daemonListenSocket(daemons.http), daemonListenSocket(daemons.tls));
+			if (successor < 0) successor = 0;
 		}
-			
-		// ALL OTHER URLS RECEIVE A 404 RESPONSE
-		return sendFileResponse (connection, STATIC_NOTFOUND, CONTENT_HTML);
+
+		childExited = 0;
+		reapFailedSuccessor(&successor);
 	}
-	
-	// ***************************************
-	// ************ POST REQUESTS ************
-	// ***************************************	
-	if ( ( 0 == strcasecmp (method, MHD_HTTP_METHOD_POST)) && ( 0 == strcasecmp (url, "/result") ) )
-	{
-		if ( 0 != *upload_data_size )
-		{
-			MHD_post_process (con_info->postprocessor, upload_data, *upload_data_size);		
-			*upload_data_size = 0;
-			return MHD_YES;
-		} 
-				
-		if (con_info->did == NULL) return sendErrorResponse (connection, ERROR_INVALID_DID_ENTERED );
-		
-		if (con_info->email == NULL) return sendNewUserResponse(connection, con_info->host, con_info->handle, con_info->did, "NO EMAIL PROVIDED");
 
-		return sendNewUserResponse(connection, con_info->host, con_info->handle, con_info->did, con_info->email);
+	// THE SUCCESSOR NOW ACCEPTS ON THE SAME SOCKETS, SO ITS QUEUED CONNECTIONS ARE LEFT TO IT
+	if (successorReady) {
+		daemons.sharedListeners = TRUE;
+		syslog(LOG_INFO, "Successor %d is ready, draining", (int)successor);
 	}
+	notifySystemd("STOPPING=1");
 
-	// GENERAL ERROR MESSAGE
-	return sendErrorResponse (connection, ERROR_REQUEST_FAILED);	
+	stopBackups ();
+	stopStaticFiles ();
+	drainDaemons(&daemons);
+	printAllocationProfile ();
+	return 0;
 }
 
 
@@ -1544,6 +9361,12 @@ int main(int argc, char *argv[])
 	if ( DBPaths == 1) {
 		return logErrorAndExit ("Unable to build database paths");
 	}
+
+	// LOAD OPTIONAL handled.conf FROM THE BASE DIRECTORY
+	if ( loadConfigFile() != 0 ) {
+		freeGlobalPaths ();
+		return logErrorAndExit ("Invalid configuration file");
+	}
 	
 	// ***************************************	
 	// COMMAND: FILTER DATABASE INITIALIZATION
@@ -1570,11 +9393,173 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	// ****************************************
+	// COMMAND: MOVE USERS TO N DATABASE FILES
+	// ****************************************
+
+	if ( strcmp(commandArg, "reshard") == 0 ) {
+		char *end = NULL;
+		long targetShards = argv[3] ? strtol(argv[3], &end, 10) : -1;
+		if (!argv[3] || *end != '\0' || targetShards < 0 || targetShards > MAX_SHARDS) {
+			freeGlobalPaths ();
+			return usageDaemon();
+		}
+		if (targetShards == 1) targetShards = 0;
+
+		// START FROM THE LAYOUT ON DISK, WHATEVER handled.conf SAYS
+		int currentShards = storedShardLayout();
+		if (currentShards < 0 || buildShardDatabasePaths(currentShards) != 0 || initializeUserDatabase() != DATABASE_SUCCESS) {
+			freeGlobalPaths ();
+			return logErrorAndExit ("Unable to open the user database");
+		}
+
+		int rc = DATABASE_SUCCESS;
+		if (currentShards == targetShards) printf("The user database already has %d file(s).\n", currentShards ? currentShards : 1);
+		else rc = reshardDatabases((int)targetShards);
+
+		freeGlobalPaths ();
+		if (rc != DATABASE_SUCCESS) return logErrorAndExit ("Resharding failed");
+
+		printf("Set shards=%ld in " CONFIG_FILENAME " before starting the daemon.\n", targetShards);
+		closelog();
+		return 0;
+	}
+
+	// ****************************************
+	// COMMAND: EXPORT EVERY USER TO A FILE
+	// ****************************************
+
+	if ( strcmp(commandArg, "export") == 0 ) {
+		const char *outputPath = argv[3];
+		const char *formatArg = argc > 4 ? argv[4] : "csv";
+		exportFormat format = strcmp(formatArg, "jsonl") == 0 ? EXPORT_JSONL : EXPORT_CSV;
+		if (!outputPath || (strcmp(formatArg, "csv") != 0 && format != EXPORT_JSONL)) {
+			freeGlobalPaths ();
+			return usageDaemon();
+		}
+
+		// READ THE LAYOUT ON DISK, NEVER CREATING AN EMPTY DATABASE
+		int currentShards = storedShardLayout();
+		if (currentShards < 0 || buildShardDatabasePaths(currentShards) != 0 || (currentShards == 0 && access(principalDatabaseGlobal, F_OK) != 0)) {
+			freeGlobalPaths ();
+			return logErrorAndExit ("Unable to open the user database");
+		}
+
+		FILE *out = fopen(outputPath, "w");
+		if (!out) {
+			fprintf(stderr, "ERROR: Unable to create '%s': %s\n", outputPath, strerror(errno));
+			freeGlobalPaths ();
+			return logErrorAndExit ("Export failed");
+		}
+		long long rows = exportUserDatabase(format, out);
+		if (fclose(out) != 0) rows = -1;
+
+		freeGlobalPaths ();
+		if (rows < 0) {
+			unlink(outputPath);
+			return logErrorAndExit ("Export failed");
+		}
+
+		printf("Exported %lld users to '%s'.\n", rows, outputPath);
+		syslog(LOG_INFO, "Exported %lld users", rows);
+		closelog();
+		return 0;
+	}
+
+	// ****************************************
+	// COMMAND: ONLINE BACKUP, OR CHECK BACKUPS
+	// ****************************************
+
+	if ( strcmp(commandArg, "backup") == 0 ) {
+		int verify = argv[3] && strcmp(argv[3], "verify") == 0;
+		if ( !verify && applyConfigArguments(argc, argv, 3) != 0 ) {
+			freeGlobalPaths ();
+			return usageDaemon();
+		}
+
+		// BACK UP THE LAYOUT ON DISK, NEVER CREATING AN EMPTY DATABASE
+		int currentShards = storedShardLayout();
+		if (!verify && (currentShards < 0 || buildShardDatabasePaths(currentShards) != 0 || (currentShards == 0 && access(principalDatabaseGlobal, F_OK) != 0))) {
+			freeGlobalPaths ();
+			return logErrorAndExit ("Unable to open the user database");
+		}
+
+		int rc = verify ? verifyBackups() : runBackup();
+		freeGlobalPaths ();
+		if (rc != 0) return logErrorAndExit (verify ? "Backup verification failed" : "Backup failed");
+
+		closelog();
+		return 0;
+	}
+
+	// *************************************************
+	// COMMAND: WRITE EVERY WELL-KNOWN FILE FOR NGINX
+	// *************************************************
+
+	if ( strcmp(commandArg, "materialize") == 0 ) {
+		if ( applyConfigArguments(argc, argv, 3) != 0 || configGlobal.staticRoot[0] == '\0' ) {
+			freeGlobalPaths ();
+			return usageDaemon();
+		}
+
+		// READ THE LAYOUT ON DISK, NEVER CREATING AN EMPTY DATABASE
+		int currentShards = storedShardLayout();
+		if (currentShards < 0 || buildShardDatabasePaths(currentShards) != 0 || (currentShards == 0 && access(principalDatabaseGlobal, F_OK) != 0)) {
+			freeGlobalPaths ();
+			return logErrorAndExit ("Unable to open the user database");
+		}
+
+		if (compileGlobalRegex() != 0) {
+			freeGlobalPaths ();
+			return logErrorAndExit ("Unable to compile global regex");
+		}
+		char *root = configFilePath(configGlobal.staticRoot);
+		long long written = root ? materializeAllHandles(root) : -1;
+		free(root);
+		freeGlobalRegexes ();
+		freeGlobalPaths ();
+		if (written < 0) return logErrorAndExit ("Writing well-known files failed");
+
+		printf("Wrote well-known files for %lld users under '%s'.\n", written, configGlobal.staticRoot);
+		syslog(LOG_INFO, "Wrote well-known files for %lld users", written);
+		closelog();
+		return 0;
+	}
+
 	// ************************************
 	// COMMAND NORMAL HTTP DEAMON OPERATION
 	// ************************************
 
-	if ( strcmp( commandArg, "httpd") == 0 ) {
+	if ( strcmp( commandArg, "httpd") == 0 || strcmp( commandArg, "replica") == 0 ) {
+		replicaMode = ( strcmp( commandArg, "replica") == 0 );
+
+		// key=value ARGUMENTS AFTER THE DOMAIN NAME OVERRIDE handled.conf
+		if ( !domainName || applyConfigArguments(argc, argv, 4) != 0 ) {
+			freeGlobalPaths ();
+			return usageDaemon();
+		}
+
+		// THE INDEX AND THE TAILING THREAD LIVE IN ONE PROCESS, WITH ONE DATABASE FILE BEHIND THEM
+		if (replicaMode && configGlobal.workers > 0) {
+			fprintf(stderr, "WARNING: A replica serves from a single process, 'workers' is ignored (use io_threads)\n");
+			configGlobal.workers = 0;
+		}
+		if (replicaMode && configGlobal.shards > 1) {
+			fprintf(stderr, "WARNING: A replica keeps its users in one file, 'shards' is ignored\n");
+			configGlobal.shards = 0;
+		}
+
+		if (buildShardDatabasePaths(configGlobal.shards) != 0) {
+			freeGlobalPaths ();
+			return logErrorAndExit ("Unable to build shard paths");
+		}
+
+		#ifndef HANDLED_TLS
+		if (configGlobal.tlsEnabled) {
+			freeGlobalPaths ();
+			return logErrorAndExit ("Native TLS requested, but handled was built without it (use make TLS=1)");
+		}
+		#endif
 				
 		#ifdef VERBOSE_FLAG
 		printf("Base directory: %s\n", baseDirectory);
@@ -1597,7 +9582,52 @@ int main(int argc, char *argv[])
 			freeGlobalPaths ();
 			return logErrorAndExit ("User database failure");
 		}
+
+		// THE HANDLE INDEX STARTS FROM WHAT THE DATABASE ALREADY HOLDS. LOADED BEFORE ANY FORK INTO A SHARED
+		// MAPPING, PREFORK WORKER 0 KEEPS IT UP TO DATE FOR ALL OF THEM.
+		if (loadHandleIndex(replicaMode ? replicaAppliedSequence() : changeLogHead()) != 0) {
+			freeHandleIndex ();
+			freeGlobalRegexes ();
+			freeGlobalPaths ();
+			return logErrorAndExit ("Unable to load the handle index");
+		}
 		
+		// LOAD AND PRE-COMPRESS STATIC PAGES
+		if (loadStaticPageCache() != 0) {
+			freeStaticPageCache ();
+			freeHandleIndex ();
+			freeGlobalRegexes ();
+			freeGlobalPaths ();
+			return logErrorAndExit ("Unable to load static pages");
+		}
+
+		// LOAD THE BLOCKLIST, BUILD THE 503 SENT WHEN SHEDDING LOAD AND THE SHARED RATE LIMIT BUCKETS
+		if (loadBlocklist() != 0 || buildOverloadResponse() != 0 || buildDeadlineResponse() != 0 || initializeRateLimiter() != 0) {
+			freeDeadlineResponse ();
+			freeRateLimiter ();
+			freeAdmissionControl ();
+			freeStaticPageCache ();
+			freeHandleIndex ();
+			freeGlobalRegexes ();
+			freeGlobalPaths ();
+			return logErrorAndExit ("Unable to set up admission control");
+		}
+
+		// COMPILE THE RESERVED LIST BEFORE ANY FORK, WORKERS SHARE IT. WITHOUT IT ONLY EXACT WORDS ARE RESERVED.
+		if (loadReservedTerms() != 0) {
+			fprintf(stderr, "WARNING: Reserved patterns not loaded, checking exact words in the database\n");
+		}
+
+		// OPEN THE TRACE FILE BEFORE ANY FORK, WORKERS APPEND TO IT. WITHOUT IT STAGES ARE ONLY COUNTED.
+		if (openTraceFile() != 0) {
+			fprintf(stderr, "WARNING: Slow requests will not be traced\n");
+		}
+
+		// SAME FOR THE REQUEST CAPTURE
+		if (openCaptureFile() != 0) {
+			fprintf(stderr, "WARNING: Requests will not be captured\n");
+		}
+
 		#ifdef VERBOSE_FLAG
 		printf("User database is active: %s\n", principalDatabaseGlobal);
 		printf("Reserved handle database: %s\n", filterDatabaseGlobal);	
@@ -1605,48 +9635,60 @@ int main(int argc, char *argv[])
 		syslog(LOG_INFO, "Reserved handle database: %s", filterDatabaseGlobal);
 		#endif
 	
-		printf("Starting Handler Daemon running on port %d.\n", PORT);
-	
-		// START THE HTTP DAEMON
-		struct MHD_Daemon *daemon;
-
-		// TO DO, ADD MHD_OPTION_STRICT_FOR_CLIENT OF 1 FOR STRICT HOST DETAILS
-/* 		daemon = MHD_start_daemon (MHD_USE_AUTO | MHD_USE_THREAD_PER_CONNECTION, PORT,
-								 NULL, NULL,  // No client connect/disconnect callbacks
-								 &requestHandler, NULL,  // Request handler
-								 MHD_OPTION_NOTIFY_COMPLETED, requestCompleted,
-								 NULL, MHD_OPTION_END); */
-		daemon = MHD_start_daemon (MHD_USE_AUTO | MHD_USE_INTERNAL_POLLING_THREAD, PORT,
-								 NULL, NULL,  // No client connect/disconnect callbacks
-								 &requestHandler, NULL,  // Request handler
-								 MHD_OPTION_NOTIFY_COMPLETED, requestCompleted,
-								 NULL, MHD_OPTION_END);
-
-		if (NULL == daemon) {
-			// FREE REGEXES
+		// SHARE THE METRICS WITH PREFORK WORKERS
+		if (initializeMetrics() != 0) {
+			fprintf(stderr, "WARNING: Metrics are per process, shared mapping failed\n");
+		}
+
+		// INITIALIZE LIBCURL ONCE, BEFORE ANY THREADS OR WORKERS EXIST
+		curl_global_init(CURL_GLOBAL_DEFAULT);
+
+		// LOAD TLS CREDENTIALS ONCE, SO PREFORK WORKERS SHARE THE SESSION TICKET KEY
+		#ifdef HANDLED_TLS
+		if (configGlobal.tlsEnabled && tlsInitialize() != 0) {
+			freeTlsCredentials ();
+			freeDeadlineResponse ();
+			freeRateLimiter ();
+			freeAdmissionControl ();
+			freeStaticPageCache ();
+			freeReservedTerms ();
+			closeTraceFile ();
+			closeCaptureFile ();
+			freeHandleIndex ();
 			freeGlobalRegexes ();
-			// FREE GLOBALS
 			freeGlobalPaths ();
-			return logErrorAndExit ("Failed to start HTTP daemon");
+			return logErrorAndExit ("Unable to load TLS certificate");
 		}
+		#endif
 
-		printf("Handler Daemon running on port %d. Type 'q' and press Enter to quit.\n", PORT);
-		syslog(LOG_INFO, "Handler Daemon running on port %d. Type 'q' and press Enter to quit", PORT);
-		char input;
+		// TAKE OVER LISTENING SOCKETS FROM SYSTEMD OR A PREDECESSOR, WARM CACHES BEFORE ANY TRAFFIC
+		savedArgv = argv;
+		collectInheritedSockets ();
+		prewarmCaches ();
 
-		while (1) { // INFINITE LOOP
-			input = getchar();  // Get user input
-			if (input == 'q') { // Check if input is 'q'
-				printf("Exiting Handler daemon...\n");
-				break; // Exit the loop
-			}
-		}
+		printf("Starting Handler Daemon running on port %d.\n", configGlobal.port);
+
+		// SERVE FROM THIS PROCESS, OR FORK WORKERS SHARING THE PORTS. WORKERS RETURN HERE TOO.
+		if (configGlobal.workers > 0) rc = superviseWorkers ();
+		else rc = serveSingleProcess ();
 
 		// ENSURE PROPER CLEANUP OF LIBCURL
 		curl_global_cleanup();
 
-		// STOP HTTP DAEMON
-		MHD_stop_daemon (daemon);
+		#ifdef HANDLED_TLS
+		freeTlsCredentials ();
+		#endif
+
+		// FREE STATIC PAGES AND THE 503 (AFTER THE DAEMONS, WHICH MAY STILL HOLD THE RESPONSES)
+		freeStaticPageCache ();
+		freeDeadlineResponse ();
+		freeRateLimiter ();
+		freeAdmissionControl ();
+		freeMetrics ();
+		freeHandleIndex ();
+		freeReservedTerms ();
+		closeTraceFile ();
+		closeCaptureFile ();
 
 		// FREE REGEXES
 		freeGlobalRegexes ();
@@ -1656,7 +9698,7 @@ int main(int argc, char *argv[])
 		syslog(LOG_INFO, "HandleD exiting.");
 		closelog();
 		
-		return 0;
+		return rc;
 	}
 	
 	// FREE GLOBALS
@@ -0,0 +1,471 @@
+// Handled-replay - Replay a request capture against a local HandleD
+// Copyright (c) 2024 Chema Hernández Gil / AGPL-3.0 license
+// https://github.com/chema/handle-handler
+
+#define _GNU_SOURCE // ppoll
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#ifndef PORT
+#define PORT 8123							// handled's default, the Makefile passes the one it builds with
+#endif
+
+#define REPLAY_CONNECTIONS			1024	// Requests in flight at once, each on its own connection
+#define REPLAY_TIMEOUT				10000	// Milliseconds before a request counts as timed out
+#define REPLAY_REQUEST_MAX			(CAPTURE_HOST_MAX + CAPTURE_URL_MAX + 256)
+#define REPLAY_SPEED_MAX			100
+#define REPLAY_DID_SIZE				32		// 'did:plc:' and 24 base32 characters, as MAX_SIZE_DID_PLC
+
+// ONE CAPTURED REQUEST, POINTING INTO THE CAPTURE FILE
+struct replayRecordStruct {
+	uint64_t arrival;				// Microseconds since the epoch
+	uint32_t bodySize;
+	uint16_t hostLength;
+	uint16_t urlLength;
+	uint8_t method;
+	const char *host;
+	const char *url;
+};
+
+// A REQUEST IN FLIGHT
+struct replaySlotStruct {
+	int fd;							// -1 for a free slot
+	size_t record;
+	long long scheduled;			// CLOCK_MONOTONIC microseconds it was due, latency is measured from here
+	char *request;					// Head and body
+	size_t requestLength;
+	size_t sent;
+	char status[16];				// Start of the status line
+	size_t statusLength;
+};
+
+// RESULTS, LATENCIES IN MICROSECONDS PER METHOD
+struct replayReportStruct {
+	long long *latency[CAPTURE_METHOD_COUNT];
+	size_t latencyCount[CAPTURE_METHOD_COUNT];
+	unsigned long long statusCounts[600];
+	unsigned long long errors;		// Connection failures and broken responses
+	unsigned long long timeouts;
+	unsigned long long overflow;	// Due with every slot busy, not sent
+	unsigned long long skipped;		// Methods other than GET, HEAD and POST
+};
+
+static const char *methodNames[CAPTURE_METHOD_COUNT] = { "GET", "POST", "HEAD", "OTHER" };
+
+static long long monotonicMicroseconds (void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int usageReplay (void)
+{
+	printf("HandleD " "replay - Plays a request capture ('capture_file' option) back against a local instance.\n");
+	printf("\n");
+	printf("handled-replay {capture} [host:port] [speed] [connections]\n");
+	printf("\n");
+	printf("host:port      Instance to load, defaults to 127.0.0.1:%d\n", PORT);
+	printf("speed          1 to %d times the captured pace, defaults to 1\n", REPLAY_SPEED_MAX);
+	printf("connections    Requests in flight at once, defaults to %d. Requests due with all of them busy are not sent.\n", REPLAY_CONNECTIONS);
+	printf("\n");
+	printf("Requests are sent when due whatever the answers to earlier ones (open loop), each on a new connection.\n");
+	printf("Latency runs from when a request was due until its response is read, so a slow server cannot hide it.\n");
+	printf("Registrations carry a generated DID:PLC, padded to the captured body size.\n");
+	return 1;
+}
+
+// READ THE WHOLE CAPTURE AND INDEX ITS RECORDS, SORTED BY ARRIVAL. RETURNS THE RECORDS TO FREE WITH '*data', OR NULL.
+static int compareArrival (const void *left, const void *right)
+{
+	const struct replayRecordStruct *a = left, *b = right;
+	return (a->arrival > b->arrival) - (a->arrival < b->arrival);
+}
+
+static struct replayRecordStruct *loadCapture (const char *path, char **data, size_t *count)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "ERROR: Unable to open capture '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	struct stat info;
+	if (fstat(fileno(file), &info) != 0 || info.st_size < CAPTURE_MAGIC_SIZE) {
+		fprintf(stderr, "ERROR: Capture '%s' is empty\n", path);
+		fclose(file);
+		return NULL;
+	}
+
+	size_t size = (size_t)info.st_size;
+	*data = malloc(size);
+	if (!*data || fread(*data, 1, size, file) != size || memcmp(*data, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0) {
+		fprintf(stderr, "ERROR: '%s' is not a request capture\n", path);
+		free(*data);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+
+	// COUNT, THEN INDEX. A MAGIC IN THE MIDDLE (A TRUNCATED AND REUSED FILE) IS SKIPPED. A CUT LAST RECORD IS DROPPED.
+	struct replayRecordStruct *records = NULL;
+	for (int pass = 0; pass < 2; pass++) {
+		size_t offset = CAPTURE_MAGIC_SIZE;
+		*count = 0;
+		while (offset + CAPTURE_RECORD_HEADER <= size) {
+			if (memcmp(*data + offset, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) == 0) {
+				offset += CAPTURE_MAGIC_SIZE;
+				continue;
+			}
+
+			struct replayRecordStruct record;
+			memcpy(&record.arrival, *data + offset, 8);
+			memcpy(&record.bodySize, *data + offset + 8, 4);
+			memcpy(&record.hostLength, *data + offset + 12, 2);
+			memcpy(&record.urlLength, *data + offset + 14, 2);
+			record.method = (uint8_t)(*data)[offset + 16];
+			if (record.hostLength > CAPTURE_HOST_MAX || record.urlLength > CAPTURE_URL_MAX || record.method >= CAPTURE_METHOD_COUNT) {
+				fprintf(stderr, "ERROR: Capture '%s' is corrupt at byte %zu\n", path, offset);
+				free(records);
+				free(*data);
+				return NULL;
+			}
+			if (offset + CAPTURE_RECORD_HEADER + record.hostLength + record.urlLength > size) break;
+
+			record.host = *data + offset + CAPTURE_RECORD_HEADER;
+			record.url = record.host + record.hostLength;
+			if (records) records[*count] = record;
+			(*count)++;
+			offset += CAPTURE_RECORD_HEADER + record.hostLength + record.urlLength;
+		}
+
+		if (pass == 0) {
+			records = malloc((*count > 0 ? *count : 1) * sizeof(*records));
+			if (!records) {
+				free(*data);
+				return NULL;
+			}
+		}
+	}
+
+	qsort(records, *count, sizeof(*records), compareArrival);
+	return records;
+}
+
+// BUILD THE REQUEST FOR A RECORD. RETURNS ITS LENGTH, 0 IF IT IS NOT REPLAYED.
+static size_t buildRequest (const struct replayRecordStruct *record, size_t index, char **request)
+{
+	static const char base32[] = "abcdefghijklmnopqrstuvwxyz234567";
+
+	if (record->method == CAPTURE_OTHER) return 0;
+
+	// A DID:PLC UNIQUE TO THE RECORD, THEN '&pad=' UP TO THE CAPTURED SIZE
+	char did[REPLAY_DID_SIZE + 1];
+	memcpy(did, "did:plc:", 8);
+	unsigned long long seed = (unsigned long long)index * 0x9E3779B97F4A7C15ULL + 1;
+	for (int i = 8; i < REPLAY_DID_SIZE; i++) {
+		seed ^= seed >> 12; seed ^= seed << 25; seed ^= seed >> 27;
+		did[i] = base32[(seed * 0x2545F4914F6CDD1DULL) >> 59];
+	}
+	did[REPLAY_DID_SIZE] = '\0';
+
+	size_t bodyLength = 0;
+	if (record->method == CAPTURE_POST) {
+		bodyLength = strlen("did=") + REPLAY_DID_SIZE;
+		if (record->bodySize > bodyLength + strlen("&pad=")) bodyLength = record->bodySize;
+	}
+
+	*request = malloc(REPLAY_REQUEST_MAX + bodyLength);
+	if (!*request) return 0;
+
+	int head;
+	if (record->method == CAPTURE_POST) {
+		head = snprintf(*request, REPLAY_REQUEST_MAX, "POST %.*s HTTP/1.1\r\nHost: %.*s\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+						"Content-Length: %zu\r\nConnection: close\r\n\r\ndid=%s",
+						record->urlLength, record->url, record->hostLength, record->host, bodyLength, did);
+		size_t length = (size_t)head;
+		size_t padding = bodyLength - strlen("did=") - REPLAY_DID_SIZE;
+		if (padding > 0) {
+			memcpy(*request + length, "&pad=", 5);
+			memset(*request + length + 5, 'x', padding - 5);
+			length += padding;
+		}
+		return length;
+	}
+
+	head = snprintf(*request, REPLAY_REQUEST_MAX, "%s %.*s HTTP/1.1\r\nHost: %.*s\r\nConnection: close\r\n\r\n",
+					methodNames[record->method], record->urlLength, record->url, record->hostLength, record->host);
+	return (size_t)head;
+}
+
+// START A REQUEST IN A FREE SLOT. RETURNS 0 ON SUCCESS.
+static int launchRequest (struct replaySlotStruct *slot, const struct addrinfo *target, const struct replayRecordStruct *records, size_t index, long long scheduled)
+{
+	slot->requestLength = buildRequest(&records[index], index, &slot->request);
+	if (slot->requestLength == 0) return 1;
+
+	slot->fd = socket(target->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (slot->fd < 0 || (connect(slot->fd, target->ai_addr, target->ai_addrlen) != 0 && errno != EINPROGRESS)) {
+		if (slot->fd >= 0) close(slot->fd);
+		slot->fd = -1;
+		free(slot->request);
+		slot->request = NULL;
+		return -1;
+	}
+
+	slot->record = index;
+	slot->scheduled = scheduled;
+	slot->sent = 0;
+	slot->statusLength = 0;
+	return 0;
+}
+
+// RELEASE A SLOT, RECORDING ITS OUTCOME. 'status' IS 0 FOR AN ERROR.
+static void finishRequest (struct replaySlotStruct *slot, const struct replayRecordStruct *records, struct replayReportStruct *report, int status)
+{
+	if (status >= 100 && status < 600) {
+		uint8_t method = records[slot->record].method;
+		report->statusCounts[status]++;
+		report->latency[method][report->latencyCount[method]++] = monotonicMicroseconds() - slot->scheduled;
+	}
+	else report->errors++;
+
+	close(slot->fd);
+	slot->fd = -1;
+	free(slot->request);
+	slot->request = NULL;
+}
+
+// MOVE A REQUEST ALONG AFTER poll: FINISH CONNECTING, WRITE, READ THE STATUS LINE AND DRAIN UNTIL THE SERVER CLOSES
+static void serviceRequest (struct replaySlotStruct *slot, short events, const struct replayRecordStruct *records, struct replayReportStruct *report)
+{
+	if (slot->sent < slot->requestLength) {
+		if (!(events & (POLLOUT | POLLERR | POLLHUP))) return;
+		ssize_t written = send(slot->fd, slot->request + slot->sent, slot->requestLength - slot->sent, MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) finishRequest(slot, records, report, 0);
+			return;
+		}
+		slot->sent += (size_t)written;
+		return;
+	}
+
+	char buffer[16384];
+	for (;;) {
+		ssize_t received = recv(slot->fd, buffer, sizeof(buffer), 0);
+		if (received < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) finishRequest(slot, records, report, 0);
+			return;
+		}
+
+		if (received == 0) {
+			// 'HTTP/1.1 200 ...', ANYTHING ELSE COUNTS AS AN ERROR
+			int status = 0;
+			slot->status[slot->statusLength] = '\0';
+			const char *space = strchr(slot->status, ' ');
+			if (slot->statusLength >= 12 && strncmp(slot->status, "HTTP/", 5) == 0 && space) status = atoi(space + 1);
+			finishRequest(slot, records, report, status);
+			return;
+		}
+
+		size_t keep = sizeof(slot->status) - 1 - slot->statusLength;
+		if ((size_t)received < keep) keep = (size_t)received;
+		memcpy(slot->status + slot->statusLength, buffer, keep);
+		slot->statusLength += keep;
+	}
+}
+
+static int compareLatency (const void *left, const void *right)
+{
+	long long a = *(const long long *)left, b = *(const long long *)right;
+	return (a > b) - (a < b);
+}
+
+static void printLatency (const char *name, long long *latency, size_t count)
+{
+	if (count == 0) return;
+	qsort(latency, count, sizeof(*latency), compareLatency);
+
+	#define PERCENTILE(p) (latency[(size_t)((double)(count - 1) * (p))] / 1000.0)
+	printf("%-6s %9zu  p50 %8.2f  p90 %8.2f  p99 %8.2f  p99.9 %8.2f  max %8.2f ms\n", name, count,
+		   PERCENTILE(0.50), PERCENTILE(0.90), PERCENTILE(0.99), PERCENTILE(0.999), latency[count - 1] / 1000.0);
+	#undef PERCENTILE
+}
+
+int main (int argc, char *argv[])
+{
+	if (argc < 2 || argc > 5) return usageReplay();
+
+	char target[CAPTURE_HOST_MAX + 1];
+	snprintf(target, sizeof(target), "%s", argc > 2 ? argv[2] : "127.0.0.1");
+	double speed = argc > 3 ? atof(argv[3]) : 1;
+	long connections = argc > 4 ? atol(argv[4]) : REPLAY_CONNECTIONS;
+	if (speed < 1 || speed > REPLAY_SPEED_MAX || connections < 1 || connections > 65536) return usageReplay();
+
+	// 'host:port', '[v6]:port' OR A BARE HOST
+	char port[8];
+	snprintf(port, sizeof(port), "%d", PORT);
+	char *host = target, *colon = strrchr(target, ':');
+	if (target[0] == '[') {
+		char *close = strchr(target, ']');
+		if (!close) return usageReplay();
+		*close = '\0';
+		host = target + 1;
+		if (close[1] == ':') snprintf(port, sizeof(port), "%s", close + 2);
+	}
+	else if (colon && strchr(target, ':') == colon) {
+		*colon = '\0';
+		snprintf(port, sizeof(port), "%s", colon + 1);
+	}
+
+	struct addrinfo hints = {0}, *address = NULL;
+	hints.ai_socktype = SOCK_STREAM;
+	int rc = getaddrinfo(host, port, &hints, &address);
+	if (rc != 0) {
+		fprintf(stderr, "ERROR: Unable to resolve '%s': %s\n", host, gai_strerror(rc));
+		return 1;
+	}
+
+	char *data = NULL;
+	size_t count = 0;
+	struct replayRecordStruct *records = loadCapture(argv[1], &data, &count);
+	if (!records) {
+		freeaddrinfo(address);
+		return 1;
+	}
+	if (count == 0) {
+		printf("Capture '%s' holds no requests\n", argv[1]);
+		free(records);
+		free(data);
+		freeaddrinfo(address);
+		return 0;
+	}
+
+	struct replayReportStruct report = {0};
+	struct replaySlotStruct *slots = calloc((size_t)connections, sizeof(*slots));
+	struct pollfd *polls = calloc((size_t)connections, sizeof(*polls));
+	size_t *polled = calloc((size_t)connections, sizeof(*polled));
+	int failed = !slots || !polls || !polled;
+	for (int method = 0; method < CAPTURE_METHOD_COUNT && !failed; method++) {
+		report.latency[method] = malloc(count * sizeof(long long));
+		failed = !report.latency[method];
+	}
+	if (failed) {
+		fprintf(stderr, "ERROR: Memory allocation failed\n");
+		rc = 1;
+		goto cleanup;
+	}
+	for (long i = 0; i < connections; i++) slots[i].fd = -1;
+
+	double captured = (double)(records[count - 1].arrival - records[0].arrival) / 1e6;
+	printf("Replaying %zu requests captured over %.1f s against %s:%s at %gx\n", count, captured, host, port, speed);
+
+	// OPEN LOOP: EACH REQUEST GOES OUT WHEN DUE, ON ITS OWN CONNECTION, WHETHER OR NOT EARLIER ONES WERE ANSWERED
+	long long start = monotonicMicroseconds();
+	size_t next = 0, active = 0, freeSlot = 0;
+	while (next < count || active > 0) {
+		long long now = monotonicMicroseconds();
+
+		while (next < count) {
+			long long scheduled = start + (long long)((double)(records[next].arrival - records[0].arrival) / speed);
+			if (scheduled > now) break;
+
+			if (records[next].method == CAPTURE_OTHER) report.skipped++;
+			else if (active == (size_t)connections) report.overflow++;
+			else {
+				while (slots[freeSlot].fd >= 0) freeSlot = (freeSlot + 1) % (size_t)connections;
+				int launched = launchRequest(&slots[freeSlot], address, records, next, scheduled);
+				if (launched == 0) active++;
+				else report.errors++;
+			}
+			next++;
+		}
+
+		// WAIT FOR SOCKETS OR THE NEXT REQUEST DUE, WHICHEVER COMES FIRST
+		nfds_t pollCount = 0;
+		for (size_t i = 0; i < (size_t)connections && pollCount < active; i++) {
+			if (slots[i].fd < 0) continue;
+
+			if (now - slots[i].scheduled > REPLAY_TIMEOUT * 1000LL) {
+				close(slots[i].fd);
+				slots[i].fd = -1;
+				free(slots[i].request);
+				slots[i].request = NULL;
+				report.timeouts++;
+				active--;
+				continue;
+			}
+
+			polls[pollCount].fd = slots[i].fd;
+			polls[pollCount].events = slots[i].sent < slots[i].requestLength ? POLLOUT : POLLIN;
+			polls[pollCount].revents = 0;
+			polled[pollCount++] = i;
+		}
+
+		long long wait = 100000;
+		if (next < count) {
+			long long scheduled = start + (long long)((double)(records[next].arrival - records[0].arrival) / speed);
+			wait = scheduled > now ? scheduled - now : 0;
+		}
+		struct timespec timeout = { wait / 1000000, (wait % 1000000) * 1000 };
+		if (ppoll(polls, pollCount, &timeout, NULL) < 0 && errno != EINTR) {
+			fprintf(stderr, "ERROR: poll failed: %s\n", strerror(errno));
+			rc = 1;
+			goto cleanup;
+		}
+
+		for (nfds_t i = 0; i < pollCount; i++) {
+			if (polls[i].revents == 0) continue;
+			serviceRequest(&slots[polled[i]], polls[i].revents, records, &report);
+			if (slots[polled[i]].fd < 0) active--;
+		}
+	}
+
+	double elapsed = (double)(monotonicMicroseconds() - start) / 1e6;
+	unsigned long long answered = 0;
+	for (int status = 0; status < 600; status++) answered += report.statusCounts[status];
+
+	printf("Sent %llu requests in %.1f s (%.0f per second), %llu answered\n",
+		   answered + report.errors + report.timeouts, elapsed, (double)(answered + report.errors + report.timeouts) / elapsed, answered);
+	printf("Errors %llu, timeouts %llu, not sent with %ld connections busy %llu, other methods skipped %llu\n",
+		   report.errors, report.timeouts, connections, report.overflow, report.skipped);
+	printf("Status:");
+	for (int status = 100; status < 600; status++) {
+		if (report.statusCounts[status] > 0) printf(" %d x %llu", status, report.statusCounts[status]);
+	}
+	printf("\n");
+	printf("Latency from when each request was due:\n");
+	for (int method = 0; method < CAPTURE_METHOD_COUNT; method++) {
+		printLatency(methodNames[method], report.latency[method], report.latencyCount[method]);
+	}
+	rc = 0;
+
+cleanup:
+	for (long i = 0; slots && i < connections; i++) {
+		if (slots[i].fd >= 0) close(slots[i].fd);
+		free(slots[i].request);
+	}
+	for (int method = 0; method < CAPTURE_METHOD_COUNT; method++) free(report.latency[method]);
+	free(slots);
+	free(polls);
+	free(polled);
+	free(records);
+	free(data);
+	freeaddrinfo(address);
+	return rc;
+}
@@ -0,0 +1,188 @@
+#!/bin/sh
+# Soak test - Replays a synthetic capture against a local HandleD and fails on resource growth
+# Copyright (c) 2024 Chema Hernández Gil / AGPL-3.0 license
+# https://github.com/chema/handle-handler
+#
+# USAGE: ./soak.sh [binary]   (or make soak, make soak MODE=1 for the AddressSanitizer build)
+#
+# RUNS THE DAEMON ON A THROWAWAY BASE DIRECTORY, SEEDS IT WITH SOAK_USERS HANDLES AND REPLAYS A MIX OF WELL-KNOWN
+# HITS, MISSES, MIXED-CASE HOSTS, PAGES AND REGISTRATIONS WITH handled-replay UNTIL SOAK_SECONDS PASS. EVERY
+# SOAK_INTERVAL SECONDS IT SAMPLES RSS, OPEN FILE DESCRIPTORS AND SQLITE'S HEAP INTO soak.csv. THE FIRST QUARTER IS
+# WARM-UP; THE TEST FAILS IF THE LAST QUARTER GROWS OVER THE SECOND BY MORE THAN SOAK_SLACK PERCENT (PLUS A SMALL
+# ALLOWANCE), OR IF THE SANITIZERS REPORT ANYTHING AT EXIT. REGISTRATIONS POST A DID:PLC TO FRESH regN HOSTS, SO THEY
+# REACH THE INSERT WITHOUT NETWORK ACCESS, AND A QUARTER OF THEM TO SEEDED HANDLES, WHICH FAIL ON THE UNIQUE CONSTRAINT.
+# EACH SAMPLE DELETES THE regN USERS AGAIN, SO EVERY PASS INSERTS THEM AND THE DATABASE STAYS THE SAME SIZE.
+
+BINARY=${1:-./handled}
+REPLAY=${REPLAY:-./handled-replay}
+SOAK_SECONDS=${SOAK_SECONDS:-600}
+SOAK_INTERVAL=${SOAK_INTERVAL:-5}
+SOAK_SLACK=${SOAK_SLACK:-10}
+SOAK_USERS=${SOAK_USERS:-500}
+SOAK_PORT=${SOAK_PORT:-18507}
+ADMIN_PORT=$((SOAK_PORT + 1))
+DOMAIN=example.test
+
+for tool in "$BINARY" "$REPLAY"; do
+	[ -x "$tool" ] || { echo "soak: $tool not found, run make first" >&2; exit 2; }
+done
+command -v python3 >/dev/null || { echo "soak: python3 is required" >&2; exit 2; }
+command -v curl >/dev/null || { echo "soak: curl is required" >&2; exit 2; }
+
+BASE=$(mktemp -d "${TMPDIR:-/tmp}/handled-soak.XXXXXX") || exit 2
+CSV=soak.csv
+PID=
+LOOP=
+
+cleanup() {
+	[ -n "$LOOP" ] && kill "$LOOP" 2>/dev/null
+	[ -n "$PID" ] && kill "$PID" 2>/dev/null
+	rm -rf "$BASE"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# LEAKS ARE REPORTED AT EXIT; KEEP GOING ON THE FIRST ERROR SO THE REPORT COVERS THE WHOLE RUN
+ASAN_OPTIONS=${ASAN_OPTIONS:-detect_leaks=1:halt_on_error=0}
+export ASAN_OPTIONS
+
+start_daemon() {
+	"$BINARY" httpd "$BASE" "$DOMAIN" port=$SOAK_PORT admin_port=$ADMIN_PORT rate_address=0 rate_label=0 \
+		>>"$BASE/stdout.log" 2>>"$BASE/stderr.log" &
+	PID=$!
+	tries=0
+	until curl -sf "http://127.0.0.1:$ADMIN_PORT/metrics" >/dev/null; do
+		tries=$((tries + 1))
+		if [ $tries -gt 100 ] || ! kill -0 "$PID" 2>/dev/null; then
+			echo "soak: daemon did not start, see below" >&2
+			cat "$BASE/stderr.log" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+stop_daemon() {
+	kill -TERM "$PID"
+	wait "$PID"
+	status=$?
+	PID=
+	if [ $status -ne 0 ]; then
+		echo "soak: daemon exited with status $status" >&2
+		cat "$BASE/stderr.log" >&2
+		exit 1
+	fi
+}
+
+echo "Base directory: $BASE"
+"$BINARY" init "$BASE" >/dev/null || { echo "soak: init failed" >&2; exit 1; }
+
+# THE FIRST START CREATES THE USER DATABASE, THEN THE SEED GOES IN WITH THE DAEMON STOPPED SO THE INDEX LOADS IT
+start_daemon
+stop_daemon
+
+python3 - "$BASE/active-user-handles.db" "$DOMAIN" "$SOAK_USERS" <<'EOF'
+import sqlite3, sys
+db = sqlite3.connect(sys.argv[1])
+domain, users = sys.argv[2], int(sys.argv[3])
+alphabet = "abcdefghijklmnopqrstuvwxyz234567"
+def did(n):
+    tail = ""
+    for _ in range(24):
+        tail += alphabet[n % 32]
+        n //= 32
+    return "did:plc:" + tail
+db.executemany("INSERT OR IGNORE INTO did_plc_users (handle, did, label, domain, token) VALUES (?, ?, ?, ?, 'soak')",
+               [("soak%d.%s" % (i, domain), did(i * 7919 + 1), "soak%d" % i, domain) for i in range(users)])
+db.commit()
+EOF
+[ $? -eq 0 ] || { echo "soak: unable to seed the user database" >&2; exit 1; }
+
+# ONE SECOND OF TRAFFIC, 2000 REQUESTS; handled-replay PLAYS IT IN REAL TIME, OVER AND OVER
+python3 - "$BASE/soak.cap" "$DOMAIN" "$SOAK_USERS" <<'EOF'
+import random, struct, sys
+path, domain, users = sys.argv[1], sys.argv[2], int(sys.argv[3])
+GET, POST, HEAD = 0, 1, 2
+rng = random.Random(49)
+out = open(path, "wb")
+out.write(b"HDCAP01\n")
+start = 1700000000000000
+for i in range(2000):
+    roll = rng.random()
+    body, method, url = 0, GET, "/"
+    n = rng.randrange(users)
+    if roll < 0.55:
+        host = "soak%d.%s" % (n, domain)
+    elif roll < 0.65:
+        host = ("soak%d.%s" % (n, domain)).upper() if n % 2 else "Soak%d.%s" % (n, domain.capitalize())
+    elif roll < 0.80:
+        host = "nobody%d.%s" % (rng.randrange(100000), domain)
+    elif roll < 0.85:
+        host, method = "soak%d.%s" % (n, domain), HEAD
+    elif roll < 0.92:
+        host, url = domain, rng.choice(["/", "/index.html", "/missing", "/result"])
+    elif roll < 0.98:
+        host, method, url = "reg%d.%s" % (i, domain), POST, "/result"
+        body = 64
+    else:
+        host, method, url = "soak%d.%s" % (n, domain), POST, "/result"
+        body = 64
+    h, u = host.encode(), url.encode()
+    out.write(struct.pack("=QIHHB", start + i * 500, body, len(h), len(u), method) + h + u)
+out.close()
+EOF
+[ $? -eq 0 ] || { echo "soak: unable to write the capture" >&2; exit 1; }
+
+start_daemon
+echo "Soaking pid $PID for $SOAK_SECONDS seconds, samples in $CSV"
+
+( while :; do "$REPLAY" "$BASE/soak.cap" "127.0.0.1:$SOAK_PORT" 1 64 >/dev/null || exit 1; done ) &
+LOOP=$!
+
+echo "seconds,rss_kb,fds,sqlite_bytes" > "$CSV"
+elapsed=0
+while [ $elapsed -lt "$SOAK_SECONDS" ]; do
+	sleep "$SOAK_INTERVAL"
+	elapsed=$((elapsed + SOAK_INTERVAL))
+	kill -0 "$PID" 2>/dev/null || { echo "soak: daemon died" >&2; cat "$BASE/stderr.log" >&2; exit 1; }
+	rss=$(awk '/^VmRSS:/ { print $2 }' "/proc/$PID/status")
+	fds=$(ls "/proc/$PID/fd" | wc -l)
+	sqlite=$(curl -sf "http://127.0.0.1:$ADMIN_PORT/metrics" | awk '/^handled_sqlite_memory_bytes\{kind="current"\}/ { print $2 }')
+	echo "$elapsed,$rss,$fds,${sqlite:-0}" >> "$CSV"
+	python3 -c 'import sqlite3, sys; db = sqlite3.connect(sys.argv[1], timeout=10); db.execute("DELETE FROM did_plc_users WHERE label LIKE ?", ("reg%",)); db.commit()' \
+		"$BASE/active-user-handles.db" || { echo "soak: unable to delete the registrations" >&2; exit 1; }
+done
+
+kill "$LOOP" 2>/dev/null
+wait "$LOOP" 2>/dev/null
+LOOP=
+stop_daemon
+
+failed=0
+if grep -E "ERROR: (LeakSanitizer|AddressSanitizer)|runtime error:" "$BASE/stderr.log" >&2; then
+	echo "soak: sanitizer errors, see above" >&2
+	failed=1
+fi
+
+# THE SECOND QUARTER AGAINST THE LAST: PEAKS FOR MEMORY, THE FLOOR FOR FILE DESCRIPTORS AS OPEN CONNECTIONS COME AND GO
+awk -F, -v slack="$SOAK_SLACK" '
+	NR > 1 { rss[n] = $2; fds[n] = $3; sql[n] = $4; n++ }
+	END {
+		if (n < 4) { print "soak: too few samples, raise SOAK_SECONDS"; exit 1 }
+		bfds = lfds = -1
+		for (i = int(n / 4); i < int(n / 2); i++) {
+			if (rss[i] > brss) brss = rss[i]; if (bfds < 0 || fds[i] < bfds) bfds = fds[i]; if (sql[i] > bsql) bsql = sql[i]
+		}
+		for (i = n - int(n / 4); i < n; i++) {
+			if (rss[i] > lrss) lrss = rss[i]; if (lfds < 0 || fds[i] < lfds) lfds = fds[i]; if (sql[i] > lsql) lsql = sql[i]
+		}
+		printf("rss %d -> %d kB, fds %d -> %d, sqlite %d -> %d bytes\n", brss, lrss, bfds, lfds, bsql, lsql)
+		bad = 0
+		if (lrss > brss * (1 + slack / 100) + 1024) { print "soak: RSS keeps growing"; bad = 1 }
+		if (lfds > bfds + 4) { print "soak: file descriptors keep growing"; bad = 1 }
+		if (lsql > bsql * (1 + slack / 100) + 65536) { print "soak: SQLite memory keeps growing"; bad = 1 }
+		exit bad
+	}' "$CSV" || failed=1
+
+[ $failed -eq 0 ] && echo "Soak passed"
+exit $failed